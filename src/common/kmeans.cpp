@@ -0,0 +1,806 @@
+/*
+ * Multithreaded k-means with blocked assignment, k-means++ seeding and mini-batch mode.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "kmeans.h"
+
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
+
+#define KMEANS_ROW(data,index,i,dim) ((data) + (size_t)((index) ? (index)[i] : (i)) * (dim))
+
+// a range of rows processed by one thread
+typedef struct {
+    const float *data;
+    const int *index;
+    int dim;
+    const float *centers;
+    const float *sqnorm;    // squared norms of the centers
+    int k;
+    int start, end;
+    int *labels;            // in/out, indexed by row
+    float *sqdist;          // out, may be NULL
+    double *sum;            // per-thread centroid sums (k x dim), may be NULL
+    int *count;             // per-thread cluster sizes (k), may be NULL
+    int changed;            // out: number of rows whose label changed
+} kmeans_job_t;
+
+////////////////////////////////////////////////////////////////////////////////////
+// kernels
+//
+
+/* dot products of four rows with one centroid
+ */
+static inline void kmeans_dot4 (const float *x0, const float *x1, const float *x2, const float *x3,
+                                const float *c, int dim, float *out)
+{
+    int j = 0;
+#ifdef __SSE__
+    __m128 s0 = _mm_setzero_ps ();
+    __m128 s1 = _mm_setzero_ps ();
+    __m128 s2 = _mm_setzero_ps ();
+    __m128 s3 = _mm_setzero_ps ();
+    for (;j+4<=dim;j+=4) {
+        __m128 v = _mm_loadu_ps (c + j);
+        s0 = _mm_add_ps (s0, _mm_mul_ps (_mm_loadu_ps (x0 + j), v));
+        s1 = _mm_add_ps (s1, _mm_mul_ps (_mm_loadu_ps (x1 + j), v));
+        s2 = _mm_add_ps (s2, _mm_mul_ps (_mm_loadu_ps (x2 + j), v));
+        s3 = _mm_add_ps (s3, _mm_mul_ps (_mm_loadu_ps (x3 + j), v));
+    }
+    _MM_TRANSPOSE4_PS (s0, s1, s2, s3);
+    _mm_storeu_ps (out, _mm_add_ps (_mm_add_ps (s0, s1), _mm_add_ps (s2, s3)));
+#else
+    out[0] = out[1] = out[2] = out[3] = 0.0;
+#endif
+    for (;j<dim;j++) {
+        out[0] += x0[j] * c[j];
+        out[1] += x1[j] * c[j];
+        out[2] += x2[j] * c[j];
+        out[3] += x3[j] * c[j];
+    }
+}
+
+static inline float kmeans_dot (const float *x, const float *c, int dim)
+{
+    int j = 0;
+    float r = 0.0;
+#ifdef __SSE__
+    __m128 s = _mm_setzero_ps ();
+    for (;j+4<=dim;j+=4)
+        s = _mm_add_ps (s, _mm_mul_ps (_mm_loadu_ps (x + j), _mm_loadu_ps (c + j)));
+    float t[4];
+    _mm_storeu_ps (t, s);
+    r = (t[0] + t[1]) + (t[2] + t[3]);
+#endif
+    for (;j<dim;j++)
+        r += x[j] * c[j];
+    return r;
+}
+
+/* assign the rows of a job by blocks of KMEANS_BLOCK rows: every centroid is streamed
+ * once per block and dotted with four rows at a time, and the best |c|^2 - 2 x.c is kept.
+ */
+static void *kmeans_job_cb (void *data)
+{
+    kmeans_job_t *job = (kmeans_job_t*)data;
+    int dim = job->dim;
+    const float *rows[KMEANS_BLOCK];
+    float best[KMEANS_BLOCK];
+    int label[KMEANS_BLOCK];
+    float dots[4];
+
+    job->changed = 0;
+
+    for (int b=job->start;b<job->end;b+=KMEANS_BLOCK) {
+        int nb = MIN (KMEANS_BLOCK, job->end - b);
+
+        for (int i=0;i<nb;i++) {
+            rows[i] = KMEANS_ROW (job->data, job->index, b+i, dim);
+            best[i] = FLT_MAX;
+            label[i] = 0;
+        }
+
+        for (int c=0;c<job->k;c++) {
+            const float *cc = job->centers + (size_t)c * dim;
+            float sq = job->sqnorm[c];
+            int i = 0;
+            for (;i+4<=nb;i+=4) {
+                kmeans_dot4 (rows[i], rows[i+1], rows[i+2], rows[i+3], cc, dim, dots);
+                for (int r=0;r<4;r++) {
+                    float d = sq - 2 * dots[r];
+                    if (d < best[i+r]) {
+                        best[i+r] = d;
+                        label[i+r] = c;
+                    }
+                }
+            }
+            for (;i<nb;i++) {
+                float d = sq - 2 * kmeans_dot (rows[i], cc, dim);
+                if (d < best[i]) {
+                    best[i] = d;
+                    label[i] = c;
+                }
+            }
+        }
+
+        for (int i=0;i<nb;i++) {
+            if (job->labels[b+i] != label[i]) {
+                job->labels[b+i] = label[i];
+                job->changed++;
+            }
+            if (job->sqdist)
+                job->sqdist[b+i] = MAX (0.0, best[i] + kmeans_dot (rows[i], rows[i], dim));
+            if (job->sum) {
+                double *s = job->sum + (size_t)label[i] * dim;
+                for (int j=0;j<dim;j++)
+                    s[j] += rows[i][j];
+                job->count[label[i]]++;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// threading
+//
+
+static int kmeans_nthreads (int nthreads, int n)
+{
+    if (nthreads <= 0)
+        nthreads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+
+    return MAX (1, MIN (nthreads, n / KMEANS_MIN_CHUNK));
+}
+
+/* assign rows [0, n) split across <nthreads> threads. If <sum> and <count> are not
+ * NULL, they receive the centroid sums and cluster sizes, reduced in thread order.
+ * Returns the number of labels that changed.
+ */
+static int kmeans_assign_accumulate (const float *data, const int *index, int n, int dim,
+                                     const float *centers, const float *sqnorm, int k, int nthreads,
+                                     int *labels, float *sqdist, double *sum, int *count)
+{
+    nthreads = kmeans_nthreads (nthreads, n);
+
+    kmeans_job_t *jobs = (kmeans_job_t*)calloc (nthreads, sizeof(kmeans_job_t));
+    pthread_t *threads = (pthread_t*)malloc (nthreads * sizeof(pthread_t));
+
+    for (int t=0;t<nthreads;t++) {
+        kmeans_job_t *job = jobs + t;
+        job->data = data;
+        job->index = index;
+        job->dim = dim;
+        job->centers = centers;
+        job->sqnorm = sqnorm;
+        job->k = k;
+        job->start = (int)((long)t * n / nthreads);
+        job->end = (int)((long)(t+1) * n / nthreads);
+        job->labels = labels;
+        job->sqdist = sqdist;
+        if (sum) {
+            job->sum = t == 0 ? sum : (double*)calloc ((size_t)k * dim, sizeof(double));
+            job->count = t == 0 ? count : (int*)calloc (k, sizeof(int));
+        }
+    }
+
+    if (sum) {
+        memset (sum, 0, (size_t)k * dim * sizeof(double));
+        memset (count, 0, k * sizeof(int));
+    }
+
+    // the calling thread takes the first chunk
+    for (int t=1;t<nthreads;t++)
+        pthread_create (threads + t, NULL, kmeans_job_cb, jobs + t);
+
+    kmeans_job_cb (jobs);
+
+    int changed = jobs[0].changed;
+
+    for (int t=1;t<nthreads;t++) {
+        pthread_join (threads[t], NULL);
+        changed += jobs[t].changed;
+        if (sum) {
+            for (size_t j=0;j<(size_t)k*dim;j++)
+                sum[j] += jobs[t].sum[j];
+            for (int c=0;c<k;c++)
+                count[c] += jobs[t].count[c];
+            free (jobs[t].sum);
+            free (jobs[t].count);
+        }
+    }
+
+    free (threads);
+    free (jobs);
+
+    return changed;
+}
+
+static void kmeans_sqnorm (const float *centers, int k, int dim, float *sqnorm)
+{
+    for (int c=0;c<k;c++)
+        sqnorm[c] = kmeans_dot (centers + (size_t)c*dim, centers + (size_t)c*dim, dim);
+}
+
+void kmeans_assign (const float *data, const int *index, int n, int dim,
+                    const float *centers, int k, int nthreads, int *labels, float *sqdist)
+{
+    float *sqnorm = (float*)malloc (k * sizeof(float));
+    kmeans_sqnorm (centers, k, dim, sqnorm);
+
+    kmeans_assign_accumulate (data, index, n, dim, centers, sqnorm, k, nthreads,
+                              labels, sqdist, NULL, NULL);
+
+    free (sqnorm);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// seeding
+//
+
+void kmeans_params_init (kmeans_params_t *p, int k)
+{
+    p->k = k;
+    p->max_iter = 100;
+    p->nthreads = 0;
+    p->seed = 1;
+    p->init = KMEANS_INIT_PLUSPLUS;
+    p->init_sample = 0;
+    p->batch_size = 0;
+    p->reseed_empty = 0;
+}
+
+static double kmeans_uniform (unsigned int *seed)
+{
+    return (double)rand_r (seed) / ((double)RAND_MAX + 1.0);
+}
+
+static int kmeans_random_index (unsigned int *seed, int n)
+{
+    return MIN (n - 1, (int)(kmeans_uniform (seed) * n));
+}
+
+/* pick <k> seeds among the rows. The candidates are a random subset of at most
+ * p->init_sample rows. For k-means++, each new seed is drawn with a probability
+ * proportional to its squared distance to the closest seed so far; of a few such
+ * draws, the one that most reduces the total distance is kept.
+ */
+static void kmeans_seed (const float *data, const int *index, int n, int dim,
+                         const kmeans_params_t *p, unsigned int *seed, float *centers)
+{
+    int k = p->k;
+    int m = p->init_sample > 0 ? MIN (n, p->init_sample) : n;
+
+    // candidate rows (partial Fisher-Yates shuffle)
+    int *cand = (int*)malloc (n * sizeof(int));
+    for (int i=0;i<n;i++)
+        cand[i] = index ? index[i] : i;
+    for (int i=0;i<MIN (m, n-1);i++) {
+        int j = i + kmeans_random_index (seed, n - i);
+        int tmp = cand[i];
+        cand[i] = cand[j];
+        cand[j] = tmp;
+    }
+
+    if (p->init == KMEANS_INIT_RANDOM || k >= m) {
+        for (int c=0;c<k;c++)
+            memcpy (centers + (size_t)c*dim, data + (size_t)cand[c % m]*dim, dim * sizeof(float));
+        free (cand);
+        return;
+    }
+
+    float *mind = (float*)malloc (m * sizeof(float));
+    float *d = (float*)malloc (m * sizeof(float));
+    int *labels = (int*)calloc (m, sizeof(int));
+    float sqnorm;
+
+    memcpy (centers, data + (size_t)cand[kmeans_random_index (seed, m)]*dim, dim * sizeof(float));
+    kmeans_sqnorm (centers, 1, dim, &sqnorm);
+    kmeans_assign_accumulate (data, cand, m, dim, centers, &sqnorm, 1, p->nthreads, labels, mind, NULL, NULL);
+
+    // greedy k-means++: keep the best of a few draws
+    int ntrials = 2 + (int)log ((double)k);
+    float *best = (float*)malloc (m * sizeof(float));
+
+    for (int c=1;c<k;c++) {
+        double total = 0.0;
+        for (int i=0;i<m;i++)
+            total += mind[i];
+
+        double best_pot = DBL_MAX;
+        int best_pick = 0;
+
+        for (int trial=0;trial<ntrials;trial++) {
+
+            // all the candidates are already seeds: fall back to uniform
+            int pick = m - 1;
+            if (total > 0.0) {
+                double r = kmeans_uniform (seed) * total;
+                for (int i=0;i<m;i++) {
+                    r -= mind[i];
+                    if (r < 0.0) {
+                        pick = i;
+                        break;
+                    }
+                }
+            } else {
+                pick = kmeans_random_index (seed, m);
+            }
+
+            const float *x = data + (size_t)cand[pick]*dim;
+            kmeans_sqnorm (x, 1, dim, &sqnorm);
+            kmeans_assign_accumulate (data, cand, m, dim, x, &sqnorm, 1, p->nthreads, labels, d, NULL, NULL);
+
+            double pot = 0.0;
+            for (int i=0;i<m;i++) {
+                d[i] = MIN (mind[i], d[i]);
+                pot += d[i];
+            }
+            if (pot < best_pot) {
+                best_pot = pot;
+                best_pick = pick;
+                float *tmp = best;
+                best = d;
+                d = tmp;
+            }
+        }
+
+        memcpy (centers + (size_t)c*dim, data + (size_t)cand[best_pick]*dim, dim * sizeof(float));
+        float *tmp = mind;
+        mind = best;
+        best = tmp;
+    }
+
+    free (best);
+    free (labels);
+    free (d);
+    free (mind);
+    free (cand);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// clustering
+//
+
+/* move every empty cluster onto the row that is the farthest from its centroid
+ */
+static int kmeans_reseed_empty (const float *data, const int *index, int n, int dim, int k,
+                                float *centers, int *count, float *sqdist)
+{
+    int nreseed = 0;
+
+    for (int c=0;c<k;c++) {
+        if (count[c] > 0)
+            continue;
+        int worst = 0;
+        for (int i=1;i<n;i++)
+            if (sqdist[i] > sqdist[worst])
+                worst = i;
+        if (sqdist[worst] <= 0.0)
+            break;
+        memcpy (centers + (size_t)c*dim, KMEANS_ROW (data, index, worst, dim), dim * sizeof(float));
+        sqdist[worst] = 0.0;
+        count[c] = 1;
+        nreseed++;
+    }
+
+    return nreseed;
+}
+
+static int kmeans_lloyd (const float *data, const int *index, int n, int dim, const kmeans_params_t *p,
+                         float *centers, int *labels)
+{
+    int k = p->k;
+    float *sqnorm = (float*)malloc (k * sizeof(float));
+    double *sum = (double*)malloc ((size_t)k * dim * sizeof(double));
+    int *count = (int*)malloc (k * sizeof(int));
+    float *sqdist = p->reseed_empty ? (float*)malloc (n * sizeof(float)) : NULL;
+
+    int iter = 0;
+    while (iter < p->max_iter) {
+
+        kmeans_sqnorm (centers, k, dim, sqnorm);
+        int changed = kmeans_assign_accumulate (data, index, n, dim, centers, sqnorm, k, p->nthreads,
+                                                labels, sqdist, sum, count);
+        iter++;
+
+        // empty clusters keep their centroid
+        for (int c=0;c<k;c++) {
+            if (count[c] == 0)
+                continue;
+            float *cc = centers + (size_t)c*dim;
+            const double *s = sum + (size_t)c*dim;
+            for (int j=0;j<dim;j++)
+                cc[j] = s[j] / count[c];
+        }
+
+        int nreseed = sqdist ? kmeans_reseed_empty (data, index, n, dim, k, centers, count, sqdist) : 0;
+
+        // the centroids are the means of the current labels
+        if (changed == 0 && nreseed == 0)
+            break;
+    }
+
+    free (sqdist);
+    free (count);
+    free (sum);
+    free (sqnorm);
+
+    return iter;
+}
+
+/* mini-batch k-means: each step assigns a random batch and moves every centroid to the
+ * running mean of all the rows it has been assigned so far. This is the per-sample
+ * update c += (x - c) / v_c applied to the whole batch at once, which lets the
+ * centroid sums be accumulated in parallel.
+ */
+static int kmeans_minibatch (const float *data, const int *index, int n, int dim, const kmeans_params_t *p,
+                             unsigned int *seed, float *centers)
+{
+    int k = p->k;
+    int nb = MIN (n, p->batch_size);
+    float *sqnorm = (float*)malloc (k * sizeof(float));
+    double *sum = (double*)malloc ((size_t)k * dim * sizeof(double));
+    int *count = (int*)malloc (k * sizeof(int));
+    double *seen = (double*)calloc (k, sizeof(double));
+    int *batch = (int*)malloc (nb * sizeof(int));
+    int *labels = (int*)malloc (nb * sizeof(int));
+
+    for (int iter=0;iter<p->max_iter;iter++) {
+
+        for (int i=0;i<nb;i++) {
+            int r = kmeans_random_index (seed, n);
+            batch[i] = index ? index[r] : r;
+            labels[i] = -1;
+        }
+
+        kmeans_sqnorm (centers, k, dim, sqnorm);
+        kmeans_assign_accumulate (data, batch, nb, dim, centers, sqnorm, k, p->nthreads,
+                                  labels, NULL, sum, count);
+
+        for (int c=0;c<k;c++) {
+            if (count[c] == 0)
+                continue;
+            float *cc = centers + (size_t)c*dim;
+            const double *s = sum + (size_t)c*dim;
+            double v = seen[c] + count[c];
+            for (int j=0;j<dim;j++)
+                cc[j] = (seen[c] * cc[j] + s[j]) / v;
+            seen[c] = v;
+        }
+    }
+
+    free (labels);
+    free (batch);
+    free (seen);
+    free (count);
+    free (sum);
+    free (sqnorm);
+
+    return p->max_iter;
+}
+
+int kmeans_run (const float *data, const int *index, int n, int dim, const kmeans_params_t *p,
+                float *centers, int *labels, int *counts)
+{
+    assert (p->k > 0 && n > 0);
+
+    unsigned int seed = p->seed;
+    int k = p->k;
+    int iter = 0;
+
+    if (p->init != KMEANS_INIT_GIVEN)
+        kmeans_seed (data, index, n, dim, p, &seed, centers);
+
+    int *lab = labels ? labels : (int*)malloc (n * sizeof(int));
+    for (int i=0;i<n;i++)
+        lab[i] = -1;
+
+    if (p->batch_size > 0 && p->batch_size < n) {
+        iter = kmeans_minibatch (data, index, n, dim, p, &seed, centers);
+        kmeans_assign (data, index, n, dim, centers, k, p->nthreads, lab, NULL);
+    } else {
+        iter = kmeans_lloyd (data, index, n, dim, p, centers, lab);
+
+        // the last iteration moved the centroids: relabel
+        if (iter == p->max_iter)
+            kmeans_assign (data, index, n, dim, centers, k, p->nthreads, lab, NULL);
+    }
+
+    if (counts) {
+        memset (counts, 0, k * sizeof(int));
+        for (int i=0;i<n;i++)
+            counts[lab[i]]++;
+    }
+
+    if (!labels)
+        free (lab);
+
+    return iter;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// testing
+//
+
+static double kmeans_secs ()
+{
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + 1E-6 * tv.tv_usec;
+}
+
+/* <n> points around <k> random centers of the unit cube, with gaussian-ish noise
+ */
+static float *kmeans_random_blobs (int n, int dim, int k, double noise, unsigned int seed, int *truth)
+{
+    float *means = (float*)malloc ((size_t)k * dim * sizeof(float));
+    float *data = (float*)malloc ((size_t)n * dim * sizeof(float));
+
+    for (int i=0;i<k*dim;i++)
+        means[i] = kmeans_uniform (&seed);
+
+    for (int i=0;i<n;i++) {
+        int c = i % k;
+        if (truth)
+            truth[i] = c;
+        for (int j=0;j<dim;j++) {
+            double e = kmeans_uniform (&seed) + kmeans_uniform (&seed) + kmeans_uniform (&seed) - 1.5;
+            data[(size_t)i*dim+j] = means[c*dim+j] + noise * e;
+        }
+    }
+
+    free (means);
+    return data;
+}
+
+static double kmeans_inertia (const float *data, int n, int dim, const float *centers, const int *labels)
+{
+    double e = 0.0;
+    for (int i=0;i<n;i++) {
+        const float *x = data + (size_t)i*dim;
+        const float *c = centers + (size_t)labels[i]*dim;
+        for (int j=0;j<dim;j++)
+            e += (x[j] - c[j]) * (x[j] - c[j]);
+    }
+    return e;
+}
+
+/* number of points whose cluster does not map to the majority true cluster
+ */
+static int kmeans_impurity (const int *labels, const int *truth, int n, int k)
+{
+    int *hist = (int*)calloc ((size_t)k * k, sizeof(int));
+    for (int i=0;i<n;i++)
+        hist[labels[i]*k+truth[i]]++;
+
+    int wrong = 0;
+    for (int c=0;c<k;c++) {
+        int best = 0, total = 0;
+        for (int t=0;t<k;t++) {
+            best = MAX (best, hist[c*k+t]);
+            total += hist[c*k+t];
+        }
+        wrong += total - best;
+    }
+
+    free (hist);
+    return wrong;
+}
+
+/* check the blocked assignment against a brute force search, and that well separated
+ * clusters are recovered, deterministically, in Lloyd and mini-batch mode.
+ * Returns the number of failed checks.
+ */
+int kmeans_unit_testing ()
+{
+    int failed = 0;
+    int n = 20000, dim = 35, k = 12;
+    int *truth = (int*)malloc (n * sizeof(int));
+    float *data = kmeans_random_blobs (n, dim, k, .1, 7, truth);
+    float *centers = (float*)malloc ((size_t)k * dim * sizeof(float));
+    float *centers2 = (float*)malloc ((size_t)k * dim * sizeof(float));
+    int *labels = (int*)malloc (n * sizeof(int));
+    int *labels2 = (int*)malloc (n * sizeof(int));
+    int *counts = (int*)malloc (k * sizeof(int));
+    float *sqdist = (float*)malloc (n * sizeof(float));
+
+    // assignment vs. brute force
+    for (int c=0;c<k;c++)
+        memcpy (centers + c*dim, data + (size_t)(3*c+1)*dim, dim * sizeof(float));
+    kmeans_assign (data, NULL, n, dim, centers, k, 4, labels, sqdist);
+    int wrong = 0;
+    for (int i=0;i<n;i++) {
+        double best = DBL_MAX;
+        int bestc = 0;
+        for (int c=0;c<k;c++) {
+            double d = 0.0;
+            for (int j=0;j<dim;j++)
+                d += (data[(size_t)i*dim+j] - centers[c*dim+j]) * (data[(size_t)i*dim+j] - centers[c*dim+j]);
+            if (d < best) {
+                best = d;
+                bestc = c;
+            }
+        }
+        if (bestc != labels[i] || fabs (best - sqdist[i]) > 1E-3 * (1.0 + best))
+            wrong++;
+    }
+    fprintf (stderr, "[kmeans] assignment: %d/%d differ from brute force\n", wrong, n);
+    failed += wrong > 0;
+
+    // Lloyd, k-means++
+    kmeans_params_t p;
+    kmeans_params_init (&p, k);
+    p.nthreads = 4;
+    int iter = kmeans_run (data, NULL, n, dim, &p, centers, labels, counts);
+    int impure = kmeans_impurity (labels, truth, n, k);
+    fprintf (stderr, "[kmeans] lloyd: %d iterations, %d misclustered\n", iter, impure);
+    failed += impure > 0;
+
+    int total = 0;
+    for (int c=0;c<k;c++)
+        total += counts[c];
+    failed += total != n;
+
+    // same seed, same result (also with a different number of threads)
+    p.nthreads = 1;
+    kmeans_run (data, NULL, n, dim, &p, centers2, labels2, NULL);
+    failed += memcmp (labels, labels2, n * sizeof(int)) != 0;
+
+    // indexed rows: every other point
+    int m = n / 2;
+    int *index = (int*)malloc (m * sizeof(int));
+    for (int i=0;i<m;i++)
+        index[i] = 2*i;
+    kmeans_run (data, index, m, dim, &p, centers2, labels2, NULL);
+    int *sub = (int*)malloc (m * sizeof(int));
+    for (int i=0;i<m;i++)
+        sub[i] = truth[2*i];
+    impure = kmeans_impurity (labels2, sub, m, k);
+    fprintf (stderr, "[kmeans] indexed: %d misclustered\n", impure);
+    failed += impure > 0;
+
+    // mini-batch
+    p.batch_size = 1000;
+    p.max_iter = 50;
+    p.nthreads = 4;
+    kmeans_run (data, NULL, n, dim, &p, centers2, labels2, NULL);
+    impure = kmeans_impurity (labels2, truth, n, k);
+    double e1 = kmeans_inertia (data, n, dim, centers, labels);
+    double e2 = kmeans_inertia (data, n, dim, centers2, labels2);
+    fprintf (stderr, "[kmeans] mini-batch: %d misclustered, inertia %.2f vs %.2f\n", impure, e2, e1);
+    failed += impure > 0 || e2 > 1.05 * e1;
+
+    // more clusters than distinct points, with reseeding
+    kmeans_params_init (&p, 20);
+    p.reseed_empty = 1;
+    float *dup = (float*)malloc (100 * dim * sizeof(float));
+    for (int i=0;i<100;i++)
+        memcpy (dup + i*dim, data + (size_t)(i % 5)*dim, dim * sizeof(float));
+    float *cc20 = (float*)malloc (20 * dim * sizeof(float));
+    int counts20[20];
+    kmeans_run (dup, NULL, 100, dim, &p, cc20, NULL, counts20);
+    int nonempty = 0;
+    for (int c=0;c<20;c++)
+        nonempty += counts20[c] > 0;
+    failed += nonempty != 5;
+
+    fprintf (stderr, "[kmeans] unit testing: failed %d\n", failed);
+
+    free (cc20);
+    free (dup);
+    free (sub);
+    free (index);
+    free (sqdist);
+    free (counts);
+    free (labels2);
+    free (labels);
+    free (centers2);
+    free (centers);
+    free (data);
+    free (truth);
+
+    return failed;
+}
+
+/* naive single-threaded Lloyd iteration, as a reference for timing
+ */
+static void kmeans_naive_iteration (const float *data, int n, int dim, float *centers, int k, int *labels)
+{
+    double *sum = (double*)calloc ((size_t)k * dim, sizeof(double));
+    int *count = (int*)calloc (k, sizeof(int));
+
+    for (int i=0;i<n;i++) {
+        const float *x = data + (size_t)i*dim;
+        double best = DBL_MAX;
+        for (int c=0;c<k;c++) {
+            double d = 0.0;
+            for (int j=0;j<dim;j++)
+                d += (x[j] - centers[c*dim+j]) * (x[j] - centers[c*dim+j]);
+            if (d < best) {
+                best = d;
+                labels[i] = c;
+            }
+        }
+        count[labels[i]]++;
+        for (int j=0;j<dim;j++)
+            sum[labels[i]*dim+j] += x[j];
+    }
+
+    for (int c=0;c<k;c++)
+        if (count[c] > 0)
+            for (int j=0;j<dim;j++)
+                centers[c*dim+j] = sum[c*dim+j] / count[c];
+
+    free (count);
+    free (sum);
+}
+
+/* time one naive iteration, and Lloyd / mini-batch runs of 10 iterations with 1 and
+ * all threads. Writes <mode> <nthreads> <secs per iteration> <inertia> per line.
+ */
+void kmeans_performance_testing (int n, int dim, int k, const char *filename)
+{
+    FILE *fp = fopen (filename, "w");
+    if (!fp) {
+        fprintf (stderr, "failed to open %s in write mode.\n", filename);
+        return;
+    }
+
+    float *data = kmeans_random_blobs (n, dim, k, .2, 3, NULL);
+    float *centers = (float*)malloc ((size_t)k * dim * sizeof(float));
+    int *labels = (int*)malloc (n * sizeof(int));
+
+    kmeans_params_t p;
+    kmeans_params_init (&p, k);
+    p.init = KMEANS_INIT_RANDOM;
+
+    kmeans_seed (data, NULL, n, dim, &p, &p.seed, centers);
+    double t0 = kmeans_secs ();
+    kmeans_naive_iteration (data, n, dim, centers, k, labels);
+    double secs = kmeans_secs () - t0;
+    fprintf (fp, "naive 1 %.4f %.2f\n", secs, kmeans_inertia (data, n, dim, centers, labels));
+    fprintf (stderr, "[kmeans] naive: %.4f secs/iteration\n", secs);
+
+    int maxthreads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+
+    for (int mode=0;mode<2;mode++) {
+        for (int nthreads=1;nthreads<=maxthreads;nthreads*=2) {
+            p.nthreads = nthreads;
+            p.max_iter = 10;
+            p.batch_size = mode == 1 ? MAX (1, n / 20) : 0;
+            t0 = kmeans_secs ();
+            int iter = kmeans_run (data, NULL, n, dim, &p, centers, labels, NULL);
+            secs = (kmeans_secs () - t0) / iter;
+            double e = kmeans_inertia (data, n, dim, centers, labels);
+            fprintf (fp, "%s %d %.4f %.2f\n", mode == 0 ? "lloyd" : "minibatch", nthreads, secs, e);
+            fprintf (stderr, "[kmeans] %s, %d threads: %.4f secs/iteration, inertia %.2f\n",
+                 mode == 0 ? "lloyd" : "minibatch", nthreads, secs, e);
+        }
+    }
+
+    free (labels);
+    free (centers);
+    free (data);
+    fclose (fp);
+}
+
@@ -0,0 +1,69 @@
+#ifndef _KMEANS_H__
+#define _KMEANS_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Multithreaded k-means on float vectors.
+ *
+ * The assignment step computes the squared distance |x|^2 - 2 x.c + |c|^2 for a block
+ * of points against all the centroids at once (a small blocked GEMM), and each thread
+ * accumulates the centroid sums of its own range of points, which are then reduced in
+ * thread order. With a fixed seed and number of threads, the result is deterministic.
+ *
+ * Seeding is k-means++ (Arthur & Vassilvitskii) or random, optionally on a sample of
+ * the data. With batch_size > 0, the centroids are fitted with mini-batch updates
+ * (Sculley 2010) instead of Lloyd iterations, which is the mode to use for millions of
+ * descriptors; the final labels are always a full assignment.
+ *
+ * This module only depends on libc and pthreads, so that libpmk can build it too.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KMEANS_INIT_PLUSPLUS 0      // k-means++ seeding
+#define KMEANS_INIT_RANDOM 1        // k distinct random points
+#define KMEANS_INIT_GIVEN 2         // the centers passed to kmeans_run are the seeds
+
+#define KMEANS_BLOCK 64             // points per assignment block
+#define KMEANS_MIN_CHUNK 1024       // min. number of points per thread
+
+typedef struct {
+    int k;
+    int max_iter;           // Lloyd iterations, or mini-batch steps
+    int nthreads;           // <= 0: one per online processor
+    unsigned int seed;
+    int init;               // KMEANS_INIT_*
+    int init_sample;        // seed on at most this many points (0: all)
+    int batch_size;         // > 0: mini-batch mode
+    int reseed_empty;       // move an empty cluster onto the worst-fitted point
+} kmeans_params_t;
+
+void kmeans_params_init (kmeans_params_t *p, int k);
+
+/* cluster the rows of <data> (<n> x <dim>). If <index> is not NULL, row i is
+ * data + index[i] * dim. <centers> (k x dim) receives the centroids, <labels> (n,
+ * may be NULL) the closest centroid of each row and <counts> (k, may be NULL) the
+ * cluster sizes. Empty clusters keep their centroid unless p->reseed_empty is set.
+ * Returns the number of iterations.
+ */
+int kmeans_run (const float *data, const int *index, int n, int dim, const kmeans_params_t *p,
+                float *centers, int *labels, int *counts);
+
+/* label each row with its closest centroid. <sqdist> (may be NULL) receives the
+ * squared distances.
+ */
+void kmeans_assign (const float *data, const int *index, int n, int dim,
+                    const float *centers, int k, int nthreads, int *labels, float *sqdist);
+
+int kmeans_unit_testing ();
+void kmeans_performance_testing (int n, int dim, int k, const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
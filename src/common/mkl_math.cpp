@@ -125,6 +125,33 @@ void math_matrix_mult_mkl_float (int m, int n, int k, const float *a, const floa
     cblas_sgemm (CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 1.0, a, k, b, n, 0.0, c, n);
 }
 
+/* c = a x b^T, where a = [ m x k ], b = [ n x k ], c = [ m x n ]
+ * 
+ * using naive approach
+ */
+void math_matrix_mult_transb_naive_float (int m, int n, int k, const float *a, const float *b, float *c)
+{
+    for (int row=0;row<m;row++) {
+        for (int col=0;col<n;col++) {
+            const float *ptra = a + row*k;
+            const float *ptrb = b + col*k;
+            float sum = .0;
+            for (int kk=0;kk<k;kk++)
+                sum += ptra[kk] * ptrb[kk];
+            c[row*n+col] = sum;
+        }
+    }
+}
+
+/* c = a x b^T, where a = [ m x k ], b = [ n x k ], c = [ m x n ]
+ * 
+ * using Intel Math Kernel Library
+ */
+void math_matrix_mult_transb_mkl_float (int m, int n, int k, const float *a, const float *b, float *c)
+{
+    cblas_sgemm (CblasRowMajor, CblasNoTrans, CblasTrans, m, n, k, 1.0, a, k, b, k, 0.0, c, n);
+}
+
 /* alloc memory for a matrix
  */
 float * math_matrix_alloc_float (int nrows, int ncols)
@@ -15,6 +15,8 @@ void math_matrix_mult_unit_testing ();
 void math_matrix_mult_unit_testing_float ();
 void math_matrix_mult_naive_float (int m, int n, int k, float *a, float *b, float *c);
 void math_matrix_mult_mkl_float (int m, int n, int k, const float *a, const float *b, float *c);
+void math_matrix_mult_transb_naive_float (int m, int n, int k, const float *a, const float *b, float *c);
+void math_matrix_mult_transb_mkl_float (int m, int n, int k, const float *a, const float *b, float *c);
 void math_matrix_mult_unit_testing_float_2 ();
 
 #endif
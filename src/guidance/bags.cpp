@@ -629,135 +629,80 @@ void node_print (GNode *node)
     }
 }
 
-/* init the k-mean algorithm on a node
- * with a branching factor K (K children)
+/* create K (empty) children under a node and move the bags of the node
+ * to the children given by <labels> (in the queue order of the bags)
  */
-void node_kmean_init (GNode *node, unsigned int K)
+void node_kmean_init (GNode *node, unsigned int K, const int *labels)
 {
     GList *iter;
     int index=0;
     tree_node_t *nd = (tree_node_t*)node->data;
+    GNode **children = (GNode**)malloc(K*sizeof(GNode*));
 
     // create the children (empty)
     for (unsigned int i=0;i<K;i++) {
         tree_node_t *child = node_create_from_void (node_data_size (node));
-        g_node_insert_data (node, -1, child);
+        children[i] = g_node_insert_data (node, -1, child);
     }
     assert (K == g_node_n_children (node));
 
-    // distribute bags evenly between children
-    // while removing them from the parent node
+    // move the bags while removing them from the parent node
     iter = g_queue_pop_head_link (nd->bags);
     while (iter) {
         bag_t *bag = (bag_t*)iter->data;
-        GNode *child = g_node_nth_child (node, index);
-        node_add_bag (child, bag);
-        index = (index + 1) % K;
-        iter = g_queue_pop_head_link (((tree_node_t*)node->data)->bags);
+        node_add_bag (children[labels[index]], bag);
+        g_list_free (iter);
+        index++;
+        iter = g_queue_pop_head_link (nd->bags);
     }
 
-}
-
-/* K-mean inner loop
- */
-void node_kmean_single_run (GNode *node, gboolean *changed)
-{
-    GNode *child1, *child2;
-    GList *iter, *iter1;
-    *changed = 0;
-
-    // update centroid for each child node
-    child1 = g_node_first_child (node);
-    while (child1) {
-        assert (G_NODE_IS_LEAF (child1));
-        tree_node_t *nd = (tree_node_t*)child1->data;
-        bag_t_centroid (nd->bags, nd->cc, nd->cc_size);
-        child1 = child1->next;
-    }
-
-    // move bags across nodes
-    for (unsigned int i1=0;i1<g_node_n_children (node);i1++) {
-        child1 = g_node_nth_child (node, i1);
-        tree_node_t *nd1 = (tree_node_t*)child1->data;
-        GQueue *toremove = g_queue_new ();
-        for (iter1=g_queue_peek_head_link (nd1->bags);iter1;iter1=g_list_next(iter1)) {
-            bag_t *b1 = (bag_t*)iter1->data;
-
-            GNode *cnode=child1;
-            float mindist = node_distance_d (child1, b1->cc);
-            for (unsigned int i2=0;i2<g_node_n_children (node);i2++) {
-                if (i1 == i2) continue;
-                child2 = g_node_nth_child (node, i2);
-                float dtonode2 = node_distance_d (child2, b1->cc);
-                if (dtonode2 < mindist - 1E-6) {
-                    cnode = child2;
-                    mindist = dtonode2;
-                }
-            }
-
-            // move bag
-            if (cnode != child1) {
-                tree_node_t *ndc = (tree_node_t*)cnode->data;
-                g_queue_push_head (ndc->bags, b1);
-                g_queue_push_head (toremove, b1);
-                *changed = TRUE;
-            }
-        }
-
-        // remove nodes from child1
-        iter = g_queue_pop_head_link (toremove);
-        while (iter) {
-            g_queue_remove (nd1->bags, (bag_t*)iter->data);
-            iter = g_queue_pop_head_link (toremove);
-        }
-        g_queue_free (toremove);
+    for (unsigned int i=0;i<K;i++) {
+        tree_node_t *child = (tree_node_t*)children[i]->data;
+        bag_t_centroid (child->bags, child->cc, child->cc_size);
     }
 
-
-#if BAG_DBG
-    // sanity check
-    GNode *child = g_node_first_child (node);
-    while (child) {
-        tree_node_t *nd = (tree_node_t*)child->data;
-        for (GList *iter=g_queue_peek_head_link (nd->bags);iter;iter=g_list_next(iter)) {
-            bag_t *b = (bag_t*)iter->data;
-            float d1 = node_distance_d (child, b->cc); 
-            GNode *child2 = g_node_first_child (node);
-            while (child2) {
-                if (child2!=child) {
-                    float d2 = node_distance_d (child2, b->cc);
-                    assert (d1 < d2 + 1E-6);
-                }
-                child2 = child2->next;
-            }
-        }
-        child = child->next;
-    }
-#endif
+    free (children);
 }
 
-/* K-mean full run
+/* K-mean full run: split the bags of a node into K children
+ * (see common/kmeans.h)
  */
 gboolean node_kmean_full_run (GNode *node, gpointer data)
 {
-    gboolean changed = TRUE;
+    tree_node_t *nd = (tree_node_t*)node->data;
 
-    int size = g_queue_get_length ( ((tree_node_t*)node->data)->bags );
+    int size = g_queue_get_length (nd->bags);
 
     if (size < BAGS_MAX_CHILDREN) return FALSE;
 
     int K = BAGS_KMEAN_N_CHILDREN;
+    int dim = nd->cc_size;
 
-    // init the children nodes
-    node_kmean_init (node, K);
-
-    // update the children
-    int nruns = 0;
-    while (changed && nruns < 100) {
-        node_kmean_single_run  (node, &changed);
-        nruns++;
+    // copy the bag centroids into one array
+    float *cc = (float*)malloc((size_t)size*dim*sizeof(float));
+    int index=0;
+    for (GList *iter=g_queue_peek_head_link (nd->bags);iter;iter=g_list_next(iter)) {
+        bag_t *b = (bag_t*)iter->data;
+        memcpy (cc + (size_t)index*dim, b->cc, dim*sizeof(float));
+        index++;
     }
 
+    kmeans_params_t params;
+    kmeans_params_init (&params, K);
+    params.max_iter = 100;
+    params.seed = 1 + nd->id;
+
+    float *centers = (float*)malloc(K*dim*sizeof(float));
+    int *labels = (int*)malloc(size*sizeof(int));
+    kmeans_run (cc, NULL, size, dim, &params, centers, labels, NULL);
+
+    // create the children nodes
+    node_kmean_init (node, K, labels);
+
+    free (labels);
+    free (centers);
+    free (cc);
+
     return FALSE;
 }
 
@@ -1098,6 +1043,443 @@ double *bags_naive_vote (GQueue *bags, int size)
 
 }
 
+/* create an empty vocabulary. The descriptor size is set by the first word.
+ */
+bags_vocabulary_t *bags_vocabulary_new ()
+{
+    bags_vocabulary_t *v = (bags_vocabulary_t*)calloc(1, sizeof(bags_vocabulary_t));
+    return v;
+}
+
+void bags_vocabulary_destroy (bags_vocabulary_t *v)
+{
+    if (!v)
+        return;
+
+    for (int j=0;j<v->num;j++) {
+        free (v->post[j].id);
+        free (v->post[j].count);
+    }
+
+    bagtree_destroy (v->tree);
+    free (v->cc);
+    free (v->n);
+    free (v->post);
+    free (v);
+}
+
+/* search the words through a vocabulary tree (approximate) once the vocabulary has
+ * BAGS_VOCABULARY_TREE_MIN_WORDS words. Off by default.
+ */
+void bags_vocabulary_use_tree (bags_vocabulary_t *v, gboolean enable)
+{
+    v->use_tree = enable;
+
+    if (!enable) {
+        bagtree_destroy (v->tree);
+        v->tree = NULL;
+    }
+}
+
+/* add index <id> to a posting list
+ */
+static void bags_postings_add (bags_postings_t *p, guint32 id, guint32 count)
+{
+    // position of the first index >= id (usually the end of the list)
+    int lo = 0, hi = p->num;
+    if (p->num > 0 && p->id[p->num-1] < id) {
+        lo = p->num;
+    } else {
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (p->id[mid] < id)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+
+    if (lo < p->num && p->id[lo] == id) {
+        p->count[lo] += count;
+        return;
+    }
+
+    if (p->num == p->capacity) {
+        p->capacity = p->capacity ? 2 * p->capacity : 4;
+        p->id = (guint32*)realloc(p->id, p->capacity*sizeof(guint32));
+        p->count = (guint32*)realloc(p->count, p->capacity*sizeof(guint32));
+    }
+
+    memmove (p->id + lo + 1, p->id + lo, (p->num - lo)*sizeof(guint32));
+    memmove (p->count + lo + 1, p->count + lo, (p->num - lo)*sizeof(guint32));
+    p->id[lo] = id;
+    p->count[lo] = count;
+    p->num++;
+}
+
+/* create a new word from a feature. Returns the word id.
+ */
+int bags_vocabulary_append (bags_vocabulary_t *v, navlcm_feature_t *ft, int id)
+{
+    if (v->num == 0)
+        v->desc_size = ft->size;
+
+    assert (ft->size == v->desc_size);
+
+    if (v->num == v->capacity) {
+        v->capacity = v->capacity ? 2 * v->capacity : 1024;
+        v->cc = (float*)realloc(v->cc, v->capacity*v->desc_size*sizeof(float));
+        v->n = (int*)realloc(v->n, v->capacity*sizeof(int));
+        v->post = (bags_postings_t*)realloc(v->post, v->capacity*sizeof(bags_postings_t));
+    }
+
+    int j = v->num;
+    memcpy (v->cc + j*v->desc_size, ft->data, v->desc_size*sizeof(float));
+    memset (v->post + j, 0, sizeof(bags_postings_t));
+    bags_postings_add (v->post + j, id, 1);
+    v->n[j] = 1;
+    v->num++;
+
+    return j;
+}
+
+void bags_vocabulary_init (bags_vocabulary_t *v, navlcm_feature_list_t *features, int id)
+{
+    for (int i=0;i<features->num;i++)
+        bags_vocabulary_append (v, features->el + i, id);
+
+    dbg (DBG_CLASS, "vocabulary init with %d words.", features->num);
+}
+
+/* input:   a vocabulary <v>
+ *          a list of features
+ *          a search radius
+ * output:  the ids of the words within <search_radius> of a feature, one entry per
+ *          (feature, word) pair, in <*hits> (allocated here). matched[i] is set to 1 if
+ *          feature i hit at least one word, 0 otherwise.
+ *          returns the number of hits.
+ * The dot products are computed by blocks of BAGS_VOCABULARY_BLOCK words, directly
+ * from the centroid buffer, and thresholded while the block is in cache.
+ * If the vocabulary tree is on, the words it covers are searched through the tree
+ * and only the words added since it was built are scanned. The tree is rebuilt
+ * when these outnumber 1/BAGS_VOCABULARY_TREE_TAIL of the tree.
+ */
+int bags_vocabulary_search (bags_vocabulary_t *v, navlcm_feature_list_t *features, double search_radius, 
+                            int **hits, unsigned char *matched, double *usecs, gboolean use_mkl)
+{
+    GTimer *timer = g_timer_new ();
+
+    int nfeatures = features->num;
+    int size = features->desc_size;
+
+    assert (v->num == 0 || size == v->desc_size);
+
+    // convert features to matrix
+    float *m1 = (float*)malloc(nfeatures*size*sizeof(float));
+    for (int i=0;i<nfeatures;i++)
+        memcpy (m1 + i*size, features->el[i].data, size*sizeof(float));
+
+    float *dotprod = (float*)malloc(nfeatures*BAGS_VOCABULARY_BLOCK*sizeof(float));
+
+    int capacity = MAX (64, nfeatures);
+    int nhits = 0;
+    *hits = (int*)malloc(capacity*sizeof(int));
+
+    for (int i=0;i<nfeatures;i++)
+        matched[i] = 0;
+
+    // vocabulary tree
+    int first = 0;
+
+    if (v->use_tree && v->num >= BAGS_VOCABULARY_TREE_MIN_WORDS) {
+        if (!v->tree || v->num - v->tree->num > v->tree->num / BAGS_VOCABULARY_TREE_TAIL) {
+            bagtree_destroy (v->tree);
+            v->tree = bagtree_new (v->cc, v->num, v->desc_size, 0);
+        }
+
+        int *thits = (int*)malloc(BAGTREE_MAX_LEAVES*v->tree->maxleaf*sizeof(int));
+
+        for (int i=0;i<nfeatures;i++) {
+            int n = bagtree_search (v->tree, m1 + i*size, search_radius, BAGTREE_MAX_LEAVES, thits);
+            if (nhits + n > capacity) {
+                capacity = MAX (2 * capacity, nhits + n);
+                *hits = (int*)realloc(*hits, capacity*sizeof(int));
+            }
+            memcpy (*hits + nhits, thits, n*sizeof(int));
+            nhits += n;
+            if (n > 0)
+                matched[i] = 1;
+        }
+
+        free (thits);
+
+        first = v->tree->num;
+    }
+
+    for (int j0=first;j0<v->num;j0+=BAGS_VOCABULARY_BLOCK) {
+
+        int nb = MIN (BAGS_VOCABULARY_BLOCK, v->num - j0);
+
+        // dot products with a block of words
+        if (use_mkl)
+            math_matrix_mult_transb_mkl_float (nfeatures, nb, size, m1, v->cc + j0*size, dotprod);
+        else
+            math_matrix_mult_transb_naive_float (nfeatures, nb, size, m1, v->cc + j0*size, dotprod);
+
+        // find all words for which the distance to a feature < search_radius
+        for (int i=0;i<nfeatures;i++) {
+            float *dot = dotprod + i*nb;
+            for (int j=0;j<nb;j++) {
+                double dist = 2.0 - 2.0 * dot[j];
+                if (dist < search_radius) {
+                    if (nhits == capacity) {
+                        capacity *= 2;
+                        *hits = (int*)realloc(*hits, capacity*sizeof(int));
+                    }
+                    (*hits)[nhits++] = j0 + j;
+                    matched[i] = 1;
+                }
+            }
+        }
+    }
+
+    free (m1);
+    free (dotprod);
+
+    double secs = g_timer_elapsed (timer, NULL);
+    g_timer_destroy (timer);
+
+    if (usecs)
+        *usecs = secs * 1000000;
+
+    dbg (DBG_CLASS, "vocabulary search: %d words, %d hits.  ** %.3f secs (%.1f Hz)", v->num, nhits, secs, 1.0/secs);
+
+    return nhits;
+}
+
+/* add index <id> to the words that were hit
+ */
+void bags_vocabulary_update (bags_vocabulary_t *v, int *hits, int nhits, int id)
+{
+    for (int h=0;h<nhits;h++) {
+        bags_postings_add (v->post + hits[h], id, 1);
+        v->n[hits[h]]++;
+    }
+}
+
+static int bags_int_comp (const void *a, const void *b)
+{
+    int ia = *(const int*)a, ib = *(const int*)b;
+    return ia < ib ? -1 : ia > ib ? 1 : 0;
+}
+
+/* add <w> * count to sim[id] for each entry of a posting list
+ */
+static inline void bags_postings_score (double *sim, const guint32 *id, const guint32 *count, int n, double w)
+{
+    for (int p=0;p<n;p++)
+        sim[id[p]] += w * count[p];
+}
+
+/* same as bags_naive_vote, for a list of word ids: each hit adds 1/n (the inverse
+ * document frequency of the word) to the similarity of every index of the word.
+ * Hits are grouped by word first, so that each posting list is read once and
+ * weighted by the number of hits (the term frequency).
+ */
+double *bags_vocabulary_vote (bags_vocabulary_t *v, int *hits, int nhits, int size)
+{
+    dbg (DBG_CLASS, "vocabulary vote for %d words", nhits);
+
+    double *sim = (double*)malloc((size)*sizeof(double));
+    for (int i=0;i<size;i++)
+        sim[i] = .0;
+
+    int *words = (int*)malloc(MAX (1, nhits)*sizeof(int));
+    memcpy (words, hits, nhits*sizeof(int));
+    qsort (words, nhits, sizeof(int), bags_int_comp);
+
+    for (int h=0;h<nhits;) {
+        int j = words[h];
+        int tf = 0;
+        while (h < nhits && words[h] == j) {
+            tf++;
+            h++;
+        }
+        bags_postings_t *p = v->post + j;
+        bags_postings_score (sim, p->id, p->count, p->num, 1.0 * tf / v->n[j]);
+    }
+
+    free (words);
+
+    return sim;
+}
+
+/* number of times index <id> was added to word <word> (0 if none)
+ */
+int bags_vocabulary_search_index (bags_vocabulary_t *v, int word, int id)
+{
+    bags_postings_t *p = v->post + word;
+
+    int lo = 0, hi = p->num;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (p->id[mid] < (guint32)id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < p->num && p->id[lo] == (guint32)id ? p->count[lo] : 0;
+}
+
+/* variable-length encoding of an unsigned integer (7 bits per byte, lowest first).
+ * returns the number of bytes.
+ */
+static int bags_varint_encode (guint32 val, unsigned char *buf)
+{
+    int n = 0;
+    while (val >= 0x80) {
+        buf[n++] = (unsigned char)(val | 0x80);
+        val >>= 7;
+    }
+    buf[n++] = (unsigned char)val;
+    return n;
+}
+
+static int bags_varint_decode (const unsigned char *buf, guint32 *val)
+{
+    int n = 0, shift = 0;
+    *val = 0;
+    do {
+        *val |= (guint32)(buf[n] & 0x7f) << shift;
+        shift += 7;
+    } while (buf[n++] & 0x80);
+    return n;
+}
+
+/* write a vocabulary to file: desc_size, num, the centroids, then for each word
+ * n, the number of postings, the size in bytes of the encoded postings and the
+ * postings (index deltas and counts, varint-encoded).
+ */
+void bags_vocabulary_write (bags_vocabulary_t *v, FILE *fp)
+{
+    fwrite (&v->desc_size, sizeof(int), 1, fp);
+    fwrite (&v->num, sizeof(int), 1, fp);
+    fwrite (v->cc, sizeof(float), v->num*v->desc_size, fp);
+
+    int bufsize = 0;
+    unsigned char *buf = NULL;
+
+    for (int j=0;j<v->num;j++) {
+        bags_postings_t *p = v->post + j;
+
+        if (bufsize < 10 * p->num) {
+            bufsize = 10 * p->num;
+            buf = (unsigned char*)realloc(buf, bufsize);
+        }
+
+        int nbytes = 0;
+        guint32 prev = 0;
+        for (int k=0;k<p->num;k++) {
+            nbytes += bags_varint_encode (p->id[k] - prev, buf + nbytes);
+            nbytes += bags_varint_encode (p->count[k], buf + nbytes);
+            prev = p->id[k];
+        }
+
+        fwrite (v->n + j, sizeof(int), 1, fp);
+        fwrite (&p->num, sizeof(int), 1, fp);
+        fwrite (&nbytes, sizeof(int), 1, fp);
+        fwrite (buf, 1, nbytes, fp);
+    }
+
+    free (buf);
+
+    dbg (DBG_CLASS, "wrote vocabulary with %d words.", v->num);
+}
+
+bags_vocabulary_t *bags_vocabulary_read (FILE *fp)
+{
+    bags_vocabulary_t *v = bags_vocabulary_new ();
+
+    int desc_size, num;
+    assert (fread (&desc_size, sizeof(int), 1, fp)==1);
+    assert (fread (&num, sizeof(int), 1, fp)==1);
+
+    v->desc_size = desc_size;
+    v->num = num;
+    v->capacity = MAX (1, num);
+    v->cc = (float*)malloc(v->capacity*desc_size*sizeof(float));
+    v->n = (int*)malloc(v->capacity*sizeof(int));
+    v->post = (bags_postings_t*)calloc(v->capacity, sizeof(bags_postings_t));
+
+    fread (v->cc, sizeof(float), num*desc_size, fp);
+
+    int bufsize = 0;
+    unsigned char *buf = NULL;
+
+    for (int j=0;j<num;j++) {
+        bags_postings_t *p = v->post + j;
+        int nbytes;
+
+        fread (v->n + j, sizeof(int), 1, fp);
+        fread (&p->num, sizeof(int), 1, fp);
+        fread (&nbytes, sizeof(int), 1, fp);
+
+        if (bufsize < nbytes) {
+            bufsize = nbytes;
+            buf = (unsigned char*)realloc(buf, bufsize);
+        }
+        fread (buf, 1, nbytes, fp);
+
+        p->capacity = p->num;
+        p->id = (guint32*)malloc(MAX (1, p->num)*sizeof(guint32));
+        p->count = (guint32*)malloc(MAX (1, p->num)*sizeof(guint32));
+
+        int pos = 0;
+        guint32 prev = 0, delta;
+        for (int k=0;k<p->num;k++) {
+            pos += bags_varint_decode (buf + pos, &delta);
+            pos += bags_varint_decode (buf + pos, p->count + k);
+            p->id[k] = prev + delta;
+            prev = p->id[k];
+        }
+    }
+
+    free (buf);
+
+    dbg (DBG_CLASS, "read vocabulary with %d words.", v->num);
+
+    return v;
+}
+
+void bags_vocabulary_write_to_file (bags_vocabulary_t *v, const char *filename)
+{
+    FILE *fp = fopen (filename, "wb");
+    if (!fp) {
+        dbg (DBG_ERROR, "failed to open %s in write mode.", filename);
+        return;
+    }
+
+    bags_vocabulary_write (v, fp);
+
+    fclose (fp);
+}
+
+bags_vocabulary_t *bags_vocabulary_read_from_file (const char *filename)
+{
+    FILE *fp = fopen (filename, "rb");
+    if (!fp) {
+        dbg (DBG_ERROR, "failed to open %s in read mode.", filename);
+        return NULL;
+    }
+
+    bags_vocabulary_t *v = bags_vocabulary_read (fp);
+
+    fclose (fp);
+
+    return v;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////
 // unit testing
 //
@@ -1201,9 +1583,127 @@ void tree_unit_testing (int num_features, unsigned int N, float bag_radius)
     printf ("missed: %.2f %%\n", missed*100.0);
 }
 
+/* feed <nsets> random sets of <nfeatures> features (half of them close to the previous
+ * set) to the naive search and to the flat vocabulary, and check that both give
+ * the same number of hits, the same unmatched features and the same votes.
+ * Then check that the vocabulary reads back as written.
+ * Returns the number of sets that differ (+1 if the file differs).
+ */
+int bags_vocabulary_unit_testing (int nsets, int nfeatures)
+{
+    double bag_word_radius = BAGS_WORD_RADIUS;
+    int nfailed = 0;
+
+    srand (time (NULL));
+
+    GQueue *voctree = g_queue_new ();
+    bags_vocabulary_t *voc = bags_vocabulary_new ();
+    navlcm_feature_list_t *prev = NULL;
+
+    for (int id=0;id<nsets;id++) {
+
+        navlcm_feature_list_t *fs = bags_random_feature_list (nfeatures, 128);
+        for (int i=0;prev && i<nfeatures/2;i++) {
+            navlcm_feature_t *f = fs->el + i;
+            for (int k=0;k<f->size;k++)
+                f->data[k] = fmax (0, prev->el[i].data[k] + .05 * (1.0 * rand() / RAND_MAX - .5));
+            math_normalize_float (f->data, f->size);
+        }
+
+        if (id == 0) {
+            bags_init (voctree, fs, id);
+            bags_vocabulary_init (voc, fs, id);
+        }
+
+        // naive search
+        GQueue *qfeatures = g_queue_new ();
+        GQueue *qbags = g_queue_new ();
+        bags_naive_search (voctree, fs, bag_word_radius, qfeatures, qbags, NULL, 1);
+        double *sim1 = bags_naive_vote (qbags, id+1);
+
+        // vocabulary search
+        int *hits = NULL;
+        unsigned char *matched = (unsigned char*)malloc(fs->num);
+        int nhits = bags_vocabulary_search (voc, fs, bag_word_radius, &hits, matched, NULL, TRUE);
+        double *sim2 = bags_vocabulary_vote (voc, hits, nhits, id+1);
+
+        int nunmatched = 0;
+        for (int i=0;i<fs->num;i++)
+            if (!matched[i])
+                nunmatched++;
+
+        int ndiff = 0;
+        if (nhits != (int)g_queue_get_length (qbags) || nunmatched != (int)g_queue_get_length (qfeatures))
+            ndiff++;
+        for (int i=0;i<=id;i++)
+            if (fabs (sim1[i] - sim2[i]) > 1E-6)
+                ndiff++;
+
+        dbg (DBG_INFO, "[bags] set %d: %d words, %d hits, %d unmatched, %d differ.", id, voc->num, nhits, nunmatched, ndiff);
+
+        if (ndiff > 0)
+            nfailed++;
+
+        // update both vocabularies
+        bags_append (voctree, qfeatures, id);
+        bags_update (qbags, id);
+        for (int i=0;i<fs->num;i++)
+            if (!matched[i])
+                bags_vocabulary_append (voc, fs->el + i, id);
+        bags_vocabulary_update (voc, hits, nhits, id);
+
+        g_queue_free (qfeatures);
+        g_queue_free (qbags);
+        free (sim1);
+        free (sim2);
+        free (hits);
+        free (matched);
+
+        if (prev)
+            navlcm_feature_list_t_destroy (prev);
+        prev = fs;
+    }
+
+    if (prev)
+        navlcm_feature_list_t_destroy (prev);
+
+    // write/read the vocabulary
+    FILE *fp = tmpfile ();
+    if (fp) {
+        bags_vocabulary_write (voc, fp);
+        rewind (fp);
+        bags_vocabulary_t *voc2 = bags_vocabulary_read (fp);
+        fclose (fp);
+
+        int ndiff = voc2->num != voc->num || voc2->desc_size != voc->desc_size;
+        for (int j=0;!ndiff && j<voc->num;j++) {
+            bags_postings_t *p1 = voc->post + j, *p2 = voc2->post + j;
+            if (voc->n[j] != voc2->n[j] || p1->num != p2->num ||
+                memcmp (voc->cc + j*voc->desc_size, voc2->cc + j*voc->desc_size, voc->desc_size*sizeof(float)) ||
+                memcmp (p1->id, p2->id, p1->num*sizeof(guint32)) || memcmp (p1->count, p2->count, p1->num*sizeof(guint32)))
+                ndiff++;
+        }
+
+        dbg (DBG_INFO, "[bags] write/read: %d differ.", ndiff);
+
+        if (ndiff > 0)
+            nfailed++;
+
+        bags_vocabulary_destroy (voc2);
+    }
+
+    bags_destroy (voctree);
+    bags_vocabulary_destroy (voc);
+
+    dbg (DBG_INFO, "[bags] unit testing: %d/%d sets failed.", nfailed, nsets);
+
+    return nfailed;
+}
+
 /* mode = 1: naive search
  * mode = 2: naive search (MKL-optimized)
  * mode = 3: tree-based search
+ * mode = 4: flat vocabulary search (MKL-optimized)
  *
  * nsets: number of feature sets (e.g 1000)
  * nfeatures: number of features per set (e.g 500)
@@ -1270,6 +1770,46 @@ void bags_performance_testing (int mode, int nsets, int nfeatures, unsigned int
         fclose (fp);
     }
 
+    if (mode == 4) {
+        // flat vocabulary
+        printf ("vocabulary search...\n");
+        bags_vocabulary_t *voc = bags_vocabulary_new ();
+        int count=0;
+
+        fp = fopen (filename, "w");
+
+        for (GList *iter=g_queue_peek_head_link (features);iter;iter=iter->next) {
+            navlcm_feature_list_t *fs = (navlcm_feature_list_t*)iter->data;
+
+            if (voc->num == 0) {
+                printf ("initializing vocabulary with %d features...\n", fs->num);
+                bags_vocabulary_init (voc, fs, 0);
+            }
+
+            int *hits = NULL;
+            unsigned char *matched = (unsigned char*)malloc(fs->num);
+            double usecs=0;
+            bags_vocabulary_search (voc, fs, bag_word_radius, &hits, matched, &usecs, TRUE);
+
+            // create new words for unmatched features
+            for (int i=0;i<fs->num;i++)
+                if (!matched[i])
+                    bags_vocabulary_append (voc, fs->el + i, 0);
+            fprintf (fp, "%d %.5f\n", voc->num, usecs/1000000);
+            fflush (fp);
+
+            free (hits);
+            free (matched);
+
+            printf ("mode = %d. progress: %.1f %%  vocabulary size: %d\n", mode, 100.0*count/nsets, voc->num);
+            count++;
+        }
+
+        bags_vocabulary_destroy (voc);
+
+        fclose (fp);
+    }
+
     if (mode == 3) {
         // tree-based search
         GNode *tree = NULL;
@@ -18,8 +18,10 @@
 #include <common/fileio.h>
 #include <common/dbg.h>
 #include <common/mkl_math.h>
+#include <common/kmeans.h>
 
 #include "corrmat.h"
+#include "bagtree.h"
 
 #define BAGS_MAX_CHILDREN 500
 #define BAGS_KMEAN_N_CHILDREN 10
@@ -41,6 +43,38 @@ struct tree_node_t {
     int id;
 };
 
+/* Posting list of a word: the indices (e.g. node ID) the word was seen in, sorted
+ * and without duplicates, with the number of times each index was added.
+ * Indices mostly come in increasing order, so that an update is an append.
+ */
+struct bags_postings_t {
+    int num;                // number of distinct indices
+    int capacity;
+    guint32 *id;            // sorted indices
+    guint32 *count;         // # of times each index was added
+};
+
+/* Flat vocabulary for the naive search. Word centroids are appended to a single
+ * buffer (a desc_size x num column-major matrix, i.e. one centroid after the other)
+ * that grows by doubling, so that a search multiplies the features against the buffer
+ * in place. Words are never removed and are referred to by their index.
+ * On file, posting lists are delta-encoded (see bags_vocabulary_write).
+ */
+struct bags_vocabulary_t {
+    int desc_size;
+    int num;                // number of words
+    int capacity;           // number of allocated words
+    float *cc;              // centroid of word j at cc + j * desc_size
+    int *n;                 // # of indices of word j (sum of the posting counts)
+    bags_postings_t *post;  // posting list of word j
+    gboolean use_tree;      // search through a vocabulary tree
+    bagtree_t *tree;        // tree over the first tree->num words (NULL if none)
+};
+
+#define BAGS_VOCABULARY_BLOCK 512       // words per block in bags_vocabulary_search
+#define BAGS_VOCABULARY_TREE_MIN_WORDS 50000    // smallest vocabulary searched through the tree
+#define BAGS_VOCABULARY_TREE_TAIL 4     // rebuild the tree when 1/4 of its words were added
+
 int bag_t_init (bag_t *b, navlcm_feature_t *ft, int id);
 int bag_t_insert_feature (bag_t *b, navlcm_feature_t *ft, int id);
 int bag_t_search_index (bag_t *b, int index);
@@ -73,6 +107,23 @@ void bags_append (GQueue *bags, GQueue *features, int id);
 void bags_update (GQueue *bags, int id);
 void bags_naive_search (GQueue *bags, navlcm_feature_list_t *features, double search_radius, GQueue *qfeatures, GQueue *qbags, double *usecs, gboolean use_mkl);
 double *bags_naive_vote (GQueue *bags, int size);
+
+bags_vocabulary_t *bags_vocabulary_new ();
+void bags_vocabulary_destroy (bags_vocabulary_t *v);
+int bags_vocabulary_append (bags_vocabulary_t *v, navlcm_feature_t *ft, int id);
+void bags_vocabulary_init (bags_vocabulary_t *v, navlcm_feature_list_t *features, int id);
+void bags_vocabulary_use_tree (bags_vocabulary_t *v, gboolean enable);
+int bags_vocabulary_search (bags_vocabulary_t *v, navlcm_feature_list_t *features, double search_radius, 
+                            int **hits, unsigned char *matched, double *usecs, gboolean use_mkl);
+void bags_vocabulary_update (bags_vocabulary_t *v, int *hits, int nhits, int id);
+double *bags_vocabulary_vote (bags_vocabulary_t *v, int *hits, int nhits, int size);
+int bags_vocabulary_search_index (bags_vocabulary_t *v, int word, int id);
+void bags_vocabulary_write (bags_vocabulary_t *v, FILE *fp);
+bags_vocabulary_t *bags_vocabulary_read (FILE *fp);
+void bags_vocabulary_write_to_file (bags_vocabulary_t *v, const char *filename);
+bags_vocabulary_t *bags_vocabulary_read_from_file (const char *filename);
+navlcm_feature_list_t *bags_random_feature_list (int num, int desc_size);
+int bags_vocabulary_unit_testing (int nsets, int nfeatures);
 void bags_performance_testing (int mode, int nsets, int nfeatures, unsigned int N, char *filename);
 
 #endif
@@ -0,0 +1,521 @@
+/*
+ * Flat hierarchical k-means tree for vocabulary search.
+ */
+
+#include "bagtree.h"
+
+typedef struct {
+    float dist;         // distance to the centroid of the branch
+    int node;
+} bagtree_branch_t;
+
+typedef struct {
+    bagtree_branch_t *el;
+    int num;
+    int capacity;
+} bagtree_heap_t;
+
+// a node to split, with its range in the word permutation
+typedef struct {
+    int node;
+    int start, count;
+    unsigned int seed;
+    int nthreads;       // threads of the k-means of this node
+    int nclusters;      // output: number of non-empty clusters
+    int sizes[BAGTREE_BRANCHING];
+    float *cc;          // output: cluster centroids (BAGTREE_BRANCHING x size)
+} bagtree_task_t;
+
+typedef struct {
+    const float *data;
+    int size;
+    int *perm;
+    bagtree_task_t *tasks;
+    int start, end;
+} bagtree_job_t;
+
+////////////////////////////////////////////////////////////////////////////////////
+// branch heap (min-heap on distance)
+//
+static void bagtree_heap_push (bagtree_heap_t *h, float dist, int node)
+{
+    if (h->num == h->capacity) {
+        h->capacity = MAX (64, 2 * h->capacity);
+        h->el = (bagtree_branch_t*)realloc (h->el, h->capacity * sizeof(bagtree_branch_t));
+    }
+
+    int i = h->num++;
+    while (i > 0) {
+        int p = (i-1)/2;
+        if (h->el[p].dist <= dist)
+            break;
+        h->el[i] = h->el[p];
+        i = p;
+    }
+    h->el[i].dist = dist;
+    h->el[i].node = node;
+}
+
+static bagtree_branch_t bagtree_heap_pop (bagtree_heap_t *h)
+{
+    bagtree_branch_t top = h->el[0];
+    bagtree_branch_t last = h->el[--h->num];
+
+    int i = 0;
+    while (2*i+1 < h->num) {
+        int c = 2*i+1;
+        if (c+1 < h->num && h->el[c+1].dist < h->el[c].dist)
+            c++;
+        if (last.dist <= h->el[c].dist)
+            break;
+        h->el[i] = h->el[c];
+        i = c;
+    }
+    if (h->num > 0)
+        h->el[i] = last;
+
+    return top;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// construction
+//
+
+/* split the words perm[0..n-1] of <data> in BAGTREE_BRANCHING clusters. The centroids
+ * are fitted on at most BAGTREE_KMEANS_SAMPLE words, then all words are assigned to
+ * their closest centroid and <perm> is reordered by cluster. Empty clusters are dropped.
+ */
+static void bagtree_kmeans (const float *data, int size, int *perm, int n, bagtree_task_t *task)
+{
+    int K = BAGTREE_BRANCHING;
+    unsigned int seed = task->seed;
+
+    // sample (partial shuffle of a copy of the permutation)
+    int nsample = MIN (n, BAGTREE_KMEANS_SAMPLE);
+    int *sample = (int*)malloc (n * sizeof(int));
+    memcpy (sample, perm, n * sizeof(int));
+    for (int i=0;i<nsample;i++) {
+        int j = i + rand_r (&seed) % (n - i);
+        int tmp = sample[i];
+        sample[i] = sample[j];
+        sample[j] = tmp;
+    }
+
+    kmeans_params_t params;
+    kmeans_params_init (&params, K);
+    params.max_iter = BAGTREE_KMEANS_ITER;
+    params.nthreads = task->nthreads;
+    params.seed = seed;
+    params.init = KMEANS_INIT_RANDOM;     // seeding costs more than it gains on a sample
+
+    float *cc = task->cc;
+    double *sum = (double*)calloc (K * size, sizeof(double));
+    int *count = (int*)calloc (K, sizeof(int));
+    int *label = (int*)malloc (n * sizeof(int));
+
+    kmeans_run (data, sample, nsample, size, &params, cc, NULL, NULL);
+
+    // assign all the words and recompute the centroids
+    kmeans_assign (data, perm, n, size, cc, K, task->nthreads, label, NULL);
+
+    for (int i=0;i<n;i++) {
+        const float *x = data + (size_t)perm[i]*size;
+        double *s = sum + label[i]*size;
+        for (int k=0;k<size;k++)
+            s[k] += x[k];
+        count[label[i]]++;
+    }
+
+    // compact the non-empty clusters
+    int *remap = (int*)malloc (K * sizeof(int));
+    int nclusters = 0;
+    for (int c=0;c<K;c++) {
+        if (count[c] == 0) {
+            remap[c] = -1;
+            continue;
+        }
+        remap[c] = nclusters;
+        for (int k=0;k<size;k++)
+            cc[nclusters*size+k] = sum[c*size+k] / count[c];
+        task->sizes[nclusters] = count[c];
+        nclusters++;
+    }
+    task->nclusters = nclusters;
+
+    // counting sort of the range by cluster (keeps the order within a cluster)
+    int pos[BAGTREE_BRANCHING];
+    pos[0] = 0;
+    for (int c=1;c<nclusters;c++)
+        pos[c] = pos[c-1] + task->sizes[c-1];
+
+    for (int i=0;i<n;i++)
+        sample[pos[remap[label[i]]]++] = perm[i];
+    memcpy (perm, sample, n * sizeof(int));
+
+    free (remap);
+    free (sample);
+    free (sum);
+    free (count);
+    free (label);
+}
+
+static gpointer bagtree_job_cb (gpointer data)
+{
+    bagtree_job_t *job = (bagtree_job_t*)data;
+
+    for (int i=job->start;i<job->end;i++) {
+        bagtree_task_t *task = job->tasks + i;
+        bagtree_kmeans (job->data, job->size, job->perm + task->start, task->count, task);
+    }
+
+    return NULL;
+}
+
+/* run the k-means of <ntasks> nodes, split across <nthreads> threads. Large nodes come
+ * first in <tasks> (root levels), so that tasks are dealt round-robin.
+ */
+static void bagtree_split (const float *data, int size, int *perm, bagtree_task_t *tasks, int ntasks, int nthreads)
+{
+    nthreads = MAX (1, MIN (nthreads, ntasks));
+
+    bagtree_job_t *jobs = (bagtree_job_t*)malloc (nthreads * sizeof(bagtree_job_t));
+    GThread **threads = (GThread**)malloc (nthreads * sizeof(GThread*));
+
+    for (int t=0;t<nthreads;t++) {
+        bagtree_job_t *job = jobs + t;
+        job->data = data;
+        job->size = size;
+        job->perm = perm;
+        job->tasks = tasks;
+        job->start = t * ntasks / nthreads;
+        job->end = (t+1) * ntasks / nthreads;
+    }
+
+    // the calling thread takes the first chunk
+    for (int t=1;t<nthreads;t++)
+        threads[t] = g_thread_create (bagtree_job_cb, jobs + t, TRUE, NULL);
+
+    bagtree_job_cb (jobs);
+
+    for (int t=1;t<nthreads;t++)
+        g_thread_join (threads[t]);
+
+    free (threads);
+    free (jobs);
+}
+
+static int bagtree_add_node (bagtree_t *t, int *capacity)
+{
+    if (t->nnodes == *capacity) {
+        *capacity = MAX (64, 2 * (*capacity));
+        t->nodes = (bagtree_node_t*)realloc (t->nodes, *capacity * sizeof(bagtree_node_t));
+        t->cc = (float*)realloc (t->cc, (size_t)(*capacity) * t->size * sizeof(float));
+        t->sqnorm = (float*)realloc (t->sqnorm, *capacity * sizeof(float));
+    }
+
+    int i = t->nnodes++;
+    t->nodes[i].first = 0;
+    t->nodes[i].count = 0;
+    t->nodes[i].leaf = 1;
+    memset (t->cc + (size_t)i*t->size, 0, t->size * sizeof(float));
+    t->sqnorm[i] = .0;
+
+    return i;
+}
+
+/* build a tree over the <num> word centroids <cc> (one after the other, <size> floats each).
+ * k-means run in <nthreads> threads (<= 0 for one per processor).
+ */
+bagtree_t *bagtree_new (const float *cc, int num, int size, int nthreads)
+{
+    GTimer *timer = g_timer_new ();
+
+    if (nthreads <= 0)
+        nthreads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+
+    bagtree_t *t = (bagtree_t*)calloc (1, sizeof(bagtree_t));
+    t->num = num;
+    t->size = size;
+
+    int *perm = (int*)malloc (MAX (1, num) * sizeof(int));
+    for (int i=0;i<num;i++)
+        perm[i] = i;
+
+    int capacity = 0;
+    bagtree_add_node (t, &capacity);
+
+    // nodes of the current level that must be split
+    bagtree_task_t *tasks = (bagtree_task_t*)malloc (sizeof(bagtree_task_t));
+    int ntasks = 0;
+
+    if (num > BAGTREE_LEAF_SIZE) {
+        tasks[0].node = 0;
+        tasks[0].start = 0;
+        tasks[0].count = num;
+        ntasks = 1;
+    } else {
+        t->nodes[0].first = 0;
+        t->nodes[0].count = num;
+    }
+
+    t->depth = 0;
+
+    while (ntasks > 0) {
+
+        for (int k=0;k<ntasks;k++) {
+            tasks[k].seed = 1 + tasks[k].node;
+            tasks[k].nthreads = MAX (1, nthreads / ntasks);
+            tasks[k].cc = (float*)malloc (BAGTREE_BRANCHING * size * sizeof(float));
+        }
+
+        bagtree_split (cc, size, perm, tasks, ntasks, nthreads);
+
+        // create the children, in breadth-first order
+        bagtree_task_t *next = (bagtree_task_t*)malloc (ntasks * BAGTREE_BRANCHING * sizeof(bagtree_task_t));
+        int nnext = 0;
+
+        for (int k=0;k<ntasks;k++) {
+            bagtree_task_t *task = tasks + k;
+            bagtree_node_t *nd = t->nodes + task->node;
+
+            // the words cannot be split (e.g. duplicates)
+            if (task->nclusters < 2) {
+                nd->first = task->start;
+                nd->count = task->count;
+                free (task->cc);
+                continue;
+            }
+
+            nd->leaf = 0;
+            nd->first = t->nnodes;
+            nd->count = task->nclusters;
+
+            int start = task->start;
+            for (int c=0;c<task->nclusters;c++) {
+                int i = bagtree_add_node (t, &capacity);
+                float *ci = t->cc + (size_t)i*size;
+                memcpy (ci, task->cc + c*size, size * sizeof(float));
+                t->sqnorm[i] = simdmatch_dot (ci, ci, size);
+
+                if (task->sizes[c] > BAGTREE_LEAF_SIZE) {
+                    next[nnext].node = i;
+                    next[nnext].start = start;
+                    next[nnext].count = task->sizes[c];
+                    nnext++;
+                } else {
+                    t->nodes[i].first = start;
+                    t->nodes[i].count = task->sizes[c];
+                }
+                start += task->sizes[c];
+            }
+
+            free (task->cc);
+        }
+
+        free (tasks);
+        tasks = next;
+        ntasks = nnext;
+        t->depth++;
+    }
+
+    free (tasks);
+
+    // words in leaf order
+    t->words = perm;
+    t->wcc = (float*)malloc ((size_t)MAX (1, num) * size * sizeof(float));
+    for (int i=0;i<num;i++)
+        memcpy (t->wcc + (size_t)i*size, cc + (size_t)perm[i]*size, size * sizeof(float));
+
+    t->maxleaf = 0;
+    for (int i=0;i<t->nnodes;i++)
+        if (t->nodes[i].leaf)
+            t->maxleaf = MAX (t->maxleaf, t->nodes[i].count);
+
+    dbg (DBG_CLASS, "[bagtree] %d words, %d nodes, depth %d, largest leaf %d. ** %.3f secs",
+         num, t->nnodes, t->depth, t->maxleaf, g_timer_elapsed (timer, NULL));
+
+    g_timer_destroy (timer);
+
+    return t;
+}
+
+void bagtree_destroy (bagtree_t *t)
+{
+    if (!t)
+        return;
+
+    free (t->nodes);
+    free (t->cc);
+    free (t->sqnorm);
+    free (t->words);
+    free (t->wcc);
+    free (t);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// search
+//
+
+/* list the words within <radius> of <query> (distance 2 - 2 dot, as in the naive search)
+ * among the words of the <maxleaves> leaves closest to the query, in best-bin-first order.
+ * <hits> must hold maxleaves x t->maxleaf entries. Returns the number of hits.
+ */
+int bagtree_search (bagtree_t *t, const float *query, double radius, int maxleaves, int *hits)
+{
+    int size = t->size;
+    int nhits = 0;
+
+    bagtree_heap_t heap;
+    memset (&heap, 0, sizeof(heap));
+
+    bagtree_heap_push (&heap, .0, 0);
+
+    for (int nleaves=0;nleaves<maxleaves && heap.num > 0;nleaves++) {
+
+        int n = bagtree_heap_pop (&heap).node;
+
+        // descend to the closest leaf, keep the other branches for later
+        while (!t->nodes[n].leaf) {
+            bagtree_node_t *nd = t->nodes + n;
+            int best = -1;
+            float bestd = FLT_MAX;
+            for (int c=nd->first;c<nd->first+nd->count;c++) {
+                float d = t->sqnorm[c] - 2 * simdmatch_dot (query, t->cc + (size_t)c*size, size);
+                if (d < bestd) {
+                    if (best != -1)
+                        bagtree_heap_push (&heap, bestd, best);
+                    bestd = d;
+                    best = c;
+                } else {
+                    bagtree_heap_push (&heap, d, c);
+                }
+            }
+            n = best;
+        }
+
+        // scan the leaf
+        bagtree_node_t *nd = t->nodes + n;
+        for (int i=nd->first;i<nd->first+nd->count;i++) {
+            double dist = 2.0 - 2.0 * simdmatch_dot (query, t->wcc + (size_t)i*size, size);
+            if (dist < radius)
+                hits[nhits++] = t->words[i];
+        }
+    }
+
+    free (heap.el);
+
+    return nhits;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// performance testing
+//
+
+/* random unit descriptors drawn around <ncenters> random centres (positive components,
+ * as for SIFT), with gaussian noise of standard deviation <sigma> per component.
+ */
+static float *bagtree_random_words (int num, int size, int ncenters, double sigma, unsigned int *seed)
+{
+    float *centers = (float*)malloc (ncenters * size * sizeof(float));
+    for (int i=0;i<ncenters*size;i++)
+        centers[i] = 1.0 * rand_r (seed) / RAND_MAX;
+
+    float *data = (float*)malloc ((size_t)num * size * sizeof(float));
+    for (int i=0;i<num;i++) {
+        const float *c = centers + (rand_r (seed) % ncenters) * size;
+        float *x = data + (size_t)i*size;
+        double norm = .0;
+        for (int k=0;k<size;k++) {
+            double u1 = (rand_r (seed) + 1.0) / (RAND_MAX + 2.0), u2 = 1.0 * rand_r (seed) / RAND_MAX;
+            double g = sqrt (-2 * log (u1)) * cos (2 * M_PI * u2);
+            x[k] = MAX (.0, c[k] + sigma * g);
+            norm += x[k] * x[k];
+        }
+        norm = sqrt (norm);
+        for (int k=0;k<size;k++)
+            x[k] /= norm;
+    }
+
+    free (centers);
+    return data;
+}
+
+/* compare the tree search with the naive search (block matrix product, as in
+ * bags_vocabulary_search) for vocabularies of 12.5k to 200k words. Queries are
+ * perturbed words. For each size, writes "<nwords> <build secs> <naive secs>
+ * <tree secs> <recall>" to <filename>. Times are for <nqueries> queries.
+ */
+void bagtree_performance_testing (int nqueries, const char *filename)
+{
+    FILE *fp = fopen (filename, "w");
+    if (!fp)
+        return;
+
+    int size = 128;
+    double radius = .30;
+    int block = 512;
+    unsigned int seed = time (NULL);
+
+    for (int num=12500;num<=200000;num*=2) {
+
+        float *words = bagtree_random_words (num, size, num / 50, .05, &seed);
+
+        // queries: words with a small perturbation
+        float *queries = (float*)malloc (nqueries * size * sizeof(float));
+        for (int q=0;q<nqueries;q++) {
+            const float *w = words + (size_t)(rand_r (&seed) % num) * size;
+            double norm = .0;
+            for (int k=0;k<size;k++) {
+                queries[q*size+k] = MAX (.0, w[k] + .02 * (2.0 * rand_r (&seed) / RAND_MAX - 1.0));
+                norm += queries[q*size+k] * queries[q*size+k];
+            }
+            for (int k=0;k<size;k++)
+                queries[q*size+k] /= sqrt (norm);
+        }
+
+        GTimer *timer = g_timer_new ();
+
+        // build
+        bagtree_t *t = bagtree_new (words, num, size, 0);
+        double build_secs = g_timer_elapsed (timer, NULL);
+
+        // naive search
+        g_timer_start (timer);
+        float *dot = (float*)malloc (nqueries * block * sizeof(float));
+        int naive_hits = 0;
+        for (int j0=0;j0<num;j0+=block) {
+            int nb = MIN (block, num - j0);
+            math_matrix_mult_transb_mkl_float (nqueries, nb, size, queries, words + (size_t)j0*size, dot);
+            for (int i=0;i<nqueries*nb;i++)
+                if (2.0 - 2.0 * dot[i] < radius)
+                    naive_hits++;
+        }
+        free (dot);
+        double naive_secs = g_timer_elapsed (timer, NULL);
+
+        // tree search
+        g_timer_start (timer);
+        int *hits = (int*)malloc (BAGTREE_MAX_LEAVES * t->maxleaf * sizeof(int));
+        int tree_hits = 0;
+        for (int q=0;q<nqueries;q++)
+            tree_hits += bagtree_search (t, queries + q*size, radius, BAGTREE_MAX_LEAVES, hits);
+        free (hits);
+        double tree_secs = g_timer_elapsed (timer, NULL);
+
+        double recall = naive_hits > 0 ? 1.0 * tree_hits / naive_hits : 1.0;
+
+        dbg (DBG_INFO, "[bagtree] %d words: build %.3f secs, naive %.4f secs, tree %.4f secs, recall %.3f",
+             num, build_secs, naive_secs, tree_secs, recall);
+
+        fprintf (fp, "%d %.5f %.5f %.5f %.4f\n", num, build_secs, naive_secs, tree_secs, recall);
+        fflush (fp);
+
+        g_timer_destroy (timer);
+        bagtree_destroy (t);
+        free (words);
+        free (queries);
+    }
+
+    fclose (fp);
+}
+
@@ -0,0 +1,68 @@
+#ifndef _BAGTREE_H__
+#define _BAGTREE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+/* from common */
+#include <common/dbg.h>
+#include <common/mkl_math.h>
+#include <common/kmeans.h>
+
+#include "simdmatch.h"
+
+/* Hierarchical k-means tree over the words of a vocabulary (Nister & Stewenius).
+ *
+ * The tree has a fixed branching factor and is stored breadth-first in one array:
+ * the children of a node are consecutive, and so are their centroids, so that a
+ * descent step is a dot product of the query against BAGTREE_BRANCHING contiguous
+ * vectors. The words are reordered by leaf, with a copy of their centroids, so that
+ * a leaf is scanned contiguously. A query descends to the closest leaf and then
+ * visits the closest unexplored branches (best-bin-first) until <maxleaves> leaves
+ * have been scanned.
+ *
+ * The k-means of the nodes of a level are independent and run in parallel; the
+ * levels with fewer nodes than threads give the spare threads to each k-means.
+ */
+
+#define BAGTREE_BRANCHING 10        // children per internal node
+#define BAGTREE_LEAF_SIZE 64        // max. number of words in a leaf
+#define BAGTREE_KMEANS_ITER 10      // max. number of k-means iterations per node
+#define BAGTREE_KMEANS_SAMPLE 4096  // max. number of words used to fit the centroids of a node
+#define BAGTREE_MAX_LEAVES 4        // default number of leaves scanned per query
+
+typedef struct {
+    int first;          // first child (internal node) or first word in <words> (leaf)
+    int count;          // number of children (internal node) or of words (leaf)
+    int leaf;
+} bagtree_node_t;
+
+typedef struct {
+    int num;            // number of words
+    int size;           // descriptor length
+    int nnodes;
+    int depth;
+    int maxleaf;        // size of the largest leaf
+    bagtree_node_t *nodes;      // breadth-first, node 0 is the root
+    float *cc;                  // centroid of node i at cc + i * size
+    float *sqnorm;              // squared norm of the centroids
+    int *words;                 // word ids grouped by leaf
+    float *wcc;                 // word centroids, in the order of <words>
+} bagtree_t;
+
+bagtree_t *bagtree_new (const float *cc, int num, int size, int nthreads);
+void bagtree_destroy (bagtree_t *t);
+
+int bagtree_search (bagtree_t *t, const float *query, double radius, int maxleaves, int *hits);
+
+void bagtree_performance_testing (int nqueries, const char *filename);
+
+#endif
+
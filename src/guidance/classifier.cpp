@@ -112,7 +112,7 @@ int class_orientation (navlcm_feature_list_t *f1, navlcm_feature_list_t *f2, con
     // match features
     navlcm_feature_match_set_t *matches = (navlcm_feature_match_set_t*)malloc(sizeof(navlcm_feature_match_set_t));
     int matching_mode = f1->feature_type == NAVLCM_FEATURES_PARAM_T_FAST ? MATCHING_NCC : MATCHING_DOTPROD;
-    find_feature_matches_fast (f1, f2, TRUE, TRUE, TRUE, TRUE, .9, -1, matching_mode, matches);
+    find_feature_matches_cached (f1, f2, TRUE, TRUE, TRUE, TRUE, .9, -1, matching_mode, matches);
     
     //navlcm_feature_match_set_t *matches = find_feature_matches_multi (f2, f1, TRUE, TRUE, 5, 0.80, -1.0, -1.0, TRUE);
 
@@ -870,15 +870,45 @@ int applanix_delta (GQueue *data, int64_t utime1, int64_t utime2, double *delta_
     return 0;
 }
 
-/* compute the psi-distance between two feature sets
+/* psi-distance between two feature sets, given their matches
 */
-double class_psi_distance (navlcm_feature_list_t *f1, navlcm_feature_list_t *f2, lcm_t *lcm)
+static double class_psi_distance_from_matches (navlcm_feature_list_t *f1, navlcm_feature_list_t *f2, navlcm_feature_match_set_t *matches)
 {
     double max_d = .0;
     double psi_d = .0;
     int missing = 0;
     int count = 0;
 
+    for (int i=0;i<matches->num;i++) {
+        navlcm_feature_match_t *m = (navlcm_feature_match_t*)matches->el + i;
+        if (m->num==0) continue;
+        f1->el[m->src.index].uid=1;
+        psi_d += sqrt (m->dist[0]);
+        count++;
+        max_d = fmax (max_d, m->dist[0]);
+    }
+    assert (max_d < 1.001);
+
+    max_d = 1.0;//*= 2.0;
+
+    missing = f1->num - count + f2->num - count;
+
+    psi_d = 2 * psi_d;
+
+    psi_d += max_d * missing;
+
+    if (f1->num > 0 || f2->num > 0)
+        psi_d /= (f1->num + f2->num);
+
+    return psi_d;
+}
+
+/* compute the psi-distance between two feature sets
+*/
+double class_psi_distance (navlcm_feature_list_t *f1, navlcm_feature_list_t *f2, lcm_t *lcm)
+{
+    double psi_d = .0;
+
     if (f1->num == 0 || f2->num == 0) {
         dbg (DBG_ERROR, "matching zero features.");
         return .0;
@@ -887,7 +917,7 @@ double class_psi_distance (navlcm_feature_list_t *f1, navlcm_feature_list_t *f2,
     // compute feature matches
     navlcm_feature_match_set_t *matches = (navlcm_feature_match_set_t*)malloc(sizeof(navlcm_feature_match_set_t));
     int matching_mode = f1->feature_type == NAVLCM_FEATURES_PARAM_T_FAST ? MATCHING_NCC : MATCHING_DOTPROD;
-    find_feature_matches_fast (f1, f2, TRUE, TRUE, TRUE, TRUE, .8, -1, matching_mode, matches);
+    find_feature_matches_cached (f1, f2, TRUE, TRUE, TRUE, TRUE, .8, -1, matching_mode, matches);
 
     if (!matches) 
         return .0;
@@ -914,39 +944,205 @@ double class_psi_distance (navlcm_feature_list_t *f1, navlcm_feature_list_t *f2,
     }
 
     // compute psi-distance
-    for (int i=0;i<matches->num;i++) {
-        navlcm_feature_match_t *m = (navlcm_feature_match_t*)matches->el + i;
-        if (m->num==0) continue;
-        f1->el[m->src.index].uid=1;
-        psi_d += sqrt (m->dist[0]);
-        count++;
-        max_d = fmax (max_d, m->dist[0]);
-    }
-    assert (max_d < 1.001);
+    psi_d = class_psi_distance_from_matches (f1, f2, matches);
 
     if (lcm)
         navlcm_feature_list_t_publish (lcm, "FEATURES_DBG", f1);
 
-    max_d = 1.0;//*= 2.0;
+    // using just matching ratio
+    //psi_d = 1.0 - 1.0 * matches->num / f1->num;
 
-    missing = f1->num - count + f2->num - count;
+    // free matches
+    navlcm_feature_match_set_t_destroy (matches);
 
-    psi_d = 2 * psi_d;
+    return psi_d;
+}
 
-    psi_d += max_d * missing;
+/* Worker pool for the observation update. The threads are created with the first
+ * batch and kept for the lifetime of the process; a batch pushes one task per
+ * feature set and waits for all of them. Each worker packs the sets in its own
+ * scratch of the matcher, and packs the live features once per frame.
+ */
+typedef struct {
+    GMutex *mutex;
+    GCond *cond;
+    int pending;
+} class_psi_batch_t;
+
+typedef struct {
+    navlcm_feature_list_t *f1;
+    navlcm_feature_list_t *f2;
+    int matching_mode;
+    navlcm_feature_match_set_t *matches;
+    class_psi_batch_t *batch;
+} class_psi_task_t;
+
+static GThreadPool *g_psi_pool = NULL;
+static int g_psi_nthreads = 0;             // one per core
+static GStaticMutex g_psi_pool_mutex = G_STATIC_MUTEX_INIT;
+static gboolean g_psi_ann = FALSE;         // approximate search (kd-forest) for the dot-product descriptors
+
+static void class_psi_task_cb (gpointer data, gpointer user_data)
+{
+    class_psi_task_t *task = (class_psi_task_t*)data;
 
-    if (f1->num > 0 || f2->num > 0)
-        psi_d /= (f1->num + f2->num);
+    find_feature_matches_cached (task->f1, task->f2, TRUE, TRUE, TRUE, TRUE, .8, -1, task->matching_mode, task->matches);
 
-    psi_d = psi_d;
+    class_psi_batch_t *batch = task->batch;
+    g_mutex_lock (batch->mutex);
+    batch->pending--;
+    if (batch->pending == 0)
+        g_cond_signal (batch->cond);
+    g_mutex_unlock (batch->mutex);
+}
 
-    // using just matching ratio
-    //psi_d = 1.0 - 1.0 * matches->num / f1->num;
+static GThreadPool *class_psi_pool ()
+{
+    g_static_mutex_lock (&g_psi_pool_mutex);
+    if (!g_psi_pool) {
+        if (g_psi_nthreads <= 0)
+            g_psi_nthreads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+        if (g_psi_nthreads > 1) {
+            GError *error = NULL;
+            g_psi_pool = g_thread_pool_new (class_psi_task_cb, NULL, g_psi_nthreads, TRUE, &error);
+            if (!g_psi_pool) {
+                dbg (DBG_ERROR, "failed to create thread pool: %s", error ? error->message : "");
+                if (error) g_error_free (error);
+                g_psi_nthreads = 1;
+            } else {
+                dbg (DBG_CLASS, "[class] observation update on %d threads.", g_psi_nthreads);
+            }
+        }
+    }
+    g_static_mutex_unlock (&g_psi_pool_mutex);
 
-    // free matches
-    navlcm_feature_match_set_t_destroy (matches);
+    return g_psi_pool;
+}
 
-    return psi_d;
+/* match the nodes against the live features with the approximate search (see kdforest.h)
+ * rather than the exhaustive one, for large node sets (e.g. after force_node). Does not
+ * apply to the NCC descriptors.
+ */
+void class_set_psi_ann (gboolean enable)
+{
+    g_psi_ann = enable;
+}
+
+/* match each of the <nkeys> sets against <keys2> on the worker pool
+ */
+static void class_psi_match_parallel (GThreadPool *pool, navlcm_feature_list_t **keys, int nkeys, navlcm_feature_list_t *f2, 
+                                      int matching_mode, navlcm_feature_match_set_t **matches)
+{
+    class_psi_batch_t batch;
+    batch.mutex = g_mutex_new ();
+    batch.cond = g_cond_new ();
+    batch.pending = nkeys;
+
+    class_psi_task_t *tasks = (class_psi_task_t*)malloc(nkeys*sizeof(class_psi_task_t));
+
+    for (int k=0;k<nkeys;k++) {
+        class_psi_task_t *task = tasks + k;
+        task->f1 = keys[k];
+        task->f2 = f2;
+        task->matching_mode = matching_mode;
+        task->matches = matches[k];
+        task->batch = &batch;
+        g_thread_pool_push (pool, task, NULL);
+    }
+
+    g_mutex_lock (batch.mutex);
+    while (batch.pending > 0)
+        g_cond_wait (batch.cond, batch.mutex);
+    g_mutex_unlock (batch.mutex);
+
+    g_mutex_free (batch.mutex);
+    g_cond_free (batch.cond);
+    free (tasks);
+}
+
+/* compute the psi-distance between feature sets <f1>[0..n-1] (e.g. the candidate
+ * nodes of the belief state) and <f2> (e.g. the live features). On a single thread,
+ * all sets are matched in a single pass (see find_feature_matches_batch_cached);
+ * otherwise each set is a task of the worker pool. Both go through the match cache,
+ * so that the rotation guidance reuses the matches of the current and next edges
+ * (see class_orientation). Each set has its own match set, and the distances are
+ * reduced in set order, so that the result does not depend on the number of threads.
+ * Fills <nmatches> and <psi_dist> (arrays of size <n>) with the same values as n 
+ * calls to class_psi_distance.
+ */
+int class_psi_distance_batch (navlcm_feature_list_t **f1, int n, navlcm_feature_list_t *f2, int *nmatches, double *psi_dist)
+{
+    for (int k=0;k<n;k++) {
+        nmatches[k] = 0;
+        psi_dist[k] = .0;
+    }
+
+    if (n == 0 || f2->num == 0) {
+        dbg (DBG_ERROR, "matching zero features.");
+        return -1;
+    }
+
+    // sets with no feature are skipped, as in class_psi_distance
+    navlcm_feature_list_t **keys = (navlcm_feature_list_t**)malloc(n*sizeof(navlcm_feature_list_t*));
+    int *pos = (int*)malloc(n*sizeof(int));
+    int nkeys = 0;
+    for (int k=0;k<n;k++) {
+        if (f1[k]->num == 0) {
+            dbg (DBG_ERROR, "matching zero features.");
+            continue;
+        }
+        keys[nkeys] = f1[k];
+        pos[nkeys] = k;
+        nkeys++;
+    }
+
+    // compute feature matches
+    navlcm_feature_match_set_t **matches = (navlcm_feature_match_set_t**)malloc(MAX (1, nkeys)*sizeof(navlcm_feature_match_set_t*));
+    for (int k=0;k<nkeys;k++)
+        matches[k] = (navlcm_feature_match_set_t*)malloc(sizeof(navlcm_feature_match_set_t));
+    if (nkeys > 0) {
+        int matching_mode = keys[0]->feature_type == NAVLCM_FEATURES_PARAM_T_FAST ? MATCHING_NCC : MATCHING_DOTPROD;
+        if (g_psi_ann && matching_mode == MATCHING_DOTPROD)
+            matching_mode = MATCHING_ANN;
+        // keep the pairs of this batch in the cache until the next frame
+        matcher_cache_reserve (nkeys);
+        // (the approximate search runs its own threads)
+        GThreadPool *pool = nkeys > 1 && matching_mode != MATCHING_ANN ? class_psi_pool () : NULL;
+        if (pool)
+            class_psi_match_parallel (pool, keys, nkeys, f2, matching_mode, matches);
+        else
+            find_feature_matches_batch_cached (keys, nkeys, f2, TRUE, TRUE, TRUE, TRUE, .8, -1, matching_mode, matches);
+    }
+
+    FILE *fp = fopen ("matching-rate.txt", "a");
+
+    for (int k=0;k<nkeys;k++) {
+        navlcm_feature_match_set_t *m = matches[k];
+        navlcm_feature_list_t *f = keys[k];
+
+        nmatches[pos[k]] = m->num;
+
+        if (m->num == 0) {
+            dbg (DBG_ERROR, "warning: no matches.");
+        } else {
+            dbg (DBG_CLASS, "%d/%d --> %d matches.", f->num, f2->num, m->num);
+            if (fp)
+                fprintf (fp, "%.4f\n", 100.0 * (m->num) / ((f->num + f2->num)/2));
+            psi_dist[pos[k]] = class_psi_distance_from_matches (f, f2, m);
+        }
+
+        // free matches
+        navlcm_feature_match_set_t_destroy (m);
+    }
+
+    if (fp)
+        fclose (fp);
+
+    free (matches);
+    free (keys);
+    free (pos);
+
+    return 0;
 }
 
 /* compute the phi-distance between two feature sets
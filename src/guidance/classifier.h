@@ -60,6 +60,8 @@ void class_imu_validation (GQueue *feature_list, GQueue *upward_image_queue, GQu
 void lr3_calib_to_matrix ();
 int applanix_delta (GQueue *data, int64_t utime1, int64_t utime2, double *delta_deg);
 double class_psi_distance (navlcm_feature_list_t *f1, navlcm_feature_list_t *f2, lcm_t *lcm);
+int class_psi_distance_batch (navlcm_feature_list_t **f1, int n, navlcm_feature_list_t *f2, int *nmatches, double *psi_dist);
+void class_set_psi_ann (gboolean enable);
 double class_phi_distance (navlcm_feature_list_t *f1, navlcm_feature_list_t *f2);
 int class_read_calib (config_t *cfg);
 int class_write_calib (config_t *cfg, const char *filename);
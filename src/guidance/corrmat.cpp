@@ -1,5 +1,10 @@
 #include "corrmat.h"
 
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 /* Smith & Waterman algorithm described in
  * Ho & Newman, Detecting Loop Closure with Scene Sequences, IJCV’07
  *
@@ -721,3 +726,1255 @@ double *dictionary_to_corrmat (const navlcm_dictionary_t *dict, int *size)
     return mat;
 }
 
+
+////////////////////////////////////////////////////////////////////////////////////
+// growable similarity matrix
+//
+
+corrmat_t *corrmat_t_new (int mode, int width)
+{
+    assert (mode == CORRMAT_DENSE || width > 0 || (mode == CORRMAT_TOPK && width == 0));
+
+    corrmat_t *m = (corrmat_t*)calloc (1, sizeof(corrmat_t));
+    m->mode = mode;
+    m->width = width;
+    m->capacity = 1024;
+    m->val = (float*)malloc (m->capacity * sizeof(float));
+    if (mode == CORRMAT_TOPK)
+        m->col = (int*)malloc (m->capacity * sizeof(int));
+
+    return m;
+}
+
+void corrmat_t_destroy (corrmat_t *m)
+{
+    if (!m)
+        return;
+
+    free (m->off);
+    free (m->len);
+    free (m->first);
+    free (m->coff);
+    if (m->map) {
+        munmap (m->map, m->map_size);
+    } else {
+        free (m->val);
+        free (m->col);
+    }
+    free (m);
+}
+
+static void corrmat_t_reserve (corrmat_t *m, size_t extra)
+{
+    if (m->num + extra <= m->capacity)
+        return;
+
+    while (m->num + extra > m->capacity)
+        m->capacity *= 2;
+
+    m->val = (float*)realloc (m->val, m->capacity * sizeof(float));
+    if (m->col)
+        m->col = (int*)realloc (m->col, m->capacity * sizeof(int));
+}
+
+/* add <count> empty rows (and columns)
+ */
+void corrmat_t_add_rows (corrmat_t *m, int count)
+{
+    assert (!m->map);
+
+    if (m->n + count > m->rows_capacity) {
+        m->rows_capacity = MAX (64, MAX (m->n + count, 2 * m->rows_capacity));
+        m->off = (size_t*)realloc (m->off, m->rows_capacity * sizeof(size_t));
+        m->len = (int*)realloc (m->len, m->rows_capacity * sizeof(int));
+        m->first = (int*)realloc (m->first, m->rows_capacity * sizeof(int));
+    }
+
+    for (int i=m->n;i<m->n+count;i++) {
+        m->off[i] = m->num;
+        m->len[i] = 0;
+        m->first[i] = 0;
+    }
+
+    m->n += count;
+}
+
+static int corrmat_t_topk_comp (const void *a, const void *b, void *data)
+{
+    const float *vals = (const float*)data;
+    float va = vals[*(const int*)a];
+    float vb = vals[*(const int*)b];
+    if (va > vb) return -1;
+    if (va < vb) return 1;
+    return *(const int*)a - *(const int*)b;
+}
+
+static int corrmat_t_int_comp (const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/* positions of the <k> largest of the <len> values <vals>, in increasing order, in
+ * <keep> (<len> entries). Returns their number.
+ */
+int corrmat_t_top_k (const float *vals, int len, int k, int *keep)
+{
+    for (int p=0;p<len;p++)
+        keep[p] = p;
+
+    if (len <= k)
+        return len;
+
+    qsort_r (keep, len, sizeof(int), corrmat_t_topk_comp, (void*)vals);
+    qsort (keep, k, sizeof(int), corrmat_t_int_comp);
+
+    return k;
+}
+
+/* store the sparse row <cols>, <vals> (sorted by column) as row i, keeping the
+ * <width> largest entries if the matrix has a width
+ */
+void corrmat_t_set_row (corrmat_t *m, int i, const int *cols, const float *vals, int len)
+{
+    assert (m->mode == CORRMAT_TOPK);
+    assert (0 <= i && i < m->n && m->len[i] == 0);
+
+    int *keep = NULL;
+    if (m->width > 0 && len > m->width) {
+        keep = (int*)malloc (len * sizeof(int));
+        len = corrmat_t_top_k (vals, len, m->width, keep);
+    }
+
+    corrmat_t_reserve (m, len);
+
+    m->off[i] = m->num;
+    m->len[i] = len;
+    for (int k=0;k<len;k++) {
+        int s = keep ? keep[k] : k;
+        assert (k == 0 || cols[s] > m->col[m->num-1]);
+        m->col[m->num] = cols[s];
+        m->val[m->num] = vals[s];
+        m->num++;
+    }
+
+    free (keep);
+}
+
+/* append row <n> from the dense vector <row> (columns 0..len-1, len <= n+1)
+ */
+void corrmat_t_append_row (corrmat_t *m, const double *row, int len)
+{
+    int i = m->n;
+    assert (len <= i + 1);
+
+    corrmat_t_add_rows (m, 1);
+
+    if (m->mode == CORRMAT_TOPK) {
+        int *cols = (int*)malloc (MAX (1, len) * sizeof(int));
+        float *vals = (float*)malloc (MAX (1, len) * sizeof(float));
+        int nz = 0;
+        for (int j=0;j<len;j++) {
+            if (row[j] == .0)
+                continue;
+            cols[nz] = j;
+            vals[nz] = row[j];
+            nz++;
+        }
+        corrmat_t_set_row (m, i, cols, vals, nz);
+        free (cols);
+        free (vals);
+        return;
+    }
+
+    int first = m->mode == CORRMAT_BAND ? MAX (0, len - m->width) : 0;
+
+    corrmat_t_reserve (m, len - first);
+
+    m->off[i] = m->num;
+    m->first[i] = first;
+    m->len[i] = len - first;
+    for (int j=first;j<len;j++)
+        m->val[m->num++] = row[j];
+}
+
+/* heap memory (a mapped matrix only holds its row index)
+ */
+size_t corrmat_t_memory (corrmat_t *m)
+{
+    size_t rows = m->rows_capacity * (sizeof(size_t) + 2 * sizeof(int) + (m->coff ? sizeof(size_t) : 0));
+    if (m->map)
+        return sizeof(corrmat_t) + rows;
+    return sizeof(corrmat_t) + m->capacity * (sizeof(float) + (m->col ? sizeof(int) : 0)) + rows;
+}
+
+double corrmat_t_max (corrmat_t *m)
+{
+    double maxval = .0;
+    for (int i=0;i<m->n;i++) {
+        const float *v = m->val + m->off[i];
+        for (int k=0;k<m->len[i];k++)
+            maxval = fmax (maxval, v[k]);
+    }
+
+    return maxval;
+}
+
+/* write as a dense text matrix (same format as corrmat_write)
+ */
+void corrmat_t_write (corrmat_t *m, const char *filename)
+{
+    FILE *fp = fopen (filename, "w");
+    if (!fp) {
+        dbg (DBG_ERROR, "failed to open %s in write mode.", filename);
+        return;
+    }
+
+    dbg (DBG_CLASS, "writing corr. matrix %d x %d to file %s", m->n, m->n, filename);
+
+    double *row = (double*)malloc (MAX (1, m->n) * sizeof(double));
+
+    for (int i=0;i<m->n;i++) {
+        const int *cols;
+        const float *vals;
+        int first;
+        int len = corrmat_t_row (m, i, &cols, &vals, &first);
+
+        for (int j=0;j<m->n;j++)
+            row[j] = .0;
+        for (int k=0;k<len;k++)
+            row[cols ? cols[k] : first + k] = vals[k];
+
+        for (int j=0;j<m->n;j++)
+            fprintf (fp, "%f ", row[j]);
+        fprintf (fp, "\n");
+    }
+
+    free (row);
+    fclose (fp);
+}
+
+/* lower triangle of a dense matrix
+ */
+corrmat_t *corrmat_t_from_dense (double *mat, int n, int mode, int width)
+{
+    corrmat_t *m = corrmat_t_new (mode, width);
+
+    for (int i=0;i<n;i++)
+        corrmat_t_append_row (m, mat + i*n, i+1);
+
+    return m;
+}
+
+/* read a text matrix, or map a binary one (which keeps its own mode and width)
+ */
+corrmat_t *corrmat_t_read (const char *filename, int mode, int width)
+{
+    if (corrmat_t_is_binary (filename))
+        return corrmat_t_map (filename, FALSE);
+
+    int n;
+    double *mat = corrmat_read (filename, &n);
+    if (!mat)
+        return NULL;
+
+    corrmat_t *m = corrmat_t_from_dense (mat, n, mode, width);
+    free (mat);
+
+    return m;
+}
+
+static uint64_t corrmat_fnv1a (uint64_t h, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    for (size_t k=0;k<size;k++) {
+        h ^= p[k];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static gboolean corrmat_file_header_valid (const corrmat_file_header_t *hdr)
+{
+    return strncmp (hdr->magic, CORRMAT_FILE_MAGIC, 8) == 0 && hdr->version == CORRMAT_FILE_VERSION &&
+        hdr->dtype == CORRMAT_FILE_FLOAT32 && hdr->n >= 0;
+}
+
+gboolean corrmat_t_is_binary (const char *filename)
+{
+    FILE *fp = fopen (filename, "rb");
+    if (!fp)
+        return FALSE;
+
+    corrmat_file_header_t hdr;
+    gboolean ok = fread (&hdr, sizeof(hdr), 1, fp) == 1 && corrmat_file_header_valid (&hdr);
+    fclose (fp);
+
+    return ok;
+}
+
+/* checksum of row <i> as it is written to file, starting from <h>
+ */
+static uint64_t corrmat_t_row_checksum (corrmat_t *m, int i, uint64_t h)
+{
+    const int *cols;
+    const float *vals;
+    int32_t rec[2];
+    rec[0] = corrmat_t_row (m, i, &cols, &vals, rec + 1);
+
+    h = corrmat_fnv1a (h, rec, sizeof(rec));
+    h = corrmat_fnv1a (h, vals, rec[0] * sizeof(float));
+    if (cols)
+        h = corrmat_fnv1a (h, cols, rec[0] * sizeof(int32_t));
+
+    return h;
+}
+
+/* append rows <start>..n-1 to <fp>, at the current position
+ */
+static int corrmat_t_write_rows (corrmat_t *m, FILE *fp, int start, corrmat_file_header_t *hdr)
+{
+    for (int i=start;i<m->n;i++) {
+        const int *cols;
+        const float *vals;
+        int32_t rec[2];
+        rec[0] = corrmat_t_row (m, i, &cols, &vals, rec + 1);
+
+        if (fwrite (rec, sizeof(int32_t), 2, fp) != 2 ||
+            fwrite (vals, sizeof(float), rec[0], fp) != (size_t)rec[0] ||
+            (cols && fwrite (cols, sizeof(int32_t), rec[0], fp) != (size_t)rec[0]))
+            return -1;
+
+        hdr->checksum = corrmat_t_row_checksum (m, i, hdr->checksum);
+        hdr->bytes += sizeof(rec) + rec[0] * (sizeof(float) + (cols ? sizeof(int32_t) : 0));
+        hdr->num += rec[0];
+        hdr->n++;
+    }
+
+    return 0;
+}
+
+/* whether the file described by <hdr> holds the first rows of <m>: the checksum of
+ * rows 0..hdr.n-1 in memory is compared with the one of the file.
+ */
+static gboolean corrmat_t_same_rows (corrmat_t *m, const corrmat_file_header_t *hdr)
+{
+    if (hdr->mode != m->mode || hdr->width != m->width || hdr->n > m->n)
+        return FALSE;
+
+    uint64_t h = 14695981039346656037ULL;
+    for (int i=0;i<hdr->n;i++)
+        h = corrmat_t_row_checksum (m, i, h);
+
+    return h == hdr->checksum;
+}
+
+/* save in binary format. If <filename> holds the first rows of the same matrix (same
+ * checksum), only the new rows are written; otherwise, the file is rewritten.
+ * Returns 0 on success.
+ */
+int corrmat_t_save (corrmat_t *m, const char *filename)
+{
+    corrmat_file_header_t hdr;
+    int start = 0;
+
+    FILE *fp = fopen (filename, "r+b");
+    if (fp) {
+        struct stat st;
+        if (fread (&hdr, sizeof(hdr), 1, fp) == 1 && corrmat_file_header_valid (&hdr) &&
+            fstat (fileno (fp), &st) == 0 && st.st_size == (off_t)(sizeof(hdr) + hdr.bytes) &&
+            corrmat_t_same_rows (m, &hdr)) {
+            start = hdr.n;
+        } else {
+            fclose (fp);
+            fp = NULL;
+        }
+    }
+
+    if (!fp) {
+        fp = fopen (filename, "w+b");
+        if (!fp) {
+            dbg (DBG_ERROR, "failed to open %s in write mode.", filename);
+            return -1;
+        }
+        memset (&hdr, 0, sizeof(hdr));
+        strncpy (hdr.magic, CORRMAT_FILE_MAGIC, 8);
+        hdr.version = CORRMAT_FILE_VERSION;
+        hdr.dtype = CORRMAT_FILE_FLOAT32;
+        hdr.mode = m->mode;
+        hdr.width = m->width;
+        hdr.checksum = 14695981039346656037ULL;
+    }
+
+    int status = fseeko (fp, sizeof(hdr) + hdr.bytes, SEEK_SET) == 0 ? corrmat_t_write_rows (m, fp, start, &hdr) : -1;
+
+    // the header goes last, so that a failed append leaves the previous rows valid
+    if (status == 0) {
+        fflush (fp);
+        if (fseeko (fp, 0, SEEK_SET) != 0 || fwrite (&hdr, sizeof(hdr), 1, fp) != 1)
+            status = -1;
+    }
+
+    fclose (fp);
+
+    if (status) {
+        dbg (DBG_ERROR, "failed to write corr. matrix to %s", filename);
+    } else {
+        dbg (DBG_CLASS, "saved corr. matrix %d x %d to %s (%d new rows)", m->n, m->n, filename, m->n - start);
+    }
+
+    return status;
+}
+
+/* map a binary file read-only. With <verify>, the checksum of the rows is checked
+ * (this reads the whole file).
+ */
+corrmat_t *corrmat_t_map (const char *filename, gboolean verify)
+{
+    int fd = open (filename, O_RDONLY);
+    if (fd < 0) {
+        dbg (DBG_ERROR, "failed to open %s", filename);
+        return NULL;
+    }
+
+    struct stat st;
+    corrmat_file_header_t hdr;
+    if (fstat (fd, &st) != 0 || read (fd, &hdr, sizeof(hdr)) != sizeof(hdr) || !corrmat_file_header_valid (&hdr) ||
+        st.st_size < (off_t)(sizeof(hdr) + hdr.bytes)) {
+        dbg (DBG_ERROR, "%s is not a valid corr. matrix file", filename);
+        close (fd);
+        return NULL;
+    }
+
+    size_t size = sizeof(hdr) + hdr.bytes;
+    void *map = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        dbg (DBG_ERROR, "failed to map %s", filename);
+        return NULL;
+    }
+
+    corrmat_t *m = (corrmat_t*)calloc (1, sizeof(corrmat_t));
+    m->mode = hdr.mode;
+    m->width = hdr.width;
+    m->map = map;
+    m->map_size = size;
+    m->val = (float*)map;
+    m->col = hdr.mode == CORRMAT_TOPK ? (int*)map : NULL;
+    m->num = hdr.num;
+    m->capacity = hdr.num;
+    m->rows_capacity = MAX (1, hdr.n);
+    m->off = (size_t*)malloc (m->rows_capacity * sizeof(size_t));
+    m->len = (int*)malloc (m->rows_capacity * sizeof(int));
+    m->first = (int*)malloc (m->rows_capacity * sizeof(int));
+    if (m->col)
+        m->coff = (size_t*)malloc (m->rows_capacity * sizeof(size_t));
+
+    // row index, in 4-byte words from the start of the file
+    const int32_t *words = (const int32_t*)map;
+    size_t end = size / 4;
+    size_t pos = sizeof(hdr) / 4;
+    gboolean ok = TRUE;
+
+    for (int i=0;i<hdr.n && ok;i++) {
+        if (pos + 2 > end) {
+            ok = FALSE;
+            break;
+        }
+        int len = words[pos];
+        m->len[i] = len;
+        m->first[i] = words[pos+1];
+        m->off[i] = pos + 2;
+        if (m->coff)
+            m->coff[i] = pos + 2 + len;
+        pos += 2 + len * (m->col ? 2 : 1);
+        ok = len >= 0 && pos <= end;
+        m->n = i + 1;
+    }
+
+    if (ok && verify) {
+        uint64_t h = corrmat_fnv1a (14695981039346656037ULL, (const char*)map + sizeof(hdr), hdr.bytes);
+        ok = h == hdr.checksum;
+    }
+
+    if (!ok || pos != end) {
+        dbg (DBG_ERROR, "corrupted corr. matrix file %s", filename);
+        corrmat_t_destroy (m);
+        return NULL;
+    }
+
+    dbg (DBG_CLASS, "mapped corr. matrix %d x %d from %s", m->n, m->n, filename);
+
+    return m;
+}
+
+navlcm_dictionary_t * corrmat_t_to_dictionary (corrmat_t *m)
+{
+    int size = m->n;
+    navlcm_dictionary_t* dict = (navlcm_dictionary_t*)malloc(sizeof(navlcm_dictionary_t));
+    dict->num = size*size;
+    dict->keys = (char**)malloc(size*size*sizeof(char*));
+    dict->vals = (char**)malloc(size*size*sizeof(char*));
+
+    for (int i=0;i<size;i++) {
+        for (int j=0;j<size;j++) {
+            char c[10];
+            sprintf (c, "%.5f", corrmat_t_get (m, i, j));
+            dict->keys[i*size+j] = strdup (c);
+            dict->vals[i*size+j] = strdup (c);
+        }
+    }
+
+    return dict;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// sparse alignment
+//
+
+/* value of the similarity matrix with the band |i-j| < diagn... around the diagonal
+ * set to zero (columns i-diagn to i+diagn-1, as in loop.cpp)
+ */
+static inline double corrmat_t_masked (corrmat_t *m, int i, int j, int diagn)
+{
+    if (diagn > 0 && i - diagn <= j && j < i + diagn)
+        return .0;
+    return corrmat_t_get (m, i, j);
+}
+
+/* value at (i,j) of the matrix convolved with <kern> (same as corrmat_convolve: the
+ * border keeps its value)
+ */
+static double corrmat_t_convolve_at (corrmat_t *m, int i, int j, double *kern, int ksize, double ksum, int diagn)
+{
+    int r = ksize/2;
+
+    if (i < r || j < r || m->n - r <= i || m->n - r <= j)
+        return corrmat_t_masked (m, i, j, diagn);
+
+    double v = .0;
+    for (int ii=0;ii<ksize;ii++)
+        for (int jj=0;jj<ksize;jj++)
+            v += kern[ii*ksize+jj] * corrmat_t_masked (m, i+ii-r, j+jj-r, diagn);
+
+    return v / ksum;
+}
+
+/* columns of row i, below <jmax>, that may be non-zero after a convolution of half-size
+ * r: the non-zero columns of rows i-r..i+r, dilated by r. Returns their number.
+ */
+static int corrmat_t_candidates (corrmat_t *m, int i, int r, int jmax, int **buf, int *bufsize)
+{
+    int num = 0;
+
+    for (int ii=MAX (0, i-r);ii<=MIN (m->n-1, i+r);ii++) {
+        const int *cols;
+        const float *vals;
+        int first;
+        int len = corrmat_t_row (m, ii, &cols, &vals, &first);
+
+        for (int k=0;k<len;k++) {
+            if (vals[k] == .0)
+                continue;
+            int c = cols ? cols[k] : first + k;
+            for (int jj=MAX (0, c-r);jj<=MIN (jmax-1, c+r);jj++) {
+                if (num == *bufsize) {
+                    *bufsize = MAX (256, 2 * *bufsize);
+                    *buf = (int*)realloc (*buf, *bufsize * sizeof(int));
+                }
+                (*buf)[num++] = jj;
+            }
+        }
+    }
+
+    qsort (*buf, num, sizeof(int), corrmat_t_int_comp);
+
+    int nu = 0;
+    for (int k=0;k<num;k++)
+        if (nu == 0 || (*buf)[nu-1] != (*buf)[k])
+            (*buf)[nu++] = (*buf)[k];
+
+    return nu;
+}
+
+/* convolved similarity of the rows of a job, above the threshold
+ */
+typedef struct {
+    corrmat_t *corrmat;
+    double *kern;
+    int ksize;
+    int diagn;
+    double thresh;
+    int start, step;        // rows start, start + step, ...
+    int **cols;             // per row: columns and values of the cells above threshold
+    double **vals;
+    int *len;
+} corrmat_conv_job_t;
+
+/* the cells of row i (below the diagonal) of the similarity matrix convolved with
+ * <kern>, with the band of half-width <diagn> around the diagonal set to zero first,
+ * that are above <thresh>. <cols> and <vals> are allocated. Returns their number.
+ */
+int corrmat_t_convolve_row (corrmat_t *m, int i, double *kern, int ksize, int diagn, double thresh, int **cols, double **vals)
+{
+    int r = ksize/2;
+    double ksum = .0;
+    for (int k=0;k<ksize*ksize;k++)
+        ksum += fabs (kern[k]);
+
+    int bufsize = 0;
+    int *buf = NULL;
+    int ncand = corrmat_t_candidates (m, i, r, i, &buf, &bufsize);
+
+    *cols = (int*)malloc (MAX (1, ncand) * sizeof(int));
+    *vals = (double*)malloc (MAX (1, ncand) * sizeof(double));
+    int len = 0;
+
+    for (int c=0;c<ncand;c++) {
+        double v = corrmat_t_convolve_at (m, i, buf[c], kern, ksize, ksum, diagn);
+        if (v < thresh)
+            continue;
+        (*cols)[len] = buf[c];
+        (*vals)[len] = v;
+        len++;
+    }
+
+    free (buf);
+
+    return len;
+}
+
+/* one row of the alignment recurrence. <cols> and <v> are the convolved row, <pcols>
+ * and <ph> the previous row of the alignment matrix (NULL for the first row); <h> and
+ * <ind> receive the scores and directions. The cell (i,j) extends (i-1,j-1), (i,j-1)
+ * or (i-1,j); if <mirror>, the cells are visited from the right and (i,j) extends
+ * (i-1,j+1), (i,j+1) or (i-1,j) instead.
+ */
+void corrmat_t_align_row (const int *pcols, const double *ph, int plen, const int *cols, const double *v, int len, double delta, gboolean mirror, double *h, float *ind)
+{
+    int step = mirror ? -1 : 1;
+    int p = mirror ? plen-1 : 0;
+
+    for (int c=mirror ? len-1 : 0;0 <= c && c < len;c+=step) {
+        int j = cols[c];
+
+        if (!pcols || j == 0) {
+            h[c] = v[c];
+            ind[c] = 1;
+            continue;
+        }
+
+        // h(i-1,j-step) and h(i-1,j): the columns of both rows are increasing
+        double h1 = .0, h3 = .0;
+        if (!mirror) {
+            while (p < plen && pcols[p] < j-1)
+                p++;
+            int q = p;
+            if (q < plen && pcols[q] == j-1)
+                h1 = ph[q++];
+            if (q < plen && pcols[q] == j)
+                h3 = ph[q];
+        } else {
+            while (0 <= p && pcols[p] > j+1)
+                p--;
+            int q = p;
+            if (0 <= q && pcols[q] == j+1)
+                h1 = ph[q--];
+            if (0 <= q && pcols[q] == j)
+                h3 = ph[q];
+        }
+        int c2 = c - step;
+        double h2 = 0 <= c2 && c2 < len && cols[c2] == j-step ? h[c2] : .0;
+
+        if (h2 > fmax (h1,h3)) {
+            h[c] = h2 + v[c] - delta;
+            ind[c] = 2;
+        } else if (h3 > fmax (h1,h2)) {
+            h[c] = h3 + v[c] - delta;
+            ind[c] = 3;
+        } else {
+            h[c] = h1 + v[c];
+            ind[c] = 1;
+        }
+    }
+}
+
+static gpointer corrmat_conv_job_cb (gpointer data)
+{
+    corrmat_conv_job_t *job = (corrmat_conv_job_t*)data;
+
+    for (int i=job->start;i<job->corrmat->n;i+=job->step)
+        job->len[i] = corrmat_t_convolve_row (job->corrmat, i, job->kern, job->ksize, job->diagn, job->thresh, job->cols + i, job->vals + i);
+
+    return NULL;
+}
+
+/* Smith & Waterman alignment matrix of the similarity matrix convolved with <kern>,
+ * with the band of half-width <diagn> around the diagonal set to zero first. Same as
+ * corrmat_convolve + corrmat_compute_alignment_matrix (+ corrmat_reverse for <rev>),
+ * but only the cells whose convolved similarity is above <thresh> are visited and
+ * stored: the others have a zero score. The reverse alignment runs from the last row
+ * up and is returned in the original row order.
+ *
+ * The convolution, which is most of the work, is split across <nthreads> threads
+ * (<= 0 for one per processor), rows dealt round-robin since row i has up to i cells.
+ * The recurrence then walks the sparse rows in order, merging each row with the
+ * previous one. The result does not depend on the number of threads.
+ */
+void corrmat_t_compute_alignment_matrix (corrmat_t *corrmat, double *kern, int ksize, int diagn, double thresh, double delta, gboolean rev, int nthreads, corrmat_t **hout, corrmat_t **hindout)
+{
+    assert (thresh > .0);
+
+    int n = corrmat->n;
+
+    if (nthreads <= 0)
+        nthreads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+    nthreads = MAX (1, MIN (nthreads, n / 64));
+
+    // convolved rows
+    int **vcols = (int**)malloc (MAX (1, n) * sizeof(int*));
+    double **vvals = (double**)malloc (MAX (1, n) * sizeof(double*));
+    int *vlen = (int*)malloc (MAX (1, n) * sizeof(int));
+
+    corrmat_conv_job_t *jobs = (corrmat_conv_job_t*)malloc (nthreads * sizeof(corrmat_conv_job_t));
+    GThread **threads = (GThread**)malloc (nthreads * sizeof(GThread*));
+
+    for (int t=0;t<nthreads;t++) {
+        corrmat_conv_job_t *job = jobs + t;
+        job->corrmat = corrmat;
+        job->kern = kern;
+        job->ksize = ksize;
+        job->diagn = rev ? 0 : diagn;
+        job->thresh = thresh;
+        job->start = t;
+        job->step = nthreads;
+        job->cols = vcols;
+        job->vals = vvals;
+        job->len = vlen;
+    }
+
+    // the calling thread takes the first chunk
+    for (int t=1;t<nthreads;t++)
+        threads[t] = g_thread_create (corrmat_conv_job_cb, jobs + t, TRUE, NULL);
+
+    corrmat_conv_job_cb (jobs);
+
+    for (int t=1;t<nthreads;t++)
+        g_thread_join (threads[t]);
+
+    free (threads);
+    free (jobs);
+
+    // alignment
+    corrmat_t *h = corrmat_t_new (CORRMAT_TOPK, 0);
+    corrmat_t *hind = corrmat_t_new (CORRMAT_TOPK, 0);
+    corrmat_t_add_rows (h, n);
+    corrmat_t_add_rows (hind, n);
+
+    // previous and current rows of the alignment matrix
+    double *ph = (double*)malloc (MAX (1, n) * sizeof(double));
+    double *ch = (double*)malloc (MAX (1, n) * sizeof(double));
+    float *fh = (float*)malloc (MAX (1, n) * sizeof(float));
+    float *find = (float*)malloc (MAX (1, n) * sizeof(float));
+    const int *pcols = NULL;
+    int plen = 0;
+
+    for (int k=0;k<n;k++) {
+        int i = rev ? n-1-k : k;
+        const int *cols = vcols[i];
+        int len = vlen[i];
+
+        corrmat_t_align_row (k == 0 ? NULL : pcols, ph, plen, cols, vvals[i], len, delta, FALSE, ch, find);
+        for (int c=0;c<len;c++)
+            fh[c] = ch[c];
+
+        corrmat_t_set_row (h, i, cols, fh, len);
+        corrmat_t_set_row (hind, i, cols, find, len);
+
+        double *th = ph; ph = ch; ch = th;
+        pcols = cols;
+        plen = len;
+    }
+
+    for (int i=0;i<n;i++) {
+        free (vcols[i]);
+        free (vvals[i]);
+    }
+    free (vcols);
+    free (vvals);
+    free (vlen);
+    free (ph);
+    free (ch);
+    free (fh);
+    free (find);
+
+    *hout = h;
+    *hindout = hind;
+}
+
+typedef struct {
+    corrmat_t *corrmat;
+    double *kern;
+    int ksize, diagn;
+    double thresh, delta;
+    gboolean rev;
+    int nthreads;
+    corrmat_t *h, *hind;
+} corrmat_align_job_t;
+
+static gpointer corrmat_align_job_cb (gpointer data)
+{
+    corrmat_align_job_t *job = (corrmat_align_job_t*)data;
+    corrmat_t_compute_alignment_matrix (job->corrmat, job->kern, job->ksize, job->diagn, job->thresh, job->delta, job->rev, job->nthreads, &job->h, &job->hind);
+    return NULL;
+}
+
+/* forward (<kern1>, diagonal band <diagn> set to zero) and reverse (<kern2>) alignment
+ * matrices, computed concurrently, each with half of the <nthreads> threads.
+ */
+void corrmat_t_compute_alignment_matrices (corrmat_t *corrmat, double *kern1, double *kern2, int ksize, int diagn, double thresh, double delta, int nthreads, corrmat_t **hmat, corrmat_t **hmatind, corrmat_t **hmatrev, corrmat_t **hmatindrev)
+{
+    if (nthreads <= 0)
+        nthreads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+
+    corrmat_align_job_t jobs[2];
+    for (int k=0;k<2;k++) {
+        corrmat_align_job_t *job = jobs + k;
+        job->corrmat = corrmat;
+        job->kern = k == 0 ? kern1 : kern2;
+        job->ksize = ksize;
+        job->diagn = k == 0 ? diagn : 0;
+        job->thresh = thresh;
+        job->delta = delta;
+        job->rev = k == 1;
+        job->nthreads = MAX (1, k == 0 ? nthreads - nthreads/2 : nthreads/2);
+    }
+
+    if (nthreads > 1) {
+        GThread *thread = g_thread_create (corrmat_align_job_cb, jobs + 1, TRUE, NULL);
+        corrmat_align_job_cb (jobs);
+        g_thread_join (thread);
+    } else {
+        corrmat_align_job_cb (jobs);
+        corrmat_align_job_cb (jobs + 1);
+    }
+
+    *hmat = jobs[0].h;
+    *hmatind = jobs[0].hind;
+    *hmatrev = jobs[1].h;
+    *hmatindrev = jobs[1].hind;
+}
+
+typedef struct {
+    float val;
+    int i, j;
+    gboolean visited;
+} corrmat_peak_t;
+
+static int corrmat_peak_comp (const void *a, const void *b, void *data)
+{
+    const corrmat_peak_t *peaks = (const corrmat_peak_t*)data;
+    const corrmat_peak_t *pa = peaks + *(const int*)a;
+    const corrmat_peak_t *pb = peaks + *(const int*)b;
+    if (pa->val > pb->val) return -1;
+    if (pa->val < pb->val) return 1;
+    return *(const int*)a - *(const int*)b;
+}
+
+/* local maxima of <h> above <thresh> (see corrmat_local_max), in row-major order.
+ * <order> receives their indices by decreasing value.
+ */
+static corrmat_peak_t *corrmat_t_local_maxima (corrmat_t *h, int radius, double thresh, int *npeaks, int **order)
+{
+    int capacity = 64;
+    int num = 0;
+    corrmat_peak_t *peaks = (corrmat_peak_t*)malloc (capacity * sizeof(corrmat_peak_t));
+
+    for (int i=0;i<h->n;i++) {
+        const int *cols;
+        const float *vals;
+        int first;
+        int len = corrmat_t_row (h, i, &cols, &vals, &first);
+
+        for (int k=0;k<len;k++) {
+            double v = vals[k];
+            int j = cols[k];
+            if (v < thresh || v <= 1E-6)
+                continue;
+
+            gboolean ismax = TRUE;
+            for (int ii=MAX (0, i-radius);ii<=MIN (h->n-1, i+radius) && ismax;ii++) {
+                const int *cols2;
+                const float *vals2;
+                int len2 = corrmat_t_row (h, ii, &cols2, &vals2, &first);
+                for (int kk=0;kk<len2;kk++) {
+                    if (cols2[kk] < j - radius) continue;
+                    if (cols2[kk] > j + radius) break;
+                    if (vals2[kk] > v + 1E-6) {
+                        ismax = FALSE;
+                        break;
+                    }
+                }
+            }
+            if (!ismax)
+                continue;
+
+            if (num == capacity) {
+                capacity *= 2;
+                peaks = (corrmat_peak_t*)realloc (peaks, capacity * sizeof(corrmat_peak_t));
+            }
+            peaks[num].val = v;
+            peaks[num].i = i;
+            peaks[num].j = j;
+            peaks[num].visited = FALSE;
+            num++;
+        }
+    }
+
+    *order = (int*)malloc (MAX (1, num) * sizeof(int));
+    for (int k=0;k<num;k++)
+        (*order)[k] = k;
+    qsort_r (*order, num, sizeof(int), corrmat_peak_comp, peaks);
+
+    *npeaks = num;
+    return peaks;
+}
+
+static void corrmat_peak_visit (corrmat_peak_t *peaks, int npeaks, int i, int j)
+{
+    int lo = 0, hi = npeaks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (peaks[mid].i < i || (peaks[mid].i == i && peaks[mid].j < j))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < npeaks && peaks[lo].i == i && peaks[lo].j == j)
+        peaks[lo].visited = TRUE;
+}
+
+/* same as corrmat_find_component_list, on sparse alignment matrices
+ */
+void corrmat_t_find_component_list (corrmat_t *hmat, corrmat_t *hmatind, corrmat_t *hmatrev, corrmat_t *hmatindrev, double alignment_threshold, double alignment_tail_thresh, int min_seq_length, int alignment_min_diag_distance, double alignment_max_slope_error, int alignment_search_radius, int alignment_min_node_id, GQueue *components)
+{
+    int n = hmat->n;
+
+    dbg (DBG_CLASS, "alignment threshold: %.5f  tail threshold: %.5f  min seq length: %d  min diag distance: %d  max slope error: %.4f",
+            alignment_threshold, alignment_tail_thresh, min_seq_length, alignment_min_diag_distance, alignment_max_slope_error);
+
+    // local maxima, forward and reverse
+    int npeaks[2], *order[2], next[2] = {0, 0};
+    corrmat_peak_t *peaks[2];
+    peaks[0] = corrmat_t_local_maxima (hmat, alignment_search_radius, alignment_threshold, npeaks, order);
+    peaks[1] = corrmat_t_local_maxima (hmatrev, alignment_search_radius, alignment_threshold, npeaks+1, order+1);
+
+    dbg (DBG_CLASS, "%d + %d local maxima", npeaks[0], npeaks[1]);
+
+    while (1) {
+
+        // next unvisited maximum, forward first
+        int r;
+        for (r=0;r<2;r++) {
+            while (next[r] < npeaks[r] && peaks[r][order[r][next[r]]].visited)
+                next[r]++;
+            if (next[r] < npeaks[r])
+                break;
+        }
+        if (r == 2)
+            break;
+
+        corrmat_peak_t *peak = peaks[r] + order[r][next[r]];
+        gboolean rev = r == 1;
+        corrmat_t *h = rev ? hmatrev : hmat;
+        corrmat_t *hind = rev ? hmatindrev : hmatind;
+
+        component_t *comp = component_t_new ();
+        comp->score = peak->val;
+        comp->reverse = rev;
+        peak->visited = TRUE;
+
+        // back-trace through matrix
+        int maxi = peak->i, maxj = peak->j;
+        while (1) {
+            if (maxi < 0 || maxj < 0 || n-1 < maxi || n-1 < maxj) break;
+            double val = corrmat_t_get (h, maxi, maxj);
+            int valind = (int)corrmat_t_get (hind, maxi, maxj);
+            if (valind == 0 || val < alignment_tail_thresh) break;
+            if (maxi > alignment_min_node_id || maxj > alignment_min_node_id) {
+                pair_int_t *p = (pair_int_t*)malloc(sizeof(pair_int_t));
+                p->key = maxi;
+                p->val = maxj;
+                g_queue_push_tail (comp->pt, p);
+            }
+
+            // mark as visited
+            corrmat_peak_visit (peaks[r], npeaks[r], maxi, maxj);
+
+            if (valind == 1) { if (rev) maxi++; else maxi--; maxj--; continue;}
+            if (valind == 2) { maxj--; continue;}
+            if (valind == 3) { if (rev) maxi++; else maxi--; continue;}
+        }
+
+        if (g_queue_get_length (comp->pt) < min_seq_length ||
+            !component_t_valid (comp, n, alignment_min_diag_distance, alignment_max_slope_error)) {
+            component_t_free (comp);
+            free (comp);
+            continue;
+        }
+
+        g_queue_push_tail (components, comp);
+    }
+
+    // sort components by decreasing score
+    g_queue_sort (components, component_t_cmp, NULL);
+    g_queue_reverse (components);
+
+    dbg (DBG_CLASS, "found %d components.", g_queue_get_length (components));
+
+    for (int r=0;r<2;r++) {
+        free (peaks[r]);
+        free (order[r]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// testing
+//
+
+/* random lower-triangular similarity matrix: strong near the diagonal, sparse noise,
+ * and a few forward and reverse sequences (loop closures)
+ */
+double *corrmat_random (int n, unsigned int *seed)
+{
+    double *m = corrmat_init (n, .0);
+
+    for (int i=0;i<n;i++) {
+        for (int j=MAX (0, i-4);j<=i;j++)
+            CORRMAT_SET (m, n, i, j, .2 + .1 * rand_r (seed) / RAND_MAX);
+        for (int j=0;j<i;j++)
+            if (rand_r (seed) % 50 == 0)
+                CORRMAT_SET (m, n, i, j, .02 * rand_r (seed) / RAND_MAX);
+    }
+
+    for (int s=0;s<4;s++) {
+        int len = 20 + rand_r (seed) % 30;
+        int i0 = n/2 + rand_r (seed) % (n/2 - len);
+        int j0 = rand_r (seed) % (n/2 - len);
+        gboolean rev = s % 2 == 1;
+        for (int k=0;k<len;k++) {
+            int i = i0 + k;
+            int j = rev ? j0 + len - 1 - k : j0 + k;
+            CORRMAT_SET (m, n, i, j, .05 + .05 * rand_r (seed) / RAND_MAX);
+        }
+    }
+
+    return m;
+}
+
+/* the dense pipeline of loop_extract_components_from_correlation_matrix
+ */
+static GQueue *corrmat_dense_components (double *corrmat, int size, double *kern1, double *kern2, int diagn)
+{
+    GQueue *components = g_queue_new ();
+    double *hmat = NULL, *hmatrev = NULL;
+    int *hmatind = NULL, *hmatindrev = NULL;
+
+    double *corrmatdup = corrmat_copy (corrmat, size);
+    double *corrmatrev = corrmat_copy (corrmatdup, size);
+
+    for (int i=0;i<size;i++) {
+        for (int j=0;j<2*diagn;j++) {
+            if (diagn <= i + j && i + j < size + diagn)
+                CORRMAT_SET (corrmatdup, size, i, i + j-diagn, .0);
+        }
+    }
+
+    corrmat_convolve (corrmatdup, size, kern1, 3);
+    corrmat_convolve (corrmatrev, size, kern2, 3);
+    corrmat_reverse (corrmatrev, size);
+
+    corrmat_compute_alignment_matrix (corrmatdup, size, .001, .0001, FALSE, &hmat, &hmatind);
+    corrmat_compute_alignment_matrix (corrmatrev, size, .001, .0001, TRUE, &hmatrev, &hmatindrev);
+    corrmat_reverse (hmatrev, size);
+    corrmat_int_reverse (hmatindrev, size);
+
+    corrmat_find_component_list (hmat, hmatind, hmatrev, hmatindrev, size, .1, .005, 2, 20, 25.0, 10, 0, components);
+
+    free (hmat);
+    free (hmatind);
+    free (hmatrev);
+    free (hmatindrev);
+    free (corrmatdup);
+    free (corrmatrev);
+
+    return components;
+}
+
+static gboolean corrmat_same_components (GQueue *c1, GQueue *c2)
+{
+    if (g_queue_get_length (c1) != g_queue_get_length (c2))
+        return FALSE;
+
+    for (GList *i1=g_queue_peek_head_link (c1), *i2=g_queue_peek_head_link (c2);i1 && i2;i1=i1->next, i2=i2->next) {
+        component_t *a = (component_t*)i1->data;
+        component_t *b = (component_t*)i2->data;
+        if (a->reverse != b->reverse || fabs (a->score - b->score) > 1E-4 * (1.0 + a->score))
+            return FALSE;
+        if (g_queue_get_length (a->pt) != g_queue_get_length (b->pt))
+            return FALSE;
+        for (GList *p1=g_queue_peek_head_link (a->pt), *p2=g_queue_peek_head_link (b->pt);p1 && p2;p1=p1->next, p2=p2->next) {
+            pair_int_t *pa = (pair_int_t*)p1->data;
+            pair_int_t *pb = (pair_int_t*)p2->data;
+            if (pa->key != pb->key || pa->val != pb->val)
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean corrmat_t_equal (corrmat_t *a, corrmat_t *b)
+{
+    if (a->n != b->n || a->num != b->num)
+        return FALSE;
+    for (int i=0;i<a->n;i++) {
+        if (a->len[i] != b->len[i] || a->first[i] != b->first[i])
+            return FALSE;
+        const int *ca, *cb;
+        const float *va, *vb;
+        int fa, fb;
+        int len = corrmat_t_row (a, i, &ca, &va, &fa);
+        corrmat_t_row (b, i, &cb, &vb, &fb);
+        if (memcmp (va, vb, len * sizeof(float)))
+            return FALSE;
+        if ((ca == NULL) != (cb == NULL) || (ca && memcmp (ca, cb, len * sizeof(int))))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void corrmat_free_components (GQueue *components)
+{
+    for (GList *iter=g_queue_peek_head_link (components);iter;iter=iter->next) {
+        component_t_free ((component_t*)iter->data);
+        free (iter->data);
+    }
+    g_queue_free (components);
+}
+
+/* check that the growable matrix stores what it is given, and that the sparse
+ * alignment finds the same components as the dense one, on <nruns> random <n> x <n>
+ * matrices. Returns the number of failed runs.
+ */
+int corrmat_unit_testing (int n, int nruns)
+{
+    int failed = 0;
+    unsigned int seed = 17;
+    double kern1[] = { 0, 1, 2, -1, 0, 1, -2, -1, 0};
+    double kern2[] = { -2, -1, 0, -1, 0, 1, 0, 1, 2};
+
+    for (int run=0;run<nruns;run++) {
+
+        double *dense = corrmat_random (n, &seed);
+        gboolean ok = TRUE;
+
+        corrmat_t *m[4];
+        m[0] = corrmat_t_from_dense (dense, n, CORRMAT_DENSE, 0);
+        m[1] = corrmat_t_from_dense (dense, n, CORRMAT_TOPK, 0);
+        m[2] = corrmat_t_from_dense (dense, n, CORRMAT_TOPK, 16);
+        m[3] = corrmat_t_from_dense (dense, n, CORRMAT_BAND, 8);
+
+        // storage
+        for (int i=0;i<n;i++) {
+            for (int j=0;j<=i;j++) {
+                float v = CORRMAT_GET (dense, n, i, j);
+                if (CORRMAT_T_GET (m[0], i, j) != v || CORRMAT_T_GET (m[1], i, j) != v)
+                    ok = FALSE;
+                if (j > i-8 && CORRMAT_T_GET (m[3], i, j) != v)
+                    ok = FALSE;
+                if (CORRMAT_T_GET (m[2], i, j) != .0 && CORRMAT_T_GET (m[2], i, j) != v)
+                    ok = FALSE;
+            }
+            if (m[2]->len[i] > 16)
+                ok = FALSE;
+        }
+
+        // binary file, written in two steps
+        for (int k=0;k<4;k++) {
+            const char *filename = "corrmat-test.bin";
+            unlink (filename);
+            corrmat_t *mk = corrmat_t_new (m[k]->mode, m[k]->width);
+            for (int i=0;i<n;i++) {
+                corrmat_t_append_row (mk, dense + i*n, i+1);
+                if (i == n/2 || i == n-1)
+                    corrmat_t_save (mk, filename);
+            }
+            corrmat_t *mm = corrmat_t_map (filename, TRUE);
+            if (!mm || !corrmat_t_equal (mm, m[k]) || corrmat_t_max (mm) != corrmat_t_max (m[k]))
+                ok = FALSE;
+            corrmat_t_destroy (mm);
+            corrmat_t_destroy (mk);
+
+            // a different, larger matrix saved to the same file replaces it
+            double *other = corrmat_random (n, &seed);
+            corrmat_t *ma = corrmat_t_new (m[k]->mode, m[k]->width);
+            for (int i=0;i<n/2;i++)
+                corrmat_t_append_row (ma, dense + i*n, i+1);
+            corrmat_t *mb = corrmat_t_from_dense (other, n, m[k]->mode, m[k]->width);
+            corrmat_t_save (ma, filename);
+            corrmat_t_save (mb, filename);
+            mm = corrmat_t_map (filename, TRUE);
+            if (!mm || !corrmat_t_equal (mm, mb))
+                ok = FALSE;
+            corrmat_t_destroy (mm);
+            corrmat_t_destroy (ma);
+            corrmat_t_destroy (mb);
+            free (other);
+            unlink (filename);
+        }
+
+        // components
+        GQueue *ref = corrmat_dense_components (dense, n, kern1, kern2, 10);
+
+        for (int k=0;k<2;k++) {
+            corrmat_t *hmat, *hmatind, *hmatrev, *hmatindrev;
+            corrmat_t_compute_alignment_matrices (m[k], kern1, kern2, 3, 10, .001, .0001, 4, &hmat, &hmatind, &hmatrev, &hmatindrev);
+
+            // same alignment in a single thread
+            corrmat_t *h1, *hind1;
+            corrmat_t_compute_alignment_matrix (m[k], kern2, 3, 0, .001, .0001, TRUE, 1, &h1, &hind1);
+            if (!corrmat_t_equal (h1, hmatrev) || !corrmat_t_equal (hind1, hmatindrev))
+                ok = FALSE;
+            corrmat_t_destroy (h1);
+            corrmat_t_destroy (hind1);
+
+            GQueue *components = g_queue_new ();
+            corrmat_t_find_component_list (hmat, hmatind, hmatrev, hmatindrev, .1, .005, 2, 20, 25.0, 10, 0, components);
+            if (!corrmat_same_components (ref, components))
+                ok = FALSE;
+            dbg (DBG_INFO, "[corrmat] run %d mode %d: %d components (%d dense), alignment %d + %d entries",
+                 run, m[k]->mode, g_queue_get_length (components), g_queue_get_length (ref), (int)hmat->num, (int)hmatrev->num);
+            corrmat_free_components (components);
+            corrmat_t_destroy (hmat);
+            corrmat_t_destroy (hmatind);
+            corrmat_t_destroy (hmatrev);
+            corrmat_t_destroy (hmatindrev);
+        }
+        corrmat_free_components (ref);
+
+        dbg (DBG_INFO, "[corrmat] %d x %d: dense %.1f MB, lower/float %.1f MB, top-16 %.1f MB, band-8 %.1f MB",
+             n, n, 1.0 * n * n * sizeof(double) / (1<<20), 1.0 * corrmat_t_memory (m[0]) / (1<<20),
+             1.0 * corrmat_t_memory (m[2]) / (1<<20), 1.0 * corrmat_t_memory (m[3]) / (1<<20));
+
+        for (int k=0;k<4;k++)
+            corrmat_t_destroy (m[k]);
+        free (dense);
+
+        if (!ok)
+            failed++;
+    }
+
+    dbg (DBG_INFO, "[corrmat] unit testing: failed %d / %d", failed, nruns);
+
+    return failed;
+}
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
+#include <unistd.h>
+#include <stdint.h>
 
 #include <glib.h>
 
@@ -16,6 +18,126 @@
 #define CORRMAT_SET(m, n, i, j, val) ((m)[(i)*(n)+(j)] = (val))
 #define CORRMAT_GET(m, n, i, j) ((m)[(i)*(n)+(j)])
 
+/* Similarity matrix grown one row at a time (row i holds the similarity of node i
+ * to nodes 0..i, the upper triangle is zero).
+ *
+ * Rows live in one float pool whose capacity doubles, so that appending a row costs
+ * the row itself and nothing is ever copied again. A row is either a contiguous range
+ * of columns (CORRMAT_DENSE: the whole lower triangle, CORRMAT_BAND: the last <width>
+ * columns up to the diagonal) or a list of (column, value) pairs sorted by column
+ * (CORRMAT_TOPK: the <width> largest entries of the row, or all the non-zero entries
+ * if width is 0). Entries that are not stored read as zero.
+ */
+#define CORRMAT_DENSE 0
+#define CORRMAT_BAND 1
+#define CORRMAT_TOPK 2
+
+#define CORRMAT_T_GET(m, i, j) corrmat_t_get ((m), (i), (j))
+
+typedef struct {
+    int n;                  // number of rows (and columns)
+    int mode;               // CORRMAT_DENSE, CORRMAT_BAND or CORRMAT_TOPK
+    int width;              // band width or number of entries per row
+    int rows_capacity;
+    size_t *off;            // first entry of row i in <val> (and <col>)
+    int *len;               // number of entries of row i
+    int *first;             // first column of row i (dense and band rows)
+    size_t num;             // number of entries
+    size_t capacity;
+    float *val;
+    int *col;               // column of each entry (CORRMAT_TOPK)
+    size_t *coff;           // first column of row i in <col>, if not <off> (mapped files)
+    void *map;              // mapped file, read-only, or NULL
+    size_t map_size;
+} corrmat_t;
+
+/* Binary file: a 64-byte header (corrmat_file_header_t) followed by one record per
+ * row: its length and first column (int32), the values (float32) and, for
+ * CORRMAT_TOPK, the columns (int32). Native byte order.
+ *
+ * Rows never change once appended, so corrmat_t_save appends the new rows to an
+ * existing file and rewrites the header only. corrmat_t_map maps a file read-only:
+ * only the row index is built, the values stay in the page cache. The checksum is
+ * a 64-bit FNV-1a of the records, continued as rows are appended.
+ */
+#define CORRMAT_FILE_MAGIC "CORRMAT"
+#define CORRMAT_FILE_VERSION 1
+#define CORRMAT_FILE_FLOAT32 1
+
+typedef struct {
+    char magic[8];
+    int32_t version;
+    int32_t dtype;          // CORRMAT_FILE_FLOAT32
+    int32_t mode;           // CORRMAT_DENSE, CORRMAT_BAND or CORRMAT_TOPK
+    int32_t width;
+    int64_t n;              // number of rows
+    int64_t num;            // number of entries
+    int64_t bytes;          // size of the row records
+    uint64_t checksum;
+    char reserved[8];
+} corrmat_file_header_t;
+
+corrmat_t *corrmat_t_new (int mode, int width);
+void corrmat_t_destroy (corrmat_t *m);
+void corrmat_t_add_rows (corrmat_t *m, int count);
+void corrmat_t_append_row (corrmat_t *m, const double *row, int len);
+void corrmat_t_set_row (corrmat_t *m, int i, const int *cols, const float *vals, int len);
+int corrmat_t_top_k (const float *vals, int len, int k, int *keep);
+size_t corrmat_t_memory (corrmat_t *m);
+double corrmat_t_max (corrmat_t *m);
+void corrmat_t_write (corrmat_t *m, const char *filename);
+corrmat_t *corrmat_t_read (const char *filename, int mode, int width);
+int corrmat_t_save (corrmat_t *m, const char *filename);
+corrmat_t *corrmat_t_map (const char *filename, gboolean verify);
+gboolean corrmat_t_is_binary (const char *filename);
+corrmat_t *corrmat_t_from_dense (double *mat, int n, int mode, int width);
+navlcm_dictionary_t * corrmat_t_to_dictionary (corrmat_t *m);
+
+void corrmat_t_compute_alignment_matrix (corrmat_t *corrmat, double *kern, int ksize, int diagn, double thresh, double delta, gboolean rev, int nthreads, corrmat_t **hout, corrmat_t **hindout);
+int corrmat_t_convolve_row (corrmat_t *m, int i, double *kern, int ksize, int diagn, double thresh, int **cols, double **vals);
+void corrmat_t_align_row (const int *pcols, const double *ph, int plen, const int *cols, const double *v, int len, double delta, gboolean mirror, double *h, float *ind);
+void corrmat_t_compute_alignment_matrices (corrmat_t *corrmat, double *kern1, double *kern2, int ksize, int diagn, double thresh, double delta, int nthreads, corrmat_t **hmat, corrmat_t **hmatind, corrmat_t **hmatrev, corrmat_t **hmatindrev);
+void corrmat_t_find_component_list (corrmat_t *hmat, corrmat_t *hmatind, corrmat_t *hmatrev, corrmat_t *hmatindrev, double alignment_threshold, double alignment_tail_thresh, int min_seq_length, int alignment_min_diag_distance, double alignment_max_slope_error, int alignment_search_radius, int alignment_min_node_id, GQueue *components);
+double *corrmat_random (int n, unsigned int *seed);
+int corrmat_unit_testing (int n, int nruns);
+
+/* number of entries of row i. <cols> receives the columns (NULL for a contiguous row,
+ * whose columns start at <first>) and <vals> the values.
+ */
+static inline int corrmat_t_row (const corrmat_t *m, int i, const int **cols, const float **vals, int *first)
+{
+    *vals = m->val + m->off[i];
+    *cols = m->col ? m->col + (m->coff ? m->coff[i] : m->off[i]) : NULL;
+    *first = m->first[i];
+    return m->len[i];
+}
+
+static inline double corrmat_t_get (const corrmat_t *m, int i, int j)
+{
+    if (i < 0 || j < 0 || i >= m->n || j >= m->n)
+        return .0;
+
+    const float *v = m->val + m->off[i];
+    int len = m->len[i];
+
+    if (!m->col) {
+        j -= m->first[i];
+        return 0 <= j && j < len ? v[j] : .0;
+    }
+
+    // binary search in the sorted columns of the row
+    const int *c = m->col + (m->coff ? m->coff[i] : m->off[i]);
+    int lo = 0, hi = len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (c[mid] < j)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < len && c[lo] == j ? v[lo] : .0;
+}
+
 
 struct component_t { GQueue *pt; double score; gboolean reverse;};
 
@@ -38,7 +160,7 @@ void corrmat_find_component_list (double * hmat, int * hmatind, double * hmatrev
 void corrmat_cleanup_component (component_t *c);
 void corrmat_cleanup_component_list (GQueue *components);
 int corrmat_find_component (double * hmat, int * hmatind, double * hmatrev, int* hmatindrev, int n, double minthresh, double maxthresh, component_t *comp, gboolean *reverse);
-gboolean component_t_valid (component_t *c, int n, int radius);
+gboolean component_t_valid (component_t *c, int n, int radius, double max_slope_error);
 int component_t_cmp (gconstpointer a, gconstpointer b, gpointer data);
 int corrmat_find_local_max (double *h, int n, double minval, double maxval, int radius, int *maxi, int *maxj);
 void corrmat_convolve (double *m, int size, double *kern, int ksize);
@@ -1,5 +1,9 @@
 #include "dijkstra.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #define DIJK_DEBUG 1
 
 int MOTION_TYPE_REVERSE (int motion_type)
@@ -30,6 +34,10 @@ dijk_edge_t *dijk_edge_new (navlcm_feature_list_t *f, GQueue *img, botlcm_image_
     e->timestamp = 0;
     e->reverse = reverse;
     e->motion_type = motion_type;
+    e->file = NULL;
+    e->rec = NULL;
+    e->features_loaded = FALSE;
+    e->images_loaded = FALSE;
 
     if (e->start) 
         g_queue_push_tail (e->start->edges, e);
@@ -54,6 +62,39 @@ dijk_edge_t *dijk_edge_new_with_copy (navlcm_feature_list_t *f, GQueue *img, bot
     return dijk_edge_new (f_copy, img_copy, up_img_copy, pose_copy, gps_copy, reverse, start, end, motion_type);
 }
 
+/* release a reference to a mapped file, unmapped with the last one
+ */
+static void dijk_map_file_unref (dijk_map_file_t *file)
+{
+    if (!g_atomic_int_dec_and_test (&file->refs))
+        return;
+
+    munmap (file->map, file->size);
+    g_mutex_free (file->mutex);
+    free (file);
+}
+
+/* deep copy of edge <e> between <start> and <end>. The images of an edge of a mapped
+ * file that are not loaded yet stay in the file, which the copy holds a reference
+ * to, so that copying a mapped graph does not decode them.
+ */
+static dijk_edge_t *dijk_edge_copy (dijk_edge_t *e, dijk_node_t *start, dijk_node_t *end)
+{
+    if (!e->file || e->images_loaded)
+        return dijk_edge_new_with_copy (dijk_edge_features (e), dijk_edge_images (e), dijk_edge_up_image (e), 
+                                        e->pose, e->gps_to_local, e->reverse, start, end, e->motion_type);
+
+    dijk_edge_t *e2 = dijk_edge_new_with_copy (dijk_edge_features (e), NULL, NULL, e->pose, e->gps_to_local, 
+                                               e->reverse, start, end, e->motion_type);
+    g_atomic_int_inc (&e->file->refs);
+    e2->file = e->file;
+    e2->rec = e->rec;
+    e2->features_loaded = TRUE;
+    e2->images_loaded = FALSE;
+
+    return e2;
+}
+
 dijk_node_t *dijk_node_new (int uid, gboolean checkpoint, int64_t utime)
 {
     dijk_node_t *n = (dijk_node_t*)malloc (sizeof(dijk_node_t));
@@ -134,6 +175,8 @@ dijk_node_t *dijk_graph_find_node_by_id (dijk_graph_t *dg, int id)
     gpointer data = g_hash_table_lookup (dg->alias, &id);
     if (!data) return NULL;
     int *data_int = (int*)data;
+    if (dg->csr)
+        return dg->csr->nodes[*data_int];
     gpointer d = g_queue_peek_nth (dg->nodes, *data_int);
     if (!d) {
         printf ("mmm... failed to find node %d at position %d\n", id, *data_int);
@@ -156,7 +199,7 @@ navlcm_feature_list_t *dijk_node_get_nth_features (dijk_node_t *n, int p)
     dijk_edge_t *e = dijk_get_nth_edge (n, p);
     if (!e)
         return NULL;
-    return e->features;
+    return dijk_edge_features (e);
 }
 
 /* init a graph
@@ -166,6 +209,8 @@ void dijk_graph_init (dijk_graph_t *dg)
     dg->nodes = g_queue_new ();
     dg->edges = g_queue_new ();
     dg->alias = g_hash_table_new_full (g_int_hash, g_int_equal, g_free, g_free);
+    dg->file = NULL;
+    dg->csr = NULL;
 }
 
 /* deep copy
@@ -185,8 +230,8 @@ dijk_graph_t *dijk_graph_copy (dijk_graph_t *dg)
         dijk_edge_t *e = (dijk_edge_t*)iter->data;
         dijk_node_t *n1 = e->start ? dijk_graph_find_node_by_id (g, e->start->uid) : NULL;
         dijk_node_t *n2 = e->end ? dijk_graph_find_node_by_id (g, e->end->uid) : NULL;
-        dijk_edge_t *e2 = dijk_edge_new_with_copy (e->features, e->img, e->up_img, e->pose, e->gps_to_local, e->reverse, n1, n2, e->motion_type);
-        g_queue_push_tail (g->edges, e2);
+        dijk_edge_t *e2 = dijk_edge_copy (e, n1, n2);
+        dijk_graph_insert_edge (g, e2);
     }
 
     // sanity check
@@ -207,6 +252,33 @@ dijk_graph_t *dijk_graph_copy (dijk_graph_t *dg)
     return g;
 }
 
+/* deep copy of the nodes and edges of <src> into <dg>, with the node ids shifted past
+ * those of <dg>. Images that are not loaded yet are left in the mapped file of <src>
+ * (see dijk_edge_copy), which outlives <src> if need be. Returns the shift.
+ */
+int dijk_graph_append (dijk_graph_t *dg, dijk_graph_t *src)
+{
+    int offset = dijk_graph_max_node_id (dg) + 1;
+
+    for (GList *iter=g_queue_peek_head_link (src->nodes);iter;iter=iter->next) {
+        dijk_node_t *n = (dijk_node_t*)iter->data;
+        dijk_node_t *n2 = dijk_node_new (n->uid + offset, n->checkpoint, n->utime);
+        if (n->label)
+            dijk_node_set_label (n2, n->label);
+        dijk_graph_insert_node (dg, n2);
+    }
+
+    for (GList *iter=g_queue_peek_head_link (src->edges);iter;iter=iter->next) {
+        dijk_edge_t *e = (dijk_edge_t*)iter->data;
+        dijk_node_t *n1 = e->start ? dijk_graph_find_node_by_id (dg, e->start->uid + offset) : NULL;
+        dijk_node_t *n2 = e->end ? dijk_graph_find_node_by_id (dg, e->end->uid + offset) : NULL;
+        dijk_edge_t *e2 = dijk_edge_copy (e, n1, n2);
+        dijk_graph_insert_edge (dg, e2);
+    }
+
+    return offset;
+}
+
 void dijk_graph_insert_nodes (dijk_graph_t *dg, GQueue *nodes)
 {
     if (nodes) {
@@ -231,10 +303,12 @@ void dijk_graph_insert_node (dijk_graph_t *dg, dijk_node_t *nd)
 
     g_hash_table_insert (dg->alias, g_intdup (nd->uid), g_intdup (g_queue_get_length (dg->nodes)));
     g_queue_push_tail (dg->nodes, nd);
+    dijk_graph_invalidate (dg);
 }
 
 gboolean dijk_graph_remove_node (dijk_graph_t *dg, dijk_node_t *n)
 {
+    dijk_graph_invalidate (dg);
     g_queue_remove (dg->nodes, n);
     gpointer data = g_hash_table_lookup (dg->alias, &n->uid);
     if (!data) return FALSE;
@@ -262,11 +336,13 @@ gboolean dijk_graph_remove_node (dijk_graph_t *dg, dijk_node_t *n)
 void dijk_graph_remove_edge (dijk_graph_t *dg, dijk_edge_t *e)
 {
     g_queue_remove (dg->edges, e);
+    dijk_graph_invalidate (dg);
 }
 
 void dijk_graph_insert_edge (dijk_graph_t *dg, dijk_edge_t *e)
 {
     g_queue_push_tail (dg->edges, e);
+    dijk_graph_invalidate (dg);
 }
 
 void dijk_node_set_label (dijk_node_t *n, const char *txt)
@@ -307,6 +383,8 @@ void dijk_edge_destroy (dijk_edge_t *e)
         botlcm_pose_t_destroy (e->pose);
     if (e->gps_to_local)
         navlcm_gps_to_local_t_destroy (e->gps_to_local);
+    if (e->file)
+        dijk_map_file_unref (e->file);
 }
 
 /* destroy a dijkstra's graph
@@ -334,6 +412,13 @@ void dijk_graph_destroy (dijk_graph_t *dg)
         g_hash_table_destroy (dg->alias);
         dg->alias = NULL;
     }
+
+    dijk_graph_invalidate (dg);
+
+    if (dg->file) {
+        dijk_map_file_unref (dg->file);
+        dg->file = NULL;
+    }
 }
 
 
@@ -573,10 +658,11 @@ void dijk_tree_print (GNode *node)
     g_node_traverse (node, G_PRE_ORDER, G_TRAVERSE_ALL, -1, dijk_tree_print_cb, NULL);
 }
 
-/* find the shortest path between two nodes
+/* find the shortest path between two nodes, with a linear search for the closest
+ * node at each step (reference for dijk_shortest_path_unit_testing)
  * output: a queue of edges
  */
-GQueue *dijk_find_shortest_path (dijk_graph_t *dg, dijk_node_t *src, dijk_node_t *dst)
+static GQueue *dijk_find_shortest_path_linear (dijk_graph_t *dg, dijk_node_t *src, dijk_node_t *dst)
 {
     GTimer *timer = g_timer_new ();
 
@@ -605,7 +691,7 @@ GQueue *dijk_find_shortest_path (dijk_graph_t *dg, dijk_node_t *src, dijk_node_t
         dijk_node_t *nd = dijk_find_node_smallest_dist (nodes);
 
         // all remaining vertices are inaccessible
-        if (nd->dist == -1) break;
+        if (!nd || nd->dist == -1) break;
 
         // stop if target is reached
         if (nd == dst) break;
@@ -689,6 +775,347 @@ GQueue *dijk_find_shortest_path (dijk_graph_t *dg, dijk_node_t *src, dijk_node_t
     return path;
 }
 
+static void dijk_khop_destroy (dijk_khop_t *k)
+{
+    free (k->offset);
+    free (k->col);
+    free (k->hops);
+    free (k->toffset);
+    free (k->tcol);
+    free (k->thops);
+    free (k);
+}
+
+/* drop the compressed adjacency of a graph (to call when its topology changes)
+ */
+void dijk_graph_invalidate (dijk_graph_t *dg)
+{
+    dijk_csr_t *c = dg->csr;
+    if (!c) return;
+
+    if (c->khop)
+        dijk_khop_destroy (c->khop);
+
+    free (c->nodes);
+    free (c->offset);
+    free (c->target);
+    free (c->weight);
+    free (c->edges);
+    free (c->dist);
+    free (c->prev);
+    free (c->heap);
+    free (c->pos);
+    free (c->stamp);
+    free (c->active[0]);
+    free (c->active[1]);
+    free (c->mark);
+    free (c);
+
+    dg->csr = NULL;
+}
+
+/* compressed adjacency of a graph, built if needed
+ */
+dijk_csr_t *dijk_graph_csr (dijk_graph_t *dg)
+{
+    if (dg->csr)
+        return dg->csr;
+
+    dijk_csr_t *c = (dijk_csr_t*)malloc(sizeof(dijk_csr_t));
+
+    int n = g_queue_get_length (dg->nodes);
+    int m = 0;
+    for (GList *iter=g_queue_peek_head_link (dg->nodes);iter;iter=iter->next) {
+        dijk_node_t *nd = (dijk_node_t*)iter->data;
+        m += g_queue_get_length (nd->edges);
+    }
+
+    c->nnodes = n;
+    c->nodes = (dijk_node_t**)malloc(MAX(1,n)*sizeof(dijk_node_t*));
+    c->offset = (int*)malloc((n+1)*sizeof(int));
+    c->target = (int*)malloc(MAX(1,m)*sizeof(int));
+    c->weight = (int*)malloc(MAX(1,m)*sizeof(int));
+    c->edges = (dijk_edge_t**)malloc(MAX(1,m)*sizeof(dijk_edge_t*));
+    c->dist = (int*)malloc(MAX(1,n)*sizeof(int));
+    c->prev = (int*)malloc(MAX(1,n)*sizeof(int));
+    c->heap = (int*)malloc(MAX(1,n)*sizeof(int));
+    c->pos = (int*)malloc(MAX(1,n)*sizeof(int));
+    c->stamp = (unsigned int*)calloc(MAX(1,n), sizeof(unsigned int));
+    c->nheap = 0;
+    c->epoch = 0;
+    c->khop = NULL;
+    c->active[0] = (int*)malloc(MAX(1,n)*sizeof(int));
+    c->active[1] = (int*)malloc(MAX(1,n)*sizeof(int));
+    c->nactive[0] = c->nactive[1] = 0;
+    c->mark = (unsigned int*)calloc(MAX(1,n), sizeof(unsigned int));
+    c->mark_epoch = 0;
+
+    int i = 0;
+    for (GList *iter=g_queue_peek_head_link (dg->nodes);iter;iter=iter->next)
+        c->nodes[i++] = (dijk_node_t*)iter->data;
+
+    for (i=0;i<n;i++) {
+        if (c->nodes[i]->pdf0 != .0)
+            c->active[0][c->nactive[0]++] = i;
+        if (c->nodes[i]->pdf1 != .0)
+            c->active[1][c->nactive[1]++] = i;
+    }
+
+    int k = 0;
+    for (i=0;i<n;i++) {
+        dijk_node_t *nd = c->nodes[i];
+        c->offset[i] = k;
+        for (GList *iter=g_queue_peek_head_link (nd->edges);iter;iter=iter->next) {
+            dijk_edge_t *e = (dijk_edge_t*)iter->data;
+            if (e->start != nd || !e->end) continue;
+            int *index = (int*)g_hash_table_lookup (dg->alias, &e->end->uid);
+            if (!index) continue;
+            c->target[k] = *index;
+            c->weight[k] = dijk_node_dist (nd, e->end);
+            c->edges[k] = e;
+            k++;
+        }
+    }
+    c->offset[n] = k;
+    c->nedges = k;
+
+    dg->csr = c;
+
+    dbg (DBG_CLASS, "[dijk] adjacency: %d nodes, %d edges.", n, k);
+
+    return c;
+}
+
+/* nodes within <radius> hops of each node (breadth-first search along the outgoing
+ * edges), built if needed
+ */
+dijk_khop_t *dijk_graph_khop (dijk_graph_t *dg, int radius)
+{
+    dijk_csr_t *c = dijk_graph_csr (dg);
+
+    if (c->khop && c->khop->radius == radius)
+        return c->khop;
+
+    if (c->khop)
+        dijk_khop_destroy (c->khop);
+
+    GTimer *timer = g_timer_new ();
+
+    int n = c->nnodes;
+    dijk_khop_t *k = (dijk_khop_t*)malloc(sizeof(dijk_khop_t));
+    k->radius = radius;
+    k->offset = (int*)malloc((n+1)*sizeof(int));
+
+    int capacity = MAX(16, 4*n);
+    k->col = (int*)malloc(capacity*sizeof(int));
+    k->hops = (int*)malloc(capacity*sizeof(int));
+
+    int *mark = (int*)malloc(MAX(1,n)*sizeof(int));
+    for (int i=0;i<n;i++)
+        mark[i] = -1;
+
+    int nnz = 0;
+    for (int i=0;i<n;i++) {
+        k->offset[i] = nnz;
+
+        // the entries of row i are the queue of the search
+        if (nnz == capacity) {
+            capacity *= 2;
+            k->col = (int*)realloc(k->col, capacity*sizeof(int));
+            k->hops = (int*)realloc(k->hops, capacity*sizeof(int));
+        }
+        k->col[nnz] = i;
+        k->hops[nnz] = 0;
+        mark[i] = i;
+        nnz++;
+
+        for (int q=k->offset[i];q<nnz;q++) {
+            int u = k->col[q];
+            int h = k->hops[q];
+            if (h == radius) continue;
+            for (int e=c->offset[u];e<c->offset[u+1];e++) {
+                int v = c->target[e];
+                if (mark[v] == i) continue;
+                mark[v] = i;
+                if (nnz == capacity) {
+                    capacity *= 2;
+                    k->col = (int*)realloc(k->col, capacity*sizeof(int));
+                    k->hops = (int*)realloc(k->hops, capacity*sizeof(int));
+                }
+                k->col[nnz] = v;
+                k->hops[nnz] = h+1;
+                nnz++;
+            }
+        }
+    }
+    k->offset[n] = nnz;
+    k->nnz = nnz;
+
+    free (mark);
+
+    // transpose
+    k->toffset = (int*)calloc(n+1, sizeof(int));
+    k->tcol = (int*)malloc(MAX(1,nnz)*sizeof(int));
+    k->thops = (int*)malloc(MAX(1,nnz)*sizeof(int));
+    for (int q=0;q<nnz;q++)
+        k->toffset[k->col[q]+1]++;
+    for (int j=0;j<n;j++)
+        k->toffset[j+1] += k->toffset[j];
+    int *fill = (int*)malloc(MAX(1,n)*sizeof(int));
+    memcpy (fill, k->toffset, MAX(1,n)*sizeof(int));
+    for (int i=0;i<n;i++) {
+        for (int q=k->offset[i];q<k->offset[i+1];q++) {
+            int p = fill[k->col[q]]++;
+            k->tcol[p] = i;
+            k->thops[p] = k->hops[q];
+        }
+    }
+    free (fill);
+
+    c->khop = k;
+
+    dbg (DBG_CLASS, "[dijk] %d-hop neighborhoods: %d nodes, %d entries (%.3f secs).", radius, n, nnz, 
+            g_timer_elapsed (timer, NULL));
+    g_timer_destroy (timer);
+
+    return k;
+}
+
+/* indexed binary heap, ordered by distance then by node index
+ */
+static inline gboolean dijk_heap_less (dijk_csr_t *c, int a, int b)
+{
+    return c->dist[a] < c->dist[b] || (c->dist[a] == c->dist[b] && a < b);
+}
+
+static void dijk_heap_up (dijk_csr_t *c, int p)
+{
+    int v = c->heap[p];
+    while (p > 0) {
+        int q = (p-1) >> 1;
+        if (!dijk_heap_less (c, v, c->heap[q])) break;
+        c->heap[p] = c->heap[q];
+        c->pos[c->heap[p]] = p;
+        p = q;
+    }
+    c->heap[p] = v;
+    c->pos[v] = p;
+}
+
+static void dijk_heap_down (dijk_csr_t *c, int p)
+{
+    int v = c->heap[p];
+    while (1) {
+        int q = 2*p+1;
+        if (q >= c->nheap) break;
+        if (q+1 < c->nheap && dijk_heap_less (c, c->heap[q+1], c->heap[q])) q++;
+        if (!dijk_heap_less (c, c->heap[q], v)) break;
+        c->heap[p] = c->heap[q];
+        c->pos[c->heap[p]] = p;
+        p = q;
+    }
+    c->heap[p] = v;
+    c->pos[v] = p;
+}
+
+static int dijk_heap_pop (dijk_csr_t *c)
+{
+    int v = c->heap[0];
+    c->pos[v] = -1;
+    c->nheap--;
+    if (c->nheap > 0) {
+        c->heap[0] = c->heap[c->nheap];
+        dijk_heap_down (c, 0);
+    }
+    return v;
+}
+
+/* find the shortest path between two nodes (Dijkstra's algorithm on the compressed
+ * adjacency, O(E log V)). Among nodes at the same distance, the first one in the
+ * graph is expanded first.
+ * output: a queue of edges
+ */
+GQueue *dijk_find_shortest_path (dijk_graph_t *dg, dijk_node_t *src, dijk_node_t *dst)
+{
+    GTimer *timer = g_timer_new ();
+
+    dbg (DBG_CLASS, "searching for path between node %d and node %d", src->uid, dst->uid);
+
+    dijk_csr_t *c = dijk_graph_csr (dg);
+
+    GQueue *path = g_queue_new ();
+
+    int *psrc = (int*)g_hash_table_lookup (dg->alias, &src->uid);
+    int *pdst = (int*)g_hash_table_lookup (dg->alias, &dst->uid);
+    assert (psrc && pdst);
+    int s = *psrc, t = *pdst;
+
+    // new search: all the nodes not stamped with the epoch are at infinity
+    c->epoch++;
+    if (c->epoch == 0) {
+        memset (c->stamp, 0, c->nnodes*sizeof(unsigned int));
+        c->epoch = 1;
+    }
+
+    c->stamp[s] = c->epoch;
+    c->dist[s] = 0;
+    c->prev[s] = -1;
+    c->heap[0] = s;
+    c->pos[s] = 0;
+    c->nheap = 1;
+
+    // main loop
+    while (c->nheap > 0) {
+
+        // node with smallest distance (marked as visited)
+        int u = dijk_heap_pop (c);
+
+        // stop if target is reached
+        if (u == t) break;
+
+        for (int k=c->offset[u];k<c->offset[u+1];k++) {
+            int v = c->target[k];
+            int alt = c->dist[u] + c->weight[k];
+            if (c->stamp[v] != c->epoch) {
+                c->stamp[v] = c->epoch;
+                c->dist[v] = alt;
+                c->prev[v] = k;
+                c->heap[c->nheap] = v;
+                c->pos[v] = c->nheap;
+                c->nheap++;
+                dijk_heap_up (c, c->pos[v]);
+            } else if (c->pos[v] >= 0 && alt < c->dist[v]) {
+                c->dist[v] = alt;
+                c->prev[v] = k;
+                dijk_heap_up (c, c->pos[v]);
+            }
+        }
+    }
+
+    dbg (DBG_CLASS, "[dijk] elapsed time (search): %.3f secs.", g_timer_elapsed (timer, NULL));
+
+    // generate path
+    if (c->stamp[t] == c->epoch) {
+        for (int k=c->prev[t];k>=0;) {
+            dijk_edge_t *e = c->edges[k];
+            g_queue_push_head (path, e);
+            int *index = (int*)g_hash_table_lookup (dg->alias, &e->start->uid);
+            k = c->prev[*index];
+        }
+    }
+
+    if (!g_queue_is_empty (path)) {
+        // check path sanity
+        assert (((dijk_edge_t*)(g_queue_peek_head(path)))->start == src);
+        assert (((dijk_edge_t*)(g_queue_peek_tail(path)))->end == dst);
+    }
+
+    dbg (DBG_CLASS, "[dijk] elapsed time (path gen.): %.3f secs.", g_timer_elapsed (timer, NULL));
+    g_timer_destroy (timer);
+
+    return path;
+}
+
 int dijk_graph_n_nodes (dijk_graph_t *dg)
 {
     if (!dg) return 0;
@@ -769,6 +1196,86 @@ void dijk_unit_testing ()
     dijk_graph_destroy (g);
 }
 
+/* check the heap-based search against the linear one on a random graph (a chain of
+ * <n> nodes with random shortcuts, and a few isolated nodes), before and after
+ * removing edges. Returns the number of paths that differ.
+ */
+int dijk_shortest_path_unit_testing (int n, int nqueries)
+{
+    dijk_graph_t *g = dijk_graph_new ();
+
+    for (int i=0;i<n+n/50;i++)
+        dijk_graph_insert_node (g, dijk_node_new (i, 0, 0));
+
+    srand (time (NULL));
+
+    for (int i=0;i+1<n;i++) {
+        dijk_node_t *n1 = dijk_graph_find_node_by_id (g, i);
+        dijk_node_t *n2 = dijk_graph_find_node_by_id (g, i+1);
+        dijk_graph_insert_edge (g, dijk_edge_new (NULL, NULL, NULL, NULL, NULL, 0, n1, n2, -1));
+        dijk_graph_insert_edge (g, dijk_edge_new (NULL, NULL, NULL, NULL, NULL, 1, n2, n1, -1));
+    }
+    for (int i=0;i<n/4;i++) {
+        dijk_node_t *n1 = dijk_graph_find_node_by_id (g, rand () % n);
+        dijk_node_t *n2 = dijk_graph_find_node_by_id (g, rand () % n);
+        if (n1 != n2 && !dijk_node_has_neighbor (n1, n2)) {
+            dijk_graph_insert_edge (g, dijk_edge_new (NULL, NULL, NULL, NULL, NULL, 0, n1, n2, -1));
+            dijk_graph_insert_edge (g, dijk_edge_new (NULL, NULL, NULL, NULL, NULL, 1, n2, n1, -1));
+        }
+    }
+
+    int nnodes = dijk_graph_n_nodes (g);
+    int errors = 0;
+    double t_linear = .0, t_heap = .0;
+    GTimer *timer = g_timer_new ();
+
+    for (int run=0;run<2;run++) {
+
+        if (run == 1) {
+            // cut the chain in a few places
+            for (int i=0;i<10;i++) {
+                int id = rand () % (n-1);
+                dijk_graph_remove_edge_by_id (g, id, id+1);
+            }
+        }
+
+        for (int q=0;q<nqueries;q++) {
+            dijk_node_t *src = dijk_graph_find_node_by_id (g, rand () % nnodes);
+            dijk_node_t *dst = dijk_graph_find_node_by_id (g, rand () % nnodes);
+
+            g_timer_start (timer);
+            GQueue *p1 = dijk_find_shortest_path_linear (g, src, dst);
+            t_linear += g_timer_elapsed (timer, NULL);
+
+            g_timer_start (timer);
+            GQueue *p2 = dijk_find_shortest_path (g, src, dst);
+            t_heap += g_timer_elapsed (timer, NULL);
+
+            gboolean same = g_queue_get_length (p1) == g_queue_get_length (p2);
+            for (GList *i1=g_queue_peek_head_link (p1), *i2=g_queue_peek_head_link (p2);same && i1 && i2;i1=i1->next, i2=i2->next)
+                same = i1->data == i2->data;
+            if (!same) {
+                dbg (DBG_ERROR, "[dijk] path %d -> %d: %d edges (linear) vs %d edges (heap)", src->uid, dst->uid, 
+                        g_queue_get_length (p1), g_queue_get_length (p2));
+                errors++;
+            }
+
+            g_queue_free (p1);
+            g_queue_free (p2);
+        }
+    }
+
+    dbg (DBG_INFO, "[dijk] %d nodes, %d edges, %d queries: linear %.3f ms/query, heap %.3f ms/query, %d errors.", 
+            nnodes, g_queue_get_length (g->edges), 2*nqueries, 1000.0 * t_linear / (2*nqueries), 
+            1000.0 * t_heap / (2*nqueries), errors);
+
+    g_timer_destroy (timer);
+    dijk_graph_destroy (g);
+    free (g);
+
+    return errors;
+}
+
 int dijk_graph_max_node_id (dijk_graph_t *dg)
 {
     int maxid = -1;
@@ -780,21 +1287,39 @@ int dijk_graph_max_node_id (dijk_graph_t *dg)
     return maxid;
 }
 
+/* write the graph in the chunked format (see dijkstra.h). The file is written next to
+ * <filename> and renamed, so that a graph mapped from <filename> stays valid.
+ */
 void dijk_graph_write_to_file (dijk_graph_t *dg, const char *filename)
 {
-    FILE *fp = fopen (filename, "wb");
-    if (!fp)
+    char *tmpname = g_strdup_printf ("%s.tmp", filename);
+
+    FILE *fp = fopen (tmpname, "wb");
+    if (!fp) {
+        dbg (DBG_ERROR, "failed to open %s", tmpname);
+        g_free (tmpname);
         return;
+    }
 
-    dijk_graph_write (dg, fp);
+    int status = dijk_graph_write_map (dg, fp);
 
-    fclose (fp);
-
-    dbg (DBG_CLASS, "wrote graph to file %s", filename);
+    if (fclose (fp) != 0 || status < 0 || rename (tmpname, filename) != 0) {
+        dbg (DBG_ERROR, "failed to write graph to file %s", filename);
+        unlink (tmpname);
+    } else {
+        dbg (DBG_CLASS, "wrote graph to file %s", filename);
+    }
 
+    g_free (tmpname);
 }
+
 void dijk_graph_read_from_file (dijk_graph_t *dg, const char *filename)
 {
+    if (dijk_graph_is_map_file (filename)) {
+        dijk_graph_map_file (dg, filename);
+        return;
+    }
+
     FILE *fp = fopen (filename, "rb");
     if (!fp)
         return;
@@ -806,6 +1331,429 @@ void dijk_graph_read_from_file (dijk_graph_t *dg, const char *filename)
     dbg (DBG_CLASS, "read graph from file %s", filename);
 }
 
+static gboolean dijk_map_header_valid (const dijk_map_header_t *hdr)
+{
+    return strncmp (hdr->magic, DIJK_MAP_MAGIC, sizeof(hdr->magic)) == 0 && hdr->version == DIJK_MAP_VERSION &&
+        hdr->nsections >= 0 && hdr->toc >= (int64_t)sizeof(dijk_map_header_t);
+}
+
+gboolean dijk_graph_is_map_file (const char *filename)
+{
+    FILE *fp = fopen (filename, "rb");
+    if (!fp)
+        return FALSE;
+
+    dijk_map_header_t hdr;
+    gboolean ok = fread (&hdr, sizeof(hdr), 1, fp) == 1 && dijk_map_header_valid (&hdr);
+    fclose (fp);
+
+    return ok;
+}
+
+/* pad with zeros to the next DIJK_MAP_ALIGN boundary. Returns the offset.
+ */
+static int64_t dijk_map_align (FILE *fp)
+{
+    static const char zeros[DIJK_MAP_ALIGN] = {0};
+
+    int64_t pos = ftello (fp);
+    int pad = (DIJK_MAP_ALIGN - pos % DIJK_MAP_ALIGN) % DIJK_MAP_ALIGN;
+    if (pad)
+        fwrite (zeros, 1, pad, fp);
+
+    return pos + pad;
+}
+
+/* start a section: aligned, with its offset in <sec>
+ */
+static void dijk_map_begin_section (FILE *fp, dijk_map_section_t *sec, int type, int count)
+{
+    memset (sec, 0, sizeof(dijk_map_section_t));
+    sec->type = type;
+    sec->count = count;
+    sec->offset = dijk_map_align (fp);
+}
+
+static void dijk_map_end_section (FILE *fp, dijk_map_section_t *sec)
+{
+    sec->size = ftello (fp) - sec->offset;
+}
+
+/* the per-edge blocks of the section <sec>, whose offset (relative to the section)
+ * and size go to the edge records <recs>. The block of a mapped edge that is not
+ * loaded yet is copied as is, the others are encoded.
+ */
+static void dijk_map_write_edge_blocks (dijk_graph_t *dg, FILE *fp, dijk_map_section_t *sec, dijk_map_edge_t *recs)
+{
+    int i = 0;
+    for (GList *iter=g_queue_peek_head_link (dg->edges);iter;iter=iter->next, i++) {
+        dijk_edge_t *e = (dijk_edge_t*)iter->data;
+        dijk_map_edge_t *rec = recs + i;
+        int64_t start = dijk_map_align (fp) - sec->offset;
+
+        if (sec->type == DIJK_MAP_POSES) {
+            botlcm_pose_t_write (e->pose, fp);
+            navlcm_gps_to_local_t_write (e->gps_to_local, fp);
+            rec->poses = start;
+            rec->poses_size = ftello (fp) - sec->offset - start;
+        }
+
+        if (sec->type == DIJK_MAP_FEATURES) {
+            if (e->file && !e->features_loaded) {
+                fwrite (e->file->features + e->rec->features, 1, e->rec->features_size, fp);
+            } else if (e->features) {
+                int size = navlcm_feature_list_t_encoded_size (e->features);
+                unsigned char *buffer = (unsigned char*)malloc (size);
+                navlcm_feature_list_t_encode (buffer, 0, size, e->features);
+                fwrite (buffer, 1, size, fp);
+                free (buffer);
+            }
+            rec->features = start;
+            rec->features_size = ftello (fp) - sec->offset - start;
+        }
+
+        if (sec->type == DIJK_MAP_IMAGES) {
+            if (e->file && !e->images_loaded) {
+                fwrite (e->file->images + e->rec->images, 1, e->rec->images_size, fp);
+            } else {
+                int nimages = e->img ? g_queue_get_length (e->img) : 0;
+                fwrite (&nimages, sizeof(int32_t), 1, fp);
+                for (GList *iiter=e->img ? g_queue_peek_head_link (e->img) : NULL;iiter;iiter=iiter->next)
+                    botlcm_image_t_write ((botlcm_image_t*)iiter->data, fp);
+                botlcm_image_t_write (e->up_img, fp);
+            }
+            rec->images = start;
+            rec->images_size = ftello (fp) - sec->offset - start;
+        }
+    }
+}
+
+int dijk_graph_write_map (dijk_graph_t *dg, FILE *fp)
+{
+    int nnodes = g_queue_get_length (dg->nodes);
+    int nedges = g_queue_get_length (dg->edges);
+
+    dijk_map_header_t hdr;
+    memset (&hdr, 0, sizeof(hdr));
+    fwrite (&hdr, sizeof(hdr), 1, fp);
+
+    dijk_map_section_t toc[DIJK_MAP_NSECTIONS];
+    dijk_map_node_t *nrecs = (dijk_map_node_t*)calloc (MAX (1, nnodes), sizeof(dijk_map_node_t));
+    dijk_map_edge_t *erecs = (dijk_map_edge_t*)calloc (MAX (1, nedges), sizeof(dijk_map_edge_t));
+
+    // labels
+    dijk_map_begin_section (fp, toc + 0, DIJK_MAP_LABELS, nnodes);
+    int i = 0;
+    for (GList *iter=g_queue_peek_head_link (dg->nodes);iter;iter=iter->next, i++) {
+        dijk_node_t *n = (dijk_node_t*)iter->data;
+        dijk_map_node_t *rec = nrecs + i;
+        rec->uid = n->uid;
+        rec->checkpoint = n->checkpoint;
+        rec->utime = n->utime;
+        rec->pdf0 = n->pdf0;
+        rec->pdf1 = n->pdf1;
+        rec->label = ftello (fp) - toc[0].offset;
+        rec->label_size = n->label ? strlen (n->label) : 0;
+        fwrite (n->label, 1, rec->label_size, fp);
+    }
+    dijk_map_end_section (fp, toc + 0);
+
+    // per-edge blocks
+    int types[3] = { DIJK_MAP_POSES, DIJK_MAP_FEATURES, DIJK_MAP_IMAGES };
+    for (int k=0;k<3;k++) {
+        dijk_map_begin_section (fp, toc + 1 + k, types[k], nedges);
+        dijk_map_write_edge_blocks (dg, fp, toc + 1 + k, erecs);
+        dijk_map_end_section (fp, toc + 1 + k);
+    }
+
+    // topology
+    i = 0;
+    for (GList *iter=g_queue_peek_head_link (dg->edges);iter;iter=iter->next, i++) {
+        dijk_edge_t *e = (dijk_edge_t*)iter->data;
+        erecs[i].start = e->start ? e->start->uid : -1;
+        erecs[i].end = e->end ? e->end->uid : -1;
+        erecs[i].reverse = e->reverse;
+        erecs[i].motion_type = e->motion_type;
+    }
+
+    dijk_map_begin_section (fp, toc + 4, DIJK_MAP_NODES, nnodes);
+    fwrite (nrecs, sizeof(dijk_map_node_t), nnodes, fp);
+    dijk_map_end_section (fp, toc + 4);
+
+    dijk_map_begin_section (fp, toc + 5, DIJK_MAP_EDGES, nedges);
+    fwrite (erecs, sizeof(dijk_map_edge_t), nedges, fp);
+    dijk_map_end_section (fp, toc + 5);
+
+    free (nrecs);
+    free (erecs);
+
+    // table of contents and header
+    strncpy (hdr.magic, DIJK_MAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = DIJK_MAP_VERSION;
+    hdr.nsections = DIJK_MAP_NSECTIONS;
+    hdr.toc = dijk_map_align (fp);
+    fwrite (toc, sizeof(dijk_map_section_t), DIJK_MAP_NSECTIONS, fp);
+    hdr.size = ftello (fp);
+
+    if (fseeko (fp, 0, SEEK_SET) != 0 || fwrite (&hdr, sizeof(hdr), 1, fp) != 1 || ferror (fp))
+        return -1;
+
+    dbg (DBG_CLASS, "wrote graph with %d nodes and %d edges (%.1f MB).", nnodes, nedges, hdr.size / 1048576.0);
+
+    return 0;
+}
+
+/* read a size-prefixed record at <*p> into <data> with <decode>, and move <*p> past
+ * it. Returns 0, or -1 if the record is empty (size 0) or runs past <end>.
+ */
+static int dijk_map_read_record (const char **p, const char *end, void *data,
+        int (*decode) (const void *, int, int, void *))
+{
+    int32_t size = 0;
+    if (*p + sizeof(int32_t) > end)
+        return -1;
+    memcpy (&size, *p, sizeof(int32_t));
+    *p += sizeof(int32_t);
+    if (size <= 0 || *p + size > end)
+        return -1;
+    int status = decode (*p, 0, size, data);
+    *p += size;
+    return status < 0 ? -1 : 0;
+}
+
+static int dijk_map_decode_image (const void *buf, int offset, int maxlen, void *data)
+{
+    return botlcm_image_t_decode (buf, offset, maxlen, (botlcm_image_t*)data);
+}
+
+static int dijk_map_decode_pose (const void *buf, int offset, int maxlen, void *data)
+{
+    return botlcm_pose_t_decode (buf, offset, maxlen, (botlcm_pose_t*)data);
+}
+
+static int dijk_map_decode_gps_to_local (const void *buf, int offset, int maxlen, void *data)
+{
+    return navlcm_gps_to_local_t_decode (buf, offset, maxlen, (navlcm_gps_to_local_t*)data);
+}
+
+static botlcm_image_t *dijk_map_read_image (const char **p, const char *end)
+{
+    botlcm_image_t *img = (botlcm_image_t*)malloc (sizeof(botlcm_image_t));
+    if (dijk_map_read_record (p, end, img, dijk_map_decode_image) < 0) {
+        free (img);
+        return NULL;
+    }
+    return img;
+}
+
+/* map a graph file in the chunked format (see dijkstra.h) and read its topology.
+ * Returns 0, or -1 if the file is not valid.
+ */
+int dijk_graph_map_file (dijk_graph_t *dg, const char *filename)
+{
+    int fd = open (filename, O_RDONLY);
+    if (fd < 0) {
+        dbg (DBG_ERROR, "failed to open %s", filename);
+        return -1;
+    }
+
+    struct stat st;
+    dijk_map_header_t hdr;
+    if (fstat (fd, &st) != 0 || read (fd, &hdr, sizeof(hdr)) != sizeof(hdr) || !dijk_map_header_valid (&hdr) ||
+        st.st_size < hdr.size || hdr.toc + hdr.nsections * (int64_t)sizeof(dijk_map_section_t) > hdr.size) {
+        dbg (DBG_ERROR, "%s is not a valid map file", filename);
+        close (fd);
+        return -1;
+    }
+
+    void *map = mmap (NULL, hdr.size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        dbg (DBG_ERROR, "failed to map %s", filename);
+        return -1;
+    }
+
+    // sections
+    const char *base = (const char*)map;
+    const dijk_map_section_t *toc = (const dijk_map_section_t*)(base + hdr.toc);
+    const dijk_map_section_t *sec[DIJK_MAP_NSECTIONS+1] = {NULL};
+    for (int k=0;k<hdr.nsections;k++) {
+        if (toc[k].offset < 0 || toc[k].size < 0 || toc[k].offset + toc[k].size > hdr.size)
+            continue;
+        if (1 <= toc[k].type && toc[k].type <= DIJK_MAP_NSECTIONS)
+            sec[toc[k].type] = toc + k;
+    }
+
+    gboolean ok = TRUE;
+    for (int k=1;k<=DIJK_MAP_NSECTIONS;k++)
+        ok = ok && sec[k];
+    ok = ok && sec[DIJK_MAP_NODES]->size >= sec[DIJK_MAP_NODES]->count * (int64_t)sizeof(dijk_map_node_t) &&
+        sec[DIJK_MAP_EDGES]->size >= sec[DIJK_MAP_EDGES]->count * (int64_t)sizeof(dijk_map_edge_t);
+
+    if (!ok) {
+        dbg (DBG_ERROR, "corrupted map file %s", filename);
+        munmap (map, hdr.size);
+        return -1;
+    }
+
+    dijk_map_file_t *file = (dijk_map_file_t*)calloc (1, sizeof(dijk_map_file_t));
+    file->map = map;
+    file->size = hdr.size;
+    file->features = base + sec[DIJK_MAP_FEATURES]->offset;
+    file->images = base + sec[DIJK_MAP_IMAGES]->offset;
+    file->mutex = g_mutex_new ();
+    file->refs = 1;
+
+    // nodes
+    int nnodes = sec[DIJK_MAP_NODES]->count;
+    const dijk_map_node_t *nrecs = (const dijk_map_node_t*)(base + sec[DIJK_MAP_NODES]->offset);
+    const char *labels = base + sec[DIJK_MAP_LABELS]->offset;
+    int first = g_queue_get_length (dg->nodes);
+    dijk_node_t **nodes = (dijk_node_t**)malloc (MAX (1, nnodes) * sizeof(dijk_node_t*));
+
+    for (int i=0;i<nnodes;i++) {
+        const dijk_map_node_t *rec = nrecs + i;
+        dijk_node_t *n = dijk_node_new (rec->uid, rec->checkpoint, rec->utime);
+        if (rec->label_size > 0 && rec->label + rec->label_size <= sec[DIJK_MAP_LABELS]->size) {
+            n->label = (char*)malloc (rec->label_size+1);
+            memcpy (n->label, labels + rec->label, rec->label_size);
+            n->label[rec->label_size] = '\0';
+        }
+        n->pdf0 = rec->pdf0;
+        n->pdf1 = rec->pdf1;
+        dijk_graph_insert_node (dg, n);
+        nodes[i] = n;
+    }
+
+    // edges, with their poses
+    int nedges = sec[DIJK_MAP_EDGES]->count;
+    const dijk_map_edge_t *erecs = (const dijk_map_edge_t*)(base + sec[DIJK_MAP_EDGES]->offset);
+    const char *poses = base + sec[DIJK_MAP_POSES]->offset;
+
+    for (int i=0;i<nedges;i++) {
+        const dijk_map_edge_t *rec = erecs + i;
+
+        dijk_node_t *n[2] = { NULL, NULL };
+        int ids[2] = { rec->start, rec->end };
+        for (int k=0;k<2;k++) {
+            int *pos = ids[k] == -1 ? NULL : (int*)g_hash_table_lookup (dg->alias, ids + k);
+            if (pos && first <= *pos && *pos < first + nnodes)
+                n[k] = nodes[*pos - first];
+            else if (pos)
+                n[k] = dijk_graph_find_node_by_id (dg, ids[k]);
+        }
+
+        botlcm_pose_t *pose = (botlcm_pose_t*)malloc (sizeof(botlcm_pose_t));
+        navlcm_gps_to_local_t *gps = (navlcm_gps_to_local_t*)malloc (sizeof(navlcm_gps_to_local_t));
+        const char *p = poses + rec->poses;
+        const char *end = poses + MIN (rec->poses + rec->poses_size, sec[DIJK_MAP_POSES]->size);
+        if (dijk_map_read_record (&p, end, pose, dijk_map_decode_pose) < 0) {
+            free (pose);
+            pose = NULL;
+        }
+        if (dijk_map_read_record (&p, end, gps, dijk_map_decode_gps_to_local) < 0) {
+            free (gps);
+            gps = NULL;
+        }
+
+        dijk_edge_t *e = dijk_edge_new (NULL, NULL, NULL, pose, gps, rec->reverse, n[0], n[1], rec->motion_type);
+        e->file = file;
+        e->rec = rec;
+        file->refs++;
+
+        // blocks past their section are not loaded
+        e->features_loaded = rec->features + rec->features_size > sec[DIJK_MAP_FEATURES]->size;
+        e->images_loaded = rec->images + rec->images_size > sec[DIJK_MAP_IMAGES]->size;
+
+        dijk_graph_insert_edge (dg, e);
+    }
+
+    free (nodes);
+
+    // the graph keeps the first file it maps
+    if (!dg->file) {
+        dg->file = file;
+    } else {
+        dbg (DBG_ERROR, "graph already holds a mapped file, %s is not mapped", filename);
+        for (GList *iter=g_queue_peek_head_link (dg->edges);iter;iter=iter->next) {
+            dijk_edge_t *e = (dijk_edge_t*)iter->data;
+            if (e->file == file) {
+                dijk_edge_features (e);
+                dijk_edge_images (e);
+                e->file = NULL;
+                dijk_map_file_unref (file);
+            }
+        }
+        dijk_map_file_unref (file);
+    }
+
+    dbg (DBG_CLASS, "mapped graph with %d nodes and %d edges from %s (%.1f MB).", nnodes, nedges, filename,
+            hdr.size / 1048576.0);
+
+    return 0;
+}
+
+/* the features of an edge, decoded on first access if the edge comes from a mapped
+ * file
+ */
+navlcm_feature_list_t *dijk_edge_features (dijk_edge_t *e)
+{
+    if (!e->file)
+        return e->features;
+
+    g_mutex_lock (e->file->mutex);
+    if (!e->features_loaded) {
+        if (e->rec->features_size > 0) {
+            navlcm_feature_list_t *f = (navlcm_feature_list_t*)malloc (sizeof(navlcm_feature_list_t));
+            if (navlcm_feature_list_t_decode (e->file->features + e->rec->features, 0, e->rec->features_size, f) < 0) {
+                free (f);
+                f = NULL;
+            }
+            e->features = f;
+        }
+        e->features_loaded = TRUE;
+    }
+    g_mutex_unlock (e->file->mutex);
+
+    return e->features;
+}
+
+/* same as dijk_edge_features, for the images and the upward image
+ */
+static void dijk_edge_load_images (dijk_edge_t *e)
+{
+    g_mutex_lock (e->file->mutex);
+    if (!e->images_loaded) {
+        const char *p = e->file->images + e->rec->images;
+        const char *end = p + e->rec->images_size;
+        int32_t nimages = 0;
+        if (p + sizeof(int32_t) <= end) {
+            memcpy (&nimages, p, sizeof(int32_t));
+            p += sizeof(int32_t);
+        }
+        e->img = g_queue_new ();
+        for (int j=0;j<nimages;j++)
+            g_queue_push_tail (e->img, dijk_map_read_image (&p, end));
+        e->up_img = dijk_map_read_image (&p, end);
+        e->images_loaded = TRUE;
+    }
+    g_mutex_unlock (e->file->mutex);
+}
+
+GQueue *dijk_edge_images (dijk_edge_t *e)
+{
+    if (e->file)
+        dijk_edge_load_images (e);
+    return e->img;
+}
+
+botlcm_image_t *dijk_edge_up_image (dijk_edge_t *e)
+{
+    if (e->file)
+        dijk_edge_load_images (e);
+    return e->up_img;
+}
+
 void dijk_graph_read (dijk_graph_t *dg, FILE *fp)
 {
     int nnodes;
@@ -943,17 +1891,18 @@ void dijk_graph_write (dijk_graph_t *g, FILE *fp)
     for (GList *iter=g_queue_peek_head_link (g->edges);iter;iter=iter->next) {
         dijk_edge_t *e = (dijk_edge_t*)iter->data;
 
-        navlcm_feature_list_t_write (e->features, fp);
+        navlcm_feature_list_t_write (dijk_edge_features (e), fp);
 
-        int nimages = g_queue_get_length (e->img);
+        GQueue *images = dijk_edge_images (e);
+        int nimages = images ? g_queue_get_length (images) : 0;
         fwrite (&nimages, sizeof(int), 1, fp);
 
-        for (GList *iter=g_queue_peek_head_link (e->img);iter;iter=iter->next) {
+        for (GList *iter=images ? g_queue_peek_head_link (images) : NULL;iter;iter=iter->next) {
             botlcm_image_t *img = (botlcm_image_t*)iter->data;
             botlcm_image_t_write (img, fp);
         }
 
-        botlcm_image_t_write (e->up_img, fp);
+        botlcm_image_t_write (dijk_edge_up_image (e), fp);
         botlcm_pose_t_write (e->pose, fp);
         navlcm_gps_to_local_t_write (e->gps_to_local, fp);
 
@@ -985,7 +1934,7 @@ void dijk_save_images_to_file (dijk_graph_t *dg, const char *dirname, gboolean o
         if (!overwrite && file_exists (filename))
             continue;
 
-        image_stitch_image_to_file (e->img, filename);
+        image_stitch_image_to_file (dijk_edge_images (e), filename);
 
         dbg (DBG_CLASS, "saved edge image to file %s", filename);
     }
@@ -1356,9 +2305,6 @@ void dijk_print_component (dijk_graph_t *dg, component_t *c, const char *corrmat
     if (!fp)
         return;
 
-    int size = 0;
-    double * corrmat = corrmat_read (corrmat_filename, &size);
-
     int64_t last_utime=0;
 
     if (dijk_graph_n_nodes (dg) == 0)
@@ -1381,8 +2327,6 @@ void dijk_print_component (dijk_graph_t *dg, component_t *c, const char *corrmat
 
     fprintf (fp, "\n");
 
-    free (corrmat);
-
     fclose (fp);
 }
 
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
+#include <stdint.h>
 
 /* from lcm*/
 #include <lcm/lcm.h>
@@ -38,9 +39,92 @@
 
 #include "util.h"
 
+/* Map file (version 2): a 64-byte header (dijk_map_header_t) and sections listed in
+ * a table of contents (dijk_map_section_t). Sections, and every per-edge block in
+ * them, start on a 64-byte boundary.
+ * - DIJK_MAP_NODES, DIJK_MAP_EDGES: the topology, one fixed-size record per node
+ *   (dijk_map_node_t) and per edge (dijk_map_edge_t)
+ * - DIJK_MAP_LABELS: the node labels
+ * - DIJK_MAP_POSES: per edge, its pose and gps_to_local
+ * - DIJK_MAP_FEATURES: per edge, its feature list (LCM encoding)
+ * - DIJK_MAP_IMAGES: per edge, the number of images, the images and the upward image
+ * Poses and images are records as in the previous format: an int32 size (0 for
+ * none) and the LCM encoding. Native byte order.
+ *
+ * dijk_graph_read_from_file maps the file and reads the topology and the poses only.
+ * The features and images of an edge are decoded on first access (dijk_edge_features,
+ * dijk_edge_images, dijk_edge_up_image), so that memory grows with the edges actually
+ * used. The mapping is released with the last graph or edge that points into it
+ * (see dijk_graph_append). Files in the previous format (a stream of records) are
+ * still read.
+ */
+#define DIJK_MAP_MAGIC "NAVMAP"
+#define DIJK_MAP_VERSION 2
+#define DIJK_MAP_ALIGN 64
+
+#define DIJK_MAP_NODES 1
+#define DIJK_MAP_EDGES 2
+#define DIJK_MAP_LABELS 3
+#define DIJK_MAP_POSES 4
+#define DIJK_MAP_FEATURES 5
+#define DIJK_MAP_IMAGES 6
+#define DIJK_MAP_NSECTIONS 6
+
+typedef struct {
+    char magic[8];
+    int32_t version;
+    int32_t nsections;
+    int64_t toc;            // offset of the table of contents
+    int64_t size;           // file size
+    char reserved[32];
+} dijk_map_header_t;
+
+typedef struct {
+    int32_t type;           // DIJK_MAP_NODES...
+    int32_t count;          // number of records (nodes and edges)
+    int64_t offset;
+    int64_t size;
+    int64_t reserved;
+} dijk_map_section_t;
+
+typedef struct {
+    int32_t uid;
+    int32_t checkpoint;
+    int64_t utime;
+    double pdf0;
+    double pdf1;
+    int64_t label;          // offset in DIJK_MAP_LABELS
+    int32_t label_size;     // 0 for none
+    int32_t reserved;
+} dijk_map_node_t;
+
+typedef struct {
+    int32_t start;          // node ids, -1 for none
+    int32_t end;
+    int32_t reverse;
+    int32_t motion_type;
+    int64_t features;       // offset in DIJK_MAP_FEATURES
+    int64_t features_size;  // 0 for none
+    int64_t images;         // offset in DIJK_MAP_IMAGES
+    int64_t images_size;
+    int64_t poses;          // offset in DIJK_MAP_POSES
+    int64_t poses_size;
+} dijk_map_edge_t;
+
+typedef struct {
+    void *map;
+    size_t size;
+    const char *features;   // DIJK_MAP_FEATURES
+    const char *images;     // DIJK_MAP_IMAGES
+    GMutex *mutex;          // lazy loading
+    int refs;               // the graph and the edges that point into the file
+} dijk_map_file_t;
+
+typedef struct _dijk_csr_t dijk_csr_t;
+
 /* a structure for the dijkstra's algorithm
  */
-typedef struct { GQueue *nodes; GQueue *edges; GHashTable *alias; } dijk_graph_t;
+typedef struct { GQueue *nodes; GQueue *edges; GHashTable *alias; dijk_map_file_t *file; dijk_csr_t *csr; } dijk_graph_t;
 
 typedef struct { 
    
@@ -75,8 +159,67 @@ typedef struct {
 
     int64_t timestamp;
 
+    // lazy loading, for the edges of a mapped file
+    dijk_map_file_t *file;      // NULL if the edge is in memory
+    const dijk_map_edge_t *rec;
+    gboolean features_loaded;
+    gboolean images_loaded;
+
 } dijk_edge_t;
 
+/* Compressed adjacency of a graph, for the shortest path search. Node i is the i-th
+ * node of dg->nodes (the index stored in dg->alias); its outgoing edges are
+ * edges[offset[i]..offset[i+1]), in the order of its edge list, leading to nodes
+ * target[] at cost weight[]. Edges without an end node are left out.
+ *
+ * The search runs on an indexed binary heap (heap[], and pos[] the position of each
+ * node in it, or -1 once settled), ordered by distance then by index. dist[] and
+ * prev[] (the edge leading to the node) are only valid for the nodes with
+ * stamp[i] == epoch, so that a search does not reset the arrays.
+ *
+ * Built on demand by dijk_graph_csr, and dropped whenever a node or an edge is
+ * inserted in or removed from the graph.
+ */
+typedef struct {
+    int radius;
+    int nnz;
+    int *offset;            // nnodes + 1
+    int *col;               // nodes within <radius> hops of node i, at col[offset[i]..offset[i+1])
+    int *hops;              // and their distance in hops (0 for the node itself)
+    int *toffset;           // transpose: the nodes that have node j within <radius> hops,
+    int *tcol;              // at tcol[toffset[j]..toffset[j+1])
+    int *thops;
+} dijk_khop_t;
+
+struct _dijk_csr_t {
+    int nnodes;
+    int nedges;
+    dijk_node_t **nodes;
+    int *offset;            // nnodes + 1
+    int *target;
+    int *weight;
+    dijk_edge_t **edges;
+
+    // search state
+    int *dist;
+    int *prev;
+    int *heap;
+    int *pos;
+    int nheap;
+    unsigned int *stamp;
+    unsigned int epoch;
+
+    dijk_khop_t *khop;      // k-hop neighborhoods, built on demand by dijk_graph_khop
+
+    // support of the belief (see state.cpp): indices of the nodes whose pdf0 (active[0])
+    // or pdf1 (active[1]) may be non-zero; pdf0 and pdf1 are zero for all the others.
+    // Initialized from the nodes when the adjacency is built.
+    int *active[2];
+    int nactive[2];
+    unsigned int *mark;     // set membership, mark[i] == mark_epoch
+    unsigned int mark_epoch;
+};
+
 
 dijk_edge_t *dijk_edge_new (navlcm_feature_list_t *f, GQueue *img, botlcm_image_t *up_img, botlcm_pose_t *pose, navlcm_gps_to_local_t *gps, gboolean reverse, dijk_node_t *start, dijk_node_t *end, int motion_type);
 dijk_node_t *dijk_node_new (int uid, gboolean checkpoint, int64_t utime);
@@ -97,6 +240,7 @@ void dijk_edge_print (dijk_edge_t *e);
 void dijk_graph_print (dijk_graph_t *dg);
 
 dijk_graph_t *dijk_graph_copy (dijk_graph_t *dg);
+int dijk_graph_append (dijk_graph_t *dg, dijk_graph_t *src);
 
 dijk_edge_t *dijk_graph_find_edge_by_id (dijk_graph_t *dg, int id0, int id1);
 dijk_node_t *dijk_graph_find_node_by_id (dijk_graph_t *dg, int id);
@@ -117,11 +261,21 @@ void dijk_tree_print (GNode *node);
 GNode* dijk_to_tree (dijk_node_t *nd, int radius) ;
 GNode* dijk_to_dual_tree (dijk_edge_t *ed, int radius) ;
 GQueue *dijk_find_shortest_path (dijk_graph_t *dg, dijk_node_t *src, dijk_node_t *dst);
+dijk_csr_t *dijk_graph_csr (dijk_graph_t *dg);
+dijk_khop_t *dijk_graph_khop (dijk_graph_t *dg, int radius);
+void dijk_graph_invalidate (dijk_graph_t *dg);
+int dijk_shortest_path_unit_testing (int n, int nqueries);
 void dijk_unit_testing ();
 void dijk_graph_read (dijk_graph_t *g, FILE *fp);
 void dijk_graph_write (dijk_graph_t *g, FILE *fp);
+int dijk_graph_write_map (dijk_graph_t *g, FILE *fp);
 void dijk_graph_read_from_file (dijk_graph_t *g, const char *filename);
 void dijk_graph_write_to_file (dijk_graph_t *g, const char *filename);
+gboolean dijk_graph_is_map_file (const char *filename);
+int dijk_graph_map_file (dijk_graph_t *g, const char *filename);
+navlcm_feature_list_t *dijk_edge_features (dijk_edge_t *e);
+GQueue *dijk_edge_images (dijk_edge_t *e);
+botlcm_image_t *dijk_edge_up_image (dijk_edge_t *e);
 void dijk_apply_components (dijk_graph_t *dg, GQueue *components);
 
 void dijk_save_images_to_file (dijk_graph_t *dg, const char *dirname, gboolean overwrite);
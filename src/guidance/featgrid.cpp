@@ -0,0 +1,186 @@
+/*
+ * Per-sensor uniform grid over feature positions, for distance-gated matching.
+ */
+
+#include "featgrid.h"
+
+#define FEATGRID_MAX_CELLS 1024     // max. number of cells along each axis
+
+static inline int featgrid_cell (double v, double cell, int n)
+{
+    int c = (int)floor (v / cell);
+    return c < 0 ? 0 : c >= n ? n-1 : c;
+}
+
+static inline int featgrid_cell_index (const featgrid_t *g, int sensorid, double col, double row)
+{
+    return ((sensorid - g->minsid) * g->nrows + featgrid_cell (row, g->cell, g->nrows)) * g->ncols +
+        featgrid_cell (col, g->cell, g->ncols);
+}
+
+static int featgrid_int_comp (const void *a, const void *b)
+{
+    int ia = *(const int*)a, ib = *(const int*)b;
+    return ia < ib ? -1 : ia > ib ? 1 : 0;
+}
+
+/* bucket the features of <keys> in cells of <cell> pixels. Use the gating distance
+ * as the cell size, so that a query visits at most 3x3 cells.
+ */
+featgrid_t *featgrid_new (navlcm_feature_list_t *keys, double cell)
+{
+    return featgrid_rebuild (NULL, keys, cell);
+}
+
+/* same as featgrid_new, in the buffers of <g> if they are large enough (e.g. a grid
+ * rebuilt every frame). <g> may be NULL. Returns the grid, to be used in place of <g>.
+ */
+featgrid_t *featgrid_rebuild (featgrid_t *g, navlcm_feature_list_t *keys, double cell)
+{
+    if (!g)
+        g = (featgrid_t*)calloc (1, sizeof(featgrid_t));
+
+    int n = keys->num;
+    g->num = n;
+
+    // extent of the grid
+    double maxcol = MAX (1.0, keys->width), maxrow = MAX (1.0, keys->height);
+    int minsid = 0, maxsid = 0;
+    for (int i=0;i<n;i++) {
+        navlcm_feature_t *f = keys->el + i;
+        maxcol = MAX (maxcol, f->col);
+        maxrow = MAX (maxrow, f->row);
+        minsid = i == 0 ? f->sensorid : MIN (minsid, f->sensorid);
+        maxsid = i == 0 ? f->sensorid : MAX (maxsid, f->sensorid);
+    }
+
+    g->cell = MAX (MAX (cell, 1.0), MAX (maxcol, maxrow) / FEATGRID_MAX_CELLS);
+    g->ncols = (int)floor (maxcol / g->cell) + 1;
+    g->nrows = (int)floor (maxrow / g->cell) + 1;
+    g->minsid = minsid;
+    g->nsensors = maxsid - minsid + 1;
+
+    int ncells = g->nsensors * g->nrows * g->ncols;
+
+    if (ncells + 2 > g->cells_capacity) {
+        g->cells_capacity = ncells + 2;
+        g->start = (int*)realloc (g->start, g->cells_capacity * sizeof(int));
+    }
+    if (n > g->capacity) {
+        g->capacity = n;
+        g->items = (int*)realloc (g->items, n * sizeof(int));
+        g->col = (double*)realloc (g->col, n * sizeof(double));
+        g->row = (double*)realloc (g->row, n * sizeof(double));
+        g->sensorid = (int*)realloc (g->sensorid, n * sizeof(int));
+    }
+
+    // counting sort by cell (keeps increasing indices within a cell). The count of
+    // cell c goes to start[c+2], so that start[c+1] is the next free item of cell c
+    // and ends up at the end of the cell.
+    memset (g->start, 0, (ncells + 2) * sizeof(int));
+
+    for (int i=0;i<n;i++) {
+        navlcm_feature_t *f = keys->el + i;
+        g->col[i] = f->col;
+        g->row[i] = f->row;
+        g->sensorid[i] = f->sensorid;
+        g->start[featgrid_cell_index (g, f->sensorid, f->col, f->row) + 2]++;
+    }
+
+    for (int c=2;c<ncells+2;c++)
+        g->start[c] += g->start[c-1];
+
+    for (int i=0;i<n;i++)
+        g->items[g->start[featgrid_cell_index (g, g->sensorid[i], g->col[i], g->row[i]) + 1]++] = i;
+
+    return g;
+}
+
+void featgrid_destroy (featgrid_t *g)
+{
+    if (!g)
+        return;
+
+    free (g->start);
+    free (g->items);
+    free (g->col);
+    free (g->row);
+    free (g->sensorid);
+    free (g);
+}
+
+/* list the features of sensor <sensorid> within <maxdist> pixels of (col, row), in
+ * increasing order. <ind> must hold g->num entries. Returns the number of features.
+ */
+int featgrid_query (const featgrid_t *g, int sensorid, double col, double row, double maxdist, int metric, int *ind)
+{
+    int s = sensorid - g->minsid;
+    if (s < 0 || s >= g->nsensors)
+        return 0;
+
+    int c0 = featgrid_cell (col - maxdist, g->cell, g->ncols);
+    int c1 = featgrid_cell (col + maxdist, g->cell, g->ncols);
+    int r0 = featgrid_cell (row - maxdist, g->cell, g->nrows);
+    int r1 = featgrid_cell (row + maxdist, g->cell, g->nrows);
+
+    double sqmaxdist = maxdist * maxdist;
+    int n = 0;
+
+    for (int r=r0;r<=r1;r++) {
+        const int *cell = g->start + (s * g->nrows + r) * g->ncols;
+        for (int k=cell[c0];k<cell[c1+1];k++) {
+            int j = g->items[k];
+            double dc = col - g->col[j];
+            double dr = row - g->row[j];
+            if (metric == FEATGRID_MANHATTAN) {
+                if (fabs (dc) + fabs (dr) > maxdist)
+                    continue;
+            } else {
+                if (dc * dc + dr * dr > sqmaxdist)
+                    continue;
+            }
+            ind[n++] = j;
+        }
+    }
+
+    // cells are visited row by row
+    if (r1 > r0 || c1 > c0)
+        qsort (ind, n, sizeof(int), featgrid_int_comp);
+
+    return n;
+}
+
+/* candidate pairs between the features of <keys> and the features of the grid, in
+ * compressed row format: the candidates of keys->el[i] are (*ind)[(*start)[i]..(*start)[i+1]-1],
+ * in increasing order. Returns the total number of pairs.
+ */
+int featgrid_pairs (const featgrid_t *g, navlcm_feature_list_t *keys, double maxdist, int metric,
+                    int **start, int **ind)
+{
+    int *buf = (int*)malloc (MAX (1, g->num) * sizeof(int));
+    int capacity = MAX (64, 4 * keys->num);
+    int n = 0;
+
+    *start = (int*)malloc ((keys->num + 1) * sizeof(int));
+    *ind = (int*)malloc (capacity * sizeof(int));
+
+    for (int i=0;i<keys->num;i++) {
+        navlcm_feature_t *f = keys->el + i;
+        int m = featgrid_query (g, f->sensorid, f->col, f->row, maxdist, metric, buf);
+
+        if (n + m > capacity) {
+            capacity = MAX (2 * capacity, n + m);
+            *ind = (int*)realloc (*ind, capacity * sizeof(int));
+        }
+
+        (*start)[i] = n;
+        memcpy (*ind + n, buf, m * sizeof(int));
+        n += m;
+    }
+    (*start)[keys->num] = n;
+
+    free (buf);
+
+    return n;
+}
+
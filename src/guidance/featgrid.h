@@ -0,0 +1,53 @@
+#ifndef _FEATGRID_H__
+#define _FEATGRID_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include <glib.h>
+
+/* From LCM */
+#include <lcmtypes/navlcm_feature_list_t.h>
+
+/* from common */
+#include <common/dbg.h>
+
+/* Uniform grid over the image positions of a feature list, one grid per sensor.
+ *
+ * Features are bucketed by (col, row) in square cells. A query lists the features
+ * of the same sensor within a given pixel distance of a position by visiting the
+ * cells that overlap the search window only. This replaces the test of every pair
+ * when matching is gated by distance in the image (tracker, maxdist mask).
+ */
+
+#define FEATGRID_MANHATTAN 0    // |dcol| + |drow| <= maxdist
+#define FEATGRID_EUCLIDEAN 1    // dcol^2 + drow^2 <= maxdist^2
+
+typedef struct {
+    int num;            // number of features
+    double cell;        // cell size in pixels
+    int minsid;         // smallest sensor id
+    int nsensors;       // number of sensors (maxsid - minsid + 1)
+    int ncols, nrows;   // number of cells per sensor
+    int *start;         // first item of each cell (nsensors x nrows x ncols + 1)
+    int *items;         // feature indices grouped by cell, in increasing order within a cell
+    double *col;        // feature position in pixels
+    double *row;
+    int *sensorid;
+    int capacity;       // size of the per-feature arrays
+    int cells_capacity; // size of <start>
+} featgrid_t;
+
+featgrid_t *featgrid_new (navlcm_feature_list_t *keys, double cell);
+featgrid_t *featgrid_rebuild (featgrid_t *g, navlcm_feature_list_t *keys, double cell);
+void featgrid_destroy (featgrid_t *g);
+
+int featgrid_query (const featgrid_t *g, int sensorid, double col, double row, double maxdist, int metric, int *ind);
+int featgrid_pairs (const featgrid_t *g, navlcm_feature_list_t *keys, double maxdist, int metric,
+                    int **start, int **ind);
+
+#endif
+
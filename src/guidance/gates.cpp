@@ -207,7 +207,7 @@ double gate_similarity (gate_t *g, navlcm_feature_list_t *fs)
     dbg (DBG_CLASS, "gate_similarity: matching %d - %d features.", fs->num, hs->num);
 
     // match with input features
-    navlcm_feature_match_set_t *matches = find_feature_matches_multi (fs, hs, TRUE, TRUE, 5, 0.80, -1.0, -1.0, TRUE);
+    navlcm_feature_match_set_t *matches = find_feature_matches_multi (fs, hs, TRUE, TRUE, 5, 0.80, -1.0, -1.0, TRUE, MATCHING_DOTPROD);
 
 
     if (!matches || matches->num == 0)  {
@@ -0,0 +1,471 @@
+/*
+ * Randomized kd-tree forest for approximate descriptor matching.
+ */
+
+#include "kdforest.h"
+
+typedef struct {
+    float dist;         // lower bound on the distance to the branch
+    int tree;
+    int node;
+} kdforest_branch_t;
+
+typedef struct {
+    kdforest_branch_t *el;
+    int num;
+    int capacity;
+} kdforest_heap_t;
+
+// per-search scratch memory (one per thread)
+typedef struct {
+    int *visited;       // last query stamp for each descriptor
+    int stamp;
+    kdforest_heap_t heap;
+} kdforest_scratch_t;
+
+////////////////////////////////////////////////////////////////////////////////////
+// branch heap (min-heap on distance)
+//
+static void kdforest_heap_push (kdforest_heap_t *h, float dist, int tree, int node)
+{
+    if (h->num == h->capacity) {
+        h->capacity = MAX (64, 2 * h->capacity);
+        h->el = (kdforest_branch_t*)realloc (h->el, h->capacity * sizeof(kdforest_branch_t));
+    }
+
+    int i = h->num++;
+    while (i > 0) {
+        int p = (i-1)/2;
+        if (h->el[p].dist <= dist)
+            break;
+        h->el[i] = h->el[p];
+        i = p;
+    }
+    h->el[i].dist = dist;
+    h->el[i].tree = tree;
+    h->el[i].node = node;
+}
+
+static kdforest_branch_t kdforest_heap_pop (kdforest_heap_t *h)
+{
+    kdforest_branch_t top = h->el[0];
+    kdforest_branch_t last = h->el[--h->num];
+
+    int i = 0;
+    while (2*i+1 < h->num) {
+        int c = 2*i+1;
+        if (c+1 < h->num && h->el[c+1].dist < h->el[c].dist)
+            c++;
+        if (last.dist <= h->el[c].dist)
+            break;
+        h->el[i] = h->el[c];
+        i = c;
+    }
+    if (h->num > 0)
+        h->el[i] = last;
+
+    return top;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// construction
+//
+static int kdforest_add_node (kdforest_tree_t *t, int *capacity)
+{
+    if (t->nnodes == *capacity) {
+        *capacity = MAX (64, 2 * *capacity);
+        t->nodes = (kdforest_node_t*)realloc (t->nodes, *capacity * sizeof(kdforest_node_t));
+    }
+
+    kdforest_node_t *nd = t->nodes + t->nnodes;
+    nd->dim = -1;
+    nd->val = .0;
+    nd->child[0] = nd->child[1] = -1;
+    nd->start = nd->count = 0;
+
+    return t->nnodes++;
+}
+
+/* choose a split dimension at random among the dimensions of highest variance
+ */
+static int kdforest_split_dim (kdforest_t *f, int *perm, int count, GRand *rnd, float *mean)
+{
+    int size = f->size;
+    int n = MIN (count, KDFOREST_SAMPLE);
+
+    float *var = (float*)calloc (size, sizeof(float));
+    for (int k=0;k<size;k++)
+        mean[k] = .0;
+
+    for (int i=0;i<n;i++) {
+        const float *x = f->data + perm[i] * size;
+        for (int k=0;k<size;k++)
+            mean[k] += x[k];
+    }
+    for (int k=0;k<size;k++)
+        mean[k] /= n;
+
+    for (int i=0;i<n;i++) {
+        const float *x = f->data + perm[i] * size;
+        for (int k=0;k<size;k++)
+            var[k] += (x[k] - mean[k]) * (x[k] - mean[k]);
+    }
+
+    // top dimensions by variance (insertion into a short sorted list)
+    int top[KDFOREST_RAND_DIM];
+    int ntop = 0;
+    for (int k=0;k<size;k++) {
+        int pos = ntop;
+        while (pos > 0 && var[top[pos-1]] < var[k])
+            pos--;
+        if (pos >= KDFOREST_RAND_DIM)
+            continue;
+        for (int p=MIN (ntop, KDFOREST_RAND_DIM-1);p>pos;p--)
+            top[p] = top[p-1];
+        top[pos] = k;
+        ntop = MIN (ntop+1, KDFOREST_RAND_DIM);
+    }
+
+    free (var);
+
+    return top[g_rand_int_range (rnd, 0, ntop)];
+}
+
+static int kdforest_build_rec (kdforest_t *f, kdforest_tree_t *t, int *capacity, int start, int count,
+                               int leaf_size, GRand *rnd, float *mean)
+{
+    int id = kdforest_add_node (t, capacity);
+
+    if (count <= leaf_size) {
+        t->nodes[id].start = start;
+        t->nodes[id].count = count;
+        return id;
+    }
+
+    int *perm = t->perm + start;
+    int dim = kdforest_split_dim (f, perm, count, rnd, mean);
+    float val = mean[dim];
+
+    // partition: left < val <= right
+    int left = 0;
+    for (int i=0;i<count;i++) {
+        if (f->data[perm[i] * f->size + dim] < val) {
+            int tmp = perm[left];
+            perm[left] = perm[i];
+            perm[i] = tmp;
+            left++;
+        }
+    }
+
+    // degenerate split (constant dimension): cut in half. All the descriptors have the
+    // same value on that dimension, so the distance bound of the search still holds.
+    if (left == 0 || left == count)
+        left = count / 2;
+
+    int c0 = kdforest_build_rec (f, t, capacity, start, left, leaf_size, rnd, mean);
+    int c1 = kdforest_build_rec (f, t, capacity, start + left, count - left, leaf_size, rnd, mean);
+
+    // <t->nodes> may have moved
+    t->nodes[id].dim = dim;
+    t->nodes[id].val = val;
+    t->nodes[id].child[0] = c0;
+    t->nodes[id].child[1] = c1;
+
+    return id;
+}
+
+/* build a forest of <ntrees> randomized trees over the descriptors of <keys>.
+ * The descriptors are copied, <keys> must outlive the forest (feature attributes
+ * are read at query time).
+ */
+kdforest_t *kdforest_new (navlcm_feature_list_t *keys, int ntrees, int leaf_size)
+{
+    kdforest_t *f = (kdforest_t*)calloc (1, sizeof(kdforest_t));
+
+    f->num = keys->num;
+    f->size = keys->desc_size;
+    f->keys = keys;
+    f->ntrees = ntrees;
+    f->data = (float*)malloc (MAX (1, f->num) * f->size * sizeof(float));
+
+    for (int i=0;i<f->num;i++) {
+        assert (keys->el[i].size == f->size);
+        memcpy (f->data + i * f->size, keys->el[i].data, f->size * sizeof(float));
+    }
+
+    f->trees = (kdforest_tree_t*)calloc (ntrees, sizeof(kdforest_tree_t));
+    float *mean = (float*)malloc (f->size * sizeof(float));
+
+    for (int t=0;t<ntrees;t++) {
+        kdforest_tree_t *tr = f->trees + t;
+        int capacity = 0;
+
+        // fixed seed: the same features always give the same forest
+        GRand *rnd = g_rand_new_with_seed (t + 1);
+
+        // random permutation, so that the first descriptors of a range are a random sample
+        tr->perm = (int*)malloc (MAX (1, f->num) * sizeof(int));
+        for (int i=0;i<f->num;i++)
+            tr->perm[i] = i;
+        for (int i=f->num-1;i>0;i--) {
+            int j = g_rand_int_range (rnd, 0, i+1);
+            int tmp = tr->perm[i];
+            tr->perm[i] = tr->perm[j];
+            tr->perm[j] = tmp;
+        }
+
+        kdforest_build_rec (f, tr, &capacity, 0, f->num, MAX (1, leaf_size), rnd, mean);
+
+        g_rand_free (rnd);
+    }
+
+    free (mean);
+
+    return f;
+}
+
+void kdforest_destroy (kdforest_t *f)
+{
+    if (!f)
+        return;
+
+    for (int t=0;t<f->ntrees;t++) {
+        free (f->trees[t].nodes);
+        free (f->trees[t].perm);
+    }
+    free (f->trees);
+    free (f->data);
+    free (f);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// search
+//
+
+/* same rules as the masks of the exhaustive matchers
+ */
+static inline gboolean kdforest_pass (navlcm_feature_t *q, navlcm_feature_t *t, const simdmatch_filter_t *filter)
+{
+    if (!filter)
+        return TRUE;
+
+    if (q->laplacian != t->laplacian)
+        return FALSE;
+
+    if (q->sensorid == t->sensorid) {
+        if (!filter->within_camera)
+            return FALSE;
+        if (filter->maxdist > 0 && fabs (q->col - t->col) + fabs (q->row - t->row) > filter->maxdist)
+            return FALSE;
+    } else if (!filter->across_cameras) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* squared distance, with 8 independent partial sums (vectorizable) and early
+ * abandon once it exceeds <bound>
+ */
+static inline float kdforest_sqdist (const float *a, const float *b, int size, float bound)
+{
+    float acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    int k = 0;
+
+    for (;k+32<=size;) {
+        for (int end=k+32;k<end;k+=8) {
+            for (int l=0;l<8;l++)
+                acc[l] += (a[k+l] - b[k+l]) * (a[k+l] - b[k+l]);
+        }
+        float d = ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+        if (d >= bound)
+            return d;
+    }
+
+    float d = ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+    for (;k<size;k++)
+        d += (a[k] - b[k]) * (a[k] - b[k]);
+
+    return d;
+}
+
+/* descend from <node> to a leaf, pushing the other branches, and check the leaf.
+ * returns the number of descriptors compared.
+ */
+static int kdforest_descend (kdforest_t *f, int tree, int node, float mindist, navlcm_feature_t *q,
+                             const simdmatch_filter_t *filter, kdforest_scratch_t *s,
+                             int k, int *ind, float *sqdist)
+{
+    kdforest_tree_t *t = f->trees + tree;
+    const float *x = q->data;
+
+    kdforest_node_t *nd = t->nodes + node;
+    while (nd->dim != -1) {
+        float diff = x[nd->dim] - nd->val;
+        int near = diff < 0 ? 0 : 1;
+        kdforest_heap_push (&s->heap, mindist + diff * diff, tree, nd->child[1-near]);
+        nd = t->nodes + nd->child[near];
+    }
+
+    int checks = 0;
+    for (int i=0;i<nd->count;i++) {
+        int j = t->perm[nd->start + i];
+        if (s->visited[j] == s->stamp)
+            continue;
+        s->visited[j] = s->stamp;
+
+        if (!kdforest_pass (q, f->keys->el + j, filter))
+            continue;
+
+        float d = kdforest_sqdist (x, f->data + j * f->size, f->size, sqdist[k-1]);
+        checks++;
+
+        // insert in the sorted list of the k best
+        if (d >= sqdist[k-1])
+            continue;
+        int pos = k-1;
+        while (pos > 0 && sqdist[pos-1] > d) {
+            sqdist[pos] = sqdist[pos-1];
+            ind[pos] = ind[pos-1];
+            pos--;
+        }
+        sqdist[pos] = d;
+        ind[pos] = j;
+    }
+
+    return checks;
+}
+
+static int kdforest_search (kdforest_t *f, navlcm_feature_t *q, const simdmatch_filter_t *filter,
+                            int k, int maxchecks, int *ind, float *sqdist, kdforest_scratch_t *s)
+{
+    assert (q->size == f->size);
+
+    for (int i=0;i<k;i++) {
+        ind[i] = -1;
+        sqdist[i] = FLT_MAX;
+    }
+
+    if (f->num == 0)
+        return 0;
+
+    s->stamp++;
+    s->heap.num = 0;
+
+    int checks = 0;
+    for (int t=0;t<f->ntrees;t++)
+        checks += kdforest_descend (f, t, 0, .0, q, filter, s, k, ind, sqdist);
+
+    while (s->heap.num > 0 && (checks < maxchecks || ind[k-1] == -1)) {
+        kdforest_branch_t b = kdforest_heap_pop (&s->heap);
+        // no closer descriptor in the remaining branches
+        if (b.dist >= sqdist[k-1])
+            break;
+        checks += kdforest_descend (f, b.tree, b.node, b.dist, q, filter, s, k, ind, sqdist);
+    }
+
+    int found = 0;
+    for (int i=0;i<k;i++)
+        if (ind[i] != -1) found++;
+
+    return found;
+}
+
+static void kdforest_scratch_init (kdforest_scratch_t *s, int num)
+{
+    s->visited = (int*)calloc (MAX (1, num), sizeof(int));
+    s->stamp = 0;
+    s->heap.el = NULL;
+    s->heap.num = s->heap.capacity = 0;
+}
+
+static void kdforest_scratch_clear (kdforest_scratch_t *s)
+{
+    free (s->visited);
+    free (s->heap.el);
+}
+
+/* approximate <k> nearest neighbours of <query> (squared euclidean distance),
+ * among the descriptors that pass <filter> (NULL for no filter).
+ * <ind> and <sqdist> (size k) are sorted by increasing distance, -1 and FLT_MAX
+ * if fewer than k descriptors were found. Returns the number of neighbours found.
+ */
+int kdforest_knn (kdforest_t *f, navlcm_feature_t *query, const simdmatch_filter_t *filter,
+                  int k, int maxchecks, int *ind, float *sqdist)
+{
+    kdforest_scratch_t s;
+    kdforest_scratch_init (&s, f->num);
+
+    int found = kdforest_search (f, query, filter, k, maxchecks, ind, sqdist, &s);
+
+    kdforest_scratch_clear (&s);
+
+    return found;
+}
+
+typedef struct {
+    kdforest_t *f;
+    navlcm_feature_list_t *queries;
+    const simdmatch_filter_t *filter;
+    int k, maxchecks;
+    int start, end;
+    int *ind;
+    float *sqdist;
+} kdforest_job_t;
+
+static gpointer kdforest_job_cb (gpointer data)
+{
+    kdforest_job_t *job = (kdforest_job_t*)data;
+    kdforest_scratch_t s;
+    kdforest_scratch_init (&s, job->f->num);
+
+    for (int i=job->start;i<job->end;i++)
+        kdforest_search (job->f, job->queries->el + i, job->filter, job->k, job->maxchecks,
+                         job->ind + i * job->k, job->sqdist + i * job->k, &s);
+
+    kdforest_scratch_clear (&s);
+
+    return NULL;
+}
+
+/* k-NN search for all the features of <queries>, split across <nthreads> threads
+ * (<= 0 for one per processor). <ind> and <sqdist> have queries->num x k entries.
+ */
+void kdforest_knn_list (kdforest_t *f, navlcm_feature_list_t *queries, const simdmatch_filter_t *filter,
+                        int k, int maxchecks, int nthreads, int *ind, float *sqdist)
+{
+    if (nthreads <= 0)
+        nthreads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+
+    // a thread is not worth it for a handful of queries
+    nthreads = MIN (nthreads, MAX (1, queries->num / 64));
+
+    kdforest_job_t *jobs = (kdforest_job_t*)malloc (nthreads * sizeof(kdforest_job_t));
+    GThread **threads = (GThread**)malloc (nthreads * sizeof(GThread*));
+
+    for (int t=0;t<nthreads;t++) {
+        kdforest_job_t *job = jobs + t;
+        job->f = f;
+        job->queries = queries;
+        job->filter = filter;
+        job->k = k;
+        job->maxchecks = maxchecks;
+        job->start = t * queries->num / nthreads;
+        job->end = (t+1) * queries->num / nthreads;
+        job->ind = ind;
+        job->sqdist = sqdist;
+    }
+
+    // the calling thread takes the first chunk
+    for (int t=1;t<nthreads;t++)
+        threads[t] = g_thread_create (kdforest_job_cb, jobs + t, TRUE, NULL);
+
+    kdforest_job_cb (jobs);
+
+    for (int t=1;t<nthreads;t++)
+        g_thread_join (threads[t]);
+
+    free (threads);
+    free (jobs);
+}
+
@@ -0,0 +1,68 @@
+#ifndef _KDFOREST_H__
+#define _KDFOREST_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+/* From LCM */
+#include <lcmtypes/navlcm_feature_list_t.h>
+
+/* from common */
+#include <common/dbg.h>
+
+#include "simdmatch.h"
+
+/* Randomized kd-tree forest for approximate nearest-neighbour search over
+ * feature descriptors (Silpa-Anan & Hartley, Muja & Lowe).
+ *
+ * Each tree splits on a dimension drawn at random among the KDFOREST_RAND_DIM
+ * dimensions of highest variance, at the mean value. A query descends all the
+ * trees, then explores the closest unexplored branches of the forest (shared
+ * priority queue) until <maxchecks> descriptors have been compared.
+ */
+
+#define KDFOREST_NTREES 4           // default number of trees
+#define KDFOREST_LEAF_SIZE 8        // max. number of descriptors in a leaf
+#define KDFOREST_RAND_DIM 5         // split dimension drawn among the top 5 by variance
+#define KDFOREST_SAMPLE 128         // descriptors used to estimate the variance at a node
+#define KDFOREST_MAX_CHECKS 256     // default bound on the number of descriptor comparisons
+
+typedef struct {
+    int dim;            // split dimension (-1 for a leaf)
+    float val;          // split value
+    int child[2];       // children (internal node)
+    int start, count;   // range in the tree permutation (leaf)
+} kdforest_node_t;
+
+typedef struct {
+    kdforest_node_t *nodes;
+    int nnodes;
+    int *perm;          // descriptor indices, grouped by leaf
+} kdforest_tree_t;
+
+typedef struct {
+    int num;            // number of descriptors
+    int size;           // descriptor length
+    float *data;        // descriptors, row-major copy
+    navlcm_feature_list_t *keys;   // source list (not owned)
+    int ntrees;
+    kdforest_tree_t *trees;
+} kdforest_t;
+
+kdforest_t *kdforest_new (navlcm_feature_list_t *keys, int ntrees, int leaf_size);
+void kdforest_destroy (kdforest_t *f);
+
+int kdforest_knn (kdforest_t *f, navlcm_feature_t *query, const simdmatch_filter_t *filter,
+                  int k, int maxchecks, int *ind, float *sqdist);
+void kdforest_knn_list (kdforest_t *f, navlcm_feature_list_t *queries, const simdmatch_filter_t *filter,
+                        int k, int maxchecks, int nthreads, int *ind, float *sqdist);
+
+#endif
+
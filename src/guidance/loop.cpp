@@ -2,72 +2,410 @@
 
 //#define LOOP_HOUGH_TRANSFORM
 
-double * loop_update_correlation_matrix (double *corrmat, int *size, GQueue *bags, double norm);
+void loop_update_correlation_matrix (corrmat_t *corrmat, bags_vocabulary_t *voctree, int *hits, int nhits, double norm);
 
-double* loop_update_full (GQueue *voctree, double *corrmat, int *corrmat_size, navlcm_feature_list_t *features, int id, double bag_word_radius)
+void loop_update_full (bags_vocabulary_t *voctree, corrmat_t *corrmat, navlcm_feature_list_t *features, int id, double bag_word_radius)
 {
     // init vocabulary
-    if (g_queue_is_empty (voctree)) {
-        bags_init (voctree, features, id);
+    if (voctree->num == 0) {
+        bags_vocabulary_init (voctree, features, id);
     }
 
     // search features in vocabulary
-    GQueue *qfeatures = g_queue_new (); // features that are un-matched (and yield new bags)
-    GQueue *qbags = g_queue_new ();     // bags that found a match
-    bags_naive_search (voctree, features, bag_word_radius, qfeatures, qbags, NULL, 1);
+    int *hits = NULL;                   // words that found a match
+    unsigned char *matched = (unsigned char*)malloc(features->num);
+    int nhits = bags_vocabulary_search (voctree, features, bag_word_radius, &hits, matched, NULL, 1);
 
     // the ratio of matched features
-    double r = 1.0 - 1.0 * g_queue_get_length (qfeatures) / features->num;
+    int nunmatched = 0;
+    for (int i=0;i<features->num;i++)
+        if (!matched[i])
+            nunmatched++;
+    double r = 1.0 - 1.0 * nunmatched / features->num;
 
     // update similarity matrix
-    double *newmat = loop_update_correlation_matrix (corrmat, corrmat_size, qbags, r);
+    loop_update_correlation_matrix (corrmat, voctree, hits, nhits, r);
 
-    // print out
-    //corrmat_print (newmat, *corrmat_size);
+    // create new words for unmatched features
+    for (int i=0;i<features->num;i++)
+        if (!matched[i])
+            bags_vocabulary_append (voctree, features->el + i, id);
+    free (matched);
 
-    //corrmat_print (corrmat, corrmat_size);
-
-    // create new bags for unmatched features
-    bags_append (voctree, qfeatures, id);
-    g_queue_free (qfeatures);
-
-    // update the list of indices for the matched bags
-    bags_update (qbags, id);
-    g_queue_free (qbags);
-
-    return newmat;
+    // update the list of indices for the matched words
+    bags_vocabulary_update (voctree, hits, nhits, id);
+    free (hits);
 }
 
-double * loop_update_correlation_matrix (double *corrmat, int *size, GQueue *bags, double norm)
+/* append the row of the new node to the similarity matrix
+ */
+void loop_update_correlation_matrix (corrmat_t *corrmat, bags_vocabulary_t *voctree, int *hits, int nhits, double norm)
 {
-    if (!corrmat) {
-        *size = 1;
-        return corrmat_init (1, .0);
+    if (corrmat->n == 0) {
+        double zero = .0;
+        corrmat_t_append_row (corrmat, &zero, 1);
+        return;
     } 
     
-    double *m = corrmat_resize_once (corrmat, size, .0);
-    
-    double *sim = bags_naive_vote (bags, *size);
+    int size = corrmat->n + 1;
+
+    double *sim = bags_vocabulary_vote (voctree, hits, nhits, size);
 
     // normalize
-    vect_normalize (sim, *size, norm);
+    vect_normalize (sim, size, norm);
 
     // smoothen
-//    double *sims = math_smooth_double  (sim, *size, 3);
+//    double *sims = math_smooth_double  (sim, size, 3);
 
     printf ("sim vector: \n");
-    for (int i=0;i<*size;i++)
+    for (int i=0;i<size;i++)
         printf ("%.4f ", sim[i]);
     printf ("\n");
 
-    for (int i=0;i<*size;i++) {
-        CORRMAT_SET (m, *size, *size-1, i, sim[i]);
-    }
+    corrmat_t_append_row (corrmat, sim, size);
 
     free (sim);
+}
+
+/* rows of loop_correlation_matrix_parallel voted at once. A batch is kept until its
+ * rows are stored.
+ */
+#define LOOP_VOTE_BATCH 4096
+
+typedef struct {
+    bags_vocabulary_t *voctree;
+    int **hits;             // words hit by node i (NULL if none)
+    int *nhits;
+    double *ratio;          // ratio of matched features of node i
+    int diagn;
+    int width;
+    int first;              // rows first..last-1 in the batch
+    int last;
+    int start;              // this job votes rows first+start, first+start+step...
+    int step;
+    double *sim;            // scratch, one entry per node, zero between rows
+    int *touched;
+    int **cols;             // row first+k at cols[k], vals[k], len[k]
+    float **vals;
+    int *len;
+} loop_vote_job_t;
+
+static int loop_int_comp (const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/* row i of the similarity matrix from the final posting lists: the vote of
+ * bags_vocabulary_vote for the words hit by node i, over the nodes 0..i-1 only, with
+ * the word weights of that time and normalized over them, which is the row
+ * loop_update_correlation_matrix appends for node i. The cells within <diagn> of the diagonal, zeroed by the alignment anyway, are
+ * dropped and only the <width> largest are kept.
+ */
+static int loop_vote_row (loop_vote_job_t *job, int i, int **cols, float **vals)
+{
+    bags_vocabulary_t *v = job->voctree;
+    int nhits = job->nhits[i];
+
+    int *words = (int*)malloc (MAX (1, nhits) * sizeof(int));
+    memcpy (words, job->hits[i], nhits * sizeof(int));
+    qsort (words, nhits, sizeof(int), loop_int_comp);
+
+    int ntouched = 0;
+    double total = .0;
+
+    for (int h=0;h<nhits;) {
+        int j = words[h];
+        int tf = 0;
+        while (h < nhits && words[h] == j) {
+            tf++;
+            h++;
+        }
+        bags_postings_t *p = v->post + j;
+        // the indices are sorted. the weight of the word when row i was appended
+        // is its number of hits by the nodes 0..i-1.
+        int end = 0, nj = 0;
+        while (end < p->num && (int)p->id[end] < i)
+            nj += p->count[end++];
+        if (nj == 0)
+            continue;
+        double w = 1.0 * tf / nj;
+        for (int k=0;k<end;k++) {
+            int id = p->id[k];
+            if (job->sim[id] == .0)
+                job->touched[ntouched++] = id;
+            job->sim[id] += w * p->count[k];
+            total += w * p->count[k];
+        }
+    }
+
+    free (words);
+
+    qsort (job->touched, ntouched, sizeof(int), loop_int_comp);
+
+    *cols = (int*)malloc (MAX (1, ntouched) * sizeof(int));
+    *vals = (float*)malloc (MAX (1, ntouched) * sizeof(float));
+    double scale = total > .0 ? job->ratio[i] / total : .0;
+    int len = 0;
+
+    for (int k=0;k<ntouched;k++) {
+        int id = job->touched[k];
+        if (job->diagn <= 0 || id < i - job->diagn) {
+            (*cols)[len] = id;
+            (*vals)[len] = scale * job->sim[id];
+            len++;
+        }
+        job->sim[id] = .0;
+    }
+
+    if (job->width > 0 && len > job->width) {
+        int *keep = (int*)malloc (len * sizeof(int));
+        len = corrmat_t_top_k (*vals, len, job->width, keep);
+        for (int k=0;k<len;k++) {
+            (*cols)[k] = (*cols)[keep[k]];
+            (*vals)[k] = (*vals)[keep[k]];
+        }
+        free (keep);
+    }
+
+    return len;
+}
+
+static gpointer loop_vote_job_cb (gpointer data)
+{
+    loop_vote_job_t *job = (loop_vote_job_t*)data;
+
+    for (int i=job->first+job->start;i<job->last;i+=job->step) {
+        int k = i - job->first;
+        job->len[k] = job->hits[i] ? loop_vote_row (job, i, job->cols + k, job->vals + k) : 0;
+    }
+
+    return NULL;
+}
+
+/* similarity matrix (CORRMAT_TOPK, <width> entries per row) of the nodes 0..n-1, whose
+ * features are <features> (NULL for an index that is not a node), as loop_update_full
+ * would build it node after node, but with the votes in parallel.
+ *
+ * The vocabulary is built first, in node order: a node is searched before its
+ * unmatched features become words and its index is added to the words it hit. The
+ * rows are then voted from the final posting lists by <nthreads> threads (0 for one per
+ * core), one batch of LOOP_VOTE_BATCH rows at a time. A thread needs one scratch entry
+ * per node and a row only costs the postings of the words it hit, so that the matrix
+ * of tens of thousands of nodes (e.g. several maps appended) is never dense. The word
+ * weights are recovered from the postings of the nodes before the row, so that the
+ * rows are those of loop_update_full.
+ */
+corrmat_t *loop_correlation_matrix_parallel (bags_vocabulary_t *voctree, navlcm_feature_list_t **features, int n, double bag_word_radius, int diagn, int width, int nthreads)
+{
+    if (nthreads <= 0)
+        nthreads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+
+    GTimer *timer = g_timer_new ();
+
+    int **hits = (int**)calloc (MAX (1, n), sizeof(int*));
+    int *nhits = (int*)calloc (MAX (1, n), sizeof(int));
+    double *ratio = (double*)calloc (MAX (1, n), sizeof(double));
+
+    // vocabulary
+    for (int i=0;i<n;i++) {
+        navlcm_feature_list_t *f = features[i];
+        if (!f || f->num == 0)
+            continue;
+
+        if (voctree->num == 0)
+            bags_vocabulary_init (voctree, f, i);
+
+        unsigned char *matched = (unsigned char*)malloc(f->num);
+        nhits[i] = bags_vocabulary_search (voctree, f, bag_word_radius, hits + i, matched, NULL, 1);
+
+        int nunmatched = 0;
+        for (int k=0;k<f->num;k++) {
+            if (!matched[k]) {
+                bags_vocabulary_append (voctree, f->el + k, i);
+                nunmatched++;
+            }
+        }
+        ratio[i] = 1.0 - 1.0 * nunmatched / f->num;
+        free (matched);
+
+        bags_vocabulary_update (voctree, hits[i], nhits[i], i);
+
+        if (i % 1000 == 0)
+            dbg (DBG_CLASS, "vocabulary: node %d/%d, %d words", i, n, voctree->num);
+    }
+
+    double vocabulary_secs = g_timer_elapsed (timer, NULL);
+
+    // votes
+    corrmat_t *m = corrmat_t_new (CORRMAT_TOPK, width);
+    corrmat_t_add_rows (m, n);
+
+    int batch = MIN (LOOP_VOTE_BATCH, MAX (1, n));
+    int **cols = (int**)calloc (batch, sizeof(int*));
+    float **vals = (float**)calloc (batch, sizeof(float*));
+    int *len = (int*)calloc (batch, sizeof(int));
+
+    loop_vote_job_t *jobs = (loop_vote_job_t*)calloc (nthreads, sizeof(loop_vote_job_t));
+    GThread **threads = (GThread**)calloc (nthreads, sizeof(GThread*));
+    for (int t=0;t<nthreads;t++) {
+        loop_vote_job_t *job = jobs + t;
+        job->voctree = voctree;
+        job->hits = hits;
+        job->nhits = nhits;
+        job->ratio = ratio;
+        job->diagn = diagn;
+        job->width = width;
+        job->start = t;
+        job->step = nthreads;
+        job->sim = (double*)calloc (MAX (1, n), sizeof(double));
+        job->touched = (int*)malloc (MAX (1, n) * sizeof(int));
+        job->cols = cols;
+        job->vals = vals;
+        job->len = len;
+    }
+
+    for (int first=0;first<n;first+=batch) {
+        int last = MIN (n, first + batch);
+
+        for (int t=0;t<nthreads;t++) {
+            jobs[t].first = first;
+            jobs[t].last = last;
+        }
+        for (int t=1;t<nthreads;t++)
+            threads[t] = g_thread_create (loop_vote_job_cb, jobs + t, TRUE, NULL);
+        loop_vote_job_cb (jobs);
+        for (int t=1;t<nthreads;t++)
+            g_thread_join (threads[t]);
+
+        for (int i=first;i<last;i++) {
+            int k = i - first;
+            if (hits[i])
+                corrmat_t_set_row (m, i, cols[k], vals[k], len[k]);
+            free (cols[k]);
+            free (vals[k]);
+            cols[k] = NULL;
+            vals[k] = NULL;
+        }
+    }
+
+    for (int t=0;t<nthreads;t++) {
+        free (jobs[t].sim);
+        free (jobs[t].touched);
+    }
+    free (jobs);
+    free (threads);
+    free (cols);
+    free (vals);
+    free (len);
+
+    for (int i=0;i<n;i++)
+        free (hits[i]);
+    free (hits);
+    free (nhits);
+    free (ratio);
+
+    dbg (DBG_CLASS, "similarity of %d nodes: vocabulary of %d words in %.1f secs, %d entries in %.1f secs (%d threads)", n,
+            voctree->num, vocabulary_secs, (int)m->num, g_timer_elapsed (timer, NULL) - vocabulary_secs, nthreads);
+
+    g_timer_destroy (timer);
 
     return m;
+}
+
+/* two sessions of <n> nodes, the second one a noisy copy of the first: the similarity
+ * matrix must not depend on the number of threads, its rows must have the entries of
+ * those loop_update_full appends (with the same sum) and every node of the second
+ * session must be the most similar to its copy (or a neighbor of it) in the first one.
+ */
+int loop_correlation_unit_testing (int n, int nfeatures)
+{
+    srand (time (NULL));
+
+    navlcm_feature_list_t **features = (navlcm_feature_list_t**)calloc (2*n, sizeof(navlcm_feature_list_t*));
+    for (int i=0;i<n;i++) {
+        // consecutive nodes share half of their features
+        navlcm_feature_list_t *fs = bags_random_feature_list (nfeatures, 128);
+        for (int k=0;i>0 && k<nfeatures/2;k++)
+            memcpy (fs->el[k].data, features[i-1]->el[nfeatures/2+k].data, fs->desc_size*sizeof(float));
+        features[i] = fs;
+
+        navlcm_feature_list_t *fs2 = navlcm_feature_list_t_copy (fs);
+        for (int k=0;k<nfeatures;k++) {
+            navlcm_feature_t *f = fs2->el + k;
+            for (int d=0;d<f->size;d++)
+                f->data[d] = fmax (0, f->data[d] + .05 * (1.0 * rand() / RAND_MAX - .5));
+            math_normalize_float (f->data, f->size);
+        }
+        features[n+i] = fs2;
+    }
+
+    corrmat_t *m[2];
+    for (int r=0;r<2;r++) {
+        bags_vocabulary_t *voctree = bags_vocabulary_new ();
+        m[r] = loop_correlation_matrix_parallel (voctree, features, 2*n, BAGS_WORD_RADIUS, 2, 32, r == 0 ? 1 : 4);
+        bags_vocabulary_destroy (voctree);
+    }
+
+    // reference: the rows appended node after node, against the full parallel rows
+    corrmat_t *mfull = corrmat_t_new (CORRMAT_TOPK, 0);
+    bags_vocabulary_t *voctree = bags_vocabulary_new ();
+    for (int i=0;i<2*n;i++)
+        loop_update_full (voctree, mfull, features[i], i, BAGS_WORD_RADIUS);
+    bags_vocabulary_destroy (voctree);
+
+    voctree = bags_vocabulary_new ();
+    corrmat_t *mpar = loop_correlation_matrix_parallel (voctree, features, 2*n, BAGS_WORD_RADIUS, 0, 0, 4);
+    bags_vocabulary_destroy (voctree);
+
+    int nref = 0;
+    for (int i=0;i<2*n;i++) {
+        const int *cols[2];
+        const float *vals[2];
+        int first[2], len[2];
+        len[0] = corrmat_t_row (mfull, i, cols, vals, first);
+        len[1] = corrmat_t_row (mpar, i, cols + 1, vals + 1, first + 1);
+        gboolean differ = len[0] != len[1] || memcmp (cols[0], cols[1], len[0]*sizeof(int));
+        for (int k=0;!differ && k<len[0];k++)
+            if (fabs (vals[0][k] - vals[1][k]) > 1E-6)
+                differ = TRUE;
+        if (differ)
+            nref++;
+    }
+
+    corrmat_t_destroy (mfull);
+    corrmat_t_destroy (mpar);
+
+    int ndiff = 0, nmissed = 0;
+    for (int i=0;i<2*n;i++) {
+        const int *cols[2];
+        const float *vals[2];
+        int first[2], len[2];
+        for (int r=0;r<2;r++)
+            len[r] = corrmat_t_row (m[r], i, cols + r, vals + r, first + r);
+        if (len[0] != len[1] || memcmp (cols[0], cols[1], len[0]*sizeof(int)) || memcmp (vals[0], vals[1], len[0]*sizeof(float)))
+            ndiff++;
+
+        if (i < n)
+            continue;
+
+        int best = -1;
+        for (int k=0;k<len[0];k++)
+            if (cols[0][k] < n && (best < 0 || vals[0][k] > vals[0][best]))
+                best = k;
+        if (best < 0 || abs (cols[0][best] - (i-n)) > 1)
+            nmissed++;
+    }
+
+    dbg (DBG_INFO, "[loop] %d x %d nodes: %d rows differ with 4 threads, %d from loop_update_full, %d nodes missed their copy, %d entries", n, n,
+            ndiff, nref, nmissed, (int)m[0]->num);
+
+    corrmat_t_destroy (m[0]);
+    corrmat_t_destroy (m[1]);
+    for (int i=0;i<2*n;i++)
+        navlcm_feature_list_t_destroy (features[i]);
+    free (features);
 
+    return ndiff + nref + nmissed;
 }
 
 double loop_line_slope (CvPoint *l)
@@ -94,12 +432,13 @@ void loop_print_line (CvPoint *l)
     printf ("%d %d %d %d (%.3f)\n", l[0].x, l[1].x, l[0].y, l[1].y, loop_line_slope (l));
 }
 
-void loop_refine_line (CvPoint *l, double *data, int size)
+void loop_refine_line (CvPoint *l, corrmat_t *data)
 {
     int winsize = 6;
+    int size = data->n;
     int x0 = l[0].x, x1=l[1].x, y0=l[0].y, y1=l[1].y;
-    double dref0 = data[y0*size+x0];
-    double dref1 = data[y1*size+x1];
+    double dref0 = CORRMAT_T_GET (data, y0, x0);
+    double dref1 = CORRMAT_T_GET (data, y1, x1);
 
     printf ("refining...\n");
     loop_print_line (l);
@@ -109,7 +448,7 @@ void loop_refine_line (CvPoint *l, double *data, int size)
             int xx0 = x0 + i - winsize/2;
             int yy0 = y0 + j - winsize/2;
             if (0 <= xx0 && xx0 < size && 0 <= y0 && yy0 < size) {
-                double d = data[yy0*size+xx0];
+                double d = CORRMAT_T_GET (data, yy0, xx0);
 //                printf ("comparing %d %d (%.3f) with %d %d (%.3f)\n", x0, y0, dref0, xx0, yy0, d);
                 if (dref0 < d) {
                     dref0 = d;
@@ -120,7 +459,7 @@ void loop_refine_line (CvPoint *l, double *data, int size)
             int xx1 = x1 + i - winsize/2;
             int yy1 = y1 + j - winsize/2;
             if (0 <= xx1 && xx1 < size && 0 <= y1 && yy1 < size) {
-                double d = data[yy1*size+xx1];
+                double d = CORRMAT_T_GET (data, yy1, xx1);
                 if (dref1 < d) {
                     dref1 = d;
                     l[1].x = xx1;
@@ -134,11 +473,11 @@ void loop_refine_line (CvPoint *l, double *data, int size)
            
 }
 
-void loop_refine_lines (GQueue *lines, double *data, int size)
+void loop_refine_lines (GQueue *lines, corrmat_t *data)
 {
     for (GList *iter=g_queue_peek_head_link (lines);iter;iter=iter->next) {
         CvPoint *l = (CvPoint*)iter->data;
-        loop_refine_line (l, data, size);
+        loop_refine_line (l, data);
     }
 }
 
@@ -239,86 +578,192 @@ void loop_fuse_lines (GQueue *lines, double theta_thresh, double pixel_thresh)
         }
     }
 }
-void loop_hough_transform (double *m, int n, gboolean reverse, GQueue *mlines, double canny_thresh, double hough_thresh)
+/* the Hough transform runs on square tiles of the matrix, in parallel. Tiles overlap
+ * by more than the longest gap of a segment plus the kernel, so that a segment that
+ * crosses a tile border is found in both tiles; the pieces are then fused. Each tile
+ * has its own list of segments, so that the output is in tile order whatever the
+ * number of threads.
+ */
+#define LOOP_HOUGH_TILE 512
+#define LOOP_HOUGH_OVERLAP 32
+
+typedef struct {
+    corrmat_t *m;
+    gboolean reverse;
+    double maxv;
+    double canny_thresh, hough_thresh;
+    int size;           // tile size
+    int *tiles;         // (row, col) of the top-left corner of each tile
+    int ntiles;
+    int start, step;    // tiles start, start + step, ...
+    GQueue **lines;     // segments of tile t in lines[t]
+} loop_hough_job_t;
+
+static gpointer loop_hough_job_cb (gpointer data)
 {
-    double maxv = corrmat_max (m, n);
-
-    dbg (DBG_CLASS, "maxv = %.3f\n", maxv);
+    loop_hough_job_t *job = (loop_hough_job_t*)data;
+    corrmat_t *m = job->m;
+    int ts = job->size;
 
-    // create image
-    IplImage *src = cvCreateImage (cvSize (n, n), 8, 1);
-    IplImage *dst8 = cvCreateImage (cvSize (n, n), 8, 1);
-    IplImage *canny = cvCreateImage (cvSize (n, n), 8, 1);
-    IplImage* color_dst = cvCreateImage( cvGetSize(src), 8, 3 );
-    IplImage* canny_color_dst = cvCreateImage( cvGetSize(src), 8, 3 );
+    IplImage *src = cvCreateImage (cvSize (ts, ts), 8, 1);
+    IplImage *dst8 = cvCreateImage (cvSize (ts, ts), 8, 1);
+    IplImage *canny = cvCreateImage (cvSize (ts, ts), 8, 1);
+    CvMemStorage* storage = cvCreateMemStorage(0);
 
     int step = src->widthStep / sizeof (unsigned char);
-    unsigned char *data = (unsigned char*)src->imageData;
-
-    for (int i=0;i<n;i++) {
-        for (int j=0;j<n;j++) {
+    unsigned char *pix = (unsigned char*)src->imageData;
 
-            unsigned char val = MAX (0, MIN (255, (int)(m[i*n+j]/maxv*255.0)));
-            data[i*step+j] = val;
+    double kern1[] = { 0, 1, 2, -1, 0, 1, -2, -1, 0};
+    double kern2[] = { -2, -1, 0, -1, 0, 1, 0, 1, 2};
+    CvMat *kernel = cvCreateMatHeader (3, 3, CV_64FC1);
+    cvSetData (kernel, job->reverse ? kern2 : kern1, 3*8);
+
+    for (int t=job->start;t<job->ntiles;t+=job->step) {
+        int y0 = job->tiles[2*t];
+        int x0 = job->tiles[2*t+1];
+
+        // only the stored entries are non-zero
+        memset (pix, 0, ts * step);
+        int count = 0;
+        for (int i=y0;i<MIN (m->n, y0+ts);i++) {
+            const int *cols;
+            const float *vals;
+            int first;
+            int len = corrmat_t_row (m, i, &cols, &vals, &first);
+            for (int k=0;k<len;k++) {
+                int j = cols ? cols[k] : first + k;
+                if (j < x0) continue;
+                if (j >= x0 + ts) break;
+                unsigned char val = MAX (0, MIN (255, (int)(vals[k]/job->maxv*255.0)));
+                pix[(i-y0)*step+(j-x0)] = val;
+                if (val)
+                    count++;
+            }
         }
-    }
+        if (count == 0)
+            continue;
 
-    CvMemStorage* storage = cvCreateMemStorage(0);
-    CvSeq* lines = 0;
+        cvFilter2D (src, dst8, kernel, cvPoint (-1, -1));
 
-    cvCvtColor( src, color_dst, CV_GRAY2BGR );
+        cvCanny (dst8, canny, job->canny_thresh, 3*job->canny_thresh, 3);
 
-    cvSaveImage (reverse ? "input-reverse.png" : "input.png", color_dst);
+        CvSeq *lines = cvHoughLines2( canny, storage, CV_HOUGH_PROBABILISTIC, 1, CV_PI/180, job->hough_thresh, 10, 5 );
 
-    double kern1[] = { 0, 1, 2, -1, 0, 1, -2, -1, 0};
-    double kern2[] = { -2, -1, 0, -1, 0, 1, 0, 1, 2};
-    CvMat *kernel = cvCreateMatHeader (3, 3, CV_64FC1);
+        for(int i = 0; i < lines->total; i++ )
+        {
+            CvPoint* line = (CvPoint*)cvGetSeqElem(lines,i);
 
-    cvSetData (kernel, reverse ? kern2 : kern1, 3*8);
+            double slope = loop_line_slope (line);
+            if (job->reverse && slope > 0) continue;
+            if (!job->reverse && slope < 0) continue;
 
-    cvFilter2D (src, dst8, kernel, cvPoint (-1, -1));
+            CvPoint *clone = (CvPoint*)malloc(2*sizeof(CvPoint));
+            clone[0] = cvPoint (line[0].x + x0, line[0].y + y0);
+            clone[1] = cvPoint (line[1].x + x0, line[1].y + y0);
 
-    cvCanny (dst8, canny, canny_thresh, 3*canny_thresh, 3);
+            g_queue_push_tail (job->lines[t], clone);
+        }
 
-    cvCvtColor( canny, canny_color_dst, CV_GRAY2BGR );
-    cvSaveImage (reverse ? "canny-reverse.png" : "canny.png", canny_color_dst);
+        cvClearMemStorage (storage);
+    }
+
+    cvReleaseMat (&kernel);
+    cvReleaseImage (&src);
+    cvReleaseImage (&dst8);
+    cvReleaseImage (&canny);
+    cvReleaseMemStorage (&storage);
 
-    lines = cvHoughLines2( canny, storage, CV_HOUGH_PROBABILISTIC, 1, CV_PI/180, hough_thresh, 10, 5 );
+    return NULL;
+}
 
-    for(int i = 0; i < lines->total; i++ )
-    {
-        CvPoint* line = (CvPoint*)cvGetSeqElem(lines,i);
+/* Hough transform on tiles of size <tile> overlapping by <overlap>, on <nthreads> threads
+ * (0 for one per core). A tile larger than the matrix gives the untiled transform.
+ */
+static void loop_hough_transform_tiles (corrmat_t *m, gboolean reverse, GQueue *mlines, double canny_thresh, double hough_thresh,
+                                        int tile, int overlap, int nthreads)
+{
+    int n = m->n;
+    double maxv = corrmat_t_max (m);
 
-        double slope = loop_line_slope (line);
-        if (reverse && slope > 0) continue;
-        if (!reverse && slope < 0) continue;
+    dbg (DBG_CLASS, "maxv = %.3f\n", maxv);
 
-//        if (fabs (1.0 - fabs (slope)) > 2.1)
-//            continue;
+    if (n == 0 || maxv <= .0)
+        return;
+
+    // tiles that meet the lower triangle
+    int stride = tile - overlap;
+    int ntiles = 0;
+    int *tiles = (int*)malloc (2 * ((n + stride - 1) / stride) * ((n + stride - 1) / stride) * sizeof(int));
+    for (int y0=0;y0 < n;y0+=stride) {
+        for (int x0=0;x0 <= y0 + tile && x0 < n;x0+=stride) {
+            tiles[2*ntiles] = y0;
+            tiles[2*ntiles+1] = x0;
+            ntiles++;
+            if (x0 + tile >= n)
+                break;
+        }
+        if (y0 + tile >= n)
+            break;
+    }
 
-        CvPoint *clone = (CvPoint*)malloc(2*sizeof(CvPoint));
-        clone[0] = line[0];
-        clone[1] = line[1];
+    if (nthreads <= 0)
+        nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+    nthreads = MAX (1, MIN (ntiles, nthreads));
+
+    GQueue **lines = (GQueue**)malloc (ntiles * sizeof(GQueue*));
+    for (int t=0;t<ntiles;t++)
+        lines[t] = g_queue_new ();
+
+    loop_hough_job_t *jobs = (loop_hough_job_t*)malloc (nthreads * sizeof(loop_hough_job_t));
+    GThread **threads = (GThread**)malloc (nthreads * sizeof(GThread*));
+
+    for (int t=0;t<nthreads;t++) {
+        loop_hough_job_t *job = jobs + t;
+        job->m = m;
+        job->reverse = reverse;
+        job->maxv = maxv;
+        job->canny_thresh = canny_thresh;
+        job->hough_thresh = hough_thresh;
+        job->size = tile;
+        job->tiles = tiles;
+        job->ntiles = ntiles;
+        job->start = t;
+        job->step = nthreads;
+        job->lines = lines;
+    }
 
+    // the calling thread takes the first chunk
+    for (int t=1;t<nthreads;t++)
+        threads[t] = g_thread_create (loop_hough_job_cb, jobs + t, TRUE, NULL);
 
-        printf ("line at : %d %d %d %d %.3f\n", line[0].x, line[0].y, line[1].x, line[1].y, slope);
-        g_queue_push_tail (mlines, clone);
+    loop_hough_job_cb (jobs);
 
-        cvLine( color_dst, line[0], line[1], CV_RGB(255,0,0), 3, 8 );
+    for (int t=1;t<nthreads;t++)
+        g_thread_join (threads[t]);
 
+    // segments in tile order, then fused across tile borders
+    int nlines = 0;
+    for (int t=0;t<ntiles;t++) {
+        while (!g_queue_is_empty (lines[t])) {
+            CvPoint *line = (CvPoint*)g_queue_pop_head (lines[t]);
+            printf ("line at : %d %d %d %d %.3f\n", line[0].x, line[0].y, line[1].x, line[1].y, loop_line_slope (line));
+            g_queue_push_tail (mlines, line);
+            nlines++;
+        }
+        g_queue_free (lines[t]);
     }
-    cvLine (color_dst, cvPoint (0,0), cvPoint(n-1,n-1), CV_RGB(0,255,0), 3, 8);
 
-    cvFlip (color_dst);
-    cvSaveImage (reverse ? "color-reverse.png" : "color.png", color_dst);
+    dbg (DBG_CLASS, "%d segments in %d tiles (%d threads)", nlines, ntiles, nthreads);
 
-    cvReleaseImage (&src);
-    cvReleaseImage (&dst8);
-    cvReleaseImage (&canny);
-    cvReleaseImage (&color_dst);
-    cvReleaseImage (&canny_color_dst);
-    cvClearMemStorage (storage);
+    free (lines);
+    free (threads);
+    free (jobs);
+    free (tiles);
+}
 
+void loop_hough_transform (corrmat_t *m, gboolean reverse, GQueue *mlines, double canny_thresh, double hough_thresh)
+{
+    loop_hough_transform_tiles (m, reverse, mlines, canny_thresh, hough_thresh, LOOP_HOUGH_TILE, LOOP_HOUGH_OVERLAP, 0);
 }
 
 void loop_free_lines (GQueue *lines)
@@ -330,6 +775,99 @@ void loop_free_lines (GQueue *lines)
     g_queue_free (lines);
 }
 
+/* number of end points of <lines1> farther than <dist> from all the segments of <lines2>
+ */
+static int loop_lines_uncovered (GQueue *lines1, GQueue *lines2, double dist)
+{
+    int count = 0;
+    for (GList *iter1=g_queue_peek_head_link (lines1);iter1;iter1=iter1->next) {
+        CvPoint *l1 = (CvPoint*)iter1->data;
+        for (int e=0;e<2;e++) {
+            gboolean covered = FALSE;
+            for (GList *iter2=g_queue_peek_head_link (lines2);iter2 && !covered;iter2=iter2->next) {
+                CvPoint *l2 = (CvPoint*)iter2->data;
+                double d;
+                if (math_project_2d_segment (l1[e].x, l1[e].y, l2[0].x, l2[0].y, l2[1].x, l2[1].y, NULL, NULL, &d) && d < dist)
+                    covered = TRUE;
+            }
+            if (!covered)
+                count++;
+        }
+    }
+    return count;
+}
+
+/* an <n> x <n> matrix with forward and reverse segments that cross tile borders: the
+ * tiled transform must give the same segments in tile order on any number of threads,
+ * and the same segments as the untiled transform up to the cuts at tile borders.
+ * Returns the number of failures.
+ */
+int loop_hough_unit_testing (int n)
+{
+    srand (time (NULL));
+
+    double *dense = corrmat_init (n, .0);
+    for (int i=0;i<n;i++)
+        for (int j=0;j<=i;j++)
+            CORRMAT_SET (dense, n, i, j, .05 * rand () / RAND_MAX);
+
+    // (row, col) of the end points of each segment, 3 cells wide
+    int segments[][4] = { { n/5, n/5-n/8, 4*n/5, 4*n/5-n/8 }, { n/2, n/20, n-1, n/2+n/20-1 }, 
+                          { 3*n/5, 2*n/5, 4*n/5, n/5 } };
+    for (int s=0;s<3;s++) {
+        int *sg = segments[s];
+        int dj = sg[3] > sg[1] ? 1 : -1;
+        for (int i=sg[0], j=sg[1];i<=sg[2];i++, j+=dj)
+            for (int w=-1;w<=1;w++)
+                if (0 <= j+w && j+w <= i)
+                    CORRMAT_SET (dense, n, i, j+w, 1.0);
+    }
+
+    corrmat_t *m = corrmat_t_from_dense (dense, n, CORRMAT_DENSE, 0);
+    free (dense);
+
+    int failed = 0;
+
+    for (int r=0;r<2;r++) {
+        gboolean reverse = r == 1;
+
+        GQueue *tiled[2];
+        for (int k=0;k<2;k++) {
+            tiled[k] = g_queue_new ();
+            loop_hough_transform_tiles (m, reverse, tiled[k], 180, 10, LOOP_HOUGH_TILE, LOOP_HOUGH_OVERLAP, k == 0 ? 4 : 1);
+        }
+
+        // same segments, in the same order, on 4 threads and on one
+        gboolean same = g_queue_get_length (tiled[0]) == g_queue_get_length (tiled[1]);
+        for (GList *iter1=g_queue_peek_head_link (tiled[0]), *iter2=g_queue_peek_head_link (tiled[1]);same && iter1 && iter2;
+                iter1=iter1->next, iter2=iter2->next)
+            same = memcmp (iter1->data, iter2->data, 2*sizeof(CvPoint)) == 0;
+        if (!same)
+            failed++;
+
+        GQueue *untiled = g_queue_new ();
+        loop_hough_transform_tiles (m, reverse, untiled, 180, 10, MAX (1, n), 0, 1);
+
+        // the pieces of a segment across tiles lie on the untiled segment and its end
+        // points lie on the pieces
+        int missed = loop_lines_uncovered (untiled, tiled[0], 10) + loop_lines_uncovered (tiled[0], untiled, 10);
+        if (missed > 0 || g_queue_is_empty (untiled))
+            failed++;
+
+        dbg (DBG_INFO, "[loop] hough %d x %d (%s): %d tiled segments, %d untiled, %s order, %d end points missed", n, n,
+                reverse ? "reverse" : "forward", g_queue_get_length (tiled[0]), g_queue_get_length (untiled),
+                same ? "same" : "different", missed);
+
+        loop_free_lines (tiled[0]);
+        loop_free_lines (tiled[1]);
+        loop_free_lines (untiled);
+    }
+
+    corrmat_t_destroy (m);
+
+    return failed;
+}
+
 component_t* loop_index_to_component (int x0, int x1, int y0, int y1, gboolean reverse, int min_length)
 {
     int stx = x1 - x0 ;
@@ -406,7 +944,7 @@ void loop_lines_to_components (GQueue *lines, GQueue *components, gboolean rever
  * alignment_min_node_id:       minimum node ID for a sequence (50)
  *
  */
-GQueue* loop_extract_components_from_correlation_matrix (double *corrmat, int size, gboolean smooth, double canny_thresh, 
+GQueue* loop_extract_components_from_correlation_matrix (corrmat_t *corrmat, gboolean smooth, double canny_thresh, 
         double hough_thresh, int min_seq_length, double correlation_diag_size, double correlation_threshold, 
         double alignment_penalty, double alignment_threshold, double alignment_tail_thresh, 
         int alignment_min_diag_distance, double alignment_max_slope_error, int alignment_search_radius,
@@ -418,25 +956,23 @@ GQueue* loop_extract_components_from_correlation_matrix (double *corrmat, int si
     if (!corrmat)
         return components;
 
-    double *corrmatdup = corrmat_copy (corrmat, size);
-
 #ifdef LOOP_HOUGH_TRANSFORM // method 1 (deprecated)
 
     GQueue *lines = g_queue_new ();
 
-    loop_hough_transform (corrmatdup, size, FALSE, lines, canny_thresh, hough_thresh);
+    loop_hough_transform (corrmat, FALSE, lines, canny_thresh, hough_thresh);
     loop_fuse_lines (lines, to_radians (10.0), 5);
     loop_print_lines (lines);
-    loop_refine_lines (lines, corrmatdup, size);
+    loop_refine_lines (lines, corrmat);
     loop_lines_to_components (lines, components, FALSE, min_seq_length);
     loop_free_lines (lines);
 
     // same thing in reverse
     lines = g_queue_new ();
-    loop_hough_transform (corrmatdup, size, TRUE, lines, canny_thresh, hough_thresh);
+    loop_hough_transform (corrmat, TRUE, lines, canny_thresh, hough_thresh);
     loop_fuse_lines (lines, to_radians (10.0), 5);
     loop_print_lines (lines);
-    loop_refine_lines (lines, corrmatdup, size);
+    loop_refine_lines (lines, corrmat);
     loop_lines_to_components (lines, components, TRUE, min_seq_length);
     loop_free_lines (lines);
 
@@ -444,66 +980,42 @@ GQueue* loop_extract_components_from_correlation_matrix (double *corrmat, int si
 
 #else // method 2 (active)
 
-    double *hmat = NULL, *hmatrev = NULL;
-    int *hmatind = NULL, *hmatindrev = NULL;
-    double *corrmatrev = NULL;
+    corrmat_t *hmat = NULL, *hmatrev = NULL;
+    corrmat_t *hmatind = NULL, *hmatindrev = NULL;
 
     double kern1[] = { 0, 1, 2, -1, 0, 1, -2, -1, 0};
     double kern2[] = { -2, -1, 0, -1, 0, 1, 0, 1, 2};
 
-    corrmatrev = corrmat_copy (corrmatdup, size);
-
-    // set diagonal to zero
-    int diagn = correlation_diag_size;
-    for (int i=0;i<size;i++) {
-        for (int j=0;j<2*diagn;j++) {
-            if (diagn <= i + j && i + j < size + diagn)
-                CORRMAT_SET (corrmatdup, size, i, i + j-diagn, .0);
-        }
-    }
-
-    corrmat_convolve (corrmatdup, size, kern1, 3);
-    corrmat_write (corrmatdup, size, "corrmat-conv.txt");
-
-    // reverse the correlation matrix
-    corrmat_convolve (corrmatrev, size, kern2, 3);
-    corrmat_reverse (corrmatrev, size);
-    corrmat_write (corrmatrev, size, "corrmatrev-conv.txt");
-
-    // compute alignment matrix
+    // compute alignment matrix on the convolved correlation matrix, with the diagonal
+    // set to zero for the forward direction. Only the cells above the correlation
+    // threshold are stored.
     //    double thresh = .001;
     //    double penalty = .0001;
+    int diagn = correlation_diag_size;
 
-    corrmat_compute_alignment_matrix (corrmatdup, size, correlation_threshold, alignment_penalty, FALSE, &hmat, &hmatind);
-    corrmat_compute_alignment_matrix (corrmatrev, size, correlation_threshold, alignment_penalty, TRUE, &hmatrev, &hmatindrev);
-    corrmat_reverse (hmatrev, size);
-    corrmat_int_reverse (hmatindrev, size);
+    corrmat_t_compute_alignment_matrices (corrmat, kern1, kern2, 3, diagn, correlation_threshold, alignment_penalty, 0, 
+            &hmat, &hmatind, &hmatrev, &hmatindrev);
 
-    // write alignment matrix to file
-    corrmat_write (hmat, size, "hmat.txt");
-    corrmat_int_write (hmatind, size, "hmatind.txt");
-    corrmat_write (hmatrev, size, "hmatrev.txt");
-    corrmat_int_write (hmatindrev, size, "hmatindrev.txt");
+    dbg (DBG_CLASS, "alignment matrices: %d + %d entries", (int)hmat->num, (int)hmatrev->num);
 
     // find components
     //double minthresh = .15;
     //double alignment_tail_thresh = 0.005;
-    corrmat_find_component_list (hmat, hmatind, hmatrev, hmatindrev, size, alignment_threshold, alignment_tail_thresh, min_seq_length, alignment_min_diag_distance, alignment_max_slope_error, alignment_search_radius, alignment_min_node_id, components);
+    corrmat_t_find_component_list (hmat, hmatind, hmatrev, hmatindrev, alignment_threshold, alignment_tail_thresh, min_seq_length, alignment_min_diag_distance, alignment_max_slope_error, alignment_search_radius, alignment_min_node_id, components);
 
-    free (hmat);
-    free (hmatind);
-    free (hmatrev);
-    free (hmatindrev);
-    free (corrmatdup);
-    free (corrmatrev);
+    corrmat_t_destroy (hmat);
+    corrmat_t_destroy (hmatind);
+    corrmat_t_destroy (hmatrev);
+    corrmat_t_destroy (hmatindrev);
 
     return components;
 #endif
 }
 
-void loop_matrix_components_to_image (double *corrmat, int size, GQueue *components)
+void loop_matrix_components_to_image (corrmat_t *corrmat, GQueue *components)
 {
-    double maxv = corrmat_max (corrmat, size);
+    int size = corrmat->n;
+    double maxv = corrmat_t_max (corrmat);
 
     // create image
     IplImage *src = cvCreateImage (cvSize (size, size), 8, 1);
@@ -517,10 +1029,17 @@ void loop_matrix_components_to_image (double *corrmat, int size, GQueue *compone
     unsigned char *data2 = (unsigned char*)src2->imageData;
     unsigned char *data2_rgb = (unsigned char*)src2_rgb->imageData;
 
+    // only the stored entries are not blank
+    memset (data, 255, size * step);
+    memset (data2, 255, size * step);
     for (int i=0;i<size;i++) {
-        for (int j=0;j<size;j++) {
-
-            unsigned char val = 255-MAX (0, MIN (255, (int)(corrmat[i*size+j]/maxv*255.0)));
+        const int *cols;
+        const float *vals;
+        int first;
+        int len = corrmat_t_row (corrmat, i, &cols, &vals, &first);
+        for (int k=0;k<len;k++) {
+            int j = cols ? cols[k] : first + k;
+            unsigned char val = 255-MAX (0, MIN (255, (int)(vals[k]/maxv*255.0)));
             data[(size-1-i)*step+j] = val;
             data2[(size-1-i)*step+j] = val;
         }
@@ -9,14 +9,17 @@
 #include <opencv/cv.h>
 #include <opencv/highgui.h>
 
-double* loop_update_full (GQueue *voctree, double *corrmat, int *corrmat_size, navlcm_feature_list_t *features, int id, double bag_word_radius);
+void loop_update_full (bags_vocabulary_t *voctree, corrmat_t *corrmat, navlcm_feature_list_t *features, int id, double bag_word_radius);
+corrmat_t *loop_correlation_matrix_parallel (bags_vocabulary_t *voctree, navlcm_feature_list_t **features, int n, double bag_word_radius, int diagn, int width, int nthreads);
+int loop_correlation_unit_testing (int n, int nfeatures);
+int loop_hough_unit_testing (int n);
 component_t* loop_index_to_component (int x0, int x1, int y0, int y1, gboolean reverse, int min_length);
 void loop_line_to_component (CvPoint *l, GQueue *components, gboolean reverse, int min_length);
-GQueue* loop_extract_components_from_correlation_matrix (double *corrmat, int size, gboolean smooth, double canny_thresh, 
+GQueue* loop_extract_components_from_correlation_matrix (corrmat_t *corrmat, gboolean smooth, double canny_thresh, 
         double hough_thresh, int min_seq_length, double correlation_diag_size, double correlation_threshold, 
         double alignment_penalty, double alignment_threshold, double alignment_tail_thresh, 
         int alignment_min_diag_distance, double alignment_max_slope_error, int alignment_search_radius, int alignment_min_node_id);
-void loop_matrix_components_to_image (double *corrmat, int size, GQueue *components);
+void loop_matrix_components_to_image (corrmat_t *corrmat, GQueue *components);
 
 
 #endif
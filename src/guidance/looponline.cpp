@@ -0,0 +1,489 @@
+#include "looponline.h"
+
+typedef struct {
+    navlcm_feature_list_t *features;
+    int id;
+} loop_online_node_t;
+
+static double loop_online_kern[2][9] = {{ 0, 1, 2, -1, 0, 1, -2, -1, 0},
+                                        { -2, -1, 0, -1, 0, 1, 0, 1, 2}};
+
+void loop_online_params_init (loop_online_params_t *p)
+{
+    p->bag_word_radius = BAGS_WORD_RADIUS;
+    p->correlation_diag_size = 10;
+    p->correlation_threshold = .001;
+    p->alignment_penalty = .0001;
+    p->alignment_threshold = .1;
+    p->alignment_tail_thresh = .005;
+    p->alignment_min_diag_distance = 20;
+    p->alignment_max_slope_error = 25.0;
+    p->alignment_search_radius = 10;
+    p->alignment_min_node_id = 50;
+    p->min_seq_length = 2;
+    p->budget_ms = 50.0;
+}
+
+loop_online_t *loop_online_new (const loop_online_params_t *p, int corrmat_mode, int corrmat_width)
+{
+    loop_online_t *lo = (loop_online_t*)calloc (1, sizeof(loop_online_t));
+
+    lo->param = *p;
+    lo->voctree = bags_vocabulary_new ();
+    lo->corrmat = corrmat_t_new (corrmat_mode, corrmat_width);
+    for (int r=0;r<2;r++) {
+        lo->h[r] = corrmat_t_new (CORRMAT_TOPK, 0);
+        lo->hind[r] = corrmat_t_new (CORRMAT_TOPK, 0);
+    }
+
+    lo->mutex = g_mutex_new ();
+    lo->cond = g_cond_new ();
+    lo->nodes = g_queue_new ();
+    lo->components = g_queue_new ();
+
+    return lo;
+}
+
+void loop_online_destroy (loop_online_t *lo)
+{
+    if (!lo)
+        return;
+
+    if (lo->thread) {
+        g_mutex_lock (lo->mutex);
+        lo->exit = TRUE;
+        g_cond_signal (lo->cond);
+        g_mutex_unlock (lo->mutex);
+        g_thread_join (lo->thread);
+    }
+
+    while (!g_queue_is_empty (lo->nodes)) {
+        loop_online_node_t *nd = (loop_online_node_t*)g_queue_pop_head (lo->nodes);
+        navlcm_feature_list_t_destroy (nd->features);
+        free (nd);
+    }
+    g_queue_free (lo->nodes);
+
+    while (!g_queue_is_empty (lo->components)) {
+        component_t *c = (component_t*)g_queue_pop_head (lo->components);
+        component_t_free (c);
+        free (c);
+    }
+    g_queue_free (lo->components);
+
+    bags_vocabulary_destroy (lo->voctree);
+    corrmat_t_destroy (lo->corrmat);
+    for (int r=0;r<2;r++) {
+        corrmat_t_destroy (lo->h[r]);
+        corrmat_t_destroy (lo->hind[r]);
+        free (lo->pcols[r]);
+        free (lo->ph[r]);
+    }
+
+    g_mutex_free (lo->mutex);
+    g_cond_free (lo->cond);
+
+    free (lo);
+}
+
+/* align row <naligned> in both directions. If <final>, the last rows of the matrix
+ * are aligned too, with the border of the convolution.
+ */
+static gboolean loop_online_align_next (loop_online_t *lo, gboolean final)
+{
+    int i = lo->naligned;
+
+    // the convolution of row i needs row i+1
+    if (i >= lo->corrmat->n || (!final && i + 1 >= lo->corrmat->n))
+        return FALSE;
+
+    for (int r=0;r<2;r++) {
+        int *cols;
+        double *vals;
+        int len = corrmat_t_convolve_row (lo->corrmat, i, loop_online_kern[r], 3, r == 0 ? lo->param.correlation_diag_size : 0,
+                lo->param.correlation_threshold, &cols, &vals);
+
+        double *h = (double*)malloc (MAX (1, len) * sizeof(double));
+        float *fh = (float*)malloc (MAX (1, len) * sizeof(float));
+        float *find = (float*)malloc (MAX (1, len) * sizeof(float));
+
+        corrmat_t_align_row (i == 0 ? NULL : lo->pcols[r], lo->ph[r], lo->plen[r], cols, vals, len,
+                lo->param.alignment_penalty, r == 1, h, find);
+
+        for (int c=0;c<len;c++)
+            fh[c] = h[c];
+
+        corrmat_t_add_rows (lo->h[r], 1);
+        corrmat_t_add_rows (lo->hind[r], 1);
+        corrmat_t_set_row (lo->h[r], i, cols, fh, len);
+        corrmat_t_set_row (lo->hind[r], i, cols, find, len);
+
+        free (lo->pcols[r]);
+        free (lo->ph[r]);
+        lo->pcols[r] = cols;
+        lo->ph[r] = h;
+        lo->plen[r] = len;
+
+        free (vals);
+        free (fh);
+        free (find);
+    }
+
+    lo->naligned++;
+
+    return TRUE;
+}
+
+/* stored cell (i,j) of a sparse matrix, NULL if not stored
+ */
+static float *loop_online_cell (corrmat_t *m, int i, int j)
+{
+    if (i < 0 || j < 0 || i >= m->n)
+        return NULL;
+
+    const int *c = m->col + m->off[i];
+    int len = m->len[i];
+    int lo = 0, hi = len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (c[mid] < j)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < len && c[lo] == j ? m->val + m->off[i] + lo : NULL;
+}
+
+static gboolean loop_online_local_max (corrmat_t *h, int i, int j, double v, int radius)
+{
+    for (int ii=MAX (0, i-radius);ii<=MIN (h->n-1, i+radius);ii++) {
+        const int *cols;
+        const float *vals;
+        int first;
+        int len = corrmat_t_row (h, ii, &cols, &vals, &first);
+        for (int k=0;k<len;k++) {
+            if (cols[k] < j - radius) continue;
+            if (cols[k] > j + radius) break;
+            if (vals[k] > v + 1E-6)
+                return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* back-trace from the peak (i,j) of direction <r>. The cells are marked as emitted.
+ */
+static component_t *loop_online_trace (loop_online_t *lo, int r, int i, int j, double score)
+{
+    corrmat_t *h = lo->h[r];
+    corrmat_t *hind = lo->hind[r];
+    int dj = r == 1 ? 1 : -1;
+
+    component_t *comp = component_t_new ();
+    comp->score = score;
+    comp->reverse = r == 1;
+
+    while (1) {
+        float *ind = loop_online_cell (hind, i, j);
+        if (!ind || *ind <= 0)
+            break;
+        int valind = (int)*ind;
+        if (corrmat_t_get (h, i, j) < lo->param.alignment_tail_thresh)
+            break;
+        if (i > lo->param.alignment_min_node_id || j > lo->param.alignment_min_node_id) {
+            pair_int_t *p = (pair_int_t*)malloc(sizeof(pair_int_t));
+            p->key = i;
+            p->val = j;
+            if (r == 1)
+                g_queue_push_head (comp->pt, p);
+            else
+                g_queue_push_tail (comp->pt, p);
+        }
+
+        *ind = -valind;
+
+        if (valind == 1) { i--; j += dj; continue;}
+        if (valind == 2) { j += dj; continue;}
+        if (valind == 3) { i--; continue;}
+    }
+
+    return comp;
+}
+
+/* search row <nscanned> of the alignment matrices for peaks. If <final>, the last
+ * rows are searched too, with what is known of their neighborhood.
+ */
+static gboolean loop_online_scan_next (loop_online_t *lo, gboolean final)
+{
+    int i = lo->nscanned;
+    int radius = lo->param.alignment_search_radius;
+
+    if (i >= lo->naligned || (!final && i + radius >= lo->naligned))
+        return FALSE;
+
+    for (int r=0;r<2;r++) {
+        corrmat_t *h = lo->h[r];
+        const int *cols;
+        const float *vals;
+        int first;
+        int len = corrmat_t_row (h, i, &cols, &vals, &first);
+
+        for (int k=0;k<len;k++) {
+            double v = vals[k];
+            int j = cols[k];
+            if (v < lo->param.alignment_threshold || v <= 1E-6)
+                continue;
+            if (*loop_online_cell (lo->hind[r], i, j) <= 0)
+                continue;
+            if (!loop_online_local_max (h, i, j, v, radius))
+                continue;
+
+            component_t *comp = loop_online_trace (lo, r, i, j, v);
+
+            if (g_queue_get_length (comp->pt) < lo->param.min_seq_length ||
+                !component_t_valid (comp, lo->naligned, lo->param.alignment_min_diag_distance, lo->param.alignment_max_slope_error)) {
+                component_t_free (comp);
+                free (comp);
+                continue;
+            }
+
+            dbg (DBG_CLASS, "[loop] new %s component at %d %d (score %.3f, %d nodes)", r == 1 ? "reverse" : "forward",
+                    i, j, v, g_queue_get_length (comp->pt));
+
+            g_mutex_lock (lo->mutex);
+            g_queue_push_tail (lo->components, comp);
+            g_mutex_unlock (lo->mutex);
+        }
+    }
+
+    lo->nscanned++;
+
+    return TRUE;
+}
+
+/* align and search the pending rows, for at most <budget_ms> (< 0 for no limit).
+ * Returns the number of rows left to align or search.
+ */
+int loop_online_update (loop_online_t *lo, double budget_ms)
+{
+    GTimer *timer = g_timer_new ();
+
+    while (budget_ms < 0 || 1000.0 * g_timer_elapsed (timer, NULL) < budget_ms) {
+        // peaks first, so that components come out as early as possible
+        if (loop_online_scan_next (lo, FALSE))
+            continue;
+        if (!loop_online_align_next (lo, FALSE))
+            break;
+    }
+
+    g_timer_destroy (timer);
+
+    return lo->corrmat->n - lo->nscanned;
+}
+
+/* align and search all the rows (end of exploration). Must not be called while the
+ * worker thread runs.
+ */
+void loop_online_flush (loop_online_t *lo)
+{
+    assert (!lo->thread);
+
+    while (loop_online_scan_next (lo, FALSE) || loop_online_align_next (lo, TRUE));
+    while (loop_online_scan_next (lo, TRUE));
+}
+
+/* move the components found so far to <components>. Returns their number.
+ */
+int loop_online_pop_components (loop_online_t *lo, GQueue *components)
+{
+    int count = 0;
+
+    g_mutex_lock (lo->mutex);
+    while (!g_queue_is_empty (lo->components)) {
+        g_queue_push_tail (components, g_queue_pop_head (lo->components));
+        count++;
+    }
+    g_mutex_unlock (lo->mutex);
+
+    return count;
+}
+
+/* queue a feature set for the worker thread (the features are copied)
+ */
+void loop_online_push_node (loop_online_t *lo, navlcm_feature_list_t *features, int id)
+{
+    loop_online_node_t *nd = (loop_online_node_t*)malloc (sizeof(loop_online_node_t));
+    nd->features = navlcm_feature_list_t_copy (features);
+    nd->id = id;
+
+    g_mutex_lock (lo->mutex);
+    g_queue_push_tail (lo->nodes, nd);
+    g_cond_signal (lo->cond);
+    g_mutex_unlock (lo->mutex);
+}
+
+static gpointer loop_online_thread_cb (gpointer data)
+{
+    loop_online_t *lo = (loop_online_t*)data;
+
+    while (1) {
+
+        g_mutex_lock (lo->mutex);
+        while (!lo->exit && g_queue_is_empty (lo->nodes))
+            g_cond_wait (lo->cond, lo->mutex);
+        if (lo->exit) {
+            g_mutex_unlock (lo->mutex);
+            break;
+        }
+        loop_online_node_t *nd = (loop_online_node_t*)g_queue_pop_head (lo->nodes);
+        g_mutex_unlock (lo->mutex);
+
+        GTimer *timer = g_timer_new ();
+
+        // similarity row
+        loop_update_full (lo->voctree, lo->corrmat, nd->features, nd->id, lo->param.bag_word_radius);
+
+        navlcm_feature_list_t_destroy (nd->features);
+        free (nd);
+
+        // alignment and peaks, on the rest of the budget
+        double budget = lo->param.budget_ms;
+        if (budget >= 0)
+            budget = MAX (.0, budget - 1000.0 * g_timer_elapsed (timer, NULL));
+        int pending = loop_online_update (lo, budget);
+
+        double ms = 1000.0 * g_timer_elapsed (timer, NULL);
+        lo->max_node_ms = MAX (lo->max_node_ms, ms);
+        g_timer_destroy (timer);
+
+        dbg (DBG_CLASS, "[loop] node %d: %.1f ms (max %.1f ms), %d rows pending, %.1f MB", lo->corrmat->n - 1, ms, lo->max_node_ms,
+                pending, (corrmat_t_memory (lo->corrmat) + corrmat_t_memory (lo->h[0]) + corrmat_t_memory (lo->h[1])) / 1048576.0);
+    }
+
+    return NULL;
+}
+
+/* start the worker thread, at low priority
+ */
+void loop_online_start (loop_online_t *lo)
+{
+    assert (!lo->thread);
+
+    lo->thread = g_thread_create_full (loop_online_thread_cb, lo, 0, TRUE, FALSE, G_THREAD_PRIORITY_LOW, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// testing
+//
+
+/* fraction of the cells of <ref> that are in a component of <components> of the same
+ * direction
+ */
+static double loop_online_coverage (component_t *ref, GQueue *components)
+{
+    int found = 0;
+
+    for (GList *iter=g_queue_peek_head_link (ref->pt);iter;iter=iter->next) {
+        pair_int_t *p = (pair_int_t*)iter->data;
+        gboolean ok = FALSE;
+        for (GList *iter2=g_queue_peek_head_link (components);iter2 && !ok;iter2=iter2->next) {
+            component_t *c = (component_t*)iter2->data;
+            if (c->reverse != ref->reverse)
+                continue;
+            for (GList *iter3=g_queue_peek_head_link (c->pt);iter3 && !ok;iter3=iter3->next) {
+                pair_int_t *q = (pair_int_t*)iter3->data;
+                ok = q->key == p->key && q->val == p->val;
+            }
+        }
+        if (ok)
+            found++;
+    }
+
+    return g_queue_is_empty (ref->pt) ? 1.0 : 1.0 * found / g_queue_get_length (ref->pt);
+}
+
+/* feed random similarity matrices with planted loops row by row, and compare the
+ * components with the batch pipeline: each long batch component must be covered by
+ * online components of the same direction.
+ */
+int loop_online_unit_testing (int n, int nruns)
+{
+    int failed = 0;
+    unsigned int seed = 29;
+
+    loop_online_params_t param;
+    loop_online_params_init (&param);
+    param.alignment_min_node_id = 0;
+
+    for (int run=0;run<nruns;run++) {
+
+        double *dense = corrmat_random (n, &seed);
+        gboolean ok = TRUE;
+
+        // online
+        loop_online_t *lo = loop_online_new (&param, CORRMAT_TOPK, 32);
+        double max_ms = .0, total_ms = .0;
+        GTimer *timer = g_timer_new ();
+        for (int i=0;i<n;i++) {
+            g_timer_start (timer);
+            corrmat_t_append_row (lo->corrmat, dense + i*n, i+1);
+            loop_online_update (lo, -1);
+            double ms = 1000.0 * g_timer_elapsed (timer, NULL);
+            max_ms = MAX (max_ms, ms);
+            total_ms += ms;
+        }
+        g_timer_destroy (timer);
+        loop_online_flush (lo);
+
+        GQueue *components = g_queue_new ();
+        loop_online_pop_components (lo, components);
+
+        // batch
+        corrmat_t *m = corrmat_t_from_dense (dense, n, CORRMAT_TOPK, 32);
+        corrmat_t *hmat, *hmatind, *hmatrev, *hmatindrev;
+        corrmat_t_compute_alignment_matrices (m, loop_online_kern[0], loop_online_kern[1], 3, param.correlation_diag_size,
+                param.correlation_threshold, param.alignment_penalty, 1, &hmat, &hmatind, &hmatrev, &hmatindrev);
+        GQueue *ref = g_queue_new ();
+        corrmat_t_find_component_list (hmat, hmatind, hmatrev, hmatindrev, param.alignment_threshold, param.alignment_tail_thresh,
+                param.min_seq_length, param.alignment_min_diag_distance, param.alignment_max_slope_error,
+                param.alignment_search_radius, param.alignment_min_node_id, ref);
+
+        for (GList *iter=g_queue_peek_head_link (ref);iter;iter=iter->next) {
+            component_t *c = (component_t*)iter->data;
+            double cov = loop_online_coverage (c, components);
+            // short sequences along the diagonal depend on the direction of the alignment
+            if (cov < .9 && g_queue_get_length (c->pt) >= 2 * param.alignment_search_radius)
+                ok = FALSE;
+            dbg (DBG_INFO, "[loop] run %d: batch %s component of %d nodes, %.0f %% found online", run, c->reverse ? "reverse" : "forward",
+                    g_queue_get_length (c->pt), 100.0 * cov);
+        }
+
+        dbg (DBG_INFO, "[loop] run %d: %d components online, %d batch, %.3f ms per row (max %.3f ms)", run,
+                g_queue_get_length (components), g_queue_get_length (ref), total_ms / n, max_ms);
+
+        for (int k=0;k<2;k++) {
+            GQueue *q = k == 0 ? components : ref;
+            while (!g_queue_is_empty (q)) {
+                component_t *c = (component_t*)g_queue_pop_head (q);
+                component_t_free (c);
+                free (c);
+            }
+            g_queue_free (q);
+        }
+        corrmat_t_destroy (hmat);
+        corrmat_t_destroy (hmatind);
+        corrmat_t_destroy (hmatrev);
+        corrmat_t_destroy (hmatindrev);
+        corrmat_t_destroy (m);
+        loop_online_destroy (lo);
+        free (dense);
+
+        if (!ok)
+            failed++;
+    }
+
+    dbg (DBG_INFO, "[loop] online unit testing: failed %d / %d", failed, nruns);
+
+    return failed;
+}
+
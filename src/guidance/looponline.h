@@ -0,0 +1,91 @@
+#ifndef _GUIDANCE_LOOPONLINE_H__
+#define _GUIDANCE_LOOPONLINE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+
+#include <glib.h>
+
+/* from common */
+#include <common/dbg.h>
+
+#include "loop.h"
+#include "corrmat.h"
+
+/* Incremental loop closure detection, for exploration mode.
+ *
+ * The batch pipeline (loop_extract_components_from_correlation_matrix) convolves the
+ * whole similarity matrix, aligns it and searches it for peaks every time it runs.
+ * Here every stage works one row at a time, as the nodes come in:
+ *
+ * - the vocabulary and the similarity row of the new node (loop_update_full)
+ * - the convolved row and the alignment row, as soon as the next row is known
+ * - the peak search on row i, as soon as the alignment rows up to i + search radius
+ *   are known: a local maximum there cannot change anymore, and its back-trace is
+ *   emitted as a component.
+ *
+ * With a banded or top-K similarity matrix, a node costs O(band) after the
+ * vocabulary search. The forward alignment is the same as in batch. The reverse one
+ * runs forward too, extending (i-1,j+1) instead of (i+1,j-1), so that its score
+ * peaks at the last row of a sequence; its components are returned in increasing row
+ * order, as in batch. A back-trace stops at the cells of a component already emitted.
+ *
+ * The worker thread runs at low priority. The similarity row of a node is always
+ * computed; the alignment and peak search stop when the node has used <budget_ms>
+ * and resume with the next node.
+ */
+
+typedef struct {
+    double bag_word_radius;
+    int correlation_diag_size;
+    double correlation_threshold;
+    double alignment_penalty;
+    double alignment_threshold;
+    double alignment_tail_thresh;
+    int alignment_min_diag_distance;
+    double alignment_max_slope_error;
+    int alignment_search_radius;
+    int alignment_min_node_id;
+    int min_seq_length;
+    double budget_ms;           // per node, < 0 for no limit
+} loop_online_params_t;
+
+typedef struct {
+    loop_online_params_t param;
+
+    bags_vocabulary_t *voctree;
+    corrmat_t *corrmat;         // similarity rows
+    corrmat_t *h[2];            // alignment rows, forward and reverse
+    corrmat_t *hind[2];         // back-trace directions (negative once emitted)
+    int *pcols[2];              // last alignment row, in double precision
+    double *ph[2];
+    int plen[2];
+    int naligned;               // number of aligned rows
+    int nscanned;               // number of rows searched for peaks
+
+    GThread *thread;
+    GMutex *mutex;
+    GCond *cond;
+    gboolean exit;
+    GQueue *nodes;              // pending feature sets
+    GQueue *components;         // components not yet popped
+    double max_node_ms;         // longest node so far
+} loop_online_t;
+
+void loop_online_params_init (loop_online_params_t *p);
+
+loop_online_t *loop_online_new (const loop_online_params_t *p, int corrmat_mode, int corrmat_width);
+void loop_online_destroy (loop_online_t *lo);
+void loop_online_start (loop_online_t *lo);
+
+void loop_online_push_node (loop_online_t *lo, navlcm_feature_list_t *features, int id);
+int loop_online_update (loop_online_t *lo, double budget_ms);
+void loop_online_flush (loop_online_t *lo);
+int loop_online_pop_components (loop_online_t *lo, GQueue *components);
+
+int loop_online_unit_testing (int n, int nruns);
+
+#endif
+
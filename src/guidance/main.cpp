@@ -240,9 +240,10 @@ void update_path (state_t *self, dijk_node_t *src, dijk_node_t *dst)
     self->param->path = NULL;
     self->param->path_size = 0;
 
+    self->param->path = (int*)malloc(g_queue_get_length (self->path)*sizeof(int));
+
     for (GList *iter=g_queue_peek_head_link (self->path);iter;iter=iter->next) {
         dijk_edge_t *e = (dijk_edge_t*)iter->data;
-        self->param->path = (int*)realloc(self->param->path, (self->param->path_size+1)*sizeof(int));
         self->param->path[self->param->path_size] = e->start->uid;
         self->param->path_size++;
     }
@@ -571,20 +572,23 @@ void create_new_node (state_t *self, gboolean checkpoint)
 
     self->param->nodeid_now = self->current_edge->start ? self->current_edge->start->uid : -1;
 
+    // live loop closure
+    if (self->loop_online)
+        loop_online_push_node (self->loop_online, f, nnodes);
+
 #if 0
     // update sim. matrix
-    self->corrmat = loop_update_full (self->voctree, self->corrmat, &self->corrmat_size, 
-            f, nnodes, BAGS_WORD_RADIUS);
-    corrmat_write (self->corrmat, self->corrmat_size, "corrmat.dat");
+    loop_update_full (self->voctree, self->corrmat, f, nnodes, BAGS_WORD_RADIUS);
+    corrmat_t_save (self->corrmat, "corrmat.bin");
 
     // publish sim. matrix
-    navlcm_dictionary_t *dict = corrmat_to_dictionary (self->corrmat, self->corrmat_size);
+    navlcm_dictionary_t *dict = corrmat_t_to_dictionary (self->corrmat);
     navlcm_dictionary_t_publish (self->lcm, "SIMILARITY_MATRIX", dict);
     navlcm_dictionary_t_destroy (dict);
 
     // detect loop closures
     dijk_graph_t *d_graph = dijk_graph_copy (self->d_graph);
-    process_correlation_matrix (self, "corrmat.dat", d_graph);
+    process_correlation_matrix (self, "corrmat.bin", d_graph);
 
     // publish the UI map
     navlcm_ui_map_t *mp = dijk_graph_to_ui_map (d_graph, "neato");
@@ -811,11 +815,16 @@ gpointer compute_thread_cb (gpointer data)
         } 
 
         if (self->param->mode == NAVLCM_CLASS_PARAM_T_NAVIGATION_MODE) {
+            // both steps match the live features against the current edge
+            matcher_cache_clear ();
+
             // local node estimation
             node_estimation_cb (self);
 
             // rotation guidance
             rotation_guidance_cb (self);
+
+            matcher_cache_clear ();
         }
 
         if (self->param->mode == NAVLCM_CLASS_PARAM_T_CALIBRATION_CHECK_MODE) {
@@ -1058,7 +1067,7 @@ void on_blit_request (state_t *self)
         }
         if (self->param->mode == NAVLCM_CLASS_PARAM_T_NAVIGATION_MODE) {
             if (self->current_edge) {
-                botlcm_image_t *img = (botlcm_image_t*)g_queue_peek_nth (self->current_edge->img, i);
+                botlcm_image_t *img = (botlcm_image_t*)g_queue_peek_nth (dijk_edge_images (self->current_edge), i);
                 // send to phone
                 char channel[20];
                 sprintf (channel, "PHONE_THUMB%d", i);
@@ -1082,7 +1091,7 @@ gboolean node_trigger_on_psi_distance (state_t *self, navlcm_feature_list_t *fea
     GTimer *timer = g_timer_new ();
 
     // compute psi-distance
-    double psi_dist = class_psi_distance (features, self->current_edge->features, self->lcm);
+    double psi_dist = class_psi_distance (features, dijk_edge_features (self->current_edge), self->lcm);
 
     //FILE *fp = fopen ("psi.txt", "a");
     //fprintf (fp, "%d %.5f\n", g_psi_count, psi_dist);
@@ -1096,7 +1105,7 @@ gboolean node_trigger_on_psi_distance (state_t *self, navlcm_feature_list_t *fea
 
     double mean_psi_dist = math_mean_double (g_psi_buffer, 10);
 
-    double time_dist = ((int)(features->utime-self->current_edge->features->utime))/1000000.0;
+    double time_dist = ((int)(features->utime-dijk_edge_features (self->current_edge)->utime))/1000000.0;
     dbg (DBG_CLASS, "mean psi distance (%d nodes): %.3f (mean: %.3f) (thresh: %.3f) (time dist.: %.3f secs.)", 
             dijk_graph_n_nodes (self->d_graph), psi_dist, mean_psi_dist, PSI_THRESH, time_dist);
 
@@ -1137,6 +1146,9 @@ gpointer node_trigger_timeout_thread_func (gpointer data)
     if (!fs)
         return NULL;
 
+    // update tracker
+    tracker_update (self, fs);
+
     gboolean body_rotation = FALSE;
 
     // compute psi distance with latest node
@@ -1161,22 +1173,24 @@ gpointer node_trigger_timeout_thread_func (gpointer data)
 
     }
 
-    /*
-    // update tracker
-    tracker_data_update (self->tracker, fs, self->config->nsensors);
+    return NULL;
+}
 
-    // print out tracker
-    tracker_data_printout (self->tracker);
+/* update the feature tracks with the latest features and publish them
+ */
+void tracker_update (state_t *self, navlcm_feature_list_t *fs)
+{
+    if (!self->tracker_enabled)
+        return;
 
-    // publish to LCM
-    navlcm_track_set_t *lcmtracks = track_list_to_lcm (self->tracker);
-    if (lcmtracks) {
-    navlcm_track_set_t_publish (self->lcm, "TRACKS", lcmtracks);
-    navlcm_track_set_t_destroy (lcmtracks);
-    }
-    */
+    if (!self->tracks)
+        self->tracks = track_store_new (fs->desc_size, fs->width, fs->height);
 
-    return NULL;
+    track_store_update (self->tracks, fs, self->tracker_ttl, self->config->tracker_max_dist, NULL);
+
+    track_store_add_new (self->tracks, fs, self->tracker_ttl, self->config->tracker_add_min_dist);
+
+    track_store_publish (self->lcm, self->tracks);
 }
 
 /* compute visual odometry
@@ -1324,13 +1338,13 @@ gboolean publish_ui_images_cb (gpointer data)
 
     if (edge) {
         if (!edge->reverse) {
-            botlcm_image_t *img_left = (botlcm_image_t*)g_queue_peek_nth (edge->img, 1);
-            botlcm_image_t *img_right = (botlcm_image_t*)g_queue_peek_nth (edge->img, 2);
+            botlcm_image_t *img_left = (botlcm_image_t*)g_queue_peek_nth (dijk_edge_images (edge), 1);
+            botlcm_image_t *img_right = (botlcm_image_t*)g_queue_peek_nth (dijk_edge_images (edge), 2);
             util_publish_image (self->lcm, img_left, "PHONE_THUMB0", 282, 180);
             util_publish_image (self->lcm, img_right, "PHONE_THUMB1", 282, 180);
         } else {
-            botlcm_image_t *img_left = (botlcm_image_t*)g_queue_peek_nth (edge->img, 3);
-            botlcm_image_t *img_right = (botlcm_image_t*)g_queue_peek_nth (edge->img, 0);
+            botlcm_image_t *img_left = (botlcm_image_t*)g_queue_peek_nth (dijk_edge_images (edge), 3);
+            botlcm_image_t *img_right = (botlcm_image_t*)g_queue_peek_nth (dijk_edge_images (edge), 0);
             util_publish_image (self->lcm, img_left, "PHONE_THUMB0", 282, 180);
             util_publish_image (self->lcm, img_right, "PHONE_THUMB1", 282, 180);
         }
@@ -1599,8 +1613,8 @@ gboolean rotation_guidance_cb (gpointer data)
 
     assert (e1->end == e2->start);
 
-    class_orientation (features, e1->features, self->config, &angles[0], &variance, self->lcm);
-    class_orientation (features, e2->features, self->config, &angles[1], NULL, NULL);
+    class_orientation (features, dijk_edge_features (e1), self->config, &angles[0], &variance, self->lcm);
+    class_orientation (features, dijk_edge_features (e2), self->config, &angles[1], NULL, NULL);
 
     self->param->psi_distance = variance;
     self->param->psi_distance_thresh = PSI_THRESH;
@@ -1799,14 +1813,20 @@ void run_loop_closure_full (state_t *self)
         dijk_edge_t *e = (dijk_edge_t*)iter->data;
         if (e->reverse)
             continue;
-        self->corrmat = loop_update_full (self->voctree, self->corrmat, &self->corrmat_size, 
-                e->features, e->start->uid, BAGS_WORD_RADIUS);
+        loop_update_full (self->voctree, self->corrmat, dijk_edge_features (e), e->start->uid, BAGS_WORD_RADIUS);
         count++;
     }
 
-    corrmat_write (self->corrmat, self->corrmat_size, "corrmat.dat");
+    corrmat_t_save (self->corrmat, "corrmat.bin");
+
+    // text export, for debugging
+    int text_export = 0;
+    bot_conf_get_int (self->conf, "loop_closure.correlation_text_export", &text_export);
+    if (text_export)
+        corrmat_t_write (self->corrmat, "corrmat.dat");
 
-    dbg (DBG_CLASS, "Saved correlation matrix %d x %d to corrmat.dat", self->corrmat_size, self->corrmat_size);
+    dbg (DBG_CLASS, "Saved correlation matrix %d x %d to corrmat.bin (%.1f MB in memory)", self->corrmat->n, self->corrmat->n,
+            corrmat_t_memory (self->corrmat) / 1048576.0);
 }
 
 void process_graph_time_lapse (state_t *self)
@@ -1839,7 +1859,111 @@ void join_nodes (state_t *self, int x0, int x1, int y0, int y1)
     g_queue_free (components);
 }
 
-void process_correlation_matrix (state_t *self, const char *filename, dijk_graph_t *dg)
+/* start the live loop closure worker if loop_closure.online is set, and feed it the
+ * nodes of the map loaded so far
+ */
+void start_loop_closure_online (state_t *self)
+{
+    int online = 0;
+    bot_conf_get_int (self->conf, "loop_closure.online", &online);
+    if (!online)
+        return;
+
+    loop_online_params_t p;
+    loop_online_params_init (&p);
+    bot_conf_get_double (self->conf, "loop_closure.online_budget_ms", &p.budget_ms);
+    bot_conf_get_int (self->conf, "loop_closure.min_seq_length", &p.min_seq_length);
+    bot_conf_get_int (self->conf, "loop_closure.correlation_diag_size", &p.correlation_diag_size);
+    bot_conf_get_double (self->conf, "loop_closure.correlation_treshold", &p.correlation_threshold);
+    bot_conf_get_double (self->conf, "loop_closure.alignment_penalty", &p.alignment_penalty);
+    bot_conf_get_double (self->conf, "loop_closure.alignment_threshold", &p.alignment_threshold);
+    bot_conf_get_double (self->conf, "loop_closure.alignment_tail_thresh", &p.alignment_tail_thresh);
+    bot_conf_get_int (self->conf, "loop_closure.alignment_min_diag_distance", &p.alignment_min_diag_distance);
+    bot_conf_get_double (self->conf, "loop_closure.alignment_max_slope_error", &p.alignment_max_slope_error);
+    bot_conf_get_int (self->conf, "loop_closure.alignment_search_radius", &p.alignment_search_radius);
+    bot_conf_get_int (self->conf, "loop_closure.alignment_min_node_id", &p.alignment_min_node_id);
+
+    int mode, width;
+    correlation_matrix_mode (self, &mode, &width);
+
+    self->loop_online = loop_online_new (&p, mode, width);
+
+    for (GList *iter=g_queue_peek_head_link (self->d_graph->edges);iter;iter=iter->next) {
+        dijk_edge_t *e = (dijk_edge_t*)iter->data;
+        if (e->reverse)
+            continue;
+        loop_online_push_node (self->loop_online, dijk_edge_features (e), e->start->uid);
+    }
+
+    loop_online_start (self->loop_online);
+
+    dbg (DBG_CLASS, "started live loop closure (%.0f ms per node)", p.budget_ms);
+}
+
+/* enable feature tracking if tracker.enable is set
+ */
+void start_tracker (state_t *self)
+{
+    int enable = 0;
+    bot_conf_get_int (self->conf, "tracker.enable", &enable);
+    self->tracker_enabled = enable;
+
+    self->tracker_ttl = 3;
+    bot_conf_get_int (self->conf, "tracker.ttl", &self->tracker_ttl);
+
+    self->tracks = NULL;
+
+    if (enable)
+        dbg (DBG_CLASS, "feature tracking enabled (ttl = %d)", self->tracker_ttl);
+}
+
+/* publish the map with the loop closures found live so far
+ */
+gboolean loop_closure_online_cb (gpointer data)
+{
+    state_t *self = (state_t*)data;
+
+    if (!self->loop_online)
+        return TRUE;
+
+    if (!loop_online_pop_components (self->loop_online, self->loop_components))
+        return TRUE;
+
+    dbg (DBG_CLASS, "%d live loop closure components", g_queue_get_length (self->loop_components));
+
+    dijk_graph_t *d_graph = dijk_graph_copy (self->d_graph);
+    dijk_apply_components (d_graph, self->loop_components);
+    publish_ui_map (d_graph, "UI_MAP_LOOP", self->lcm);
+    dijk_graph_destroy (d_graph);
+
+    return TRUE;
+}
+
+/* storage of the correlation matrix: the top-K entries of each row if 
+ * loop_closure.correlation_top_k is set, a band of that many columns below the
+ * diagonal if loop_closure.correlation_band is set, the whole lower triangle otherwise.
+ */
+void correlation_matrix_mode (state_t *self, int *mode, int *width)
+{
+    int top_k = 0, band = 0;
+    bot_conf_get_int (self->conf, "loop_closure.correlation_top_k", &top_k);
+    bot_conf_get_int (self->conf, "loop_closure.correlation_band", &band);
+
+    *mode = CORRMAT_DENSE;
+    *width = 0;
+
+    if (top_k > 0) {
+        *mode = CORRMAT_TOPK;
+        *width = top_k;
+    } else if (band > 0) {
+        *mode = CORRMAT_BAND;
+        *width = band;
+    }
+}
+
+/* components of the similarity matrix, with the loop_closure parameters
+ */
+GQueue *extract_loop_components (state_t *self, corrmat_t *corrmat)
 {
     double canny_thresh, hough_thresh;
     double correlation_threshold, alignment_penalty;
@@ -1860,22 +1984,19 @@ void process_correlation_matrix (state_t *self, const char *filename, dijk_graph
     bot_conf_get_int (self->conf, "loop_closure.alignment_search_radius", &alignment_search_radius);
     bot_conf_get_int (self->conf, "loop_closure.alignment_min_node_id", &alignment_min_node_id);
 
-    int size;
-    double *corrmat = corrmat_read (filename, &size);
-
     // extract similar sequences
-    GQueue *comp = loop_extract_components_from_correlation_matrix (corrmat, size, FALSE, canny_thresh, hough_thresh, 
+    return loop_extract_components_from_correlation_matrix (corrmat, FALSE, canny_thresh, hough_thresh, 
             min_seq_length, correlation_diag_size, correlation_threshold, alignment_penalty, alignment_threshold, 
             alignment_tail_thresh, alignment_min_diag_distance, alignment_max_slope_error, alignment_search_radius,
             alignment_min_node_id); 
+}
 
-    // save results to images
-    loop_matrix_components_to_image  (corrmat, size, comp);
-
-    free (corrmat);
-
+/* fuse the nodes of the components in the graph and save it to new-map.bin
+ */
+void apply_loop_components (dijk_graph_t *dg, GQueue *comp, const char *corrmat_filename)
+{
     for (GList *iter=g_queue_peek_head_link(comp);iter;iter=iter->next) {
-        dijk_print_component (dg, (component_t*)iter->data, filename, "match.txt");
+        dijk_print_component (dg, (component_t*)iter->data, corrmat_filename, "match.txt");
     }
 
     if (dijk_graph_n_nodes (dg) > 1) {
@@ -1895,6 +2016,90 @@ void process_correlation_matrix (state_t *self, const char *filename, dijk_graph
     }
 }
 
+void process_correlation_matrix (state_t *self, const char *filename, dijk_graph_t *dg)
+{
+    int mode, width;
+    correlation_matrix_mode (self, &mode, &width);
+    corrmat_t *corrmat = corrmat_t_read (filename, mode, width);
+    if (!corrmat) {
+        dbg (DBG_ERROR, "failed to read correlation matrix from %s", filename);
+        return;
+    }
+
+    GQueue *comp = extract_loop_components (self, corrmat);
+
+    // save results to images
+    loop_matrix_components_to_image  (corrmat, comp);
+
+    corrmat_t_destroy (corrmat);
+
+    apply_loop_components (dg, comp, filename);
+}
+
+/* merge the maps <filenames> (comma-separated) of several sessions into one. The
+ * node ids of a map are shifted past those of the previous maps and the merged graph
+ * is saved to merged-map.bin. One vocabulary is built over the nodes of all the maps
+ * and their similarity matrix (the top loop_closure.merge_top_k entries of each row)
+ * is saved to merged-corrmat.bin. Its components, within a session or across two,
+ * are fused as in batch loop closure, into new-map.bin.
+ */
+void merge_maps (state_t *self, const char *filenames)
+{
+    dijk_graph_t *dg = dijk_graph_new ();
+
+    gchar **names = g_strsplit (filenames, ",", -1);
+    for (int k=0;names[k];k++) {
+        if (!file_exists (names[k])) {
+            dbg (DBG_ERROR, "WARNING! Input file %s does not exist.", names[k]);
+            continue;
+        }
+        dijk_graph_t *g = dijk_graph_new ();
+        dijk_graph_read_from_file (g, names[k]);
+        int offset = dijk_graph_append (dg, g);
+        dbg (DBG_CLASS, "map %s: %d nodes, ids from %d", names[k], dijk_graph_n_nodes (g), offset);
+        dijk_graph_destroy (g);
+    }
+    g_strfreev (names);
+
+    dijk_graph_write_to_file (dg, "merged-map.bin");
+
+    // features of node i at i
+    int n = dijk_graph_max_node_id (dg) + 1;
+    navlcm_feature_list_t **features = (navlcm_feature_list_t**)calloc (MAX (1, n), sizeof(navlcm_feature_list_t*));
+    for (GList *iter=g_queue_peek_head_link (dg->edges);iter;iter=iter->next) {
+        dijk_edge_t *e = (dijk_edge_t*)iter->data;
+        if (e->reverse || !e->start)
+            continue;
+        features[e->start->uid] = dijk_edge_features (e);
+    }
+
+    int top_k = 256, correlation_diag_size = 0;
+    bot_conf_get_int (self->conf, "loop_closure.merge_top_k", &top_k);
+    bot_conf_get_int (self->conf, "loop_closure.correlation_diag_size", &correlation_diag_size);
+
+    // the sessions together are too large for an exhaustive word search
+    bags_vocabulary_t *voctree = bags_vocabulary_new ();
+    bags_vocabulary_use_tree (voctree, TRUE);
+
+    corrmat_t *corrmat = loop_correlation_matrix_parallel (voctree, features, n, BAGS_WORD_RADIUS, correlation_diag_size, top_k, 0);
+
+    bags_vocabulary_destroy (voctree);
+    free (features);
+
+    corrmat_t_save (corrmat, "merged-corrmat.bin");
+
+    dbg (DBG_CLASS, "Saved correlation matrix %d x %d to merged-corrmat.bin (%.1f MB in memory)", corrmat->n, corrmat->n,
+            corrmat_t_memory (corrmat) / 1048576.0);
+
+    GQueue *comp = extract_loop_components (self, corrmat);
+
+    corrmat_t_destroy (corrmat);
+
+    apply_loop_components (dg, comp, "merged-corrmat.bin");
+
+    dijk_graph_destroy (dg);
+}
+
 static void main_shutdown (int sig)
 {
     state_t *self = g_self;
@@ -1910,6 +2115,13 @@ static void main_shutdown (int sig)
 
     g_thread_join (self->compute_thread);
 
+    loop_online_destroy (self->loop_online);
+    self->loop_online = NULL;
+
+    if (self->tracks)
+        track_store_destroy (self->tracks);
+    self->tracks = NULL;
+
     self->exit = 1;
 }
 
@@ -1951,7 +2163,8 @@ int main (int argc, char *argv[])
     getopt_add_bool  (gopt, ' ',   "imu-validation", 0, "Run IMU validation upon exit");
     getopt_add_bool (gopt, ' ', "save-graph-images", 0, "Save node images in PNG format and place graph is PS format");
     getopt_add_string (gopt, ' ', "map-file", "map.bin", "Map file");
-    getopt_add_string (gopt, ' ', "corrmat", "", "Correspondence matrix file");
+    getopt_add_string (gopt, ' ', "corrmat", "", "Correspondence matrix file (binary or text)");
+    getopt_add_string (gopt, ' ', "merge-maps", "", "Merge map files into one (comma-separated)");
     getopt_add_string (gopt, ' ', "gates-snap-dir", "img", "Directory to save gates images");
     getopt_add_string (gopt, ' ', "mission-file", "mission.txt", "Mission file");
     getopt_add_string (gopt, ' ', "flow-calib-file", "", "Flow calibration file");
@@ -2042,9 +2255,12 @@ int main (int argc, char *argv[])
     self->computing = FALSE;
     self->last_utterance_utime = 0;
     self->d_graph = dijk_graph_new ();
-    self->corrmat = NULL;
-    self->corrmat_size = 0;
-    self->voctree = g_queue_new ();
+    int corrmat_mode, corrmat_width;
+    correlation_matrix_mode (self, &corrmat_mode, &corrmat_width);
+    self->corrmat = corrmat_t_new (corrmat_mode, corrmat_width);
+    self->voctree = bags_vocabulary_new ();
+    self->loop_online = NULL;
+    self->loop_components = g_queue_new ();
     self->last_node_estimate_utime = 0;
     self->last_rotation_guidance_utime = 0;
     self->features_param = NULL;
@@ -2058,12 +2274,22 @@ int main (int argc, char *argv[])
 
     ///////////// unit tests //////////////////////////
     //tree_unit_testing (10000, 10, BAGS_WORD_RADIUS);
+    //bags_vocabulary_unit_testing (100, 500);
+    //bagtree_performance_testing (500, "vocabulary-tree-flat.txt");
+    //kmeans_unit_testing ();
+    //corrmat_unit_testing (500, 5);
+    //loop_online_unit_testing (500, 5);
+    //loop_correlation_unit_testing (200, 200);
+    //loop_hough_unit_testing (1500);
+    //kmeans_performance_testing (100000, 128, 100, "kmeans-perf.txt");
     //dijk_unit_testing ();
+    //dijk_shortest_path_unit_testing (10000, 100);
     //bags_performance_testing ();
 //    int bags_nsets = 1000;
 //    int bags_nfeatures = 500;
 //    bags_performance_testing (1, bags_nsets, bags_nfeatures, 1, "vocabulary-naive.txt");
 //    bags_performance_testing (2, bags_nsets, bags_nfeatures, 1, "vocabulary-naive-opt.txt");
+//    bags_performance_testing (4, bags_nsets, bags_nfeatures, 1, "vocabulary-flat.txt");
 //    bags_performance_testing (3, bags_nsets, bags_nfeatures, 2, "vocabulary-tree-N-2.txt");
 //      bags_performance_testing (3, bags_nsets, bags_nfeatures, 3, "vocabulary-tree-N-3.txt");
 //    bags_performance_testing (3, bags_nsets, bags_nfeatures, 5, "vocabulary-tree-N-5.txt");
@@ -2074,6 +2300,19 @@ int main (int argc, char *argv[])
     // math unit testing
     //math_matrix_mult_unit_testing_float ();
 
+    // matcher unit and performance testing (tiled vs full matrix)
+    //matcher_unit_testing (100);
+    //matcher_performance_testing (4, 5, "matcher-perf.txt");
+
+    // track store vs. update_tracks
+    //track_store_unit_testing (50);
+
+    // merge maps of several sessions
+    if (strlen (getopt_get_string (gopt, "merge-maps")) > 2) {
+        merge_maps (self, getopt_get_string (gopt, "merge-maps"));
+        return 0;
+    }
+
     // read gates from command line file
     if (file_exists (self->param->map_filename)) {
 
@@ -2261,15 +2500,27 @@ int main (int argc, char *argv[])
     g_timeout_add_seconds (4, publish_ui_images_cb, self);
     g_timeout_add_seconds (2, update_future_direction_cb, self);
     g_timeout_add_seconds (10, end_of_log_cb, self);
+    g_timeout_add_seconds (2, loop_closure_online_cb, self);
 
     // publish cam settings every now and then
     g_timeout_add (500, &publish_class_param, self);
     g_timeout_add_seconds (10, &publish_map_list, self);
     //    g_timeout_add_seconds (2, &speak, self);
 
+    // approximate matching for the node estimation
+    int ann = 0;
+    bot_conf_get_int (self->conf, "classifier.ann_matching", &ann);
+    class_set_psi_ann (ann);
+
+    // enable feature tracking
+    start_tracker (self);
+
     // start main computation thread
     self->compute_thread = g_thread_create (compute_thread_cb, self, TRUE, NULL);
 
+    // start live loop closure
+    start_loop_closure_online (self);
+
     //    signal (SIGINT, main_shutdown);
     //    signal (SIGHUP, main_shutdown);
 
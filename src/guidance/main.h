@@ -41,6 +41,7 @@
 #include "bags.h"
 #include "dijkstra.h"
 #include "loop.h"
+#include "looponline.h"
 #include "util.h"
 #include "tracker2.h"
 #include "flow.h"
@@ -111,9 +112,15 @@ struct state_t {
     int64_t user_where_next_utime;
 
     // loop closure
-    double *corrmat;
-    int corrmat_size;
-    GQueue *voctree; // a list of bag_t words
+    corrmat_t *corrmat;         // similarity matrix (lower triangle)
+    bags_vocabulary_t *voctree; // the vocabulary (flat word centroids)
+    loop_online_t *loop_online; // live loop closure (exploration mode), or NULL
+    GQueue *loop_components;    // components found live so far
+
+    // feature tracking
+    gboolean tracker_enabled;
+    int tracker_ttl;
+    track_store_t *tracks;      // created on the first features, or NULL
 
     int64_t last_node_estimate_utime;
     int64_t last_rotation_guidance_utime;
@@ -154,7 +161,13 @@ int utime_to_index (state_t *self, int64_t utime);
 int64_t index_to_utime (state_t *self, int index);
 double calibration_dead_reckoning (int delta, int nframes, 
                                                    double freq, int code);
+void correlation_matrix_mode (state_t *self, int *mode, int *width);
 void process_correlation_matrix (state_t *self, const char *filename, dijk_graph_t *dg);
+GQueue *extract_loop_components (state_t *self, corrmat_t *corrmat);
+void apply_loop_components (dijk_graph_t *dg, GQueue *comp, const char *corrmat_filename);
+void merge_maps (state_t *self, const char *filenames);
+void start_loop_closure_online (state_t *self);
+void start_tracker (state_t *self);
 void run_calibration (state_t *self, int code);
 void populate_classifier_tables (state_t *self);
 void run_imu_validation (state_t *self);
@@ -172,6 +185,7 @@ void save_class_state (state_t *self);
 void utter_directions (state_t *self, double angle_rad);
 gpointer demo_timeout_thread_func (gpointer data);
 gpointer node_trigger_timeout_thread_func (gpointer data);
+void tracker_update (state_t *self, navlcm_feature_list_t *fs);
 void on_class_ui_video_mode_changed (state_t *self, char *string);
 void on_class_check_calibration (state_t *self);
 void on_class_node_set_label (state_t *self, char *txt);
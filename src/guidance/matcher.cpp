@@ -61,10 +61,29 @@ int patch_average (float *data, int width, int height, float c, float r, int rad
     return 0;
 }
 
+// sum of each channel and sum of squares (all channels) over the patch of radius <radius>
+// centered on (col,row), from the integral images <sum> and <sqsum> (see compute_integral_image)
+//
+static void patch_moments (double *sum, double *sqsum, int width, int col, int row, int radius,
+                           double *s, double *sq)
+{
+    int w = width + 1;
+    int c0 = col - (radius-1), c1 = col + radius;
+    int r0 = row - (radius-1), r1 = row + radius;
+
+    for (int k=0;k<3;k++) {
+        s[k] = sum[3*(r1*w+c1)+k] - sum[3*(r0*w+c1)+k] - sum[3*(r1*w+c0)+k] + sum[3*(r0*w+c0)+k];
+    }
+
+    *sq = sqsum[r1*w+c1] - sqsum[r0*w+c1] - sqsum[r1*w+c0] + sqsum[r0*w+c0];
+}
+
 // compute NCC between two patches in RGB
+// patch means and variances come from the integral images in O(1), only the cross
+// term is computed on the pixels (one vectorized dot product per patch row)
 //
-int patch_ncc (float *data1, float *data2, float *data1_mean, float *data2_mean, int width, int height,
-               float c1, float r1, float c2, float r2, int radius, float *val)
+int patch_ncc (float *data1, float *data2, double *sum1, double *sqsum1, double *sum2, double *sqsum2,
+               int width, int height, float c1, float r1, float c2, float r2, int radius, float *val)
 {
     if (!data1 || !data2)
         return -1;
@@ -82,57 +101,30 @@ int patch_ncc (float *data1, float *data2, float *data1_mean, float *data2_mean,
     if (patch_is_border (col2, row2, radius, width, height))
         return -1;
 
-    // compute patch average
-    float *ptr1 = data1_mean + 3*(width*row1+col1);
-    float *ptr2 = data2_mean + 3*(width*row2+col2);
-
-    float av1r = *ptr1; ptr1++;
-    float av1g = *ptr1; ptr1++;
-    float av1b = *ptr1; ptr1++;
-
-    float av2r = *ptr2; ptr2++;
-    float av2g = *ptr2; ptr2++;
-    float av2b = *ptr2; ptr2++;
-    /*
-    if (patch_average (data1, width, height, c1, r1, radius, &av1r, &av1g, &av1b) < 0)
-        return -1;
-
-    if (patch_average (data2, width, height, c2, r2, radius, &av2r, &av2g, &av2b) < 0)
-        return -1;
-    */
+    // compute patch sums
+    double s1[3], s2[3], sq1, sq2;
+    patch_moments (sum1, sqsum1, width, col1, row1, radius, s1, &sq1);
+    patch_moments (sum2, sqsum2, width, col2, row2, radius, s2, &sq2);
+
+    // cross term
+    int size = 2*radius-1;
+    float *ptr1 = data1 + 3*(width*(row1-radius+1)+col1-radius+1);
+    float *ptr2 = data2 + 3*(width*(row2-radius+1)+col2-radius+1);
+
+    double cross = 0.0;
+    for (int ii=0;ii<size;ii++) {
+        cross += simdmatch_dot (ptr1, ptr2, 3*size);
+        ptr1 += 3*width;
+        ptr2 += 3*width;
+    }
 
     // compute normalized cross-correlation
-    float nom = 0.0, denom = 0.0;
-    float  d1 = 0.0, d2 = 0.0;
-    
-    col1 -= radius-1; col2 -= radius-1;
-    row1 -= radius-1; row2 -= radius-1;
-
-    ptr1 = data1 + 3*(width*row1+col1);
-    ptr2 = data2 + 3*(width*row2+col2);
-
-    for (int ii=0;ii<2*radius-1;ii++) {
-        for (int jj=0;jj<2*radius-1;jj++) {
-            
-            float r1 = *ptr1; ptr1++;
-            float g1 = *ptr1; ptr1++;
-            float b1 = *ptr1; ptr1++;
-            
-            float r2 = *ptr2; ptr2++;
-            float g2 = *ptr2; ptr2++;
-            float b2 = *ptr2; ptr2++;
-            
-            d1 += (r1-av1r)*(r1-av1r)+(g1-av1g)*(g1-av1g)+(b1-av1b)*(b1-av1b);
-            d2 += (r2-av2r)*(r2-av2r)+(g2-av2g)*(g2-av2g)+(b2-av2b)*(b2-av2b);
-
-            nom += (r1-av1r)*(r2-av2r)+(g1-av1g)*(g2-av2g)+(b1-av1b)*(b2-av2b);
-        }
-
-        ptr1 = ptr1 + 3*(width-2*radius+1);
-        ptr2 = ptr2 + 3*(width-2*radius+1);
-    }
+    double n = size * size;
+    double nom = cross - (s1[0]*s2[0] + s1[1]*s2[1] + s1[2]*s2[2]) / n;
+    double d1 = sq1 - (s1[0]*s1[0] + s1[1]*s1[1] + s1[2]*s1[2]) / n;
+    double d2 = sq2 - (s2[0]*s2[0] + s2[1]*s2[1] + s2[2]*s2[2]) / n;
 
-    denom = sqrt(d1*d2);
+    double denom = sqrt(MAX(d1,0.0)*MAX(d2,0.0));
 
     if (fabs(denom)<1E-6)
         return -1;
@@ -143,52 +135,26 @@ int patch_ncc (float *data1, float *data2, float *data1_mean, float *data2_mean,
 }
 
 // standard deviation of a patch
-int patch_stdev (float *data, float *data_mean, int width, int height, int col, int row, int radius, float *val)
+int patch_stdev (double *sum, double *sqsum, int width, int height, int col, int row, int radius, float *val)
 {
     if (patch_is_border (col, row, radius, width, height))
         return -1;
 
-    float stdev = 0.0;
-
-    // compute patch average
-    float *ptr = data_mean + 3*(width*row+col);
-
-    float avr = *ptr; ptr++;
-    float avg = *ptr; ptr++;
-    float avb = *ptr; ptr++;
-
-    // compute stdev
-    int c = col - (radius-1);
-    int r = row - (radius-1);
-
-    ptr = data + 3*(width*r+c);
-
-    for (int ii=0;ii<2*radius-1;ii++) {
-        for (int jj=0;jj<2*radius-1;jj++) {
-            
-            float cr = *ptr; ptr++;
-            float cg = *ptr; ptr++;
-            float cb = *ptr; ptr++;
-    
-            stdev += (cr-avr)*(cr-avr)+(cg-avg)*(cg-avg)+(cb-avb)*(cb-avb);
-
-        }
-
-        ptr = ptr + 3*(width-2*radius+1);
-    }
+    double s[3], sq;
+    patch_moments (sum, sqsum, width, col, row, radius, s, &sq);
 
     float surf = (2*radius-1)*(2*radius-1);
 
-    stdev = sqrt(stdev)/surf;
+    double var = sq - (s[0]*s[0] + s[1]*s[1] + s[2]*s[2]) / surf;
 
-    *val = stdev;
+    *val = sqrt(MAX(var,0.0))/surf;
 
     return 0;
 }
 
 // exhaustive search of a patch using NCC
 //
-int patch_search (float *data1, float *data2, float *data1_mean, float *data2_mean,
+int patch_search (float *data1, float *data2, double *sum1, double *sqsum1, double *sum2, double *sqsum2,
                   int width, int height, int c1, int r1, int radius, 
                   int search_radius, int *c2, int *r2, float *val)
 {
@@ -217,7 +183,7 @@ int patch_search (float *data1, float *data2, float *data1_mean, float *data2_me
                 continue;
 
             // skip if ncc computation failed
-            if (patch_ncc (data1, data2, data1_mean, data2_mean, width, height, c1, r1, cc, rr, radius, &ncc) < 0)
+            if (patch_ncc (data1, data2, sum1, sqsum1, sum2, sqsum2, width, height, c1, r1, cc, rr, radius, &ncc) < 0)
                 continue;
             
             // keep if better
@@ -243,7 +209,8 @@ tracker_t::tracker_t ()
 {
     prev = next = NULL;
     prev_32f = next_32f = NULL;
-    prev_mean_32f = next_mean_32f = NULL;
+    prev_sum = next_sum = NULL;
+    prev_sqsum = next_sqsum = NULL;
     pts = NULL;
 
     width = height = 0;
@@ -257,8 +224,10 @@ tracker_t::~tracker_t ()
     if (next_32f) ippFree (next_32f);
     if (prev_32f) ippFree (prev_32f);
 
-    if (next_mean_32f) ippFree (next_mean_32f);
-    if (prev_mean_32f) ippFree (prev_mean_32f);
+    free (next_sum);
+    free (prev_sum);
+    free (next_sqsum);
+    free (prev_sqsum);
 
     free (pts);
 }
@@ -275,10 +244,16 @@ void tracker_t::init (int w, int h)
     if (!next_32f)
         next_32f = (Ipp32f*)ippMalloc (3*w*h*sizeof(float));
 
-    if (!prev_mean_32f)
-        prev_mean_32f = (Ipp32f*)ippMalloc (3*w*h*sizeof(float));
-    if (!next_mean_32f)
-        next_mean_32f = (Ipp32f*)ippMalloc (3*w*h*sizeof(float));
+    // integral images have one extra row and column of zeros
+    if (!prev_sum)
+        prev_sum = (double*)calloc (3*(w+1)*(h+1), sizeof(double));
+    if (!next_sum)
+        next_sum = (double*)calloc (3*(w+1)*(h+1), sizeof(double));
+
+    if (!prev_sqsum)
+        prev_sqsum = (double*)calloc ((w+1)*(h+1), sizeof(double));
+    if (!next_sqsum)
+        next_sqsum = (double*)calloc ((w+1)*(h+1), sizeof(double));
 
     width = w;
     height = h;
@@ -296,15 +271,16 @@ void tracker_t::copy_data (unsigned char *data, int w, int h, int radius)
     // copy next_32f to prev_32f
     ippiCopy_32f_C3R (next_32f, 3*width*sizeof(float), prev_32f, 3*width*sizeof(float), dst_roi);
     
-    // copy next_mean_32f to prev_mean_32f
-    ippiCopy_32f_C3R (next_mean_32f, 3*width*sizeof(float), prev_mean_32f, 3*width*sizeof(float), dst_roi);
+    // swap integral images
+    double *tmp = prev_sum; prev_sum = next_sum; next_sum = tmp;
+    tmp = prev_sqsum; prev_sqsum = next_sqsum; next_sqsum = tmp;
 
     // scale from unsigned char [0-255] to float [0.0-1.0]
     ippiScale_8u32f_C3R (data, 3*width, next_32f,
                          3*width * sizeof(float), dst_roi , 0.0, 1.0);
     
-    // compute mean image
-    compute_mean_image (next_32f, next_mean_32f, w, h, radius);
+    // compute integral images (patch means and variances in O(1))
+    compute_integral_image (next_32f, next_sum, next_sqsum, w, h);
 
     // copy to next
     ippiCopy_8u_C3R (data, 3*width, next, 3*width, dst_roi);
@@ -323,7 +299,7 @@ void tracker_t::ncc_run (int col, int row, int radius, int search_radius)
     int col2, row2;
     float ncc;
     
-    if (patch_search (prev_32f, next_32f, prev_mean_32f, next_mean_32f, width, height, col, row, radius, 
+    if (patch_search (prev_32f, next_32f, prev_sum, prev_sqsum, next_sum, next_sqsum, width, height, col, row, radius, 
                       search_radius, &col2, &row2, &ncc) < 0) {
         dbg (DBG_INFO, "[track] failed to search patch!");
         return;
@@ -339,6 +315,54 @@ void tracker_t::ncc_run (int col, int row, int radius, int search_radius)
     npts++;
 }
 
+typedef struct {
+    tracker_t *tracker;
+    int *grid;          // (col,row) of each grid point
+    int *res;           // (col2,row2,score,valid) of each grid point
+    int start, end;
+    int radius, search_radius;
+} tracker_job_t;
+
+static gpointer tracker_calibration_job_cb (gpointer data)
+{
+    tracker_job_t *job = (tracker_job_t*)data;
+    tracker_t *tr = job->tracker;
+
+    for (int i=job->start;i<job->end;i++) {
+
+        int col = job->grid[2*i+0];
+        int row = job->grid[2*i+1];
+        int *res = job->res + 4*i;
+        int col2, row2;
+        float ncc;
+
+        res[3] = 0;
+
+        // compute patch stdev
+        float stdev = 0.0;
+        if (patch_stdev (tr->prev_sum, tr->prev_sqsum, tr->width, tr->height, col, row, job->radius, &stdev) < 0)
+            continue;
+
+        // search for patch using NCC
+        if (patch_search (tr->prev_32f, tr->next_32f, tr->prev_sum, tr->prev_sqsum, tr->next_sum, tr->next_sqsum, 
+                          tr->width, tr->height, col, row, job->radius, job->search_radius, &col2, &row2, &ncc) < 0)
+            continue;
+
+        // filter
+        if (stdev*1000 < 2)// || (1.0-ncc)*1000 > 10)
+            continue;
+
+        res[0] = col2;
+        res[1] = row2;
+        res[2] = math_round((1.0-ncc)*1000);
+        res[3] = 1;
+    }
+
+    return NULL;
+}
+
+// the grid points are split across one thread per core
+//
 void tracker_t::ncc_run_straight_calibration (int nx, int ny, int radius, int search_radius)
 {
     if (pts) {
@@ -354,38 +378,65 @@ void tracker_t::ncc_run_straight_calibration (int nx, int ny, int radius, int se
     int dc = math_round(1.0*width/nx);
     int dr = math_round(1.0*height/ny);
 
+    int ngrid = 0;
+    int *grid = (int*)malloc (2*((width+dc-1)/dc)*((height+dr-1)/dr)*sizeof(int));
+
     for (int col=dc;col<width;col+=dc) {
         for (int row=dr;row<height;row+=dr) {
-            
-            int col2, row2;
-            float ncc;
+            grid[2*ngrid+0] = col;
+            grid[2*ngrid+1] = row;
+            ngrid++;
+        }
+    }
 
-            // compute patch stdev
-            float stdev = 0.0;
-            if (patch_stdev (prev_32f, prev_mean_32f, width, height, col, row, radius, &stdev) < 0)
-                continue;
+    int *res = (int*)malloc (4*MAX(1,ngrid)*sizeof(int));
 
-            // search for patch using NCC
-            if (patch_search (prev_32f, next_32f, prev_mean_32f, next_mean_32f, width, height, col, row, radius, 
-                search_radius, &col2, &row2, &ncc) < 0)
-                continue;
-            
-            // filter
-            if (stdev*1000 < 2)// || (1.0-ncc)*1000 > 10)
-                continue;
+    int nthreads = MAX (1, MIN (sysconf (_SC_NPROCESSORS_ONLN), ngrid / 16));
 
-            pts = (int*)realloc(pts, 5*(npts+1)*sizeof(int));
-            
-            pts[5*npts+0] = col;
-            pts[5*npts+1] = row;
-            pts[5*npts+2] = col2;
-            pts[5*npts+3] = row2;
-            pts[5*npts+4] = math_round((1.0-ncc)*1000);
+    tracker_job_t *jobs = (tracker_job_t*)malloc (nthreads * sizeof(tracker_job_t));
+    GThread **threads = (GThread**)malloc (nthreads * sizeof(GThread*));
 
-            npts++;
-        }
+    for (int t=0;t<nthreads;t++) {
+        tracker_job_t *job = jobs + t;
+        job->tracker = this;
+        job->grid = grid;
+        job->res = res;
+        job->start = t * ngrid / nthreads;
+        job->end = (t+1) * ngrid / nthreads;
+        job->radius = radius;
+        job->search_radius = search_radius;
     }
-    
+
+    // the calling thread takes the first chunk
+    for (int t=1;t<nthreads;t++)
+        threads[t] = g_thread_create (tracker_calibration_job_cb, jobs + t, TRUE, NULL);
+
+    tracker_calibration_job_cb (jobs);
+
+    for (int t=1;t<nthreads;t++)
+        g_thread_join (threads[t]);
+
+    // collect the tracks in grid order
+    pts = (int*)malloc (5*MAX(1,ngrid)*sizeof(int));
+
+    for (int i=0;i<ngrid;i++) {
+        if (!res[4*i+3])
+            continue;
+
+        pts[5*npts+0] = grid[2*i+0];
+        pts[5*npts+1] = grid[2*i+1];
+        pts[5*npts+2] = res[4*i+0];
+        pts[5*npts+3] = res[4*i+1];
+        pts[5*npts+4] = res[4*i+2];
+
+        npts++;
+    }
+
+    free (grid);
+    free (res);
+    free (jobs);
+    free (threads);
+
     gulong usecs;
     
     dbg (DBG_INFO, "[tracker] process %d points in %.3f sec", npts, g_timer_elapsed (timer, &usecs));
@@ -452,89 +503,45 @@ void tracker_t::ncc_publish (lcm_t *lcm, int sensor_id)
 {
 }
 
-void tracker_t::compute_mean_image (Ipp32f *src, Ipp32f *dst, int w, int h, int radius)
+// integral images of an RGB image: <sum> (3 channels) and <sqsum> (sum of squares
+// over the 3 channels), both (w+1)x(h+1) with a first row and column of zeros
+//
+void tracker_t::compute_integral_image (Ipp32f *src, double *sum, double *sqsum, int w, int h)
 {
     GTimer *timer = g_timer_new ();
 
-    // temp images
-    Ipp32f *mean_x = (Ipp32f*)ippMalloc(3*width*height*sizeof(float));
-
-    // mean X
-    for (int r=0;r<height;r++) {
-        
-        float valr = 0.0, valg = 0.0, valb = 0.0;
-        
-        float *ptr1 = src + 3 * r * width;
-        float *ptr2 = ptr1 + 3 * (2*radius-1);
-        float *ptrd = mean_x + 3 * (r * width + radius - 1);
+    int ws = w + 1;
 
-        for (int c=0;c<width-2*radius;c++) {
-            
-            // first column, init mean value
-            if (c == 0) {
-                float *ptr3 = ptr1;
-                for (int k=0;k<2*radius-1;k++) {
-                    valr += *ptr3; ptr3++;
-                    valg += *ptr3; ptr3++;
-                    valb += *ptr3; ptr3++;
-                }
-            } else {
-                // other columns, simply update
-                valr += *ptr2-*ptr1; ptr1++; ptr2++;
-                valg += *ptr2-*ptr1; ptr1++; ptr2++;
-                valb += *ptr2-*ptr1; ptr1++; ptr2++;
-            }
+    for (int r=0;r<h;r++) {
 
-            *ptrd = valr; ptrd++;
-            *ptrd = valg; ptrd++;
-            *ptrd = valb; ptrd++;
+        double accr = 0.0, accg = 0.0, accb = 0.0, accsq = 0.0;
 
-        }
-    }
-            
-    float surf = (2*radius-1)*(2*radius-1);
+        float *ptr = src + 3 * r * w;
+        double *prow = sum + 3 * r * ws;
+        double *drow = sum + 3 * (r+1) * ws;
+        double *pqrow = sqsum + r * ws;
+        double *dqrow = sqsum + (r+1) * ws;
 
-    // dst
-    for (int c=0;c<width;c++) {
-        
-        float valr = 0.0, valg = 0.0, valb = 0.0;
-        
-        float *ptr1 = mean_x + 3 * c;
-        float *ptr2 = ptr1 + 3 * (2*radius-1) * width;
-        float *ptrd = dst + 3 * c + 3 * width * (radius - 1);
+        for (int c=0;c<w;c++) {
+            float vr = *ptr; ptr++;
+            float vg = *ptr; ptr++;
+            float vb = *ptr; ptr++;
 
-        for (int r=0;r<height-2*radius;r++) {
-            
-            // first row, init mean value
-            if (r == 0) {
-                float *ptr3 = ptr1;
-                for (int k=0;k<2*radius-1;k++) {
-                    valr += *ptr3; ptr3++;
-                    valg += *ptr3; ptr3++;
-                    valb += *ptr3; ptr3++;
-                    ptr3 += 3*(width-1);
-                }
-            } else {
-                // other columns, simply update
-                valr += *ptr2-*ptr1; ptr1++; ptr2++;
-                valg += *ptr2-*ptr1; ptr1++; ptr2++;
-                valb += *ptr2-*ptr1; ptr1++; ptr2++;
-                ptr1 += 3*(width-1); ptr2 += 3*(width-1);
-            }
+            accr += vr;
+            accg += vg;
+            accb += vb;
+            accsq += vr*vr + vg*vg + vb*vb;
 
-            *ptrd = valr/surf; ptrd++;
-            *ptrd = valg/surf; ptrd++;
-            *ptrd = valb/surf; ptrd++;
-            ptrd += 3*(width-1);
+            drow[3*(c+1)+0] = prow[3*(c+1)+0] + accr;
+            drow[3*(c+1)+1] = prow[3*(c+1)+1] + accg;
+            drow[3*(c+1)+2] = prow[3*(c+1)+2] + accb;
+            dqrow[c+1] = pqrow[c+1] + accsq;
         }
     }
-    
-    // free
-    ippFree (mean_x);
 
     gulong usecs;
     
-    dbg (DBG_INFO, "[track] compute mean perf %.3f sec.", g_timer_elapsed (timer, &usecs));
+    dbg (DBG_INFO, "[track] compute integral image perf %.3f sec.", g_timer_elapsed (timer, &usecs));
     
     g_timer_destroy (timer);
 }
@@ -587,6 +594,18 @@ int neighbor_features (float col1, float row1, int sid1,
 
     return onedge1 && onedge2;
 }
+
+/* Use a spatial grid (see featgrid.h) to list the candidate pairs when matching
+ * is gated by distance in the image and restricted to the same camera (tracker,
+ * maxdist). Only these pairs are compared, with the same matches as the full scan.
+ */
+static gboolean g_spatial_index = TRUE;
+
+void matcher_set_spatial_index (gboolean enable)
+{
+    g_spatial_index = enable;
+}
+
 // compute multiple feature matches
 // keep the <topK> best matches in set2 for each feature in set1
 // <maxdist>: maximum distance between two matches in pixels.
@@ -598,20 +617,20 @@ int neighbor_features (float col1, float row1, int sid1,
 // <monogamy>: if set to true, monogamy is enforced within each camera
 // <within_camera>: if this is set to true, matches are allowed with the same camera.
 // <across_camera>: if this is set to true, matches are allowed across cameras.
+// <matching_mode>: MATCHING_ANN to take the candidates from a kd-forest over set2
+// (approximate, see kdforest.h), any other value for the exhaustive search.
 //
 navlcm_feature_match_set_t *
 find_feature_matches_multi (navlcm_feature_list_t *keys1, 
                             navlcm_feature_list_t *keys2, gboolean within_camera,
                             gboolean across_cameras,
                             int topK, double thresh, 
-                            double maxdist, double maxdist_ft, gboolean monogamy)
+                            double maxdist, double maxdist_ft, gboolean monogamy,
+                            int matching_mode)
 {
     // init to empty set
     navlcm_feature_match_set_t *matches = 
-        (navlcm_feature_match_set_t *)malloc
-        (sizeof(navlcm_feature_match_set_t *));
-    matches->num = 0;
-    matches->el = NULL;
+        navlcm_feature_match_set_t_create ();
 
     // skip if no features
     if (!keys1 || !keys2 || keys1->num < 1 || keys2->num < 1)
@@ -623,6 +642,29 @@ find_feature_matches_multi (navlcm_feature_list_t *keys1,
     int index = 0;
     double sqmaxdist = maxdist * maxdist;
 
+    // candidate pairs from a spatial grid if only nearby features of the same camera
+    // can match
+    int *pstart = NULL, *pind = NULL;
+    if (matching_mode != MATCHING_ANN && g_spatial_index && within_camera && !across_cameras && maxdist > 1E-6) {
+        featgrid_t *grid = featgrid_new (keys2, maxdist);
+        featgrid_pairs (grid, keys1, maxdist, FEATGRID_EUCLIDEAN, &pstart, &pind);
+        featgrid_destroy (grid);
+    }
+
+    // or the approximate topK nearest neighbours. The forest gates on the L1 distance
+    // in the image, so that it is given a radius that keeps all the pairs within <maxdist>
+    // (euclidean), which are then tested below.
+    int *ann_ind = NULL;
+    if (matching_mode == MATCHING_ANN) {
+        simdmatch_filter_t filter = { within_camera, across_cameras, maxdist > 1E-6 ? M_SQRT2 * maxdist : -1.0 };
+        kdforest_t *forest = kdforest_new (keys2, KDFOREST_NTREES, KDFOREST_LEAF_SIZE);
+        ann_ind = (int*)malloc(topK*keys1->num*sizeof(int));
+        float *ann_dist = (float*)malloc(topK*keys1->num*sizeof(float));
+        kdforest_knn_list (forest, keys1, &filter, topK, KDFOREST_MAX_CHECKS, 0, ann_ind, ann_dist);
+        kdforest_destroy (forest);
+        free (ann_dist);
+    }
+
     for (int i=0;i<keys1->num;i++) {
 
         navlcm_feature_t *key = keys1->el + i;
@@ -639,9 +681,15 @@ find_feature_matches_multi (navlcm_feature_list_t *keys1,
              ind_u[k] = 0;
         }
 
-        // parse set 2
-        for (int j=0 ; j<keys2->num ; j++) {
+        // parse set 2 (or the candidates)
+        int jstart = pstart ? pstart[i] : ann_ind ? i * topK : 0;
+        int jend = pstart ? pstart[i+1] : ann_ind ? (i+1) * topK : keys2->num;
+        int *cand = pind ? pind : ann_ind;
+
+        for (int jj=jstart ; jj<jend ; jj++) {
 
+            int j = cand ? cand[jj] : jj;
+            if (j == -1) break;
             navlcm_feature_t *tar = keys2->el + j;
 
             // use laplacian to skip early
@@ -728,17 +776,40 @@ find_feature_matches_multi (navlcm_feature_list_t *keys1,
 
     }
 
+    free (pstart);
+    free (pind);
+    free (ann_ind);
+
     if (monogamy)
         matches = filter_matches_polygamy (matches, TRUE);
 
     return matches;
 }
 
-typedef struct { int index; double dist; } matcher_pair_t;
+/* a candidate match (destination feature <sensorid>.<index>) for the monogamy filter.
+ * <match> is the position of the source match in the set, <pos> the position of the
+ * candidate in the flattened list of destinations (order of appearance).
+ */
+typedef struct { int sensorid; int index; double dist; int match; int pos; } matcher_candidate_t;
+
+static int matcher_candidate_comp (const void *a, const void *b)
+{
+    const matcher_candidate_t *ca = (const matcher_candidate_t*)a;
+    const matcher_candidate_t *cb = (const matcher_candidate_t*)b;
+
+    if (ca->sensorid != cb->sensorid) return ca->sensorid < cb->sensorid ? -1 : 1;
+    if (ca->index != cb->index) return ca->index < cb->index ? -1 : 1;
+    if (ca->pos != cb->pos) return ca->pos < cb->pos ? -1 : 1;
+    return 0;
+}
 
 // filter matches to avoid polygamy within the same camera
 // <within_camera>: if set to true, monogamy is only reinforced within the same camera
 //
+// the candidates are sorted by destination feature (O(M log M) for M candidates). For each
+// destination, the source match with the smallest distance wins (the last one in order of
+// appearance on ties) and keeps all its candidates for that destination.
+//
 navlcm_feature_match_set_t *
 filter_matches_polygamy (navlcm_feature_match_set_t *matches, gboolean within_camera)
 {
@@ -748,40 +819,54 @@ filter_matches_polygamy (navlcm_feature_match_set_t *matches, gboolean within_ca
 
     GTimer *timer = g_timer_new ();
 
-    // create a hash table
-    GHashTable *hash = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify)g_str_free, 
-            (GDestroyNotify)g_free);
+    // flatten the candidates
+    int ncand = 0;
+    for (int i=0;i<matches->num;i++)
+        ncand += matches->el[i].num;
 
-    // populate the hash table
+    matcher_candidate_t *cand = (matcher_candidate_t*)malloc (MAX (1, ncand) * sizeof(matcher_candidate_t));
+    gboolean *keep = (gboolean*)malloc (MAX (1, ncand) * sizeof(gboolean));
 
+    int n = 0, pos = 0;
     for (int i=0;i<matches->num;i++) {
         navlcm_feature_match_t *match = matches->el + i;
-        if (match->num == 0) continue;
-        for (int k=0;k<match->num;k++) {
-            if (match->dst[k].index < 0) continue;
+        for (int k=0;k<match->num;k++, pos++) {
 
-            // do not incorporate in hash table if across different cameras
+            // matches across different cameras are accepted
             gboolean same_camera = match->dst[k].sensorid == match->src.sensorid;
-            if (within_camera && !same_camera) continue; // these matches will be accepted
-
-            matcher_pair_t pa; pa.index = i; pa.dist = match->dist[k];
-
-            // query hash table
-            char key[20];
-            sprintf (key, "%d.%d", match->dst[k].sensorid, 
-                                    match->dst[k].index);
-            gpointer data = g_hash_table_lookup (hash, key);
-            if (data) {
-                matcher_pair_t *pb = (matcher_pair_t*)data;
-                if (pb->dist < pa.dist) continue;
-            }
+            keep[pos] = within_camera && !same_camera;
+            if (keep[pos] || match->dst[k].index < 0) continue;
+
+            matcher_candidate_t *c = cand + n++;
+            c->sensorid = match->dst[k].sensorid;
+            c->index = match->dst[k].index;
+            c->dist = match->dist[k];
+            c->match = i;
+            c->pos = pos;
+        }
+    }
+
+    // group the candidates by destination feature
+    qsort (cand, n, sizeof(matcher_candidate_t), matcher_candidate_comp);
 
-            // if there was no entry or a worse entry, replace
-            matcher_pair_t *copy = g_new (matcher_pair_t, 1);
-            copy->index = pa.index; copy->dist = pa.dist;
-            g_hash_table_replace (hash, g_strdup(key), copy);
+    for (int start=0;start<n;) {
+        int end = start + 1;
+        while (end < n && cand[end].sensorid == cand[start].sensorid && cand[end].index == cand[start].index)
+            end++;
+
+        // best match for this destination
+        int best = start;
+        for (int c=start+1;c<end;c++) {
+            if (!(cand[best].dist < cand[c].dist))
+                best = c;
+        }
 
+        for (int c=start;c<end;c++) {
+            if (cand[c].match == cand[best].match)
+                keep[cand[c].pos] = TRUE;
         }
+
+        start = end;
     }
 
     // create a new set of matches from scratch
@@ -789,33 +874,13 @@ filter_matches_polygamy (navlcm_feature_match_set_t *matches, gboolean within_ca
         navlcm_feature_match_set_t_create ();
 
     // parse the old set
+    pos = 0;
     for (int i=0;i<matches->num;i++) {
         navlcm_feature_match_t *match = matches->el + i;
         navlcm_feature_match_t *new_match = 
             navlcm_feature_match_t_create(&match->src);
-        for (int k=0;k<match->num;k++) {
-            gboolean ok = FALSE;
-            
-            // do not incorporate in hash table if across different cameras
-            gboolean same_camera = match->dst[k].sensorid == match->src.sensorid;
-            if (within_camera && !same_camera) {
-                ok = TRUE;
-            } else {
-                // search in the hash table
-                char key[20];
-                sprintf (key, "%d.%d", match->dst[k].sensorid, 
-                                        match->dst[k].index);
-                gpointer data = g_hash_table_lookup (hash, key);
-                if (data) {
-                    matcher_pair_t *pa = (matcher_pair_t*)data;
-                    // keep if does correspond to this match
-                    if (pa->index  == i) {
-                        ok = TRUE;
-                    }
-                }
-            }
-
-            if (ok) {
+        for (int k=0;k<match->num;k++, pos++) {
+            if (keep[pos]) {
                 navlcm_feature_t *fc = navlcm_feature_t_copy (match->dst + k);
                 new_match = navlcm_feature_match_t_insert (new_match, fc, match->dist[k]);
                 free (fc);
@@ -834,8 +899,8 @@ filter_matches_polygamy (navlcm_feature_match_set_t *matches, gboolean within_ca
     // destroy the old set
     navlcm_feature_match_set_t_destroy (matches);
 
-    // destroy the hash table
-    g_hash_table_destroy (hash);
+    free (cand);
+    free (keep);
 
     gulong usecs;
     double secs = g_timer_elapsed (timer, &usecs);
@@ -897,18 +962,107 @@ float ncc_float (float *d1, float *d2, int size)
     return ncc;
 }
 
-/* Match features between two sets. We assume that feature descriptors are normalized.
- * Therefore, minimizing the SSD is equivalent to maximazing the dot product, which
- * is computed between each pair of features using a matrix representation.
- *
- * options:
- *              <monogamy>: enforce monogamy
- *              <mutual_consistency>: mutual consistency check
- *              <maxdist> : maximum distance between features in pixels (<0 to skip)
- *              <matching_mode>: MATCHING_DOTPROD or MATCHING_NCC
+/* Consistency mode used by the matchers (see matcher_set_consistency_mode).
+ */
+static int g_consistency_mode = MATCHER_CONSISTENCY_FAST;
+
+/* MATCHER_CONSISTENCY_FAST (default): mutual consistency from the per-column best
+ * and second best, monogamy with a per-destination winner array (both linear).
+ * MATCHER_CONSISTENCY_QUADRATIC: original pairwise passes, kept as a reference.
+ * Both modes produce the same matches.
+ */
+void matcher_set_consistency_mode (int mode)
+{
+    g_consistency_mode = mode;
+}
+
+int matcher_consistency_mode ()
+{
+    return g_consistency_mode;
+}
+
+/* best and second best entry of each column of a [n1 x n2] matrix, and the row of the best.
+ */
+static void matcher_column_top2 (float *dotprod, int n1, int n2, int *col_ind, float *col_best, float *col_secn)
+{
+    for (int j=0;j<n2;j++) {
+        col_ind[j] = -1;
+        col_best[j] = -FLT_MAX;
+        col_secn[j] = -FLT_MAX;
+    }
+
+    for (int i=0;i<n1;i++) {
+        float *row = dotprod + i*n2;
+        for (int j=0;j<n2;j++) {
+            if (col_best[j] < row[j]) {
+                col_secn[j] = col_best[j];
+                col_best[j] = row[j];
+                col_ind[j] = i;
+            } else if (col_secn[j] < row[j]) {
+                col_secn[j] = row[j];
+            }
+        }
+    }
+}
+
+/* mutual consistency: reject row <i> if another row has a better dot product with its
+ * best column. <col_*> as computed by matcher_column_top2.
+ */
+static gboolean matcher_mutual_consistency (int i, int best_ind, float best_dot, int *col_ind, float *col_best, float *col_secn)
+{
+    float other = col_ind[best_ind] == i ? col_secn[best_ind] : col_best[best_ind];
+
+    return best_dot < other ? FALSE : TRUE;
+}
+
+/* monogamy: only one row may match a given column. The row with the best dot product
+ * wins, the first one in case of a tie.
+ */
+static void matcher_monogamy_quadratic (int *best_inds, float *best_dots, int n1)
+{
+    for (int i=0;i<n1;i++) {
+        for (int j=i+1;j<n1;j++) {
+            if (best_inds[i] == best_inds[j] && best_inds[i] != -1) {
+                if (best_dots[i] < best_dots[j])
+                    best_inds[i] = -1;
+                else
+                    best_inds[j] = -1;
+            }
+        }
+    }
+}
+
+/* same as above, in one pass with a per-destination winner array
+ */
+static void matcher_monogamy_linear (int *best_inds, float *best_dots, int n1, int n2)
+{
+    int *winner = (int*)malloc(n2*sizeof(int));
+    for (int j=0;j<n2;j++)
+        winner[j] = -1;
+
+    for (int i=0;i<n1;i++) {
+        int j = best_inds[i];
+        if (j == -1)
+            continue;
+        if (winner[j] == -1) {
+            winner[j] = i;
+        } else if (best_dots[winner[j]] < best_dots[i]) {
+            best_inds[winner[j]] = -1;
+            winner[j] = i;
+        } else {
+            best_inds[i] = -1;
+        }
+    }
+
+    free (winner);
+}
+
+/* Reference implementation of find_feature_matches_fast: computes the full
+ * n1 x n2 dot-product matrix with MKL and parses it. Kept for NCC matching and
+ * for validation of the tiled matcher.
  */
 int
-find_feature_matches_fast (navlcm_feature_list_t *keys1, 
+find_feature_matches_naive (navlcm_feature_list_t *keys1, 
                             navlcm_feature_list_t *keys2, gboolean within_camera,
                             gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
                             double thresh, double maxdist, int matching_mode,
@@ -1001,6 +1155,18 @@ find_feature_matches_fast (navlcm_feature_list_t *keys1,
     // parse distance matrix
     int *best_inds = (int*)malloc(keys1->num*sizeof(int));
     int *secn_inds = (int*)malloc(keys1->num*sizeof(int));
+    float *best_dots = (float*)malloc(keys1->num*sizeof(float));
+
+    // per-column best, for the mutual consistency check
+    gboolean fast_consistency = g_consistency_mode == MATCHER_CONSISTENCY_FAST;
+    int *col_inds = NULL;
+    float *col_best = NULL, *col_secn = NULL;
+    if (mutual_consistency && fast_consistency) {
+        col_inds = (int*)malloc(keys2->num*sizeof(int));
+        col_best = (float*)malloc(keys2->num*sizeof(float));
+        col_secn = (float*)malloc(keys2->num*sizeof(float));
+        matcher_column_top2 (dotprod, keys1->num, keys2->num, col_inds, col_best, col_secn);
+    }
 
     for (int i=0;i<keys1->num;i++) {
         int *best_ind=best_inds+i;
@@ -1024,12 +1190,16 @@ find_feature_matches_fast (navlcm_feature_list_t *keys1,
             }
         }
         assert (*best_ind != -1);
+        best_dots[i] = best_dot;
 
         // skip if threshold criteria not met
         if (1.0-best_dot > thresh  * (1.0-secn_dot)) {
             *best_ind = -1;
         } else {
-            if (mutual_consistency) {
+            if (mutual_consistency && fast_consistency) {
+                if (!matcher_mutual_consistency (i, *best_ind, best_dot, col_inds, col_best, col_secn))
+                    *best_ind = -1;
+            } else if (mutual_consistency) {
                 // skip if mutual consistency fails
                 for (int ii=0;ii<keys1->num;ii++) {
                     if (ii != i && best_dot < dotprod[ii*keys2->num+*best_ind]) {
@@ -1043,18 +1213,10 @@ find_feature_matches_fast (navlcm_feature_list_t *keys1,
 
     // monogamy
     if (monogamy) {
-        for (int i=0;i<keys1->num;i++) {
-            for (int j=i+1;j<keys1->num;j++) {
-                if (best_inds[i] == best_inds[j] && best_inds[i] != -1) {
-                    double doti = dotprod[i*keys2->num + best_inds[i]];
-                    double dotj = dotprod[j*keys2->num + best_inds[j]];
-                    if (doti < dotj)
-                        best_inds[i] = -1;
-                    else
-                        best_inds[j] = -1;
-                }
-            }
-        }
+        if (fast_consistency)
+            matcher_monogamy_linear (best_inds, best_dots, keys1->num, keys2->num);
+        else
+            matcher_monogamy_quadratic (best_inds, best_dots, keys1->num);
     }
 
     // generate matches
@@ -1083,6 +1245,10 @@ find_feature_matches_fast (navlcm_feature_list_t *keys1,
     free (desc2);
     free (secn_inds);
     free (best_inds);
+    free (best_dots);
+    free (col_inds);
+    free (col_best);
+    free (col_secn);
     free (dotprod);
 
     // sanity check
@@ -1094,196 +1260,956 @@ find_feature_matches_fast (navlcm_feature_list_t *keys1,
     return 0;
 }
 
-/* Matching sanity check.
-*/
-void match_sanity_check (
-        navlcm_feature_match_set_t *matches,
-        navlcm_feature_list_t *set1, navlcm_feature_list_t *set2, 
-        gboolean within_camera, gboolean across_cameras)
+/* turn the output of simdmatch_top2 into matches: ratio test, mutual consistency,
+ * monogamy. <row0> is the position of keys1 in the (batch) query set, <best_*> and
+ * <col_*> point to the entries of keys1.
+ */
+static void matcher_select_matches (navlcm_feature_list_t *keys1, navlcm_feature_list_t *keys2, int row0,
+                                    int *best_inds, float *best_dots, float *secn_dots,
+                                    int *col_inds, float *col_best, float *col_secn,
+                                    double thresh, gboolean monogamy, gboolean mutual_consistency,
+                                    navlcm_feature_match_set_t *matches)
 {
-    // for each match, make sure that no better match can be found
-    //
-    for (int i=0;i<matches->num;i++) {
-        navlcm_feature_match_t *match = matches->el + i;
+    int n1 = keys1->num;
+    int n2 = keys2->num;
 
-        navlcm_feature_t *f1 = &match->src;
-        navlcm_feature_t *f2 = match->dst;
+    for (int i=0;i<n1;i++) {
+        assert (best_inds[i] != -1);
 
-        if (!within_camera  && f1->sensorid == f2->sensorid) assert (false);
-        if (!across_cameras && f1->sensorid != f2->sensorid) assert (false);
+        // skip if threshold criteria not met
+        if (1.0-best_dots[i] > thresh  * (1.0-secn_dots[i])) {
+            best_inds[i] = -1;
+        } else if (mutual_consistency) {
+            // skip if mutual consistency fails
+            if (!matcher_mutual_consistency (row0 + i, best_inds[i], best_dots[i], col_inds, col_best, col_secn))
+                best_inds[i] = -1;
+        }
+    }
 
-        double d = vect_sqdist_float (f1->data, f2->data, f1->size);
-        double dot = vect_dot_float (f1->data, f2->data, f1->size);
+    // monogamy
+    if (monogamy) {
+        if (g_consistency_mode == MATCHER_CONSISTENCY_FAST)
+            matcher_monogamy_linear (best_inds, best_dots, n1, n2);
+        else
+            matcher_monogamy_quadratic (best_inds, best_dots, n1);
+    }
 
-        for (int j=0;j<set2->num;j++) {
-            navlcm_feature_t *ff2 = set2->el + j;
+    // generate matches
+    for (int i=0;i<n1;i++) {
 
-            if (ff2->laplacian != f1->laplacian) continue;
+        if (best_inds[i] != -1) {
 
-            double dd = vect_sqdist_float (f1->data, ff2->data, f1->size);
-            double ddot = vect_dot_float (f1->data, ff2->data, f1->size);
+            // create a new match
+            navlcm_feature_match_t *match = navlcm_feature_match_t_create (keys1->el + i);
+            navlcm_feature_t *fc = navlcm_feature_t_copy ( keys2->el + best_inds[i]);
+            match = navlcm_feature_match_t_insert (match, fc, fabs(1.0 - best_dots[i]));
+            free (fc);
 
-            if (d > dd + 1E-6) {
-                dbg (DBG_ERROR, "d(%d,%d) = %.5f (dot: %.4f) , dd(%d,%d) = %.5f (dot: %.4f)", f1->index, f2->index, d, dot, f1->index, ff2->index, dd, ddot);
-            }
-            assert (d < dd + 1E-6);
+            navlcm_feature_match_set_t_insert (matches, match);
+            free (match);
         }
     }
-
 }
 
-/* compute the min distance between a feature and a set of features, in pixels
-*/
-double features_min_distance (navlcm_feature_t *f1, GList *features)
+/* best and second best matches of a pair of feature sets, before the ratio test.
+ * The ratio threshold, monogamy and the mutual consistency check only filter these
+ * (see matcher_select_matches), so that they can be shared by calls that differ by
+ * their threshold only.
+ */
+typedef struct {
+    int n1, n2;
+    int *best_inds;
+    float *best_dots, *secn_dots;
+    int *col_inds;                  // column statistics (NULL if no mutual consistency)
+    float *col_best, *col_secn;
+    int refs;                       // references (see the match cache)
+} matcher_top2_t;
+
+static void matcher_top2_destroy (matcher_top2_t *t)
 {
-    assert (f1 && features);
+    if (!t)
+        return;
 
-    double min_dist = 1000000.0;
+    free (t->best_inds);
+    free (t->best_dots);
+    free (t->secn_dots);
+    free (t->col_inds);
+    free (t->col_best);
+    free (t->col_secn);
+    free (t);
+}
 
-    for (GList *iter = g_list_first (features); iter!=NULL; iter=g_list_next (iter)) {
-        navlcm_feature_t *f2 = (navlcm_feature_t*)iter->data;
-        if (f2->sensorid != f1->sensorid) continue;
-        double dist = sqrt ((f2->col - f1->col)*(f2->col - f1->col) + (f2->row - f1->row)*(f2->row - f1->row));
-        if (dist < min_dist)
-            min_dist = dist;
+static matcher_top2_t *matcher_top2_alloc (int n1, int n2, gboolean mutual_consistency)
+{
+    matcher_top2_t *t = (matcher_top2_t*)calloc (1, sizeof(matcher_top2_t));
+    t->n1 = n1;
+    t->n2 = n2;
+    t->refs = 1;
+    t->best_inds = (int*)malloc(MAX (1, n1)*sizeof(int));
+    t->best_dots = (float*)malloc(MAX (1, n1)*sizeof(float));
+    t->secn_dots = (float*)malloc(MAX (1, n1)*sizeof(float));
+
+    if (mutual_consistency) {
+        t->col_inds = (int*)malloc(MAX (1, n2)*sizeof(int));
+        t->col_best = (float*)malloc(MAX (1, n2)*sizeof(float));
+        t->col_secn = (float*)malloc(MAX (1, n2)*sizeof(float));
     }
 
-    return min_dist;
+    return t;
 }
 
-/*
-   GTimer *timer = g_timer_new ();
-
-// compute a table containing the correspondence between 
-// feature indices and distances
-//
-printf ("pol: init table.\n"); fflush(stdout);
-
-int sid1max=0, sid2max=0, id1max=0, id2max=0;
-navlcm_feature_match_t *match = matches->el;
-for (int i=0;i<matches->num;i++) {
-if (match->num == 0) continue;
-sid1max = MAX(sid1max, match->src.sensorid);
-id1max  = MAX(id1max,  match->src.index);
-
-for (int k=0;k<match->num;k++) {
-if (match->dst[k].index < 0) continue;
-sid2max = MAX(sid2max, match->dst[k].sensorid);
-id2max  = MAX(id2max,  match->dst[k].index);
-}
-match++;
+/* Per-thread scratch of the tiled search: the packed sets, the top-2 arrays of the
+ * uncached searches and the indices of matcher_top2_select. The buffers only grow,
+ * so that the workers of the observation update (see class_psi_distance_batch) and
+ * the tracker do not allocate for each pair of sets.
+ * The packed reference set is kept for the next search on the same list within a
+ * frame of the match cache (see matcher_cache_clear), e.g. the live features matched
+ * against each node of the belief state.
+ */
+typedef struct {
+    simdmatch_set_t *s1, *s2;
+    navlcm_feature_list_t *keys2;       // list <s2> was packed from (NULL if not kept)
+    int64_t utime2;
+    int num2, mode2, generation;
+    matcher_top2_t top2;
+    int cap1, cap2;                     // size of the top-2 arrays
+    int *inds;
+    int ninds;
+} matcher_scratch_t;
+
+static GStaticPrivate g_matcher_scratch = G_STATIC_PRIVATE_INIT;
+
+static void matcher_scratch_destroy (gpointer data)
+{
+    matcher_scratch_t *s = (matcher_scratch_t*)data;
+
+    simdmatch_set_destroy (s->s1);
+    simdmatch_set_destroy (s->s2);
+    free (s->top2.best_inds);
+    free (s->top2.best_dots);
+    free (s->top2.secn_dots);
+    free (s->top2.col_inds);
+    free (s->top2.col_best);
+    free (s->top2.col_secn);
+    free (s->inds);
+    free (s);
 }
 
-printf ("pol: malloc table.\n"); fflush(stdout);
-double ****tab;
-tab = (double****)malloc(sid1max*sizeof(double***));
-for (int i=0;i<=sid1max;i++) {
-tab[i] = (double***)malloc(sid2max*sizeof(double**));
-for (int j=0;j<=sid2max;j++) {
-tab[i][j] = (double**)malloc(id1max*sizeof(double*));
-for (int k=0;k<=id1max;k++) {
-tab[i][j][k] = (double*)malloc(id2max*sizeof(double));
-for (int r=0;r<=id2max;r++) {
-tab[i][j][k][r] = -1.0;
-}
-}
-}
-}
+static matcher_scratch_t *matcher_scratch ()
+{
+    matcher_scratch_t *s = (matcher_scratch_t*)g_static_private_get (&g_matcher_scratch);
 
-// populate the table
-//
-printf ("pol: populate table.\n"); fflush(stdout);
-
-match = matches->el;
-for (int i=0;i<matches->num;i++) {
-if (match->num == 0) continue;
-for (int k=0;k<match->num;k++) {
-if (match->dst[k].index < 0) continue;
-double dist =  tab[match->src.sensorid][match->dst[k].sensorid]
-[match->src.index][match->dst[k].index];
-if (dist < 0 || match->dist[k] < dist) {
-tab[match->src.sensorid][match->dst[k].sensorid]
-[match->src.index][match->dst[k].index] = match->dist[k];
-}
-}
-match++;
+    if (!s) {
+        s = (matcher_scratch_t*)calloc (1, sizeof(matcher_scratch_t));
+        s->generation = -1;
+        g_static_private_set (&g_matcher_scratch, s, matcher_scratch_destroy);
+    }
+
+    return s;
 }
 
-// now for each match, check that its distance corresponds to
-// the one in the table
-// (create a new set of matches from scratch)
-printf ("pol: populate new set.\n"); fflush(stdout);
+/* the top-2 arrays of the scratch, for <n1> x <n2> features. Column statistics are
+ * always available; they are only filled with mutual consistency.
+ */
+static matcher_top2_t *matcher_scratch_top2 (matcher_scratch_t *s, int n1, int n2)
+{
+    matcher_top2_t *t = &s->top2;
 
-navlcm_feature_match_set_t *new_set =
-(navlcm_feature_match_set_t *)malloc(sizeof
-(navlcm_feature_match_set_t));
-new_set->el = NULL;
-new_set->num = 0;
+    if (n1 > s->cap1) {
+        s->cap1 = MAX (n1, 2 * s->cap1);
+        t->best_inds = (int*)realloc(t->best_inds, s->cap1*sizeof(int));
+        t->best_dots = (float*)realloc(t->best_dots, s->cap1*sizeof(float));
+        t->secn_dots = (float*)realloc(t->secn_dots, s->cap1*sizeof(float));
+    }
+    if (n2 > s->cap2) {
+        s->cap2 = MAX (n2, 2 * s->cap2);
+        t->col_inds = (int*)realloc(t->col_inds, s->cap2*sizeof(int));
+        t->col_best = (float*)realloc(t->col_best, s->cap2*sizeof(float));
+        t->col_secn = (float*)realloc(t->col_secn, s->cap2*sizeof(float));
+    }
 
-int count = 0;
+    t->n1 = n1;
+    t->n2 = n2;
 
-// parse old matches
-//
-match = matches->el;
-for (int i=0;i<matches->num;i++) {
-    if (match->num == 0) continue;
+    return t;
+}
 
-    navlcm_feature_match_t new_match = 
-        navlcm_feature_match_t_create (&match->src);
+/* tiled (or grid-gated) search of the first and second best matches of <keys1> in <keys2>,
+ * into <t>. See find_feature_matches_fast. <matching_mode> is MATCHING_DOTPROD or MATCHING_NCC.
+ * With <generation> >= 0 (the frame of the match cache), the packed <keys2> is kept in
+ * the scratch of the thread for the next search on the same list.
+ */
+static void matcher_top2_search (matcher_top2_t *t, navlcm_feature_list_t *keys1, navlcm_feature_list_t *keys2, 
+                                 gboolean within_camera, gboolean across_cameras, 
+                                 gboolean mutual_consistency, double maxdist, int matching_mode, int generation)
+{
+    int n1 = keys1->num;
+    int n2 = keys2->num;
+
+    simdmatch_filter_t filter = { within_camera, across_cameras, maxdist };
+
+    // candidate pairs from a spatial grid if only nearby features of the same camera
+    // can match. fall back on the tiled search if the gating is not selective.
+    int *pstart = NULL, *pind = NULL;
+    if (g_spatial_index && within_camera && !across_cameras && maxdist > 0) {
+        featgrid_t *grid = featgrid_new (keys2, maxdist);
+        int npairs = featgrid_pairs (grid, keys1, maxdist, FEATGRID_MANHATTAN, &pstart, &pind);
+        featgrid_destroy (grid);
+        if (4.0 * npairs > 1.0 * n1 * n2) {
+            free (pstart);
+            free (pind);
+            pstart = pind = NULL;
+        }
+    }
 
-    for (int k=0;k<match->num;k++) {
-        int dist = tab[match->src.sensorid]
-            [match->dst[k].sensorid]
-            [match->src.index]
-            [match->dst[k].index];
+    // pack descriptors in the scratch of the thread. cross-correlation is the dot
+    // product of centred, unit-norm descriptors.
+    matcher_scratch_t *sc = matcher_scratch ();
+    gboolean panels = pstart == NULL;
+
+    sc->s1 = simdmatch_set_repack (sc->s1, keys1, NULL, n1, FALSE);
+    if (matching_mode == MATCHING_NCC)
+        simdmatch_set_center (sc->s1);
+
+    if (generation < 0 || sc->keys2 != keys2 || sc->utime2 != keys2->utime || sc->num2 != n2 || 
+        sc->mode2 != matching_mode || sc->generation != generation || sc->s2->panels != panels) {
+        sc->s2 = simdmatch_set_repack (sc->s2, keys2, NULL, n2, panels);
+        if (matching_mode == MATCHING_NCC)
+            simdmatch_set_center (sc->s2);
+        sc->keys2 = generation < 0 ? NULL : keys2;
+        sc->utime2 = keys2->utime;
+        sc->num2 = n2;
+        sc->mode2 = matching_mode;
+        sc->generation = generation;
+    }
 
-        if (fabs(match->dist[k] - dist) > 1E-6) {
-            if (k==0) count++;
-            continue;
+    // tiled search for the first and second best matches (per row), and for the
+    // best and second best rows of each column if mutual consistency is required
+    int *col_inds = mutual_consistency ? t->col_inds : NULL;
+    float *col_best = mutual_consistency ? t->col_best : NULL;
+    float *col_secn = mutual_consistency ? t->col_secn : NULL;
+
+    if (pstart)
+        simdmatch_top2_sparse (sc->s1, sc->s2, &filter, pstart, pind, t->best_inds, t->best_dots, t->secn_dots, 
+                               col_inds, col_best, col_secn);
+    else
+        simdmatch_top2 (sc->s1, sc->s2, &filter, t->best_inds, t->best_dots, t->secn_dots, 
+                        col_inds, col_best, col_secn);
+
+    free (pstart);
+    free (pind);
+}
+
+/* apply the ratio test, mutual consistency and monogamy to <t> and append the matches
+ * to <matches>. <t> is left untouched.
+ */
+static void matcher_top2_select (navlcm_feature_list_t *keys1, navlcm_feature_list_t *keys2, matcher_top2_t *t,
+                                 double thresh, gboolean monogamy, gboolean mutual_consistency,
+                                 navlcm_feature_match_set_t *matches)
+{
+    matcher_scratch_t *sc = matcher_scratch ();
+    if (t->n1 > sc->ninds) {
+        sc->ninds = MAX (t->n1, 2 * sc->ninds);
+        sc->inds = (int*)realloc(sc->inds, sc->ninds*sizeof(int));
+    }
+
+    int *best_inds = sc->inds;
+    memcpy (best_inds, t->best_inds, t->n1*sizeof(int));
+
+    matcher_select_matches (keys1, keys2, 0, best_inds, t->best_dots, t->secn_dots, 
+                            t->col_inds, t->col_best, t->col_secn,
+                            thresh, monogamy, mutual_consistency, matches);
+}
+
+/* Match features between two sets. We assume that feature descriptors are normalized.
+ * Therefore, minimizing the SSD is equivalent to maximazing the dot product.
+ * Dot products are computed tile by tile (see simdmatch.h): masks and the
+ * best/second-best search are applied inside each tile, so that the full
+ * n1 x n2 matrix is never stored.
+ * In MATCHING_NCC mode, descriptors are mean-centred and normalized once when
+ * they are packed, so that cross-correlations go through the same tiled engine.
+ * If matches are gated by <maxdist> within the same camera only, the candidate
+ * pairs come from a spatial grid and only these are computed.
+ *
+ * options:
+ *              <monogamy>: enforce monogamy
+ *              <mutual_consistency>: mutual consistency check
+ *              <maxdist> : maximum distance between features in pixels (<0 to skip)
+ *              <matching_mode>: MATCHING_DOTPROD, MATCHING_NCC or MATCHING_ANN
+ */
+int
+find_feature_matches_fast (navlcm_feature_list_t *keys1, 
+                            navlcm_feature_list_t *keys2, gboolean within_camera,
+                            gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
+                            double thresh, double maxdist, int matching_mode,
+                            navlcm_feature_match_set_t *matches)
+{
+    // approximate search in a kd-tree forest
+    if (matching_mode == MATCHING_ANN)
+        return find_feature_matches_ann (keys1, keys2, within_camera, across_cameras, monogamy, 
+                                         mutual_consistency, thresh, maxdist, matches);
+
+    // init to empty set
+    matches->num = 0;
+    matches->el = NULL;
+
+    // skip if no features
+    if (!keys1 || !keys2 || keys1->num == 0 || keys2->num == 0)
+        return -1;
+
+    if (keys1->desc_size != keys2->desc_size) {
+        dbg (DBG_ERROR, "descriptor size inconsistency: %d %d", keys1->desc_size, keys2->desc_size);
+    }
+    assert (keys1->desc_size == keys2->desc_size);
+
+    matcher_top2_t *t = matcher_scratch_top2 (matcher_scratch (), keys1->num, keys2->num);
+
+    matcher_top2_search (t, keys1, keys2, within_camera, across_cameras, mutual_consistency, 
+                         maxdist, matching_mode, -1);
+
+    matcher_top2_select (keys1, keys2, t, thresh, monogamy, mutual_consistency, matches);
+
+    // sanity check
+#if MATCH_DBG
+    match_sanity_check (matches, keys1, keys2, within_camera, across_cameras);
+#endif
+
+    return 0;
+}
+
+/* Match cache. On a navigation frame, the observation update matches the features
+ * of each node against the live features, and the rotation guidance matches the
+ * live features against the features of the current and next edges, with a
+ * different ratio threshold. The best/second-best search is stored once per pair of
+ * sets and each threshold is a re-filter of the cached candidates. With the mutual
+ * consistency check, the column statistics of a pair are the row statistics of the
+ * transposed pair, so that a lookup of (keys2, keys1) is served by the entry of
+ * (keys1, keys2) (see matcher_top2_transpose).
+ * Entries are keyed by the feature lists (address, utime and size) and by the
+ * parameters of the search. The cache must be cleared once per frame
+ * (matcher_cache_clear), since the feature lists it points to may be freed. It holds
+ * at least MATCHER_CACHE_SIZE entries; a batch makes room for its own pairs
+ * (matcher_cache_reserve), so that they are not evicted within the frame.
+ * Entries are reference counted: the ratio test and the copy of the matches run
+ * outside of the lock, while the entry may be replaced by another thread.
+ */
+#define MATCHER_CACHE_SIZE 8
+
+typedef struct {
+    navlcm_feature_list_t *keys1, *keys2;
+    int64_t utime1, utime2;
+    gboolean within_camera, across_cameras, mutual_consistency;
+    double maxdist;
+    int matching_mode;
+    matcher_top2_t *top2;
+} matcher_cache_entry_t;
+
+static matcher_cache_entry_t *g_match_cache = NULL;
+static int g_match_cache_size = 0;
+static int g_match_cache_next = 0;
+static int g_match_cache_hits = 0, g_match_cache_misses = 0;
+static int g_match_cache_generation = 0;     // frame of the cache, see matcher_top2_search
+static GStaticMutex g_match_cache_mutex = G_STATIC_MUTEX_INIT;
+
+/* release a reference to <t>, with the cache lock held
+ */
+static void matcher_top2_unref (matcher_top2_t *t)
+{
+    if (t && --t->refs == 0)
+        matcher_top2_destroy (t);
+}
+
+static void matcher_cache_release (matcher_top2_t *t)
+{
+    g_static_mutex_lock (&g_match_cache_mutex);
+    matcher_top2_unref (t);
+    g_static_mutex_unlock (&g_match_cache_mutex);
+}
+
+void matcher_cache_clear ()
+{
+    g_static_mutex_lock (&g_match_cache_mutex);
+
+    if (g_match_cache_hits + g_match_cache_misses > 0)
+        dbg (DBG_CLASS, "[matcher] match cache: %d hits, %d misses (%d entries).", g_match_cache_hits, 
+             g_match_cache_misses, g_match_cache_size);
+
+    for (int k=0;k<g_match_cache_size;k++) {
+        matcher_top2_unref (g_match_cache[k].top2);
+        memset (g_match_cache + k, 0, sizeof(matcher_cache_entry_t));
+    }
+
+    g_match_cache_next = 0;
+    g_match_cache_hits = g_match_cache_misses = 0;
+    g_match_cache_generation++;
+
+    g_static_mutex_unlock (&g_match_cache_mutex);
+}
+
+/* make room for <count> more pairs. The cache only grows.
+ */
+void matcher_cache_reserve (int count)
+{
+    g_static_mutex_lock (&g_match_cache_mutex);
+
+    int size = MAX (MATCHER_CACHE_SIZE, count + MATCHER_CACHE_SIZE);
+    if (size > g_match_cache_size) {
+        g_match_cache = (matcher_cache_entry_t*)realloc (g_match_cache, size * sizeof(matcher_cache_entry_t));
+        memset (g_match_cache + g_match_cache_size, 0, (size - g_match_cache_size) * sizeof(matcher_cache_entry_t));
+        // fill the new entries first
+        g_match_cache_next = g_match_cache_size;
+        g_match_cache_size = size;
+    }
+
+    g_static_mutex_unlock (&g_match_cache_mutex);
+}
+
+static gboolean matcher_cache_entry_matches (matcher_cache_entry_t *e, navlcm_feature_list_t *keys1, navlcm_feature_list_t *keys2, 
+                                             gboolean within_camera, gboolean across_cameras, 
+                                             gboolean mutual_consistency, double maxdist, int matching_mode)
+{
+    return e->top2 && e->keys1 == keys1 && e->keys2 == keys2 && 
+        e->utime1 == keys1->utime && e->utime2 == keys2->utime &&
+        e->top2->n1 == keys1->num && e->top2->n2 == keys2->num &&
+        e->within_camera == within_camera && e->across_cameras == across_cameras &&
+        e->mutual_consistency == mutual_consistency && e->maxdist == maxdist && 
+        e->matching_mode == matching_mode;
+}
+
+/* top-2 of (keys2, keys1) from the top-2 <t> of (keys1, keys2) with column statistics:
+ * the best row of a column is the best of the transposed row and conversely. A row
+ * scan starts from a zero second best (see simdmatch_top2), which remains only if the
+ * best is the first entry of the row. The second best of a column is only compared
+ * with the best of the same column (see matcher_mutual_consistency), so that any value
+ * up to the best gives the same decision.
+ */
+static matcher_top2_t *matcher_top2_transpose (matcher_top2_t *t)
+{
+    assert (t->col_inds);
+
+    matcher_top2_t *tt = (matcher_top2_t*)calloc (1, sizeof(matcher_top2_t));
+    tt->n1 = t->n2;
+    tt->n2 = t->n1;
+    tt->refs = 1;
+
+    tt->best_inds = (int*)malloc(tt->n1*sizeof(int));
+    tt->best_dots = (float*)malloc(tt->n1*sizeof(float));
+    tt->secn_dots = (float*)malloc(tt->n1*sizeof(float));
+    memcpy (tt->best_inds, t->col_inds, tt->n1*sizeof(int));
+    memcpy (tt->best_dots, t->col_best, tt->n1*sizeof(float));
+    for (int j=0;j<tt->n1;j++)
+        tt->secn_dots[j] = t->col_inds[j] == 0 ? MAX (t->col_secn[j], .0f) : t->col_secn[j];
+
+    tt->col_inds = (int*)malloc(tt->n2*sizeof(int));
+    tt->col_best = (float*)malloc(tt->n2*sizeof(float));
+    tt->col_secn = (float*)malloc(tt->n2*sizeof(float));
+    memcpy (tt->col_inds, t->best_inds, tt->n2*sizeof(int));
+    memcpy (tt->col_best, t->best_dots, tt->n2*sizeof(float));
+    for (int i=0;i<tt->n2;i++)
+        tt->col_secn[i] = MIN (t->secn_dots[i], t->best_dots[i]);
+
+    return tt;
+}
+
+/* cached top-2 of (keys1, keys2), or NULL. The caller gets a reference, to release
+ * with matcher_cache_release. With <transposed>, the entry of (keys2, keys1) is used
+ * as well. The cache lock must be held.
+ */
+static matcher_top2_t *matcher_cache_lookup (navlcm_feature_list_t *keys1, navlcm_feature_list_t *keys2, 
+                                             gboolean within_camera, gboolean across_cameras, 
+                                             gboolean mutual_consistency, double maxdist, int matching_mode,
+                                             gboolean transposed)
+{
+    for (int k=0;k<g_match_cache_size;k++) {
+        matcher_cache_entry_t *e = g_match_cache + k;
+        if (matcher_cache_entry_matches (e, keys1, keys2, within_camera, across_cameras, mutual_consistency, 
+                                         maxdist, matching_mode)) {
+            e->top2->refs++;
+            return e->top2;
         }
+    }
 
-        // keep match
-        new_match = navlcm_feature_match_t_insert (new_match,
-                &match->dst[k],
-                match->dist[k]);
+    if (!transposed || !mutual_consistency)
+        return NULL;
 
+    for (int k=0;k<g_match_cache_size;k++) {
+        matcher_cache_entry_t *e = g_match_cache + k;
+        if (matcher_cache_entry_matches (e, keys2, keys1, within_camera, across_cameras, mutual_consistency, 
+                                         maxdist, matching_mode))
+            return matcher_top2_transpose (e->top2);
     }
 
-    // add match to set
-    navlcm_feature_match_set_t_insert (new_set, new_match);
+    return NULL;
+}
 
-    // move pointer
-    match++;
+/* store the top-2 <t> of (keys1, keys2), unless another thread did it meanwhile, and
+ * return the entry with a reference for the caller (<t> is taken over). The cache
+ * lock must be held.
+ */
+static matcher_top2_t *matcher_cache_insert (navlcm_feature_list_t *keys1, navlcm_feature_list_t *keys2, 
+                                             gboolean within_camera, gboolean across_cameras, 
+                                             gboolean mutual_consistency, double maxdist, int matching_mode,
+                                             matcher_top2_t *t)
+{
+    matcher_top2_t *o = matcher_cache_lookup (keys1, keys2, within_camera, across_cameras, mutual_consistency, 
+                                              maxdist, matching_mode, FALSE);
+    if (o) {
+        matcher_top2_unref (t);
+        return o;
+    }
+
+    if (g_match_cache_size == 0) {
+        g_match_cache = (matcher_cache_entry_t*)calloc (MATCHER_CACHE_SIZE, sizeof(matcher_cache_entry_t));
+        g_match_cache_size = MATCHER_CACHE_SIZE;
+    }
+
+    // replace the oldest entry
+    matcher_cache_entry_t *e = g_match_cache + g_match_cache_next;
+    matcher_top2_unref (e->top2);
+    e->keys1 = keys1;
+    e->keys2 = keys2;
+    e->utime1 = keys1->utime;
+    e->utime2 = keys2->utime;
+    e->within_camera = within_camera;
+    e->across_cameras = across_cameras;
+    e->mutual_consistency = mutual_consistency;
+    e->maxdist = maxdist;
+    e->matching_mode = matching_mode;
+    e->top2 = t;
+    t->refs++;
+    g_match_cache_next = (g_match_cache_next + 1) % g_match_cache_size;
+
+    return t;
 }
 
-gulong usecs;
-double secs = g_timer_elapsed (timer, &usecs);
+/* same as find_feature_matches_fast, through the match cache.
+ */
+int
+find_feature_matches_cached (navlcm_feature_list_t *keys1, 
+                             navlcm_feature_list_t *keys2, gboolean within_camera,
+                             gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
+                             double thresh, double maxdist, int matching_mode,
+                             navlcm_feature_match_set_t *matches)
+{
+    // the approximate search is not cached
+    if (matching_mode == MATCHING_ANN)
+        return find_feature_matches_fast (keys1, keys2, within_camera, across_cameras, monogamy, 
+                                          mutual_consistency, thresh, maxdist, matching_mode, matches);
 
-dbg (DBG_INFO, "[tracker] enforced matches monogamy in %.3f secs."
-        " dropped %d matches.", secs, count);
+    // init to empty set
+    matches->num = 0;
+    matches->el = NULL;
+
+    // skip if no features
+    if (!keys1 || !keys2 || keys1->num == 0 || keys2->num == 0)
+        return -1;
 
-g_timer_destroy (timer);
+    assert (keys1->desc_size == keys2->desc_size);
+
+    g_static_mutex_lock (&g_match_cache_mutex);
+
+    matcher_top2_t *t = matcher_cache_lookup (keys1, keys2, within_camera, across_cameras, mutual_consistency, 
+                                              maxdist, matching_mode, TRUE);
+    if (t)
+        g_match_cache_hits++;
+    else
+        g_match_cache_misses++;
+    int generation = g_match_cache_generation;
+
+    g_static_mutex_unlock (&g_match_cache_mutex);
+
+    if (!t) {
+        // the search runs outside of the lock, so that the workers of the 
+        // observation update do not wait for each other
+        t = matcher_top2_alloc (keys1->num, keys2->num, mutual_consistency);
+        matcher_top2_search (t, keys1, keys2, within_camera, across_cameras, mutual_consistency, 
+                             maxdist, matching_mode, generation);
+
+        g_static_mutex_lock (&g_match_cache_mutex);
+        t = matcher_cache_insert (keys1, keys2, within_camera, across_cameras, mutual_consistency, 
+                                  maxdist, matching_mode, t);
+        g_static_mutex_unlock (&g_match_cache_mutex);
+    }
 
-// destroy old set
+    matcher_top2_select (keys1, keys2, t, thresh, monogamy, mutual_consistency, matches);
 
-navlcm_feature_match_set_t_destroy (matches);
+    matcher_cache_release (t);
+
+    return 0;
+}
+
+/* Approximate version of find_feature_matches_fast for large sets: the best and
+ * second best matches come from a kd-tree forest built over <keys2> (bounded number
+ * of checks, queries run in parallel). For the mutual consistency check, the columns
+ * selected by the ratio test are searched in a forest built over <keys1>.
+ * Descriptors are assumed normalized, so that dot = 1 - sqdist / 2.
+ */
+int
+find_feature_matches_ann (navlcm_feature_list_t *keys1, 
+                          navlcm_feature_list_t *keys2, gboolean within_camera,
+                          gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
+                          double thresh, double maxdist, navlcm_feature_match_set_t *matches)
+{
+    // init to empty set
+    matches->num = 0;
+    matches->el = NULL;
+
+    // skip if no features
+    if (!keys1 || !keys2 || keys1->num == 0 || keys2->num == 0)
+        return -1;
+
+    assert (keys1->desc_size == keys2->desc_size);
+
+    int n1 = keys1->num;
+    int n2 = keys2->num;
+
+    simdmatch_filter_t filter = { within_camera, across_cameras, maxdist };
+
+    // first and second nearest neighbours
+    kdforest_t *forest = kdforest_new (keys2, KDFOREST_NTREES, KDFOREST_LEAF_SIZE);
+    int *nn_ind = (int*)malloc(2*n1*sizeof(int));
+    float *nn_dist = (float*)malloc(2*n1*sizeof(float));
+    kdforest_knn_list (forest, keys1, &filter, 2, KDFOREST_MAX_CHECKS, 0, nn_ind, nn_dist);
+    kdforest_destroy (forest);
+
+    int *best_inds = (int*)malloc(n1*sizeof(int));
+    float *best_dots = (float*)malloc(n1*sizeof(float));
+    float *secn_dots = (float*)malloc(n1*sizeof(float));
+
+    // entries that do not pass the filter count as zero, as in the exhaustive matchers
+    for (int i=0;i<n1;i++) {
+        best_inds[i] = nn_ind[2*i] == -1 ? 0 : nn_ind[2*i];
+        best_dots[i] = nn_ind[2*i] == -1 ? .0 : 1.0 - nn_dist[2*i] / 2;
+        secn_dots[i] = nn_ind[2*i+1] == -1 ? .0 : 1.0 - nn_dist[2*i+1] / 2;
+    }
 
-// free memory
-printf ("pol: free table.\n"); fflush(stdout);
-for (int i=0;i<=sid1max;i++) {
-    for (int j=0;j<=sid2max;j++) {
-        for (int k=0;k<=id1max;k++) {
-            free(tab[i][j][k]);
+    // column statistics, for the columns that survive the ratio test
+    int *col_inds = NULL;
+    float *col_best = NULL, *col_secn = NULL;
+
+    if (mutual_consistency) {
+        col_inds = (int*)malloc(n2*sizeof(int));
+        col_best = (float*)malloc(n2*sizeof(float));
+        col_secn = (float*)malloc(n2*sizeof(float));
+
+        // list of the candidate columns (shallow copies)
+        navlcm_feature_list_t cand;
+        memset (&cand, 0, sizeof(cand));
+        cand.el = (navlcm_feature_t*)malloc(n2*sizeof(navlcm_feature_t));
+        cand.desc_size = keys2->desc_size;
+        int *cols = (int*)malloc(n2*sizeof(int));
+
+        for (int j=0;j<n2;j++) {
+            col_inds[j] = -1;
+            col_best[j] = col_secn[j] = -FLT_MAX;
         }
-        free (tab[i][j]);
+
+        for (int i=0;i<n1;i++) {
+            int j = best_inds[i];
+            if (nn_ind[2*i] == -1 || 1.0-best_dots[i] > thresh  * (1.0-secn_dots[i]) || col_inds[j] != -1)
+                continue;
+            col_inds[j] = -2;
+            cols[cand.num] = j;
+            cand.el[cand.num] = keys2->el[j];
+            cand.num++;
+        }
+
+        if (cand.num > 0) {
+            kdforest_t *rforest = kdforest_new (keys1, KDFOREST_NTREES, KDFOREST_LEAF_SIZE);
+            int *rind = (int*)malloc(2*cand.num*sizeof(int));
+            float *rdist = (float*)malloc(2*cand.num*sizeof(float));
+            kdforest_knn_list (rforest, &cand, &filter, 2, KDFOREST_MAX_CHECKS, 0, rind, rdist);
+            kdforest_destroy (rforest);
+
+            for (int c=0;c<cand.num;c++) {
+                int j = cols[c];
+                col_inds[j] = rind[2*c];
+                col_best[j] = rind[2*c] == -1 ? -FLT_MAX : 1.0 - rdist[2*c] / 2;
+                col_secn[j] = rind[2*c+1] == -1 ? -FLT_MAX : 1.0 - rdist[2*c+1] / 2;
+            }
+
+            free (rind);
+            free (rdist);
+        }
+
+        free (cand.el);
+        free (cols);
     }
-    free (tab[i]);
+
+    matcher_select_matches (keys1, keys2, 0, best_inds, best_dots, secn_dots, col_inds, col_best, col_secn,
+                            thresh, monogamy, mutual_consistency, matches);
+
+    free (nn_ind);
+    free (nn_dist);
+    free (best_inds);
+    free (best_dots);
+    free (secn_dots);
+    free (col_inds);
+    free (col_best);
+    free (col_secn);
+
+    return 0;
 }
-free (tab);
 
-return new_set;
+/* best and second best matches of several feature sets <keys1>[0..nkeys-1] in the same
+ * feature set <keys2>, in a single pass. <keys2> is packed once and the <keys1> are
+ * stacked in one query set. The search is split back into one top-2 per set in <tops>
+ * (NULL for an empty set), as computed by matcher_top2_search for each pair.
+ */
+static void matcher_top2_batch_new (navlcm_feature_list_t **keys1, int nkeys,
+                                    navlcm_feature_list_t *keys2, gboolean within_camera,
+                                    gboolean across_cameras, gboolean mutual_consistency,
+                                    double maxdist, int matching_mode, matcher_top2_t **tops)
+{
+    int n1 = 0;
+    for (int k=0;k<nkeys;k++) {
+        if (keys1[k]->desc_size != keys2->desc_size) {
+            dbg (DBG_ERROR, "descriptor size inconsistency: %d %d", keys1[k]->desc_size, keys2->desc_size);
+        }
+        assert (keys1[k]->desc_size == keys2->desc_size);
+        n1 += keys1[k]->num;
+        tops[k] = NULL;
+    }
+    int n2 = keys2->num;
+
+    if (n1 == 0 || n2 == 0)
+        return;
+
+    simdmatch_filter_t filter = { within_camera, across_cameras, maxdist };
+
+    // pack descriptors
+    simdmatch_set_t *s1 = simdmatch_set_new_batch (keys1, nkeys);
+    simdmatch_set_t *s2 = simdmatch_set_new (keys2, NULL, n2, TRUE);
+
+    if (matching_mode == MATCHING_NCC) {
+        simdmatch_set_center (s1);
+        simdmatch_set_center (s2);
+    }
+
+    // tiled search over the stacked sets, with per-set column statistics
+    int *best_inds = (int*)malloc(n1*sizeof(int));
+    float *best_dots = (float*)malloc(n1*sizeof(float));
+    float *secn_dots = (float*)malloc(n1*sizeof(float));
+    int *col_inds = NULL;
+    float *col_best = NULL, *col_secn = NULL;
+
+    if (mutual_consistency) {
+        col_inds = (int*)malloc(nkeys*n2*sizeof(int));
+        col_best = (float*)malloc(nkeys*n2*sizeof(float));
+        col_secn = (float*)malloc(nkeys*n2*sizeof(float));
+    }
+
+    simdmatch_top2 (s1, s2, &filter, best_inds, best_dots, secn_dots, col_inds, col_best, col_secn);
+
+    // split per set. column indices are relative to the stacked set.
+    int row0 = 0;
+    for (int k=0;k<nkeys;k++) {
+        int nk = keys1[k]->num;
+        if (nk > 0) {
+            matcher_top2_t *t = matcher_top2_alloc (nk, n2, mutual_consistency);
+            memcpy (t->best_inds, best_inds + row0, nk*sizeof(int));
+            memcpy (t->best_dots, best_dots + row0, nk*sizeof(float));
+            memcpy (t->secn_dots, secn_dots + row0, nk*sizeof(float));
+            if (mutual_consistency) {
+                int off = k*n2;
+                for (int j=0;j<n2;j++)
+                    t->col_inds[j] = col_inds[off+j] < 0 ? col_inds[off+j] : col_inds[off+j] - row0;
+                memcpy (t->col_best, col_best + off, n2*sizeof(float));
+                memcpy (t->col_secn, col_secn + off, n2*sizeof(float));
+            }
+            tops[k] = t;
+        }
+        row0 += nk;
+    }
+
+    simdmatch_set_destroy (s1);
+    simdmatch_set_destroy (s2);
+    free (best_inds);
+    free (best_dots);
+    free (secn_dots);
+    free (col_inds);
+    free (col_best);
+    free (col_secn);
 }
+
+/* Match several feature sets <keys1>[0..nkeys-1] (e.g. the features of the candidate
+ * nodes of the belief state) against the same feature set <keys2> (e.g. the live
+ * features) in a single pass (see matcher_top2_batch_new). Each set gets its own 
+ * matches in <matches>[k], exactly as if find_feature_matches_fast was called for 
+ * each pair.
+ * <matches> is an array of <nkeys> pointers to allocated match sets.
+ */
+int
+find_feature_matches_batch (navlcm_feature_list_t **keys1, int nkeys,
+                            navlcm_feature_list_t *keys2, gboolean within_camera,
+                            gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
+                            double thresh, double maxdist, int matching_mode,
+                            navlcm_feature_match_set_t **matches)
+{
+    for (int k=0;k<nkeys;k++) {
+        matches[k]->num = 0;
+        matches[k]->el = NULL;
+    }
+
+    if (!keys2 || keys2->num == 0 || nkeys == 0)
+        return -1;
+
+    // approximate search goes one set at a time
+    if (matching_mode == MATCHING_ANN) {
+        for (int k=0;k<nkeys;k++)
+            find_feature_matches_fast (keys1[k], keys2, within_camera, across_cameras, monogamy, 
+                                       mutual_consistency, thresh, maxdist, matching_mode, matches[k]);
+        return 0;
+    }
+
+    matcher_top2_t **tops = (matcher_top2_t**)malloc(nkeys*sizeof(matcher_top2_t*));
+
+    matcher_top2_batch_new (keys1, nkeys, keys2, within_camera, across_cameras, mutual_consistency, 
+                            maxdist, matching_mode, tops);
+
+    for (int k=0;k<nkeys;k++) {
+        if (tops[k])
+            matcher_top2_select (keys1[k], keys2, tops[k], thresh, monogamy, mutual_consistency, matches[k]);
+        matcher_top2_destroy (tops[k]);
+    }
+
+    free (tops);
+
+    return 0;
+}
+
+/* same as find_feature_matches_batch, through the match cache: the sets that are
+ * not in the cache are searched in a single pass and their top-2 are stored, so that
+ * later calls on the same pairs (or on the transposed pairs) are served by the cache.
+ */
+int
+find_feature_matches_batch_cached (navlcm_feature_list_t **keys1, int nkeys,
+                                   navlcm_feature_list_t *keys2, gboolean within_camera,
+                                   gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
+                                   double thresh, double maxdist, int matching_mode,
+                                   navlcm_feature_match_set_t **matches)
+{
+    if (matching_mode == MATCHING_ANN)
+        return find_feature_matches_batch (keys1, nkeys, keys2, within_camera, across_cameras, monogamy, 
+                                           mutual_consistency, thresh, maxdist, matching_mode, matches);
+
+    for (int k=0;k<nkeys;k++) {
+        matches[k]->num = 0;
+        matches[k]->el = NULL;
+    }
+
+    if (!keys2 || keys2->num == 0 || nkeys == 0)
+        return -1;
+
+    matcher_top2_t **tops = (matcher_top2_t**)calloc(nkeys, sizeof(matcher_top2_t*));
+    navlcm_feature_list_t **mkeys = (navlcm_feature_list_t**)malloc(nkeys*sizeof(navlcm_feature_list_t*));
+    int *mind = (int*)malloc(nkeys*sizeof(int));
+    int nmiss = 0;
+
+    g_static_mutex_lock (&g_match_cache_mutex);
+
+    for (int k=0;k<nkeys;k++) {
+        if (keys1[k]->num == 0)
+            continue;
+        tops[k] = matcher_cache_lookup (keys1[k], keys2, within_camera, across_cameras, mutual_consistency, 
+                                        maxdist, matching_mode, TRUE);
+        if (tops[k]) {
+            g_match_cache_hits++;
+        } else {
+            g_match_cache_misses++;
+            mkeys[nmiss] = keys1[k];
+            mind[nmiss] = k;
+            nmiss++;
+        }
+    }
+
+    g_static_mutex_unlock (&g_match_cache_mutex);
+
+    if (nmiss > 0) {
+        matcher_top2_t **mtops = (matcher_top2_t**)malloc(nmiss*sizeof(matcher_top2_t*));
+
+        matcher_top2_batch_new (mkeys, nmiss, keys2, within_camera, across_cameras, mutual_consistency, 
+                                maxdist, matching_mode, mtops);
+
+        g_static_mutex_lock (&g_match_cache_mutex);
+        for (int m=0;m<nmiss;m++)
+            tops[mind[m]] = matcher_cache_insert (mkeys[m], keys2, within_camera, across_cameras, 
+                                                  mutual_consistency, maxdist, matching_mode, mtops[m]);
+        g_static_mutex_unlock (&g_match_cache_mutex);
+
+        free (mtops);
+    }
+
+    for (int k=0;k<nkeys;k++) {
+        if (tops[k]) {
+            matcher_top2_select (keys1[k], keys2, tops[k], thresh, monogamy, mutual_consistency, matches[k]);
+            matcher_cache_release (tops[k]);
+        }
+    }
+
+    free (tops);
+    free (mkeys);
+    free (mind);
+
+    return 0;
+}
+
+/* Matching sanity check.
+*/
+void match_sanity_check (
+        navlcm_feature_match_set_t *matches,
+        navlcm_feature_list_t *set1, navlcm_feature_list_t *set2, 
+        gboolean within_camera, gboolean across_cameras)
+{
+    // for each match, make sure that no better match can be found
+    //
+    for (int i=0;i<matches->num;i++) {
+        navlcm_feature_match_t *match = matches->el + i;
+
+        navlcm_feature_t *f1 = &match->src;
+        navlcm_feature_t *f2 = match->dst;
+
+        if (!within_camera  && f1->sensorid == f2->sensorid) assert (false);
+        if (!across_cameras && f1->sensorid != f2->sensorid) assert (false);
+
+        double d = vect_sqdist_float (f1->data, f2->data, f1->size);
+        double dot = vect_dot_float (f1->data, f2->data, f1->size);
+
+        for (int j=0;j<set2->num;j++) {
+            navlcm_feature_t *ff2 = set2->el + j;
+
+            if (ff2->laplacian != f1->laplacian) continue;
+
+            double dd = vect_sqdist_float (f1->data, ff2->data, f1->size);
+            double ddot = vect_dot_float (f1->data, ff2->data, f1->size);
+
+            if (d > dd + 1E-6) {
+                dbg (DBG_ERROR, "d(%d,%d) = %.5f (dot: %.4f) , dd(%d,%d) = %.5f (dot: %.4f)", f1->index, f2->index, d, dot, f1->index, ff2->index, dd, ddot);
+            }
+            assert (d < dd + 1E-6);
+        }
+    }
+
+}
+
+/* compute the min distance between a feature and a set of features, in pixels
 */
+double features_min_distance (navlcm_feature_t *f1, GList *features)
+{
+    assert (f1 && features);
+
+    double min_dist = 1000000.0;
+
+    for (GList *iter = g_list_first (features); iter!=NULL; iter=g_list_next (iter)) {
+        navlcm_feature_t *f2 = (navlcm_feature_t*)iter->data;
+        if (f2->sensorid != f1->sensorid) continue;
+        double dist = sqrt ((f2->col - f1->col)*(f2->col - f1->col) + (f2->row - f1->row)*(f2->row - f1->row));
+        if (dist < min_dist)
+            min_dist = dist;
+    }
+
+    return min_dist;
+}
 
 int track_find_closest_index (track_t tr, double col, double row, int sensorid, double *dist)
 {
@@ -1310,3 +2236,351 @@ int track_find_closest_index (track_t tr, double col, double row, int sensorid,
 
     return bindex;
 }
+
+////////////////////////////////////////////////////////////////////////////////////
+// unit testing
+//
+
+/* random feature list with normalized descriptors, spread over <nsensors> cameras
+ */
+navlcm_feature_list_t *matcher_random_feature_list (int num, int desc_size, int nsensors, int width, int height)
+{
+    navlcm_feature_list_t *list = (navlcm_feature_list_t*)calloc(1,sizeof(navlcm_feature_list_t));
+    list->num = num;
+    list->el = (navlcm_feature_t*)calloc(num, sizeof(navlcm_feature_t));
+    list->desc_size = desc_size;
+    list->feature_type = NAVLCM_FEATURES_PARAM_T_SIFT;
+    list->width = width;
+    list->height = height;
+    for (int i=0;i<num;i++) {
+        navlcm_feature_t *f = list->el + i;
+        *f = navlcm_feature_t_random (width, height, desc_size, rand () % nsensors);
+        f->index = i;
+        f->utime = 0;
+        f->laplacian = rand () % 2;
+        math_normalize_float (f->data, desc_size);
+    }
+    return list;
+}
+
+/* copy a feature list, adding uniform noise of amplitude <noise> to the descriptors
+ * (re-normalized) and to the feature positions (in pixels). A fraction <outliers> of
+ * the descriptors is replaced by random ones, the others have a true match in the
+ * original list.
+ */
+navlcm_feature_list_t *matcher_perturb_feature_list (navlcm_feature_list_t *list, double noise, double outliers)
+{
+    navlcm_feature_list_t *copy = navlcm_feature_list_t_copy (list);
+
+    for (int i=0;i<copy->num;i++) {
+        navlcm_feature_t *f = copy->el + i;
+        if (1.0 * rand () / RAND_MAX < outliers) {
+            for (int k=0;k<f->size;k++)
+                f->data[k] = 1.0 * rand () / RAND_MAX;
+        }
+        for (int k=0;k<f->size;k++)
+            f->data[k] += noise * (2.0 * rand () / RAND_MAX - 1.0) / sqrt (f->size);
+        math_normalize_float (f->data, f->size);
+        f->col = MIN (MAX (f->col + 10.0 * (2.0 * rand () / RAND_MAX - 1.0), 0), copy->width-1);
+        f->row = MIN (MAX (f->row + 10.0 * (2.0 * rand () / RAND_MAX - 1.0), 0), copy->height-1);
+    }
+
+    return copy;
+}
+
+/* return the number of matches that differ between two match sets
+ */
+int matcher_compare_match_sets (navlcm_feature_match_set_t *m1, navlcm_feature_match_set_t *m2)
+{
+    int diff = 0;
+
+    for (int i=0;i<m1->num;i++) {
+        navlcm_feature_match_t *a = m1->el + i;
+        gboolean found = FALSE;
+        for (int j=0;j<m2->num;j++) {
+            navlcm_feature_match_t *b = m2->el + j;
+            if (a->src.index == b->src.index && a->dst[0].index == b->dst[0].index) {
+                found = TRUE;
+                break;
+            }
+        }
+        if (!found) diff++;
+    }
+
+    return diff + (m2->num - (m1->num - diff));
+}
+
+/* regression test: the fast consistency mode (column maxima, winner array) and the
+ * quadratic mode must produce identical match sets, for both the full matrix and the
+ * tiled matcher, batch matching must agree with pairwise matching, the tiled
+ * cross-correlation must agree with the reference one, gated matching must give
+ * the same matches with and without the spatial index, and cached matching (direct,
+ * batched or transposed) must agree with uncached matching.
+ * Parameters vary from run to run.
+ * Returns the number of runs that failed.
+ */
+int matcher_unit_testing (int nruns)
+{
+    int nfailed = 0;
+    int mode = g_consistency_mode;
+
+    srand (time (NULL));
+
+    for (int run=0;run<nruns;run++) {
+
+        int nfeatures = 100 + rand () % 1000;
+        int nsensors = 1 + rand () % 4;
+        gboolean within_camera = rand () % 2;
+        gboolean across_cameras = !within_camera || rand () % 2;
+        gboolean monogamy = rand () % 4 != 0;
+        gboolean mutual_consistency = rand () % 4 != 0;
+        double maxdist = rand () % 2 ? -1 : 10.0 + rand () % 50;
+
+        navlcm_feature_list_t *f1 = matcher_random_feature_list (nfeatures, 128, nsensors, 376, 240);
+        navlcm_feature_list_t *f2 = matcher_perturb_feature_list (f1, .5, .3);
+
+        navlcm_feature_match_set_t *m[4];
+        for (int k=0;k<4;k++) {
+            m[k] = navlcm_feature_match_set_t_create ();
+            matcher_set_consistency_mode (k % 2 ? MATCHER_CONSISTENCY_FAST : MATCHER_CONSISTENCY_QUADRATIC);
+            if (k < 2)
+                find_feature_matches_naive (f1, f2, within_camera, across_cameras, monogamy, mutual_consistency, 
+                                            .8, maxdist, MATCHING_DOTPROD, m[k]);
+            else
+                find_feature_matches_fast (f1, f2, within_camera, across_cameras, monogamy, mutual_consistency, 
+                                           .8, maxdist, MATCHING_DOTPROD, m[k]);
+        }
+
+        int ndiff = 0;
+        for (int k=1;k<4;k++)
+            ndiff += matcher_compare_match_sets (m[0], m[k]);
+
+        // batch matching: several sets against f2 must give the same matches as
+        // matching each set separately
+        navlcm_feature_list_t *fb[3] = { f1, 
+            matcher_random_feature_list (1 + rand () % 500, 128, nsensors, 376, 240),
+            matcher_perturb_feature_list (f1, .7, .5) };
+        navlcm_feature_match_set_t *mb[3];
+        for (int k=0;k<3;k++)
+            mb[k] = navlcm_feature_match_set_t_create ();
+        find_feature_matches_batch (fb, 3, f2, within_camera, across_cameras, monogamy, mutual_consistency, 
+                                    .8, maxdist, MATCHING_DOTPROD, mb);
+        for (int k=0;k<3;k++) {
+            navlcm_feature_match_set_t *mk = navlcm_feature_match_set_t_create ();
+            find_feature_matches_fast (fb[k], f2, within_camera, across_cameras, monogamy, mutual_consistency, 
+                                       .8, maxdist, MATCHING_DOTPROD, mk);
+            ndiff += matcher_compare_match_sets (mk, mb[k]);
+            navlcm_feature_match_set_t_destroy (mk);
+            navlcm_feature_match_set_t_destroy (mb[k]);
+        }
+        navlcm_feature_list_t_destroy (fb[1]);
+        navlcm_feature_list_t_destroy (fb[2]);
+
+        // cross-correlation: the tiled matcher (centred descriptors) must agree with
+        // the reference matcher (ncc_float)
+        navlcm_feature_match_set_t *mn[2];
+        for (int k=0;k<2;k++) {
+            mn[k] = navlcm_feature_match_set_t_create ();
+            if (k == 0)
+                find_feature_matches_naive (f1, f2, within_camera, across_cameras, monogamy, mutual_consistency, 
+                                            .8, maxdist, MATCHING_NCC, mn[k]);
+            else
+                find_feature_matches_fast (f1, f2, within_camera, across_cameras, monogamy, mutual_consistency, 
+                                           .8, maxdist, MATCHING_NCC, mn[k]);
+        }
+        ndiff += matcher_compare_match_sets (mn[0], mn[1]);
+        navlcm_feature_match_set_t_destroy (mn[0]);
+        navlcm_feature_match_set_t_destroy (mn[1]);
+
+        // spatial index: gated matching within cameras must agree with the full scan
+        double gate = 10.0 + rand () % 50;
+        navlcm_feature_match_set_t *mg[2];
+        navlcm_feature_match_set_t *mt[2];
+        for (int k=0;k<2;k++) {
+            matcher_set_spatial_index (k == 1);
+            mg[k] = navlcm_feature_match_set_t_create ();
+            find_feature_matches_fast (f1, f2, TRUE, FALSE, monogamy, mutual_consistency, 
+                                       .8, gate, MATCHING_DOTPROD, mg[k]);
+            mt[k] = find_feature_matches_multi (f1, f2, TRUE, FALSE, 5, .6, gate, -1.0, monogamy, MATCHING_DOTPROD);
+        }
+        ndiff += matcher_compare_match_sets (mg[0], mg[1]);
+        ndiff += matcher_compare_match_sets (mt[0], mt[1]);
+        for (int k=0;k<2;k++) {
+            navlcm_feature_match_set_t_destroy (mg[k]);
+            navlcm_feature_match_set_t_destroy (mt[k]);
+        }
+
+        // match cache: the batch seeds the cache, each threshold re-filters the same
+        // candidates, and the transposed pair is served by the same entry
+        matcher_cache_clear ();
+        for (int k=0;k<5;k++) {
+            double th = k % 2 ? .9 : .8;
+            navlcm_feature_list_t *fa = k < 3 ? f1 : f2;
+            navlcm_feature_list_t *fb = k < 3 ? f2 : f1;
+            navlcm_feature_match_set_t *mc[2];
+            for (int l=0;l<2;l++)
+                mc[l] = navlcm_feature_match_set_t_create ();
+            find_feature_matches_fast (fa, fb, within_camera, across_cameras, monogamy, mutual_consistency, 
+                                       th, maxdist, MATCHING_DOTPROD, mc[0]);
+            if (k == 0)
+                find_feature_matches_batch_cached (&fa, 1, fb, within_camera, across_cameras, monogamy, 
+                                                   mutual_consistency, th, maxdist, MATCHING_DOTPROD, mc + 1);
+            else
+                find_feature_matches_cached (fa, fb, within_camera, across_cameras, monogamy, mutual_consistency, 
+                                             th, maxdist, MATCHING_DOTPROD, mc[1]);
+            ndiff += matcher_compare_match_sets (mc[0], mc[1]);
+            for (int l=0;l<2;l++)
+                navlcm_feature_match_set_t_destroy (mc[l]);
+        }
+        matcher_cache_clear ();
+
+        dbg (DBG_INFO, "[matcher] run %d: %d features, %d matches, %d differ.", run, nfeatures, m[0]->num, ndiff);
+
+        if (ndiff > 0)
+            nfailed++;
+
+        for (int k=0;k<4;k++)
+            navlcm_feature_match_set_t_destroy (m[k]);
+        navlcm_feature_list_t_destroy (f1);
+        navlcm_feature_list_t_destroy (f2);
+    }
+
+    matcher_set_consistency_mode (mode);
+    matcher_set_spatial_index (TRUE);
+
+    dbg (DBG_INFO, "[matcher] unit testing: %d/%d runs failed.", nfailed, nruns);
+
+    return nfailed;
+}
+
+/* compare the tiled matcher and the approximate matcher against the reference
+ * (full matrix) matcher. For each set size, writes "<nfeatures> <naive secs> <fast secs>
+ * <nmatches> <ndiff> <ann secs> <ann nmatches> <ann ndiff> <ncc naive secs> <ncc fast secs>
+ * <ncc ndiff> <gated full secs> <gated grid secs> <gated ndiff>" to <filename>. The
+ * reference cross-correlation is only timed up to 1024 features (-1 above). Gated
+ * matching is the tracker setting (same camera, 30 pixels, multi-match).
+ */
+void matcher_performance_testing (int nsensors, int nruns, const char *filename)
+{
+    FILE *fp = fopen (filename, "w");
+    if (!fp)
+        return;
+
+    srand (time (NULL));
+
+    for (int nfeatures=256;nfeatures<=4096;nfeatures*=2) {
+
+        double naive_secs = .0, fast_secs = .0, ann_secs = .0, ncc_naive_secs = .0, ncc_fast_secs = .0;
+        int nmatches = 0, ndiff = 0, ann_nmatches = 0, ann_ndiff = 0, ncc_ndiff = 0;
+        gboolean ncc_naive = nfeatures <= 1024;
+        double gated_full_secs = .0, gated_grid_secs = .0;
+        int gated_ndiff = 0;
+        double multi_full_secs = .0, multi_ann_secs = .0;
+        int multi_nmatches = 0, multi_ann_nmatches = 0, multi_ann_ndiff = 0;
+
+        for (int run=0;run<nruns;run++) {
+
+            navlcm_feature_list_t *f1 = matcher_random_feature_list (nfeatures, 128, nsensors, 376, 240);
+            navlcm_feature_list_t *f2 = matcher_perturb_feature_list (f1, .5, .5);
+
+            navlcm_feature_match_set_t *m1 = navlcm_feature_match_set_t_create ();
+            navlcm_feature_match_set_t *m2 = navlcm_feature_match_set_t_create ();
+
+            GTimer *timer = g_timer_new ();
+            find_feature_matches_naive (f1, f2, TRUE, TRUE, TRUE, TRUE, .8, -1, MATCHING_DOTPROD, m1);
+            naive_secs += g_timer_elapsed (timer, NULL);
+
+            g_timer_start (timer);
+            find_feature_matches_fast (f1, f2, TRUE, TRUE, TRUE, TRUE, .8, -1, MATCHING_DOTPROD, m2);
+            fast_secs += g_timer_elapsed (timer, NULL);
+
+            navlcm_feature_match_set_t *m3 = navlcm_feature_match_set_t_create ();
+            g_timer_start (timer);
+            find_feature_matches_fast (f1, f2, TRUE, TRUE, TRUE, TRUE, .8, -1, MATCHING_ANN, m3);
+            ann_secs += g_timer_elapsed (timer, NULL);
+
+            navlcm_feature_match_set_t *m4 = navlcm_feature_match_set_t_create ();
+            navlcm_feature_match_set_t *m5 = navlcm_feature_match_set_t_create ();
+            if (ncc_naive) {
+                g_timer_start (timer);
+                find_feature_matches_naive (f1, f2, TRUE, TRUE, TRUE, TRUE, .8, -1, MATCHING_NCC, m4);
+                ncc_naive_secs += g_timer_elapsed (timer, NULL);
+            }
+            g_timer_start (timer);
+            find_feature_matches_fast (f1, f2, TRUE, TRUE, TRUE, TRUE, .8, -1, MATCHING_NCC, m5);
+            ncc_fast_secs += g_timer_elapsed (timer, NULL);
+            g_timer_destroy (timer);
+
+            if (ncc_naive)
+                ncc_ndiff += matcher_compare_match_sets (m4, m5);
+            navlcm_feature_match_set_t_destroy (m4);
+            navlcm_feature_match_set_t_destroy (m5);
+
+            // tracker setting, with and without the spatial index
+            timer = g_timer_new ();
+            matcher_set_spatial_index (FALSE);
+            navlcm_feature_match_set_t *m6 = find_feature_matches_multi (f1, f2, TRUE, FALSE, 5, .6, 30.0, -1.0, TRUE, MATCHING_DOTPROD);
+            gated_full_secs += g_timer_elapsed (timer, NULL);
+            g_timer_start (timer);
+            matcher_set_spatial_index (TRUE);
+            navlcm_feature_match_set_t *m7 = find_feature_matches_multi (f1, f2, TRUE, FALSE, 5, .6, 30.0, -1.0, TRUE, MATCHING_DOTPROD);
+            gated_grid_secs += g_timer_elapsed (timer, NULL);
+            g_timer_destroy (timer);
+
+            gated_ndiff += matcher_compare_match_sets (m6, m7);
+            navlcm_feature_match_set_t_destroy (m6);
+            navlcm_feature_match_set_t_destroy (m7);
+
+            // gates setting, exhaustive and approximate
+            timer = g_timer_new ();
+            navlcm_feature_match_set_t *m8 = find_feature_matches_multi (f1, f2, TRUE, TRUE, 5, .8, -1.0, -1.0, TRUE, MATCHING_DOTPROD);
+            multi_full_secs += g_timer_elapsed (timer, NULL);
+            g_timer_start (timer);
+            navlcm_feature_match_set_t *m9 = find_feature_matches_multi (f1, f2, TRUE, TRUE, 5, .8, -1.0, -1.0, TRUE, MATCHING_ANN);
+            multi_ann_secs += g_timer_elapsed (timer, NULL);
+            g_timer_destroy (timer);
+
+            multi_nmatches += m8->num;
+            multi_ann_nmatches += m9->num;
+            multi_ann_ndiff += matcher_compare_match_sets (m8, m9);
+            navlcm_feature_match_set_t_destroy (m8);
+            navlcm_feature_match_set_t_destroy (m9);
+
+            nmatches += m2->num;
+            ndiff += matcher_compare_match_sets (m1, m2);
+            ann_nmatches += m3->num;
+            ann_ndiff += matcher_compare_match_sets (m1, m3);
+
+            navlcm_feature_match_set_t_destroy (m1);
+            navlcm_feature_match_set_t_destroy (m2);
+            navlcm_feature_match_set_t_destroy (m3);
+            navlcm_feature_list_t_destroy (f1);
+            navlcm_feature_list_t_destroy (f2);
+        }
+
+        printf ("[%s] %d features: naive %.4f secs. fast %.4f secs. (%.1fx) %d matches, %d differ\n", 
+                simdmatch_isa_name (simdmatch_isa ()), nfeatures, naive_secs/nruns, fast_secs/nruns, 
+                naive_secs / fast_secs, nmatches/nruns, ndiff);
+        printf ("[ann] %d features: %.4f secs. (%.1fx) %d matches, %d differ\n", 
+                nfeatures, ann_secs/nruns, naive_secs / ann_secs, ann_nmatches/nruns, ann_ndiff);
+
+        printf ("[ncc] %d features: naive %.4f secs. fast %.4f secs. (%.1fx dotprod) %d differ\n", 
+                nfeatures, ncc_naive ? ncc_naive_secs/nruns : -1.0, ncc_fast_secs/nruns, 
+                ncc_fast_secs / fast_secs, ncc_ndiff);
+
+        printf ("[gated] %d features: full %.4f secs. grid %.4f secs. (%.1fx) %d differ\n", 
+                nfeatures, gated_full_secs/nruns, gated_grid_secs/nruns, gated_full_secs / gated_grid_secs, gated_ndiff);
+
+        printf ("[multi] %d features: full %.4f secs. (%d matches) ann %.4f secs. (%.1fx) %d matches, %d differ\n", 
+                nfeatures, multi_full_secs/nruns, multi_nmatches/nruns, multi_ann_secs/nruns, 
+                multi_full_secs / multi_ann_secs, multi_ann_nmatches/nruns, multi_ann_ndiff);
+
+        fprintf (fp, "%d %.5f %.5f %d %d %.5f %d %d %.5f %.5f %d %.5f %.5f %d %.5f %.5f %d\n", nfeatures, naive_secs/nruns, fast_secs/nruns, 
+                 nmatches/nruns, ndiff, ann_secs/nruns, ann_nmatches/nruns, ann_ndiff, ncc_naive ? ncc_naive_secs/nruns : -1.0, 
+                 ncc_fast_secs/nruns, ncc_ndiff, gated_full_secs/nruns, gated_grid_secs/nruns, gated_ndiff,
+                 multi_full_secs/nruns, multi_ann_secs/nruns, multi_ann_ndiff);
+        fflush (fp);
+    }
+
+    fclose (fp);
+}
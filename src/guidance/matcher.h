@@ -25,6 +25,10 @@
 
 #include <glib.h>
 
+#include "simdmatch.h"
+#include "kdforest.h"
+#include "featgrid.h"
+
 #define EDGE_TOP 0
 #define EDGE_BOTTOM 1
 #define EDGE_RIGHT 2
@@ -32,6 +36,10 @@
 
 #define MATCHING_NCC 0
 #define MATCHING_DOTPROD 1
+#define MATCHING_ANN 2
+
+#define MATCHER_CONSISTENCY_QUADRATIC 0
+#define MATCHER_CONSISTENCY_FAST 1
 
 struct track_t { int id; int start, end; int *idx; double *col, *row; int *sid; 
                          unsigned char desc[128]; };
@@ -41,7 +49,8 @@ class tracker_t {
 
     Ipp8u *prev, *next;
     Ipp32f *prev_32f, *next_32f;
-    Ipp32f *prev_mean_32f, *next_mean_32f;
+    double *prev_sum, *next_sum;        // integral images (3 channels)
+    double *prev_sqsum, *next_sqsum;    // integral images of the squares (summed over channels)
     
     int width, height;
     int *pts;
@@ -56,7 +65,7 @@ class tracker_t {
     void ncc_run (int col, int row, int radius, int search_radius);
     void search_pointer ();
     void ncc_publish (lcm_t *lcm, int sensor_id);
-    void compute_mean_image (Ipp32f *src, Ipp32f *dst, int width, int height, int radius);
+    void compute_integral_image (Ipp32f *src, double *sum, double *sqsum, int width, int height);
     void ncc_filter_tracks (float ratio);
 
 };
@@ -66,13 +75,49 @@ navlcm_feature_match_set_t*
 find_feature_matches_multi (navlcm_feature_list_t *keys1, 
                             navlcm_feature_list_t *keys2, gboolean within_camera, gboolean across_cameras,
                             int topK, double thresh, double maxdist, 
-                            double max_dist_ft, gboolean monogamy);
+                            double max_dist_ft, gboolean monogamy, int matching_mode);
 int
 find_feature_matches_fast (navlcm_feature_list_t *keys1, 
                             navlcm_feature_list_t *keys2, gboolean within_camera,
                             gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
                             double thresh, double maxdist, int matching_mode,
                             navlcm_feature_match_set_t *matches);
+int
+find_feature_matches_cached (navlcm_feature_list_t *keys1, 
+                             navlcm_feature_list_t *keys2, gboolean within_camera,
+                             gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
+                             double thresh, double maxdist, int matching_mode,
+                             navlcm_feature_match_set_t *matches);
+void matcher_cache_clear ();
+void matcher_cache_reserve (int count);
+int
+find_feature_matches_ann (navlcm_feature_list_t *keys1, 
+                          navlcm_feature_list_t *keys2, gboolean within_camera,
+                          gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
+                          double thresh, double maxdist, navlcm_feature_match_set_t *matches);
+int
+find_feature_matches_batch (navlcm_feature_list_t **keys1, int nkeys,
+                            navlcm_feature_list_t *keys2, gboolean within_camera,
+                            gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
+                            double thresh, double maxdist, int matching_mode,
+                            navlcm_feature_match_set_t **matches);
+int
+find_feature_matches_batch_cached (navlcm_feature_list_t **keys1, int nkeys,
+                                   navlcm_feature_list_t *keys2, gboolean within_camera,
+                                   gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
+                                   double thresh, double maxdist, int matching_mode,
+                                   navlcm_feature_match_set_t **matches);
+
+void matcher_set_consistency_mode (int mode);
+int matcher_consistency_mode ();
+void matcher_set_spatial_index (gboolean enable);
+
+int
+find_feature_matches_naive (navlcm_feature_list_t *keys1, 
+                            navlcm_feature_list_t *keys2, gboolean within_camera,
+                            gboolean across_cameras, gboolean monogamy, gboolean mutual_consistency,
+                            double thresh, double maxdist, int matching_mode,
+                            navlcm_feature_match_set_t *matches);
 
 void match_sanity_check (
         navlcm_feature_match_set_t *matches,
@@ -93,4 +138,10 @@ double features_min_distance (navlcm_feature_t *f1, GList *features);
 int feature_edge_code (double col, double row, int width, int height);
 unsigned char edge_to_index (navlcm_feature_t *f, int width, int height);
 
+navlcm_feature_list_t *matcher_random_feature_list (int num, int desc_size, int nsensors, int width, int height);
+navlcm_feature_list_t *matcher_perturb_feature_list (navlcm_feature_list_t *list, double noise, double outliers);
+int matcher_compare_match_sets (navlcm_feature_match_set_t *m1, navlcm_feature_match_set_t *m2);
+void matcher_performance_testing (int nsensors, int nruns, const char *filename);
+int matcher_unit_testing (int nruns);
+
 #endif
@@ -93,7 +93,7 @@ int rot_estimate_angle_from_features (navlcm_feature_list_t *f1, navlcm_feature_
     if (!f1 || !f2) return -1;
 
     // match features
-    navlcm_feature_match_set_t *matches = find_feature_matches_multi (f1, f2, TRUE, TRUE, 5, 0.80, -1.0, -1.0, FALSE);
+    navlcm_feature_match_set_t *matches = find_feature_matches_multi (f1, f2, TRUE, TRUE, 5, 0.80, -1.0, -1.0, FALSE, MATCHING_DOTPROD);
 
     if (!matches) {
         dbg (DBG_ERROR, "no matches found in rot_estimate_angle_from_features");
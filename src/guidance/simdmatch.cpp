@@ -0,0 +1,774 @@
+/*
+ * Blocked dot-product matching engine with runtime SIMD dispatch.
+ */
+
+#include "simdmatch.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMDMATCH_X86 1
+#include <immintrin.h>
+#else
+#define SIMDMATCH_X86 0
+#endif
+
+typedef void (*simdmatch_kernel_t) (const float *a, const float *b, int size, float *c, float *rmax, float *cmax);
+
+static int g_simdmatch_isa = -1;
+
+////////////////////////////////////////////////////////////////////////////////////
+// micro-kernels: c[MR x NR] = a[MR x size] * b[size x NR]
+// rmax[MR] and cmax[NR] receive the max of each row and column of the tile, which
+// lets the drivers skip the entries that cannot change the current best matches.
+//
+static void simdmatch_kernel_generic (const float *a, const float *b, int size, float *c, float *rmax, float *cmax)
+{
+    for (int r=0;r<SIMDMATCH_MR;r++) {
+        float acc[SIMDMATCH_NR];
+        const float *pa = a + r*size;
+
+        for (int j=0;j<SIMDMATCH_NR;j++)
+            acc[j] = .0;
+
+        for (int k=0;k<size;k++) {
+            const float *pb = b + k*SIMDMATCH_NR;
+            for (int j=0;j<SIMDMATCH_NR;j++)
+                acc[j] += pa[k] * pb[j];
+        }
+
+        memcpy (c + r*SIMDMATCH_NR, acc, SIMDMATCH_NR*sizeof(float));
+    }
+
+    for (int j=0;j<SIMDMATCH_NR;j++)
+        cmax[j] = c[j];
+
+    for (int r=0;r<SIMDMATCH_MR;r++) {
+        const float *pc = c + r*SIMDMATCH_NR;
+        float m = pc[0];
+        for (int j=0;j<SIMDMATCH_NR;j++) {
+            m = MAX (m, pc[j]);
+            cmax[j] = MAX (cmax[j], pc[j]);
+        }
+        rmax[r] = m;
+    }
+}
+
+#if SIMDMATCH_X86
+
+/* two rows at a time: 8 accumulators + 4 panel registers fit in the 16 xmm registers
+ */
+__attribute__ ((target ("sse")))
+static void simdmatch_kernel_sse (const float *a, const float *b, int size, float *c, float *rmax, float *cmax)
+{
+    __m128 x0 = _mm_set1_ps (-FLT_MAX), x1 = x0, x2 = x0, x3 = x0;
+
+    for (int r=0;r<SIMDMATCH_MR;r+=2) {
+        __m128 c00 = _mm_setzero_ps (), c01 = _mm_setzero_ps (), c02 = _mm_setzero_ps (), c03 = _mm_setzero_ps ();
+        __m128 c10 = _mm_setzero_ps (), c11 = _mm_setzero_ps (), c12 = _mm_setzero_ps (), c13 = _mm_setzero_ps ();
+
+        const float *a0 = a + r*size, *a1 = a + (r+1)*size;
+        const float *pb = b;
+
+        for (int k=0;k<size;k++) {
+            __m128 b0 = _mm_load_ps (pb);
+            __m128 b1 = _mm_load_ps (pb+4);
+            __m128 b2 = _mm_load_ps (pb+8);
+            __m128 b3 = _mm_load_ps (pb+12);
+            pb += SIMDMATCH_NR;
+
+            __m128 va = _mm_set1_ps (a0[k]);
+            c00 = _mm_add_ps (c00, _mm_mul_ps (va, b0));
+            c01 = _mm_add_ps (c01, _mm_mul_ps (va, b1));
+            c02 = _mm_add_ps (c02, _mm_mul_ps (va, b2));
+            c03 = _mm_add_ps (c03, _mm_mul_ps (va, b3));
+            va = _mm_set1_ps (a1[k]);
+            c10 = _mm_add_ps (c10, _mm_mul_ps (va, b0));
+            c11 = _mm_add_ps (c11, _mm_mul_ps (va, b1));
+            c12 = _mm_add_ps (c12, _mm_mul_ps (va, b2));
+            c13 = _mm_add_ps (c13, _mm_mul_ps (va, b3));
+        }
+
+        float *pc = c + r*SIMDMATCH_NR;
+        _mm_storeu_ps (pc,    c00); _mm_storeu_ps (pc+4,  c01); _mm_storeu_ps (pc+8,  c02); _mm_storeu_ps (pc+12, c03);
+        _mm_storeu_ps (pc+16, c10); _mm_storeu_ps (pc+20, c11); _mm_storeu_ps (pc+24, c12); _mm_storeu_ps (pc+28, c13);
+
+        // column maxima
+        x0 = _mm_max_ps (x0, _mm_max_ps (c00, c10));
+        x1 = _mm_max_ps (x1, _mm_max_ps (c01, c11));
+        x2 = _mm_max_ps (x2, _mm_max_ps (c02, c12));
+        x3 = _mm_max_ps (x3, _mm_max_ps (c03, c13));
+
+        // row maxima
+        __m128 m0 = _mm_max_ps (_mm_max_ps (c00, c01), _mm_max_ps (c02, c03));
+        __m128 m1 = _mm_max_ps (_mm_max_ps (c10, c11), _mm_max_ps (c12, c13));
+        __m128 lo = _mm_unpacklo_ps (m0, m1);           // m0[0] m1[0] m0[1] m1[1]
+        __m128 hi = _mm_unpackhi_ps (m0, m1);           // m0[2] m1[2] m0[3] m1[3]
+        __m128 m = _mm_max_ps (lo, hi);
+        m = _mm_max_ps (m, _mm_movehl_ps (m, m));
+        _mm_storel_pi ((__m64*)(rmax+r), m);
+    }
+
+    _mm_storeu_ps (cmax, x0); _mm_storeu_ps (cmax+4, x1); _mm_storeu_ps (cmax+8, x2); _mm_storeu_ps (cmax+12, x3);
+}
+
+/* 6 rows x 16 columns: 12 independent FMA chains hide the FMA latency
+ * (12 accumulators + 2 panel registers + 1 broadcast = 15 ymm registers)
+ */
+__attribute__ ((target ("avx2,fma")))
+static void simdmatch_kernel_avx2 (const float *a, const float *b, int size, float *c, float *rmax, float *cmax)
+{
+    __m256 c00 = _mm256_setzero_ps (), c01 = _mm256_setzero_ps ();
+    __m256 c10 = _mm256_setzero_ps (), c11 = _mm256_setzero_ps ();
+    __m256 c20 = _mm256_setzero_ps (), c21 = _mm256_setzero_ps ();
+    __m256 c30 = _mm256_setzero_ps (), c31 = _mm256_setzero_ps ();
+    __m256 c40 = _mm256_setzero_ps (), c41 = _mm256_setzero_ps ();
+    __m256 c50 = _mm256_setzero_ps (), c51 = _mm256_setzero_ps ();
+
+    const float *a0 = a, *a1 = a + size, *a2 = a + 2*size;
+    const float *a3 = a + 3*size, *a4 = a + 4*size, *a5 = a + 5*size;
+
+    for (int k=0;k<size;k++) {
+        __m256 b0 = _mm256_load_ps (b);
+        __m256 b1 = _mm256_load_ps (b+8);
+        b += SIMDMATCH_NR;
+
+        __m256 va = _mm256_broadcast_ss (a0+k);
+        c00 = _mm256_fmadd_ps (va, b0, c00);
+        c01 = _mm256_fmadd_ps (va, b1, c01);
+        va = _mm256_broadcast_ss (a1+k);
+        c10 = _mm256_fmadd_ps (va, b0, c10);
+        c11 = _mm256_fmadd_ps (va, b1, c11);
+        va = _mm256_broadcast_ss (a2+k);
+        c20 = _mm256_fmadd_ps (va, b0, c20);
+        c21 = _mm256_fmadd_ps (va, b1, c21);
+        va = _mm256_broadcast_ss (a3+k);
+        c30 = _mm256_fmadd_ps (va, b0, c30);
+        c31 = _mm256_fmadd_ps (va, b1, c31);
+        va = _mm256_broadcast_ss (a4+k);
+        c40 = _mm256_fmadd_ps (va, b0, c40);
+        c41 = _mm256_fmadd_ps (va, b1, c41);
+        va = _mm256_broadcast_ss (a5+k);
+        c50 = _mm256_fmadd_ps (va, b0, c50);
+        c51 = _mm256_fmadd_ps (va, b1, c51);
+    }
+
+    _mm256_storeu_ps (c,     c00); _mm256_storeu_ps (c+8,   c01);
+    _mm256_storeu_ps (c+16,  c10); _mm256_storeu_ps (c+24,  c11);
+    _mm256_storeu_ps (c+32,  c20); _mm256_storeu_ps (c+40,  c21);
+    _mm256_storeu_ps (c+48,  c30); _mm256_storeu_ps (c+56,  c31);
+    _mm256_storeu_ps (c+64,  c40); _mm256_storeu_ps (c+72,  c41);
+    _mm256_storeu_ps (c+80,  c50); _mm256_storeu_ps (c+88,  c51);
+
+    // column maxima
+    __m256 x0 = _mm256_max_ps (_mm256_max_ps (_mm256_max_ps (c00, c10), _mm256_max_ps (c20, c30)), _mm256_max_ps (c40, c50));
+    __m256 x1 = _mm256_max_ps (_mm256_max_ps (_mm256_max_ps (c01, c11), _mm256_max_ps (c21, c31)), _mm256_max_ps (c41, c51));
+    _mm256_storeu_ps (cmax, x0);
+    _mm256_storeu_ps (cmax+8, x1);
+
+    // row maxima: reduce rows 0-3 in parallel, then rows 4-5
+    __m256 m0 = _mm256_max_ps (c00, c01);
+    __m256 m1 = _mm256_max_ps (c10, c11);
+    __m256 m2 = _mm256_max_ps (c20, c21);
+    __m256 m3 = _mm256_max_ps (c30, c31);
+    __m256 m01 = _mm256_max_ps (_mm256_unpacklo_ps (m0, m1), _mm256_unpackhi_ps (m0, m1));
+    __m256 m23 = _mm256_max_ps (_mm256_unpacklo_ps (m2, m3), _mm256_unpackhi_ps (m2, m3));
+    __m256 m = _mm256_max_ps (_mm256_castpd_ps (_mm256_unpacklo_pd (_mm256_castps_pd (m01), _mm256_castps_pd (m23))),
+                              _mm256_castpd_ps (_mm256_unpackhi_pd (_mm256_castps_pd (m01), _mm256_castps_pd (m23))));
+    _mm_storeu_ps (rmax, _mm_max_ps (_mm256_castps256_ps128 (m), _mm256_extractf128_ps (m, 1)));
+
+    __m256 m4 = _mm256_max_ps (c40, c41);
+    __m256 m5 = _mm256_max_ps (c50, c51);
+    __m256 m45 = _mm256_max_ps (_mm256_unpacklo_ps (m4, m5), _mm256_unpackhi_ps (m4, m5));
+    __m128 r = _mm_max_ps (_mm256_castps256_ps128 (m45), _mm256_extractf128_ps (m45, 1));
+    r = _mm_max_ps (r, _mm_movehl_ps (r, r));
+    _mm_storel_pi ((__m64*)(rmax+4), r);
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////
+// runtime dispatch
+//
+static int simdmatch_detect_isa ()
+{
+#if SIMDMATCH_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+        return SIMDMATCH_ISA_AVX2;
+    if (__builtin_cpu_supports ("sse"))
+        return SIMDMATCH_ISA_SSE;
+#endif
+    return SIMDMATCH_ISA_GENERIC;
+}
+
+int simdmatch_isa ()
+{
+    if (g_simdmatch_isa < 0) {
+        g_simdmatch_isa = simdmatch_detect_isa ();
+        dbg (DBG_INFO, "[simdmatch] using %s kernel.", simdmatch_isa_name (g_simdmatch_isa));
+    }
+
+    return g_simdmatch_isa;
+}
+
+/* force a given instruction set (for benchmarking). falls back on what the CPU supports.
+ */
+void simdmatch_set_isa (int isa)
+{
+    int best = simdmatch_detect_isa ();
+
+    g_simdmatch_isa = isa < 0 ? best : MIN (isa, best);
+}
+
+const char *simdmatch_isa_name (int isa)
+{
+    switch (isa) {
+        case SIMDMATCH_ISA_AVX2: return "avx2";
+        case SIMDMATCH_ISA_SSE: return "sse";
+        default: return "generic";
+    }
+}
+
+static simdmatch_kernel_t simdmatch_kernel ()
+{
+#if SIMDMATCH_X86
+    switch (simdmatch_isa ()) {
+        case SIMDMATCH_ISA_AVX2: return simdmatch_kernel_avx2;
+        case SIMDMATCH_ISA_SSE: return simdmatch_kernel_sse;
+    }
+#endif
+    return simdmatch_kernel_generic;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// single dot product (e.g. cross term of the patch correlation in the tracker)
+//
+static float simdmatch_dot_generic (const float *a, const float *b, int n)
+{
+    float acc0 = .0, acc1 = .0, acc2 = .0, acc3 = .0;
+    int k = 0;
+
+    for (;k+4<=n;k+=4) {
+        acc0 += a[k] * b[k];
+        acc1 += a[k+1] * b[k+1];
+        acc2 += a[k+2] * b[k+2];
+        acc3 += a[k+3] * b[k+3];
+    }
+    for (;k<n;k++)
+        acc0 += a[k] * b[k];
+
+    return (acc0 + acc1) + (acc2 + acc3);
+}
+
+#if SIMDMATCH_X86
+
+__attribute__ ((target ("sse")))
+static float simdmatch_dot_sse (const float *a, const float *b, int n)
+{
+    __m128 acc0 = _mm_setzero_ps (), acc1 = _mm_setzero_ps ();
+    int k = 0;
+
+    for (;k+8<=n;k+=8) {
+        acc0 = _mm_add_ps (acc0, _mm_mul_ps (_mm_loadu_ps (a+k), _mm_loadu_ps (b+k)));
+        acc1 = _mm_add_ps (acc1, _mm_mul_ps (_mm_loadu_ps (a+k+4), _mm_loadu_ps (b+k+4)));
+    }
+
+    float v[4];
+    _mm_storeu_ps (v, _mm_add_ps (acc0, acc1));
+    float dot = (v[0] + v[1]) + (v[2] + v[3]);
+
+    for (;k<n;k++)
+        dot += a[k] * b[k];
+
+    return dot;
+}
+
+/* 16 floats per iteration on two independent FMA chains
+ */
+__attribute__ ((target ("avx2,fma")))
+static float simdmatch_dot_avx2 (const float *a, const float *b, int n)
+{
+    __m256 acc0 = _mm256_setzero_ps (), acc1 = _mm256_setzero_ps ();
+    int k = 0;
+
+    for (;k+16<=n;k+=16) {
+        acc0 = _mm256_fmadd_ps (_mm256_loadu_ps (a+k), _mm256_loadu_ps (b+k), acc0);
+        acc1 = _mm256_fmadd_ps (_mm256_loadu_ps (a+k+8), _mm256_loadu_ps (b+k+8), acc1);
+    }
+    if (k+8<=n) {
+        acc0 = _mm256_fmadd_ps (_mm256_loadu_ps (a+k), _mm256_loadu_ps (b+k), acc0);
+        k += 8;
+    }
+
+    __m256 acc = _mm256_add_ps (acc0, acc1);
+    __m128 v = _mm_add_ps (_mm256_castps256_ps128 (acc), _mm256_extractf128_ps (acc, 1));
+    v = _mm_add_ps (v, _mm_movehl_ps (v, v));
+    v = _mm_add_ss (v, _mm_shuffle_ps (v, v, 1));
+    float dot = _mm_cvtss_f32 (v);
+
+    for (;k<n;k++)
+        dot += a[k] * b[k];
+
+    return dot;
+}
+
+#endif
+
+float simdmatch_dot (const float *a, const float *b, int n)
+{
+#if SIMDMATCH_X86
+    switch (simdmatch_isa ()) {
+        case SIMDMATCH_ISA_AVX2: return simdmatch_dot_avx2 (a, b, n);
+        case SIMDMATCH_ISA_SSE: return simdmatch_dot_sse (a, b, n);
+    }
+#endif
+    return simdmatch_dot_generic (a, b, n);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// packing
+//
+
+/* number of descriptors of a set of <n> descriptors, padded to a full panel (reference)
+ * or a full micro-tile (query) so that the kernels never read past the end of the buffer
+ */
+static int simdmatch_set_padded (int n, gboolean panels)
+{
+    return MAX (1, panels ? (n + SIMDMATCH_NR - 1) / SIMDMATCH_NR * SIMDMATCH_NR :
+                (n + SIMDMATCH_MR - 1) / SIMDMATCH_MR * SIMDMATCH_MR);
+}
+
+static simdmatch_set_t *simdmatch_set_alloc (int n, int size, gboolean panels)
+{
+    simdmatch_set_t *s = (simdmatch_set_t*)calloc (1, sizeof(simdmatch_set_t));
+
+    s->num = n;
+    s->size = size;
+    s->panels = panels;
+    s->npanels = (n + SIMDMATCH_NR - 1) / SIMDMATCH_NR;
+    s->ngroups = 1;
+
+    int padded = simdmatch_set_padded (n, panels);
+    size_t bytes = padded * s->size * sizeof(float);
+
+    void *ptr = NULL;
+    if (posix_memalign (&ptr, 64, bytes) != 0) {
+        dbg (DBG_ERROR, "[simdmatch] failed to allocate %d bytes.", (int)bytes);
+        free (s);
+        return NULL;
+    }
+    s->data = (float*)ptr;
+    memset (s->data, 0, bytes);
+
+    s->col = (double*)malloc (padded * sizeof(double));
+    s->row = (double*)malloc (padded * sizeof(double));
+    s->sensorid = (int*)malloc (padded * sizeof(int));
+    s->laplacian = (int*)malloc (padded * sizeof(int));
+    s->index = (int*)malloc (padded * sizeof(int));
+    s->capacity = padded;
+
+    return s;
+}
+
+static void simdmatch_set_pack (simdmatch_set_t *s, int i, navlcm_feature_t *f, int idx)
+{
+    assert (f->size == s->size);
+
+    s->col[i] = f->col;
+    s->row[i] = f->row;
+    s->sensorid[i] = f->sensorid;
+    s->laplacian[i] = f->laplacian;
+    s->index[i] = idx;
+
+    if (s->panels) {
+        float *dst = s->data + (i / SIMDMATCH_NR) * s->size * SIMDMATCH_NR + (i % SIMDMATCH_NR);
+        for (int k=0;k<s->size;k++)
+            dst[k*SIMDMATCH_NR] = f->data[k];
+    } else {
+        memcpy (s->data + i * s->size, f->data, s->size * sizeof(float));
+    }
+}
+
+/* pack descriptors from <keys> into a matching set.
+ * <subset>: list of <n> indices into keys->el (NULL to take the first <n> features)
+ * <panels>: TRUE to pack as a reference set, FALSE to pack as a query set
+ */
+simdmatch_set_t *simdmatch_set_new (navlcm_feature_list_t *keys, const int *subset, int n, gboolean panels)
+{
+    simdmatch_set_t *s = simdmatch_set_alloc (n, keys->desc_size, panels);
+    if (!s)
+        return NULL;
+
+    for (int i=0;i<n;i++) {
+        int idx = subset ? subset[i] : i;
+        simdmatch_set_pack (s, i, keys->el + idx, idx);
+    }
+
+    return s;
+}
+
+/* same as simdmatch_set_new, in the buffers of <s> if they are large enough (e.g. a
+ * per-thread scratch set), so that a caller that packs a set per call does not
+ * allocate each time. <s> may be NULL. Returns the set, to be used in place of <s>.
+ */
+simdmatch_set_t *simdmatch_set_repack (simdmatch_set_t *s, navlcm_feature_list_t *keys, const int *subset, int n, gboolean panels)
+{
+    int padded = simdmatch_set_padded (n, panels);
+
+    if (!s || s->size != keys->desc_size || s->capacity < padded) {
+        simdmatch_set_destroy (s);
+        return simdmatch_set_new (keys, subset, n, panels);
+    }
+
+    s->num = n;
+    s->panels = panels;
+    s->npanels = (n + SIMDMATCH_NR - 1) / SIMDMATCH_NR;
+    s->ngroups = 1;
+    free (s->group);
+    s->group = NULL;
+
+    // clear the padding (the last partial panel is cleared whole)
+    int start = panels ? n / SIMDMATCH_NR * SIMDMATCH_NR : n;
+    memset (s->data + start * s->size, 0, (padded - start) * s->size * sizeof(float));
+
+    for (int i=0;i<n;i++) {
+        int idx = subset ? subset[i] : i;
+        simdmatch_set_pack (s, i, keys->el + idx, idx);
+    }
+
+    return s;
+}
+
+/* pack <nkeys> feature lists one after the other into a single query set.
+ * Row i comes from list group[i], at position index[i] in that list.
+ * simdmatch_top2 keeps separate column statistics for each list.
+ */
+simdmatch_set_t *simdmatch_set_new_batch (navlcm_feature_list_t **keys, int nkeys)
+{
+    int n = 0;
+    for (int g=0;g<nkeys;g++)
+        n += keys[g]->num;
+
+    simdmatch_set_t *s = simdmatch_set_alloc (n, keys[0]->desc_size, FALSE);
+    if (!s)
+        return NULL;
+
+    s->ngroups = nkeys;
+    s->group = (int*)malloc (MAX (1, n) * sizeof(int));
+
+    int i = 0;
+    for (int g=0;g<nkeys;g++) {
+        assert (keys[g]->desc_size == s->size);
+        for (int idx=0;idx<keys[g]->num;idx++) {
+            s->group[i] = g;
+            simdmatch_set_pack (s, i, keys[g]->el + idx, idx);
+            i++;
+        }
+    }
+
+    return s;
+}
+
+/* mean-centre each packed descriptor and scale it to unit norm, so that the dot
+ * product of two centred descriptors is their normalized cross-correlation
+ * (see ncc_float in matcher.cpp). Constant descriptors become zero (ncc = 0).
+ */
+void simdmatch_set_center (simdmatch_set_t *s)
+{
+    int stride = s->panels ? SIMDMATCH_NR : 1;
+
+    for (int i=0;i<s->num;i++) {
+        float *v = s->panels ? s->data + (i / SIMDMATCH_NR) * s->size * SIMDMATCH_NR + (i % SIMDMATCH_NR) :
+            s->data + i * s->size;
+
+        double mean = .0;
+        for (int k=0;k<s->size;k++)
+            mean += v[k*stride];
+        mean /= s->size;
+
+        double norm = .0;
+        for (int k=0;k<s->size;k++)
+            norm += (v[k*stride] - mean) * (v[k*stride] - mean);
+        norm = sqrt (norm);
+
+        double scale = norm > 1E-12 ? 1.0 / norm : .0;
+        for (int k=0;k<s->size;k++)
+            v[k*stride] = (float)((v[k*stride] - mean) * scale);
+    }
+}
+
+void simdmatch_set_destroy (simdmatch_set_t *s)
+{
+    if (!s)
+        return;
+
+    free (s->data);
+    free (s->col);
+    free (s->row);
+    free (s->sensorid);
+    free (s->laplacian);
+    free (s->index);
+    free (s->group);
+    free (s);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// tile post-processing
+//
+
+/* dot product between s1[i] and s2[j] after masking: zero if the pair does not pass
+ * the filter (same rules as the mask passes of find_feature_matches_naive)
+ */
+static inline float simdmatch_mask (const simdmatch_set_t *s1, int i, const simdmatch_set_t *s2, int j,
+                                    const simdmatch_filter_t *filter, float dot)
+{
+    if (s2->laplacian[j] != s1->laplacian[i])
+        return .0;
+
+    if (s2->sensorid[j] == s1->sensorid[i]) {
+        if (!filter->within_camera)
+            return .0;
+        if (filter->maxdist > 0) {
+            double mandist = fabs (s1->col[i] - s2->col[j]) + fabs (s1->row[i] - s2->row[j]);
+            if (mandist > filter->maxdist)
+                return .0;
+        }
+    } else if (!filter->across_cameras) {
+        return .0;
+    }
+
+    return dot;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// drivers
+//
+
+/* for each descriptor in <s1>, find the best and second best (masked) dot product in <s2>.
+ * Ties are resolved exactly as in the sequential scan of find_feature_matches_naive
+ * (first best index wins).
+ *
+ * If <col_ind> is not NULL, also compute for each descriptor in <s2> the best and second
+ * best dot product over <s1> (<col_best>, <col_secn>) and the row that achieves the best
+ * (<col_ind>). This is what the mutual consistency check needs. For a batch query set,
+ * these are computed for each group separately: the arrays have s1->ngroups x s2->num
+ * entries, group g first at offset g * s2->num.
+ *
+ * Masked entries are zero, so that no entry of a row (column) exceeds max(rmax, 0)
+ * (max(cmax, 0)). The running thresholds min(best, second) never decrease, hence the
+ * rows (columns) below the threshold are skipped without changing the result.
+ */
+void simdmatch_top2 (const simdmatch_set_t *s1, const simdmatch_set_t *s2, const simdmatch_filter_t *filter,
+                     int *best_ind, float *best_dot, float *secn_dot,
+                     int *col_ind, float *col_best, float *col_secn)
+{
+    assert (!s1->panels && s2->panels);
+    assert (s1->size == s2->size);
+
+    for (int i=0;i<s1->num;i++) {
+        best_ind[i] = -1;
+        best_dot[i] = .0;
+        secn_dot[i] = .0;
+    }
+
+    if (col_ind) {
+        for (int j=0;j<s1->ngroups*s2->num;j++) {
+            col_ind[j] = -1;
+            col_best[j] = -FLT_MAX;
+            col_secn[j] = -FLT_MAX;
+        }
+    }
+
+    simdmatch_kernel_t kernel = simdmatch_kernel ();
+    float tile[SIMDMATCH_MR*SIMDMATCH_NR] __attribute__ ((aligned (32)));
+    float rmax[SIMDMATCH_MR], cmax[SIMDMATCH_NR];
+    int size = s1->size;
+
+    for (int m0=0;m0<s1->num;m0+=SIMDMATCH_MC) {
+        int m1 = MIN (m0 + SIMDMATCH_MC, s1->num);
+
+        for (int p=0;p<s2->npanels;p++) {
+            int j0 = p * SIMDMATCH_NR;
+            int nr = MIN (SIMDMATCH_NR, s2->num - j0);
+
+            for (int i0=m0;i0<m1;i0+=SIMDMATCH_MR) {
+                int mr = MIN (SIMDMATCH_MR, s1->num - i0);
+                const float *a = s1->data + i0 * size;
+
+                kernel (a, s2->data + p * size * SIMDMATCH_NR, size, tile, rmax, cmax);
+
+                // rows: sequential rule in increasing column order
+                for (int r=0;r<mr;r++) {
+                    int i = i0 + r;
+
+                    if (best_ind[i] != -1 && MAX (rmax[r], .0f) <= MIN (best_dot[i], secn_dot[i]))
+                        continue;
+
+                    const float *v = tile + r * SIMDMATCH_NR;
+                    for (int c=0;c<nr;c++) {
+                        int j = j0 + c;
+                        float dot = simdmatch_mask (s1, i, s2, j, filter, v[c]);
+                        if (best_ind[i] == -1 || best_dot[i] < dot) {
+                            secn_dot[i] = best_dot[i];
+                            best_ind[i] = j;
+                            best_dot[i] = dot;
+                        } else if (secn_dot[i] < dot) {
+                            secn_dot[i] = dot;
+                        }
+                    }
+                }
+
+                if (!col_ind)
+                    continue;
+
+                // columns: order-independent best and second best.
+                // the skip test only applies if the tile rows belong to a single group.
+                int g0 = s1->group ? s1->group[i0] : 0;
+                gboolean single = !s1->group || s1->group[i0 + mr - 1] == g0;
+
+                for (int c=0;c<nr;c++) {
+                    int j = j0 + c;
+
+                    if (single && MAX (cmax[c], .0f) <= col_secn[g0 * s2->num + j])
+                        continue;
+
+                    for (int r=0;r<mr;r++) {
+                        int i = i0 + r;
+                        int jj = (s1->group ? s1->group[i] : 0) * s2->num + j;
+                        float dot = simdmatch_mask (s1, i, s2, j, filter, tile[r * SIMDMATCH_NR + c]);
+                        if (col_best[jj] < dot) {
+                            col_secn[jj] = col_best[jj];
+                            col_best[jj] = dot;
+                            col_ind[jj] = i;
+                        } else if (col_secn[jj] < dot) {
+                            col_secn[jj] = dot;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* sparse version of simdmatch_top2 (single group): only the candidate pairs given in
+ * compressed row format (<start>, <ind>, columns in increasing order in each row) are
+ * computed, all the other entries are taken as masked (zero). Both sets are packed
+ * row-wise. The results are the same as simdmatch_top2 over the full matrix: in the
+ * sequential scan of a row (column), the entries that are not candidates only count
+ * through the first two of them, which are inserted as zeros at their position.
+ */
+void simdmatch_top2_sparse (const simdmatch_set_t *s1, const simdmatch_set_t *s2, const simdmatch_filter_t *filter,
+                            const int *start, const int *ind,
+                            int *best_ind, float *best_dot, float *secn_dot,
+                            int *col_ind, float *col_best, float *col_secn)
+{
+    assert (!s1->panels && !s2->panels && s1->ngroups == 1);
+    assert (s1->size == s2->size);
+
+    int n1 = s1->num, n2 = s2->num;
+    int npairs = start[n1];
+    float *vals = (float*)malloc (MAX (1, npairs) * sizeof(float));
+
+    // rows
+    for (int i=0;i<n1;i++) {
+        best_ind[i] = -1;
+        best_dot[i] = .0;
+        secn_dot[i] = .0;
+
+        const int *c = ind + start[i];
+        int m = start[i+1] - start[i];
+
+        // first two columns that are not candidates
+        int z[2] = { n2, n2 }, nz = 0;
+        for (int j=0, k=0;j<n2 && nz<2;j++) {
+            if (k < m && c[k] == j) { k++; continue; }
+            z[nz++] = j;
+        }
+
+        for (int k=0, zk=0;k<m || zk<nz;) {
+            int j;
+            float dot;
+            if (zk < nz && (k == m || z[zk] < c[k])) {
+                j = z[zk++];
+                dot = .0;
+            } else {
+                j = c[k];
+                dot = simdmatch_mask (s1, i, s2, j, filter, simdmatch_dot (s1->data + i * s1->size, s2->data + j * s2->size, s1->size));
+                vals[start[i]+k] = dot;
+                k++;
+            }
+            if (best_ind[i] == -1 || best_dot[i] < dot) {
+                secn_dot[i] = best_dot[i];
+                best_ind[i] = j;
+                best_dot[i] = dot;
+            } else if (secn_dot[i] < dot) {
+                secn_dot[i] = dot;
+            }
+        }
+    }
+
+    if (!col_ind) {
+        free (vals);
+        return;
+    }
+
+    // columns: transpose the candidate pairs (rows stay in increasing order)
+    int *cstart = (int*)calloc (n2 + 1, sizeof(int));
+    int *cpair = (int*)malloc (MAX (1, npairs) * sizeof(int));
+    int *crow = (int*)malloc (MAX (1, npairs) * sizeof(int));
+
+    for (int k=0;k<npairs;k++)
+        cstart[ind[k]+1]++;
+    for (int j=0;j<n2;j++)
+        cstart[j+1] += cstart[j];
+
+    int *pos = (int*)malloc ((n2 + 1) * sizeof(int));
+    memcpy (pos, cstart, (n2 + 1) * sizeof(int));
+    for (int i=0;i<n1;i++) {
+        for (int k=start[i];k<start[i+1];k++) {
+            int p = pos[ind[k]]++;
+            cpair[p] = k;
+            crow[p] = i;
+        }
+    }
+    free (pos);
+
+    for (int j=0;j<n2;j++) {
+        col_ind[j] = -1;
+        col_best[j] = -FLT_MAX;
+        col_secn[j] = -FLT_MAX;
+
+        const int *r = crow + cstart[j];
+        int m = cstart[j+1] - cstart[j];
+
+        int z[2] = { n1, n1 }, nz = 0;
+        for (int i=0, k=0;i<n1 && nz<2;i++) {
+            if (k < m && r[k] == i) { k++; continue; }
+            z[nz++] = i;
+        }
+
+        for (int k=0, zk=0;k<m || zk<nz;) {
+            int i;
+            float dot;
+            if (zk < nz && (k == m || z[zk] < r[k])) {
+                i = z[zk++];
+                dot = .0;
+            } else {
+                i = r[k];
+                dot = vals[cpair[cstart[j]+k]];
+                k++;
+            }
+            if (col_best[j] < dot) {
+                col_secn[j] = col_best[j];
+                col_best[j] = dot;
+                col_ind[j] = i;
+            } else if (col_secn[j] < dot) {
+                col_secn[j] = dot;
+            }
+        }
+    }
+
+    free (cstart);
+    free (cpair);
+    free (crow);
+    free (vals);
+}
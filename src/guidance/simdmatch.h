@@ -0,0 +1,79 @@
+#ifndef _SIMDMATCH_H__
+#define _SIMDMATCH_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+
+#include <glib.h>
+
+/* From LCM */
+#include <lcmtypes/navlcm_feature_list_t.h>
+
+/* from common */
+#include <common/dbg.h>
+
+/* Blocked, cache-tiled dot-product matching engine.
+ *
+ * The reference set is packed into panels of SIMDMATCH_NR descriptors stored
+ * column-wise (descriptor element k of the NR features is contiguous), the query
+ * set is packed row-wise. Each panel stays in L1 while a block of SIMDMATCH_MC
+ * query rows (in L2) is streamed against it. A micro-kernel computes a SIMDMATCH_MR x SIMDMATCH_NR
+ * tile of dot products which is masked (laplacian, camera, pixel distance) and
+ * reduced while it is still in L1. The n1 x n2 matrix is never materialized.
+ */
+
+#define SIMDMATCH_MR 6          // rows per micro-tile
+#define SIMDMATCH_NR 16         // columns per panel
+#define SIMDMATCH_MC 120        // query rows per cache block (120 x 128 floats = 60 KB)
+
+#define SIMDMATCH_ISA_GENERIC 0
+#define SIMDMATCH_ISA_SSE 1
+#define SIMDMATCH_ISA_AVX2 2
+
+typedef struct {
+    int num;            // number of descriptors
+    int size;           // descriptor length
+    gboolean panels;    // TRUE: panel layout (reference set), FALSE: row layout (query set)
+    int npanels;        // number of panels (panel layout only)
+    float *data;        // packed descriptors (64-byte aligned, zero-padded)
+    double *col;        // feature position in pixels
+    double *row;
+    int *sensorid;
+    int *laplacian;
+    int *index;         // position of each descriptor in the source list
+    int ngroups;        // number of source lists (batch query set, 1 otherwise)
+    int *group;         // source list of each descriptor (batch query set, NULL otherwise)
+    int capacity;       // descriptors the buffers can hold, padding included
+} simdmatch_set_t;
+
+typedef struct {
+    gboolean within_camera;     // allow matches within the same camera
+    gboolean across_cameras;    // allow matches across cameras
+    double maxdist;             // max. manhattan distance in pixels within a camera (<0 to skip)
+} simdmatch_filter_t;
+
+int simdmatch_isa ();
+void simdmatch_set_isa (int isa);
+const char *simdmatch_isa_name (int isa);
+
+float simdmatch_dot (const float *a, const float *b, int n);
+
+simdmatch_set_t *simdmatch_set_new (navlcm_feature_list_t *keys, const int *subset, int n, gboolean panels);
+simdmatch_set_t *simdmatch_set_new_batch (navlcm_feature_list_t **keys, int nkeys);
+simdmatch_set_t *simdmatch_set_repack (simdmatch_set_t *s, navlcm_feature_list_t *keys, const int *subset, int n, gboolean panels);
+void simdmatch_set_center (simdmatch_set_t *s);
+void simdmatch_set_destroy (simdmatch_set_t *s);
+
+void simdmatch_top2 (const simdmatch_set_t *s1, const simdmatch_set_t *s2, const simdmatch_filter_t *filter,
+                     int *best_ind, float *best_dot, float *secn_dot,
+                     int *col_ind, float *col_best, float *col_secn);
+void simdmatch_top2_sparse (const simdmatch_set_t *s1, const simdmatch_set_t *s2, const simdmatch_filter_t *filter,
+                            const int *start, const int *ind,
+                            int *best_ind, float *best_dot, float *secn_dot,
+                            int *col_ind, float *col_best, float *col_secn);
+
+#endif
@@ -3,21 +3,6 @@
 
 #include "state.h"
 
-static double g_state_sigma = 1.0;
-
-gboolean state_transition_convolve_cb (GNode *node, gpointer data)
-{
-    int depth = g_node_depth (node);
-
-    dijk_node_t *nd = (dijk_node_t*)node->data;
-
-    double *val = (double*)data;
-
-    *val += nd->pdf1 * exp (-powf(depth,2)/(2.0*g_state_sigma*g_state_sigma));
-
-    return FALSE;
-}
-
 gboolean state_observation_sum_cb (GNode *node, gpointer data)
 {
     dijk_node_t *nd = (dijk_node_t*)node->data;
@@ -73,52 +58,73 @@ gboolean state_transition_timestamp_cb (GNode *node, gpointer data)
     return FALSE;
 }
 
+/* start a new set in the membership marks of the belief support
+ */
+static unsigned int state_mark_new (dijk_csr_t *c)
+{
+    c->mark_epoch++;
+    if (c->mark_epoch == 0) {
+        memset (c->mark, 0, MAX(1,c->nnodes)*sizeof(unsigned int));
+        c->mark_epoch = 1;
+    }
+    return c->mark_epoch;
+}
+
 /* apply the transition update to the belief state
  * <dg> is the graph (entire map)
- * <cg> is the current gate
+ * The prediction of a node is the belief of the nodes within <radius> hops of it,
+ * weighted by a gaussian of the number of hops (the node itself counting as one hop,
+ * as in the depth of a tree rooted at the node). The neighborhoods are computed once
+ * for a given graph (dijk_graph_khop). Only the nodes of the belief support are
+ * spread over their neighborhoods, so that the cost does not depend on the size of
+ * the map.
  */
 void state_transition_update (dijk_graph_t *dg, int radius, double state_sigma)
 {
     if (!dg) return;
 
-    g_state_sigma = state_sigma;
+    dijk_csr_t *c = dijk_graph_csr (dg);
+    dijk_khop_t *k = dijk_graph_khop (dg, radius);
 
-    int64_t timestamp = bot_timestamp_now ();
+    if (c->nnodes == 0) return;
 
-    /* reset all pdf to zero */
-    for (GList *iter=g_queue_peek_head_link(dg->nodes);iter;iter=iter->next) {
-        dijk_node_t *nd = (dijk_node_t*)iter->data;
-        nd->pdf0 = .0;
-    }
+    double *kernel = (double*)malloc((radius+1)*sizeof(double));
+    for (int h=0;h<=radius;h++)
+        kernel[h] = exp (-powf(h+1,2)/(2.0*state_sigma*state_sigma));
 
-    /* loop through all nodes */
-    for (GList *iter=g_queue_peek_head_link(dg->nodes);iter;iter=iter->next) {
-        dijk_node_t *nd = (dijk_node_t*)iter->data;
+    /* reset the previous prediction */
+    for (int a=0;a<c->nactive[0];a++)
+        c->nodes[c->active[0][a]]->pdf0 = .0;
+    c->nactive[0] = 0;
 
-        // convert to dual tree
-        GNode *tr = dijk_to_tree (nd, radius);
+    /* convolve with gaussian kernel */
+    unsigned int epoch = state_mark_new (c);
 
-        // convolve with gaussian kernel
-        double val = .0;
-        g_node_traverse (tr, G_PRE_ORDER, G_TRAVERSE_ALL, -1, state_transition_convolve_cb, &val);
-        nd->pdf0 = val;
-        
-        g_node_destroy (tr);
+    for (int a=0;a<c->nactive[1];a++) {
+        int j = c->active[1][a];
+        double p = c->nodes[j]->pdf1;
+        if (p == .0) continue;
+        for (int q=k->toffset[j];q<k->toffset[j+1];q++) {
+            int i = k->tcol[q];
+            if (c->mark[i] != epoch) {
+                c->mark[i] = epoch;
+                c->active[0][c->nactive[0]++] = i;
+            }
+            c->nodes[i]->pdf0 += kernel[k->thops[q]] * p;
+        }
     }
 
     // normalize
     double t = .0;
-    for (GList *iter=g_queue_peek_head_link(dg->nodes);iter;iter=iter->next) {
-        dijk_node_t *nd = (dijk_node_t*)iter->data;
-        t += nd->pdf0;
-    }
+    for (int a=0;a<c->nactive[0];a++)
+        t += c->nodes[c->active[0][a]]->pdf0;
 
     if (t > 1E-6) {
-        for (GList *iter=g_queue_peek_head_link(dg->nodes);iter;iter=iter->next) {
-            dijk_node_t *nd = (dijk_node_t*)iter->data;
-            nd->pdf0 /= t;
-        }
+        for (int a=0;a<c->nactive[0];a++)
+            c->nodes[c->active[0][a]]->pdf0 /= t;
     }
+
+    free (kernel);
 }
 
 void state_print_to_file (dijk_graph_t *dg, const char *filename)
@@ -160,95 +166,113 @@ void state_print (dijk_graph_t *dg, dijk_node_t *cg)
     dbg (DBG_CLASS, "sum pdf0 = %.4f  sum pdf1 = %.4f", sum_pdf0, sum_pdf1);
 }
 
-gboolean state_compute_variance_cb (GNode *nd, gpointer data)
+/* observation update for a set of nodes: the live features are matched against
+ * the features of all the nodes in a single pass.
+ */
+void state_observation_update_nodes (GQueue *nodes, navlcm_feature_list_t *f)
 {
-    double *variance = (double*)data;
-    dijk_node_t *n = (dijk_node_t*)nd->data;
+    int n = g_queue_get_length (nodes);
+    if (n == 0)
+        return;
 
-    *variance += n->pdf1 * powf (1.0 * g_node_depth (nd), 2);
-    return FALSE;
-}
+    navlcm_feature_list_t **fn = (navlcm_feature_list_t**)malloc(n*sizeof(navlcm_feature_list_t*));
+    int *nmatches = (int*)malloc(n*sizeof(int));
+    double *psi_dist = (double*)malloc(n*sizeof(double));
 
-gboolean state_observation_cb (GNode *nd, gpointer data)
-{
-    dijk_node_t *n = (dijk_node_t*)nd->data;
-    navlcm_feature_list_t *f = (navlcm_feature_list_t*)data;
-    navlcm_feature_list_t *fn = dijk_node_get_nth_features (n, 0);
-    assert (fn);
-    printf ("state obs. %d %d\n", f->num, fn->num); 
-    double prob = 1.0 - class_psi_distance (fn, f, NULL);
-    n->pdf1 = n->pdf0 * prob;
-    n->timestamp = f->utime;
-    return FALSE;
+    int count = 0;
+    for (GList *iter=g_queue_peek_head_link (nodes);iter;iter=iter->next) {
+        dijk_node_t *nd = (dijk_node_t*)iter->data;
+        fn[count] = dijk_node_get_nth_features (nd, 0);
+        assert (fn[count]);
+        count++;
+    }
+
+    class_psi_distance_batch (fn, n, f, nmatches, psi_dist);
+
+    count = 0;
+    for (GList *iter=g_queue_peek_head_link (nodes);iter;iter=iter->next) {
+        dijk_node_t *nd = (dijk_node_t*)iter->data;
+        double prob = 1.0 - psi_dist[count];
+        dbg (DBG_CLASS, "state obs. node %d: %d/%d features, %d matches, prob %.4f", 
+             nd->uid, fn[count]->num, f->num, nmatches[count], prob);
+        nd->pdf1 = nd->pdf0 * prob;
+        nd->timestamp = f->utime;
+        count++;
+    }
+
+    free (fn);
+    free (nmatches);
+    free (psi_dist);
 }
 
 /* apply the observation update to the belief state
  * limiting the application to <radius> distance to edge <e>
+ * The belief is zero out of this neighborhood, which becomes the belief support.
  */
 void state_observation_update (dijk_graph_t *dg, dijk_edge_t *e, int radius, navlcm_feature_list_t *f, GQueue *path, double *variance)
 {
     if (!e || !e->start)
         return;
 
-    // convert to dual tree
-    GNode *tr = dijk_to_tree (e->start, radius);
+    dijk_csr_t *c = dijk_graph_csr (dg);
+    dijk_khop_t *k = dijk_graph_khop (dg, radius);
+
+    int *index = (int*)g_hash_table_lookup (dg->alias, &e->start->uid);
+    if (!index)
+        return;
+
+    int q0 = k->offset[*index], q1 = k->offset[*index+1];
 
-    // apply observation update to the tree 
-    g_node_traverse (tr, G_PRE_ORDER, G_TRAVERSE_ALL, -1, state_observation_cb, f);
+    // apply observation update to the neighborhood
+    GQueue *nodes = g_queue_new ();
+    for (int q=q0;q<q1;q++)
+        g_queue_push_tail (nodes, c->nodes[k->col[q]]);
+    state_observation_update_nodes (nodes, f);
+    g_queue_free (nodes);
 
-    // compute variance across tree
+    // compute variance across the neighborhood (depth in hops, the node itself at one)
     *variance = .0;
-    g_node_traverse (tr, G_PRE_ORDER, G_TRAVERSE_ALL, -1, state_compute_variance_cb, variance);
+    for (int q=q0;q<q1;q++)
+        *variance += c->nodes[k->col[q]]->pdf1 * powf (1.0 * (k->hops[q]+1), 2);
     *variance /= radius;
 
-    // destroy tree
-    g_node_destroy (tr);
-
-    // set to zero for all nodes out of the tree
-    for (GList *iter=g_queue_peek_head_link(dg->nodes);iter;iter=iter->next) {
-        dijk_node_t *nd = (dijk_node_t*)iter->data;
-        if (nd->timestamp != f->utime) {
-            nd->pdf0 = .0;
-            nd->pdf1 = .0;
+    // set to zero for all nodes out of the neighborhood
+    unsigned int epoch = state_mark_new (c);
+    for (int q=q0;q<q1;q++)
+        c->mark[k->col[q]] = epoch;
+
+    for (int s=0;s<2;s++) {
+        for (int a=0;a<c->nactive[s];a++) {
+            dijk_node_t *nd = c->nodes[c->active[s][a]];
+            if (c->mark[c->active[s][a]] != epoch) {
+                nd->pdf0 = .0;
+                nd->pdf1 = .0;
+            }
         }
     }
 
-    // hack: set to zero for all nodes out of the path
-    for (GList *iter=g_queue_peek_head_link(dg->nodes);iter;iter=iter->next) {
-        dijk_node_t *nd = (dijk_node_t*)iter->data;
-        if (!path) continue;
-        gboolean on_path = FALSE;
-        for (GList *eiter=g_queue_peek_head_link (path);eiter;eiter=eiter->next) {
-            dijk_edge_t *e = (dijk_edge_t*)eiter->data;
-            if (e->start == nd || e->end == nd) {
-                on_path = TRUE;
-            }
-        }
-        if (!on_path) {
-    //        nd->pdf0 = .0;
-    //        nd->pdf1 = .0;
-        }
+    for (int s=0;s<2;s++) {
+        memcpy (c->active[s], k->col + q0, (q1-q0)*sizeof(int));
+        c->nactive[s] = q1-q0;
     }
 
     // normalize
     double t = state_sum (dg);
 
     if (t > 1E-6) {
-        for (GList *iter=g_queue_peek_head_link(dg->nodes);iter;iter=iter->next) {
-            dijk_node_t *nd = (dijk_node_t*)iter->data;
-            nd->pdf1 /= t;
-        }
+        for (int a=0;a<c->nactive[1];a++)
+            c->nodes[c->active[1][a]]->pdf1 /= t;
     }
 
 }
 
 double state_sum (dijk_graph_t *dg)
 {
+    dijk_csr_t *c = dijk_graph_csr (dg);
+
     double t = .0;
-    for (GList *iter=g_queue_peek_head_link(dg->nodes);iter;iter=iter->next) {
-        dijk_node_t *nd = (dijk_node_t*)iter->data;
-        t += nd->pdf1;
-    }
+    for (int a=0;a<c->nactive[1];a++)
+        t += c->nodes[c->active[1][a]]->pdf1;
 
     return t;
 }
@@ -265,43 +289,54 @@ gboolean state_find_maximum_cb (GNode *node, gpointer data)
 }
 
 /* find the node with maximum probability
- * <og> is the output gate (the one with highest probability)
+ * <og> is the output gate (the one with highest probability, the first one in the
+ * graph in case of a tie)
  */
 void state_find_maximum (dijk_graph_t *dg, dijk_node_t **og)
 {
-    double maxpdf = -1.0;
+    dijk_csr_t *c = dijk_graph_csr (dg);
 
-    for (GList *iter=g_queue_peek_head_link (dg->nodes);iter;iter=iter->next) {
-        dijk_node_t *nd = (dijk_node_t*)iter->data;
-        if (nd->pdf1 > maxpdf) {
-            maxpdf = nd->pdf1;
-            *og = nd;
+    if (c->nnodes == 0)
+        return;
+
+    double maxpdf = .0;
+    int best = 0;
+
+    for (int a=0;a<c->nactive[1];a++) {
+        int i = c->active[1][a];
+        double pdf = c->nodes[i]->pdf1;
+        if (pdf > maxpdf || (pdf == maxpdf && pdf > .0 && i < best)) {
+            maxpdf = pdf;
+            best = i;
         }
     }
+
+    *og = c->nodes[best];
 }
 
 
-/* update the classifier state with pdf values
-*/
+/* update the classifier state with pdf values (the nodes of the belief support;
+ * the belief is zero for the other nodes)
+ */
 void state_update_class_param (navlcm_class_param_t *state, dijk_graph_t *dg)
 {
     if (g_queue_is_empty (dg->nodes))
         return;
 
+    dijk_csr_t *c = dijk_graph_csr (dg);
+
     if (state->pdfval)
         free (state->pdfval);
     if (state->pdfind)
         free (state->pdfind);
-    state->pdf_size = g_queue_get_length (dg->nodes);
-    state->pdfind = (int*)calloc(state->pdf_size, sizeof(int));
-    state->pdfval = (double*)calloc(state->pdf_size, sizeof(double));
-
-    int count = 0;
-    for (GList *iter=g_queue_peek_head_link(dg->nodes);iter;iter=iter->next) {
-        dijk_node_t *nd = (dijk_node_t*)iter->data;
-        state->pdfind[count] = nd->uid;
-        state->pdfval[count] = nd->pdf1;
-        count++;
+    state->pdf_size = c->nactive[1];
+    state->pdfind = (int*)calloc(MAX(1,state->pdf_size), sizeof(int));
+    state->pdfval = (double*)calloc(MAX(1,state->pdf_size), sizeof(double));
+
+    for (int a=0;a<c->nactive[1];a++) {
+        dijk_node_t *nd = c->nodes[c->active[1][a]];
+        state->pdfind[a] = nd->uid;
+        state->pdfval[a] = nd->pdf1;
     }
 }
 
@@ -309,16 +344,24 @@ void state_init (dijk_graph_t *dg, dijk_node_t *n)
 {
     assert (n);
 
-    for (GList *iter=g_queue_peek_head_link (dg->nodes);iter;iter=iter->next) {
-        dijk_node_t *p = (dijk_node_t*)iter->data;
-        if (p == n) {
-            p->pdf0 = 1.0;
-            p->pdf1 = 1.0;
-        }
-        else {
+    dijk_csr_t *c = dijk_graph_csr (dg);
+
+    for (int s=0;s<2;s++) {
+        for (int a=0;a<c->nactive[s];a++) {
+            dijk_node_t *p = c->nodes[c->active[s][a]];
             p->pdf0 = .0;
             p->pdf1 = .0;
         }
+        c->nactive[s] = 0;
     }
+
+    int *index = (int*)g_hash_table_lookup (dg->alias, &n->uid);
+    assert (index && c->nodes[*index] == n);
+
+    n->pdf0 = 1.0;
+    n->pdf1 = 1.0;
+
+    for (int s=0;s<2;s++)
+        c->active[s][c->nactive[s]++] = *index;
 }
 
@@ -10,6 +10,7 @@
 
 void state_transition_update (dijk_graph_t *dg, int radius, double state_sigma);
 void state_observation_update (dijk_graph_t *dg, dijk_edge_t *e, int radius, navlcm_feature_list_t *f, GQueue *path, double *variance);
+void state_observation_update_nodes (GQueue *nodes, navlcm_feature_list_t *f);
 void state_init (dijk_graph_t *dg, dijk_node_t *n);
 void state_print (dijk_graph_t *dg, dijk_node_t *cg);
 void state_print_to_file (dijk_graph_t *dg, const char *filename);
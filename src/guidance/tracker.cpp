@@ -353,7 +353,7 @@ navlcm_track_set_t *update_tracks (navlcm_track_set_t *tracks,
 
     // match track features against input features (within cameras)
     navlcm_feature_match_set_t *matches = find_feature_matches_multi 
-        (last_fs, features, TRUE, FALSE, 5, .6, tracker_max_dist, -1.0, TRUE);
+        (last_fs, features, TRUE, FALSE, 5, .6, tracker_max_dist, -1.0, TRUE, MATCHING_DOTPROD);
 
     // destroy features
     navlcm_feature_list_t_destroy (last_fs);
@@ -531,7 +531,7 @@ navlcm_track_set_t *fuse_tracks (navlcm_track_set_t *tracks, int ttl, int width,
     // match features forward
     //
     navlcm_feature_match_set_t *matches = find_feature_matches_multi 
-        (ls, rs, FALSE, TRUE, 5, 1.0, -1.0, -1.0, FALSE);
+        (ls, rs, FALSE, TRUE, 5, 1.0, -1.0, -1.0, FALSE, MATCHING_DOTPROD);
 
     if (!matches) return tracks;
 
@@ -564,7 +564,7 @@ navlcm_track_set_t *fuse_tracks (navlcm_track_set_t *tracks, int ttl, int width,
 
     // match features backward
     //
-    matches = find_feature_matches_multi (rs, ls, FALSE, TRUE, 5, .6, -1.0, -1.0, TRUE);
+    matches = find_feature_matches_multi (rs, ls, FALSE, TRUE, 5, .6, -1.0, -1.0, TRUE, MATCHING_DOTPROD);
 
     if (!matches) return tracks;
 
@@ -938,3 +938,548 @@ navlcm_feature_list_t* tracks_to_features (GList *ts, int width, int height, int
     return fs;
 }
 
+
+////////////////////////////////////////////////////////////////////////////////////
+// persistent track store
+//
+
+#define TRACK_STORE_INIT_CAPACITY 256
+#define TRACK_STORE_TOPK 5              // candidates per head, as in update_tracks
+#define TRACK_STORE_RATIO .6            // second neighbour ratio, as in update_tracks
+
+static inline gboolean track_store_is_alive (track_store_t *s, int slot)
+{
+    return (s->alive[slot >> 5] >> (slot & 31)) & 1;
+}
+
+track_store_t *track_store_new (int size, int width, int height)
+{
+    track_store_t *s = (track_store_t*)calloc (1, sizeof(track_store_t));
+
+    s->size = size;
+    s->width = width;
+    s->height = height;
+    s->free_slot = -1;
+    s->hfree = -1;
+    s->heads.width = width;
+    s->heads.height = height;
+    s->heads.desc_size = size;
+
+    return s;
+}
+
+void track_store_destroy (track_store_t *s)
+{
+    if (!s)
+        return;
+
+    free (s->alive);
+    free (s->next_free);
+    free (s->desc);
+    free (s->ttl);
+    free (s->uid);
+    free (s->time_start);
+    free (s->time_end);
+    free (s->last);
+    free (s->length);
+    free (s->stamp);
+    free (s->hist);
+    free (s->hdesc);
+    free (s->hprev);
+    free (s->heads.el);
+    featgrid_destroy (s->grid);
+    free (s->query);
+    free (s->cand);
+    free (s->cand_dist);
+    free (s->match);
+    free (s->owner);
+    free (s->owner_dist);
+    free (s);
+}
+
+/* double the number of slots
+ */
+static void track_store_grow (track_store_t *s)
+{
+    int capacity = MAX (TRACK_STORE_INIT_CAPACITY, 2 * s->capacity);
+    int words = (capacity + 31) / 32;
+    int old_words = (s->capacity + 31) / 32;
+
+    s->alive = (guint32*)realloc (s->alive, words * sizeof(guint32));
+    memset (s->alive + old_words, 0, (words - old_words) * sizeof(guint32));
+
+    s->next_free = (int*)realloc (s->next_free, capacity * sizeof(int));
+    s->desc = (float*)realloc (s->desc, (size_t)capacity * s->size * sizeof(float));
+    s->ttl = (int*)realloc (s->ttl, capacity * sizeof(int));
+    s->uid = (int64_t*)realloc (s->uid, capacity * sizeof(int64_t));
+    s->time_start = (int64_t*)realloc (s->time_start, capacity * sizeof(int64_t));
+    s->time_end = (int64_t*)realloc (s->time_end, capacity * sizeof(int64_t));
+    s->last = (int*)realloc (s->last, capacity * sizeof(int));
+    s->length = (int*)realloc (s->length, capacity * sizeof(int));
+    s->stamp = (int*)realloc (s->stamp, capacity * sizeof(int));
+    s->heads.el = (navlcm_feature_t*)realloc (s->heads.el, capacity * sizeof(navlcm_feature_t));
+
+    s->capacity = capacity;
+}
+
+/* get a history node from the free list, or from the end of the pool
+ */
+static int track_store_node (track_store_t *s)
+{
+    if (s->hfree != -1) {
+        int k = s->hfree;
+        s->hfree = s->hprev[k];
+        return k;
+    }
+
+    if (s->hnum == s->hcapacity) {
+        s->hcapacity = MAX (4 * TRACK_STORE_INIT_CAPACITY, 2 * s->hcapacity);
+        s->hist = (navlcm_feature_t*)realloc (s->hist, s->hcapacity * sizeof(navlcm_feature_t));
+        s->hdesc = (float*)realloc (s->hdesc, (size_t)s->hcapacity * s->size * sizeof(float));
+        s->hprev = (int*)realloc (s->hprev, s->hcapacity * sizeof(int));
+    }
+
+    return s->hnum++;
+}
+
+/* make <f> the new head of the track in <slot> (in place)
+ */
+static void track_store_push (track_store_t *s, int slot, navlcm_feature_t *f)
+{
+    assert (f->size == s->size);
+
+    int k = track_store_node (s);
+
+    s->hist[k] = *f;
+    s->hist[k].data = NULL;
+    memcpy (s->hdesc + (size_t)k * s->size, f->data, s->size * sizeof(float));
+    s->hprev[k] = s->last[slot];
+
+    memcpy (s->desc + (size_t)slot * s->size, f->data, s->size * sizeof(float));
+    s->last[slot] = k;
+    s->length[slot]++;
+}
+
+/* release a track: its slot and its history nodes go on the free lists
+ */
+static void track_store_kill (track_store_t *s, int slot)
+{
+    int k = s->last[slot];
+    if (k != -1) {
+        while (s->hprev[k] != -1)
+            k = s->hprev[k];
+        s->hprev[k] = s->hfree;
+        s->hfree = s->last[slot];
+    }
+
+    s->alive[slot >> 5] &= ~(1u << (slot & 31));
+    s->next_free[slot] = s->free_slot;
+    s->free_slot = slot;
+    s->nalive--;
+}
+
+/* start a new track with feature <f>. Returns the slot of the track.
+ */
+int track_store_add (track_store_t *s, navlcm_feature_t *f, int ttl)
+{
+    int slot;
+
+    if (s->free_slot != -1) {
+        slot = s->free_slot;
+        s->free_slot = s->next_free[slot];
+    } else {
+        if (s->num == s->capacity)
+            track_store_grow (s);
+        slot = s->num++;
+    }
+
+    s->alive[slot >> 5] |= 1u << (slot & 31);
+    s->nalive++;
+
+    s->ttl[slot] = ttl;
+    s->uid[slot] = s->maxuid++;
+    s->time_start[slot] = f->utime;
+    s->time_end[slot] = f->utime;
+    s->last[slot] = -1;
+    s->length[slot] = 0;
+    s->stamp[slot] = -1;
+
+    track_store_push (s, slot, f);
+
+    return slot;
+}
+
+/* list of the heads of the live tracks, in slot order. The list belongs to the store
+ * and its descriptors point into the head block: it is only valid until the next update.
+ * el[k].uid is the slot of the track.
+ */
+navlcm_feature_list_t *track_store_heads (track_store_t *s)
+{
+    int n = 0;
+
+    for (int w=0;w<(s->num+31)/32;w++) {
+        guint32 bits = s->alive[w];
+        while (bits) {
+            int slot = 32 * w + __builtin_ctz (bits);
+            bits &= bits - 1;
+
+            navlcm_feature_t *ft = s->heads.el + n++;
+            *ft = s->hist[s->last[slot]];
+            ft->data = s->desc + (size_t)slot * s->size;
+            ft->uid = slot;
+        }
+    }
+
+    s->heads.num = n;
+
+    return &s->heads;
+}
+
+/* grow the matching buffers for <nheads> heads and <nfeatures> features
+ */
+static void track_store_reserve (track_store_t *s, int nheads, int nfeatures)
+{
+    if (nheads > s->mcapacity) {
+        s->mcapacity = MAX (nheads, 2 * s->mcapacity);
+        s->cand = (int*)realloc (s->cand, s->mcapacity * TRACK_STORE_TOPK * sizeof(int));
+        s->cand_dist = (double*)realloc (s->cand_dist, s->mcapacity * TRACK_STORE_TOPK * sizeof(double));
+        s->match = (int*)realloc (s->match, s->mcapacity * sizeof(int));
+    }
+
+    if (nfeatures > s->fcapacity) {
+        s->fcapacity = MAX (nfeatures, 2 * s->fcapacity);
+        s->owner = (int*)realloc (s->owner, s->fcapacity * sizeof(int));
+        s->owner_dist = (double*)realloc (s->owner_dist, s->fcapacity * sizeof(double));
+    }
+
+    int n = MAX (nheads, nfeatures);
+    if (n > s->qcapacity) {
+        s->qcapacity = MAX (n, 2 * s->qcapacity);
+        s->query = (int*)realloc (s->query, s->qcapacity * sizeof(int));
+    }
+}
+
+/* match the heads against the features in the buffers of the store, with the matches
+ * of find_feature_matches_multi (heads, features, TRUE, FALSE, TRACK_STORE_TOPK, 
+ * TRACK_STORE_RATIO, <maxdist>, -1, TRUE, MATCHING_DOTPROD) in update_tracks: the TRACK_STORE_TOPK closest
+ * features of the same camera within <maxdist> pixels, the ratio test on the first two,
+ * then each feature goes to the closest head that has it as a candidate (the last one
+ * on ties) and a head keeps its first remaining candidate. Features are told apart by
+ * their position in <features> (by sensor and index in filter_matches_polygamy).
+ * s->match[k] is the feature matched by head k, -1 if none. Returns the number of
+ * matched heads.
+ */
+static int track_store_match (track_store_t *s, navlcm_feature_list_t *heads, navlcm_feature_list_t *features, 
+                              double maxdist)
+{
+    int nh = heads->num;
+    int nf = features->num;
+
+    track_store_reserve (s, nh, nf);
+
+    gboolean gated = maxdist > 1E-6;
+    double sqmaxdist = maxdist * maxdist;
+    if (gated)
+        s->grid = featgrid_rebuild (s->grid, features, maxdist);
+
+    for (int j=0;j<nf;j++)
+        s->owner[j] = -1;
+
+    for (int i=0;i<nh;i++) {
+        navlcm_feature_t *key = heads->el + i;
+        int *cand = s->cand + i * TRACK_STORE_TOPK;
+        double *cand_dist = s->cand_dist + i * TRACK_STORE_TOPK;
+
+        for (int k=0;k<TRACK_STORE_TOPK;k++)
+            cand[k] = -1;
+
+        // candidates of the same camera (sorted by index) and their distance in feature space
+        int n = gated ? featgrid_query (s->grid, key->sensorid, key->col, key->row, maxdist, 
+                                        FEATGRID_EUCLIDEAN, s->query) : nf;
+
+        for (int jj=0;jj<n;jj++) {
+            int j = gated ? s->query[jj] : jj;
+            navlcm_feature_t *tar = features->el + j;
+
+            if (key->laplacian != tar->laplacian || key->sensorid != tar->sensorid)
+                continue;
+            if (gated && (key->col - tar->col)*(key->col - tar->col) + 
+                    (key->row - tar->row)*(key->row - tar->row) > sqmaxdist)
+                continue;
+
+            double dist = vect_sqdist_float (key->data, tar->data, key->size) / key->size;
+
+            for (int k=0;k<TRACK_STORE_TOPK;k++) {
+                if (cand[k] == -1 || dist < cand_dist[k]) {
+                    for (int kk=TRACK_STORE_TOPK-1;kk>k;kk--) {
+                        cand[kk] = cand[kk-1];
+                        cand_dist[kk] = cand_dist[kk-1];
+                    }
+                    cand[k] = j;
+                    cand_dist[k] = dist;
+                    break;
+                }
+            }
+        }
+
+        // skip non-selective matches
+        if (cand[0] != -1 && cand[1] != -1 && TRACK_STORE_RATIO * cand_dist[1] < cand_dist[0])
+            cand[0] = -1;
+
+        // monogamy
+        for (int k=0;k<TRACK_STORE_TOPK && cand[k] != -1;k++) {
+            int j = cand[k];
+            if (features->el[j].index < 0)
+                continue;
+            if (s->owner[j] == -1 || !(s->owner_dist[j] < cand_dist[k])) {
+                s->owner[j] = i;
+                s->owner_dist[j] = cand_dist[k];
+            }
+        }
+    }
+
+    int matched = 0;
+    for (int i=0;i<nh;i++) {
+        int *cand = s->cand + i * TRACK_STORE_TOPK;
+        s->match[i] = -1;
+        for (int k=0;k<TRACK_STORE_TOPK && cand[k] != -1;k++) {
+            int j = cand[k];
+            if (features->el[j].index < 0 || s->owner[j] == i) {
+                s->match[i] = j;
+                matched++;
+                break;
+            }
+        }
+    }
+
+    return matched;
+}
+
+/* update tracks given a set of features and a time to live (ttl): same as update_tracks,
+ * on the store. Tracks that die are released and, if <dead_tracks> is not NULL, a copy
+ * is prepended to it. Returns the number of matched tracks.
+ */
+int track_store_update (track_store_t *s, navlcm_feature_list_t *features, int ttl, double tracker_max_dist, 
+                        GList **dead_tracks)
+{
+    // sanity check
+    if (!features || features->num==0) {
+        dbg (DBG_ERROR, "no features to track.");
+        return 0;
+    }
+
+    // performance timer
+    GTimer *timer = g_timer_new ();
+    gulong usecs;    double secs;
+
+    // populate tracks and return if there are none
+    if (s->nalive == 0) {
+        for (int i=0;i<features->num;i++)
+            track_store_add (s, features->el + i, ttl);
+        g_timer_destroy (timer);
+        return 0;
+    }
+
+    s->frame++;
+
+    // match track heads against input features (within cameras)
+    navlcm_feature_list_t *heads = track_store_heads (s);
+    heads->width = features->width;
+    heads->height = features->height;
+
+    int matched = track_store_match (s, heads, features, tracker_max_dist);
+
+    secs = g_timer_elapsed (timer, &usecs);
+    dbg (DBG_CLASS, "found %d matches in %.3f secs.", matched, secs);
+
+    // update the head of each matched track
+    for (int k=0;k<heads->num;k++) {
+        if (s->match[k] == -1) continue;
+        navlcm_feature_t *ft = features->el + s->match[k];
+        int slot = heads->el[k].uid;
+        track_store_push (s, slot, ft);
+        s->ttl[slot] = ttl;
+        s->time_end[slot] = ft->utime;
+        s->stamp[slot] = s->frame;
+    }
+
+    // demote non-matched tracks
+    int demoted = 0, died = 0;
+    for (int slot=0;slot<s->num;slot++) {
+        if (!track_store_is_alive (s, slot) || s->stamp[slot] == s->frame) continue;
+        s->ttl[slot]--;
+        demoted++;
+        if (s->ttl[slot] > 0) continue;
+        if (dead_tracks)
+            *dead_tracks = g_list_prepend (*dead_tracks, track_store_to_track (s, slot));
+        track_store_kill (s, slot);
+        died++;
+    }
+
+    // performance timer
+    secs = g_timer_elapsed (timer, &usecs);
+    g_timer_destroy (timer);
+
+    dbg (DBG_CLASS, "tracks: %d matched, %d demoted, %d died, total %d (%.3f secs)", matched, demoted, died, s->nalive, secs);
+
+    return matched;
+}
+
+/* add new tracks given a set of features (see add_new_tracks): a feature starts a track
+ * unless it is already the head of a track or it is closer than <param_min_dist> pixels
+ * to the head of a track of the same camera.
+ */
+int track_store_add_new (track_store_t *s, navlcm_feature_list_t *features, int ttl, double param_min_dist)
+{
+    if (!features) return 0;
+
+    navlcm_feature_list_t *heads = track_store_heads (s);
+    track_store_reserve (s, heads->num, 0);
+    featgrid_t *grid = heads->num > 0 ? (s->grid = featgrid_rebuild (s->grid, heads, MAX (1.0, param_min_dist))) : NULL;
+    int *ind = s->query;
+
+    int nheads = heads->num;
+    int ncreated = 0;
+
+    for (int i=0;i<features->num;i++) {
+        navlcm_feature_t *ft = features->el + i;
+
+        // heads (same feature or within the minimum distance)
+        gboolean skip = FALSE;
+        int n = grid ? featgrid_query (grid, ft->sensorid, ft->col, ft->row, MAX (0.0, param_min_dist), 
+                                       FEATGRID_EUCLIDEAN, ind) : 0;
+        for (int k=0;k<n && !skip;k++) {
+            navlcm_feature_t *h = heads->el + ind[k];
+            double dist = sqrt ((h->col - ft->col)*(h->col - ft->col) + (h->row - ft->row)*(h->row - ft->row));
+            if (feature_comp (h, ft) == 0 || dist < param_min_dist)
+                skip = TRUE;
+        }
+        if (skip)
+            continue;
+
+        track_store_add (s, ft, ttl);
+        ncreated++;
+    }
+
+    dbg (DBG_CLASS, "created %d new tracks (%d alive).", ncreated, nheads);
+
+    return ncreated;
+}
+
+/* copy a track of the store to an LCM track (most recent feature first, as in update_tracks)
+ */
+navlcm_track_t *track_store_to_track (track_store_t *s, int slot)
+{
+    navlcm_track_t *track = navlcm_track_t_create (NULL, s->width, s->height, s->ttl[slot], s->uid[slot]);
+
+    track->time_start = s->time_start[slot];
+    track->time_end = s->time_end[slot];
+    track->ft.num = s->length[slot];
+    track->ft.desc_size = s->size;
+    track->ft.el = (navlcm_feature_t*)malloc (MAX (1, s->length[slot]) * sizeof(navlcm_feature_t));
+
+    int i = 0;
+    for (int k=s->last[slot];k!=-1;k=s->hprev[k]) {
+        navlcm_feature_t *ft = track->ft.el + i++;
+        *ft = s->hist[k];
+        ft->data = (float*)malloc (s->size * sizeof(float));
+        memcpy (ft->data, s->hdesc + (size_t)k * s->size, s->size * sizeof(float));
+    }
+
+    return track;
+}
+
+/* live tracks as an LCM track set (for publishing)
+ */
+navlcm_track_set_t *track_store_to_lcm (track_store_t *s)
+{
+    navlcm_track_set_t *tracks = init_tracks ();
+
+    tracks->maxuid = s->maxuid;
+    tracks->el = (navlcm_track_t*)malloc (MAX (1, s->nalive) * sizeof(navlcm_track_t));
+
+    for (int slot=0;slot<s->num;slot++) {
+        if (!track_store_is_alive (s, slot)) continue;
+        navlcm_track_t *track = track_store_to_track (s, slot);
+        tracks->el[tracks->num++] = *track;
+        free (track);
+    }
+
+    return tracks;
+}
+
+void track_store_publish (lcm_t *lcm, track_store_t *s)
+{
+    navlcm_track_set_t *tracks = track_store_to_lcm (s);
+
+    dbg (DBG_CLASS, "[class] publishing %d tracks.", tracks->num);
+
+    navlcm_track_set_t_publish (lcm, "TRACKS", tracks);
+
+    navlcm_track_set_t_destroy (tracks);
+}
+
+/* regression test: the track store must follow the same tracks as update_tracks and
+ * add_new_tracks over a random sequence of frames (same ttl, length and head for each
+ * live track). Returns the number of frames that differ.
+ */
+int track_store_unit_testing (int nframes)
+{
+    int ttl = 3, nfailed = 0;
+    double max_dist = 30.0, min_dist = 5.0;
+
+    srand (time (NULL));
+
+    navlcm_feature_list_t *fs = matcher_random_feature_list (300, 128, 4, 376, 240);
+    navlcm_track_set_t *tracks = init_tracks ();
+    track_store_t *store = track_store_new (128, 376, 240);
+
+    for (int frame=0;frame<nframes;frame++) {
+
+        // next frame: perturbed features, some of them replaced by new ones
+        navlcm_feature_list_t *next = matcher_perturb_feature_list (fs, .3, .2);
+        for (int i=0;i<next->num;i++) {
+            next->el[i].utime = frame + 1;
+            next->el[i].index = i;
+        }
+
+        tracks = update_tracks (tracks, next, ttl, 0, max_dist, NULL);
+        tracks = add_new_tracks (tracks, next, ttl, min_dist);
+
+        track_store_update (store, next, ttl, max_dist, NULL);
+        track_store_add_new (store, next, ttl, min_dist);
+
+        int ndiff = 0, nalive = 0;
+        for (int i=0;i<tracks->num;i++) {
+            navlcm_track_t *t = tracks->el + i;
+            if (t->ttl <= 0) continue;
+            nalive++;
+            int slot = -1;
+            for (int k=0;k<store->num;k++) {
+                if (track_store_is_alive (store, k) && store->uid[k] == t->uid) { slot = k; break; }
+            }
+            if (slot == -1 || store->ttl[slot] != t->ttl || store->length[slot] != t->ft.num ||
+                store->hist[store->last[slot]].col != t->ft.el[0].col || 
+                store->hist[store->last[slot]].row != t->ft.el[0].row)
+                ndiff++;
+        }
+        if (nalive != store->nalive)
+            ndiff++;
+
+        dbg (DBG_INFO, "[tracker] frame %d: %d live tracks, %d differ.", frame, nalive, ndiff);
+
+        if (ndiff > 0)
+            nfailed++;
+
+        navlcm_feature_list_t_destroy (fs);
+        fs = next;
+    }
+
+    navlcm_feature_list_t_destroy (fs);
+    navlcm_track_set_t_destroy (tracks);
+    track_store_destroy (store);
+
+    dbg (DBG_INFO, "[tracker] unit testing: %d/%d frames failed.", nfailed, nframes);
+
+    return nfailed;
+}
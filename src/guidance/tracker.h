@@ -15,6 +15,7 @@
 
 /* From here */
 #include <guidance/classifier.h>
+#include <guidance/featgrid.h>
 
 /* From GSL */
 #include <gsl/gsl_sort.h>
@@ -56,4 +57,72 @@ navlcm_feature_list_t* track_filter_on_utime (navlcm_feature_list_t *fs, int64_t
 
 navlcm_feature_list_t* tracks_to_features (GList *ts, int width, int height, int sensorid, int64_t utime, int dist_mode);
 
+/* Persistent structure-of-arrays store of the tracks, replacing the navlcm_track_set_t
+ * that update_tracks grows and copies every frame.
+ *
+ * Slot i holds track i: its head descriptor is row i of <desc> (contiguous, used
+ * as-is for matching), its features are history nodes linked from the most recent
+ * one. Dead slots and nodes go on free lists and are reused, and the heads are matched
+ * in buffers kept from frame to frame, so that the store does not allocate in steady
+ * state. navlcm_track_set_t is only built for publishing.
+ */
+typedef struct {
+    int size;                   // descriptor length
+    int width, height;          // image size
+    int capacity;               // number of slots
+    int num;                    // number of slots ever used
+    int nalive;
+    guint32 *alive;             // alive bitmap (one bit per slot)
+    int free_slot;              // first free slot (linked through <next_free>), -1 if none
+    int *next_free;
+
+    // track heads
+    float *desc;                // head descriptors (capacity x size)
+    int *ttl;
+    int64_t *uid;
+    int64_t *time_start, *time_end;
+    int *last;                  // most recent history node
+    int *length;                // number of features
+    int *stamp;                 // last frame the track was matched
+    int64_t maxuid;
+    int frame;
+
+    // history: node k is a feature (descriptor in row k of <hdesc>) and the previous
+    // node of the same track in <hprev> (-1 for the first feature)
+    int hcapacity;
+    int hnum;                   // number of nodes ever used
+    navlcm_feature_t *hist;     // data is NULL, see <hdesc>
+    float *hdesc;
+    int *hprev;
+    int hfree;                  // first free node (linked through <hprev>), -1 if none
+
+    // live heads, rebuilt in place for matching (el[k].uid is the slot); the
+    // array has one entry per slot (<capacity>)
+    navlcm_feature_list_t heads;
+
+    // matching buffers, kept from frame to frame (see track_store_match)
+    featgrid_t *grid;           // live features (update) or heads (add_new)
+    int *query;                 // featgrid_query results
+    int qcapacity;
+    int *cand;                  // TRACK_STORE_TOPK candidates of each head, -1 past the last
+    double *cand_dist;
+    int *match;                 // feature matched by each head, -1 if none
+    int mcapacity;              // heads
+    int *owner;                 // head that keeps each feature (monogamy), -1 if none
+    double *owner_dist;
+    int fcapacity;              // features
+} track_store_t;
+
+track_store_t *track_store_new (int size, int width, int height);
+void track_store_destroy (track_store_t *s);
+int track_store_add (track_store_t *s, navlcm_feature_t *f, int ttl);
+int track_store_update (track_store_t *s, navlcm_feature_list_t *features, int ttl, double tracker_max_dist, 
+                        GList **dead_tracks);
+int track_store_add_new (track_store_t *s, navlcm_feature_list_t *features, int ttl, double param_min_dist);
+navlcm_feature_list_t *track_store_heads (track_store_t *s);
+navlcm_track_t *track_store_to_track (track_store_t *s, int slot);
+navlcm_track_set_t *track_store_to_lcm (track_store_t *s);
+void track_store_publish (lcm_t *lcm, track_store_t *s);
+int track_store_unit_testing (int nframes);
+
 #endif
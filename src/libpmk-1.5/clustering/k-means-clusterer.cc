@@ -10,6 +10,7 @@
 #include "point_set/point-ref.h"
 #include "point_set/point-set.h"
 #include "util/distance-computer.h"
+#include "common/kmeans.h"
 
 namespace libpmk {
 
@@ -42,6 +43,13 @@ void KMeansClusterer::DoClustering(const vector<PointRef>& data) {
       return;
    }  // End trivial case
 
+   // Squared L2 is what the shared k-means engine minimizes: use it.
+   if (dynamic_cast<const L2DistanceComputer*>(&distance_computer_) != NULL) {
+      DoClusteringL2(data);
+      done_ = true;
+      return;
+   }
+
    // Compute initial clusters: we'll pick random points in the data set
    // to put the clusters on.
    vector<int> random_indices(num_clusters_);
@@ -97,6 +105,51 @@ void KMeansClusterer::DoClustering(const vector<PointRef>& data) {
 }
 
 
+void KMeansClusterer::DoClusteringL2(const vector<PointRef>& data) {
+   int num_points = data.size();
+   int dim = data[0].GetFeature().GetDim();
+
+   // Copy the features into one contiguous array.
+   vector<float> points((size_t)num_points * dim);
+   for (int ii = 0; ii < num_points; ++ii) {
+      const Feature& feature(data[ii].GetFeature());
+      for (int jj = 0; jj < dim; ++jj) {
+         points[(size_t)ii * dim + jj] = feature[jj];
+      }
+   }
+
+   // Empty clusters are moved onto other points while iterating, like
+   // ComputeMeans() does, and the ones left over are dropped below.
+   kmeans_params_t params;
+   kmeans_params_init(&params, num_clusters_);
+   params.max_iter = max_iterations_;
+   params.seed = rand();
+   params.reseed_empty = 1;
+
+   vector<float> centers((size_t)num_clusters_ * dim);
+   vector<int> counts(num_clusters_);
+   kmeans_run(&points[0], NULL, num_points, dim, &params,
+              &centers[0], &membership_[0], &counts[0]);
+
+   vector<int> remap(num_clusters_);
+   Feature center(dim);
+   for (int ii = 0; ii < num_clusters_; ++ii) {
+      if (counts[ii] == 0) {
+         remap[ii] = -1;
+         continue;
+      }
+      for (int jj = 0; jj < dim; ++jj) {
+         center[jj] = centers[(size_t)ii * dim + jj];
+      }
+      remap[ii] = cluster_centers_->GetNumFeatures();
+      cluster_centers_->AddFeature(center);
+   }
+
+   for (int ii = 0; ii < num_points; ++ii) {
+      membership_[ii] = remap[membership_[ii]];
+   }
+}
+
 void KMeansClusterer::ComputeMembership(const vector<PointRef>& data) {
    for (int ii = 0; ii < (int)data.size(); ++ii) {
       int best = 0;
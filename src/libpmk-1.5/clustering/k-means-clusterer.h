@@ -58,6 +58,10 @@ class KMeansClusterer : public Clusterer {
 
    void ComputeMembership(const vector<PointRef>& data);
 
+   // Same as DoClustering(), for L2 distances, with the multithreaded
+   // engine from common/kmeans.h.
+   void DoClusteringL2(const vector<PointRef>& data);
+
    // Returns true if this call to ComputeMeans() has changed
    // cluster_centers_.
    bool ComputeMeans(const vector<PointRef>& data);
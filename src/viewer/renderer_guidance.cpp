@@ -303,17 +303,20 @@ void render_pdf_plot (navlcm_class_param_t *param, int map_width, int width, int
     double xstep = 1.0 * pwidth / (maxindex - minindex);
     double ystep = 1.0 * pheight / (maxval - minval);
 
-    // sort data by increasing index values
+    // data by increasing index values (the nodes not listed have zero belief)
     GQueue *data = g_queue_new ();
+    for (int key=minindex;key<=maxindex;key++) {
+        pair_t *p = (pair_t*)malloc(sizeof(pair_t));
+        p->key = key;
+        p->val = .0;
+        g_queue_push_tail (data, p);
+    }
     for (int i=0;i<param->pdf_size;i++) {
         if (param->pdfind[i] < minindex || maxindex < param->pdfind[i]) 
             continue;
-        pair_t *p = (pair_t*)malloc(sizeof(pair_t));
-        p->key = param->pdfind[i];
+        pair_t *p = (pair_t*)g_queue_peek_nth (data, param->pdfind[i] - minindex);
         p->val = param->pdfval[i];
-        g_queue_push_tail (data, p);
     }
-    g_queue_sort (data, pair_comp_key, NULL);
 
     // draw
     glColor3f (1,0,0);
@@ -469,7 +472,7 @@ static void render_node_images (navlcm_class_param_t *state, dijk_graph_t *dg, i
                     state->nodeid_next);
             if (e) {
                 int idx=0;
-                for (GList *iter=g_queue_peek_head_link (e->img);iter;iter=iter->next) {
+                for (GList *iter=g_queue_peek_head_link (dijk_edge_images (e));iter;iter=iter->next) {
                     botlcm_image_t *img = (botlcm_image_t*)iter->data;
                     int c0 = 2 * img->width + 10;
                     int r0 = 0;
@@ -477,7 +480,7 @@ static void render_node_images (navlcm_class_param_t *state, dijk_graph_t *dg, i
                     util_draw_image (img, idx, window_width, window_height, TRUE, FALSE, desired_width, nsensors, c0, r0, 10);
 
                     if (draw_features) {
-                        util_draw_features (e->features, window_width, window_height, TRUE, FALSE,
+                        util_draw_features (dijk_edge_features (e), window_width, window_height, TRUE, FALSE,
                                 desired_width, nsensors, c0, r0, 10, 3, FALSE, FALSE, FALSE);
                     }
                     idx++;
@@ -502,7 +505,7 @@ navlcm_ui_map_node_t *find_ui_map_node_by_id (navlcm_ui_map_t *map, int id)
 double find_weight_by_node_id (navlcm_class_param_t *param, int id)
 {
     double weight = 1.0;
-    if (!param)
+    if (!param || param->pdf_size == 0)
         return weight;
 
     for (int i=0;i<param->pdf_size;i++) {
@@ -510,7 +513,8 @@ double find_weight_by_node_id (navlcm_class_param_t *param, int id)
             return param->pdfval[i];
     }
 
-    return weight;
+    // the belief only lists the nodes where it is non-zero
+    return .0;
 }
 
 /* render only a local part of the map, centered on the user's location